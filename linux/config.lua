@@ -44,7 +44,7 @@ if file then file:close() ime.fetcher_path = user_fetcher end
 -- 如果存在，则加载用户配置文件
 local user_config = ime.USERCONFIGDIR..'/config.lua'
 local file = io.open(user_config, 'r')
-if file then file:close() dofile(user_config) ime.apply_settings() end
+if file then file:close() if not do_not_load_user_config then dofile(user_config) ime.apply_settings() end end
 
 -- 加载 ime.PKGDATADIR .. '/db' 和 ime.USERDATADIR .. '/db' 下所有 .db 文件
 if not do_not_load_database then
@@ -79,5 +79,5 @@ if not do_not_load_remote_script then
 		autoload_file:close()
 	end
 	local file = io.open(autoload_file_path, 'r')
-	if file then file:close() dofile(autoload_file_path) end
+	if file then file:close() dofile(autoload_file_path) ime.register_worker_script(autoload_file_path) end
 end
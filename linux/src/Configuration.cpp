@@ -6,7 +6,12 @@
 #include "Configuration.h"
 #include "defines.h"
 #include "XUtility.h"
+#include "Tracer.h"
 #include <ibus.h>
+#include <deque>
+#include <pthread.h>
+#include <sched.h>
+#include <tr1/unordered_map>
 
 namespace Configuration {
     void* activeEngine = NULL;
@@ -17,6 +22,21 @@ namespace Configuration {
     static vector<Extension*> extensions;
     IBusPropList *extensionList = NULL;
 
+    // (keymask, keyval) => first extension registered with it
+    static std::tr1::unordered_map<unsigned long long, Extension*> extensionHotkeys;
+#define HOTKEY(keyval, keymask) ((((unsigned long long) (keymask)) << 32) | (keyval))
+
+    // extension executor, runs scripts one by one in order
+    static pthread_mutex_t extensionScriptsLock = PTHREAD_MUTEX_INITIALIZER;
+    static pthread_cond_t extensionScriptsCond = PTHREAD_COND_INITIALIZER;
+    // (script, worker safe)
+    static std::deque<pair<string, bool> > extensionScripts;
+    // a script posted to main loop is finished, extension thread waits for it
+    static pthread_mutex_t mainLoopScriptLock = PTHREAD_MUTEX_INITIALIZER;
+    static pthread_cond_t mainLoopScriptCond = PTHREAD_COND_INITIALIZER;
+    static bool mainLoopScriptFinished;
+    static bool extensionThreadStarted = false;
+
     // full path of fetcher script
     string fetcherPath = PKGDATADIR "/fetcher";
 
@@ -59,16 +79,46 @@ namespace Configuration {
     bool fallbackUsingDb = true;
     bool preRequestFallback = true;
     bool useAlternativePopen = true;
+    bool cacheSegments = true;
+    bool deltaRequest = true;
+    bool idlePrefetch = false;
+    bool localPreview = true;
+    bool batchRequests = true;
+    bool tracing = false;
 
     // int
     int fallbackEngTolerance = 5;
     int preRequestRetry = 4;
     int preeditReservedPinyinCount = 0;
+    int cacheSegmentMinLength = 2, cacheSegmentLimit = 16;
+    int deltaContext = 2, deltaRequestMinPrefix = 4;
+    int splitRequestLength = 16;
+    int lowPriorityNiceness = 10;
+    int batchMaxSize = 8;
+    int luaWorkerCount = 2;
+    int prefetchCandidates = 3, prefetchRequestsPerMinute = 6, prefetchBytesPerMinute = 2048;
 
     // pre request timeout
     double preRequestTimeout = 0.6;
     double requestTimeout = 12.;
 
+    // idle prefetch
+    double prefetchDelay = 1.;
+
+    // batched requests
+    double batchWindow = 0.02;
+
+    // metrics dump, default path is set in staticInit
+    string statsDumpPath;
+    double statsDumpInterval = 60.;
+
+    // adaptive timeouts and hedged requests
+    bool adaptiveTimeout = true;
+    bool hedgeRequests = true;
+    double requestTimeoutPercentile = 0.99, preRequestTimeoutPercentile = 0.9, hedgePercentile = 0.9;
+    double adaptiveTimeoutMargin = 1.5, minimumTimeout = 0.3;
+    int adaptiveTimeoutMinSamples = 8;
+
     // selection timeout tolerance
     long long selectionTimout = 3LL * XUtility::MICROSECOND_PER_SECOND;
 
@@ -218,13 +268,18 @@ namespace Configuration {
         return (keys.count(keyval) > 0);
     }
 
+    const set<unsigned int>& ImeKey::getKeys() const {
+        return keys;
+    }
+
     // Extension
 
-    Extension::Extension(ImeKey key, unsigned int keymask, string label, string script) {
+    Extension::Extension(ImeKey key, unsigned int keymask, string label, string script, bool inWorker) {
         this->key = key;
         this->keymask = keymask;
         this->script = script;
         this->label = label;
+        this->inWorker = inWorker;
         this->prop = ibus_property_new((string(".") + label).c_str(), PROP_TYPE_NORMAL, ibus_text_new_from_string(label.c_str()), NULL, NULL, TRUE, TRUE, PROP_STATE_INCONSISTENT, NULL);
 #if IBUS_CHECK_VERSION(1, 2, 98)
         g_object_ref_sink(this->prop);
@@ -240,14 +295,205 @@ namespace Configuration {
         return label;
     }
 
+    /**
+     * "foo.bar(...)" => "foo.bar", empty if script does not start with a call
+     */
+    static string getScriptEntryFunction(const string& script) {
+        size_t begin = script.find_first_not_of(" \t\r\n");
+        if (begin == string::npos) return "";
+        size_t end = script.find_first_not_of("abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_.", begin);
+        if (end == string::npos || end == begin) return "";
+        size_t parenthesis = script.find_first_not_of(" \t", end);
+        if (parenthesis == string::npos || (script[parenthesis] != '(' && script[parenthesis] != '"' && script[parenthesis] != '\'' && script[parenthesis] != '{')) return "";
+        return script.substr(begin, end - begin);
+    }
+
+    static gboolean executeScriptInMainLoop(gpointer data) {
+        string* script = (string*) data;
+        LuaBinding::getStaticBinding().doString(script->c_str(), true);
+        delete script;
+
+        pthread_mutex_lock(&mainLoopScriptLock);
+        mainLoopScriptFinished = true;
+        pthread_cond_signal(&mainLoopScriptCond);
+        pthread_mutex_unlock(&mainLoopScriptLock);
+        // run once
+        return FALSE;
+    }
+
+    static void* extensionThreadFunc(void* data) {
+        UNUSED(data);
+        for (;;) {
+            pthread_mutex_lock(&extensionScriptsLock);
+            while (extensionScripts.empty()) pthread_cond_wait(&extensionScriptsCond, &extensionScriptsLock);
+            string script = extensionScripts.front().first;
+            bool inWorker = extensionScripts.front().second;
+            extensionScripts.pop_front();
+            pthread_mutex_unlock(&extensionScriptsLock);
+
+            // run in a worker if workers define entry function (scripts
+            // loaded by ime.register_worker_script, autoload.lua, etc), so
+            // that a slow script does not block typing. functions only
+            // static binding has (ime.request, ime.apply_settings, ...) are
+            // called in main loop then. scripts not marked worker safe have
+            // ime values they set copied to static binding as well.
+            // others run in static binding, which is only safe in main loop
+            string entry = getScriptEntryFunction(script);
+            LuaBinding* worker = entry.empty() ? NULL : LuaBinding::acquireWorker(entry.c_str());
+            if (worker) {
+                DEBUG_PRINT(2, "[CONF] extension runs in worker: %s\n", entry.c_str());
+                if (inWorker) worker->doString(script.c_str(), true);
+                else worker->doStringInWorker(script.c_str());
+                LuaBinding::releaseWorker(worker);
+            } else {
+                // wait for it, so that later scripts do not overtake it
+                pthread_mutex_lock(&mainLoopScriptLock);
+                mainLoopScriptFinished = false;
+                pthread_mutex_unlock(&mainLoopScriptLock);
+                g_idle_add(executeScriptInMainLoop, (gpointer) new string(script));
+                pthread_mutex_lock(&mainLoopScriptLock);
+                while (!mainLoopScriptFinished) pthread_cond_wait(&mainLoopScriptCond, &mainLoopScriptLock);
+                pthread_mutex_unlock(&mainLoopScriptLock);
+            }
+        }
+        return NULL;
+    }
+
     void Extension::execute() const {
-        LuaBinding::getStaticBinding().doString(script.c_str(), true);
+        pthread_mutex_lock(&extensionScriptsLock);
+        if (!extensionThreadStarted) {
+            pthread_t extensionThread;
+            pthread_attr_t threadAttr;
+            pthread_attr_init(&threadAttr);
+            pthread_attr_setdetachstate(&threadAttr, PTHREAD_CREATE_DETACHED);
+            extensionThreadStarted = (pthread_create(&extensionThread, &threadAttr, extensionThreadFunc, NULL) == 0);
+            pthread_attr_destroy(&threadAttr);
+        }
+        if (extensionThreadStarted) {
+            extensionScripts.push_back(pair<string, bool>(script, inWorker));
+            pthread_cond_signal(&extensionScriptsCond);
+        }
+        pthread_mutex_unlock(&extensionScriptsLock);
+
+        if (!extensionThreadStarted) {
+            perror("can not create extension thread");
+            LuaBinding::getStaticBinding().doString(script.c_str(), true);
+        }
     }
 
     bool Extension::matchKey(unsigned int keyval, unsigned keymask) const {
         return (keymask == this->keymask) && this->key.match(keyval);
     }
 
+    const ImeKey& Extension::getKey() const {
+        return key;
+    }
+
+    const unsigned int Extension::getKeymask() const {
+        return keymask;
+    }
+
+    // snapshots, epoch based reclamation: a reader registers itself in
+    // snapshotReaders[epoch & 1]. publisher swaps pointer, advances epoch
+    // and waits for readers of previous epoch, then old snapshot is free
+
+    static Snapshot* volatile currentSnapshot = NULL;
+    static volatile gint snapshotEpoch = 0;
+    static volatile gint snapshotReaders[2] = {0, 0};
+    static pthread_mutex_t publishSnapshotLock = PTHREAD_MUTEX_INITIALIZER;
+
+    // ime.full_pinyin_adjustments compiled by apply_settings. published and
+    // reclaimed together with snapshots, but kept out of Snapshot so that
+    // copying a snapshot stays cheap
+    struct FullPinyinAdjustments {
+        std::tr1::unordered_map<string, string> tails;
+        size_t maxTailLength;
+    };
+    static FullPinyinAdjustments* volatile currentFullPinyinAdjustments = NULL;
+    // built by apply_settings, waiting for next publishSnapshot
+    static FullPinyinAdjustments* stagedFullPinyinAdjustments = NULL;
+
+    SnapshotReader::SnapshotReader() {
+        for (;;) {
+            epoch = g_atomic_int_get(&snapshotEpoch);
+            g_atomic_int_inc(&snapshotReaders[epoch & 1]);
+            // publisher may have advanced epoch meanwhile, register again
+            if (g_atomic_int_get(&snapshotEpoch) == epoch) break;
+            g_atomic_int_add(&snapshotReaders[epoch & 1], -1);
+        }
+        snapshot = (const Snapshot*) g_atomic_pointer_get(&currentSnapshot);
+    }
+
+    SnapshotReader::~SnapshotReader() {
+        g_atomic_int_add(&snapshotReaders[epoch & 1], -1);
+    }
+
+    const Snapshot* SnapshotReader::operator->() const {
+        return snapshot;
+    }
+
+    const Snapshot& SnapshotReader::operator*() const {
+        return *snapshot;
+    }
+
+    void publishSnapshot() {
+        Snapshot* snapshot = new Snapshot();
+        snapshot->fetcherPath = fetcherPath;
+        snapshot->requestTimeout = requestTimeout;
+        snapshot->preRequestTimeout = preRequestTimeout;
+        snapshot->useAlternativePopen = useAlternativePopen;
+        snapshot->adaptiveTimeout = adaptiveTimeout;
+        snapshot->hedgeRequests = hedgeRequests;
+        snapshot->requestTimeoutPercentile = requestTimeoutPercentile;
+        snapshot->preRequestTimeoutPercentile = preRequestTimeoutPercentile;
+        snapshot->hedgePercentile = hedgePercentile;
+        snapshot->adaptiveTimeoutMargin = adaptiveTimeoutMargin;
+        snapshot->minimumTimeout = minimumTimeout;
+        snapshot->adaptiveTimeoutMinSamples = adaptiveTimeoutMinSamples;
+        snapshot->dbResultLimit = dbResultLimit;
+        snapshot->dbLengthLimit = dbLengthLimit;
+        snapshot->dbOrder = dbOrder;
+        snapshot->dbLongPhraseAdjust = dbLongPhraseAdjust;
+        snapshot->dbCompleteLongPhraseAdjust = dbCompleteLongPhraseAdjust;
+        snapshot->statsDumpPath = statsDumpPath;
+        snapshot->statsDumpInterval = statsDumpInterval;
+        snapshot->writeRequestCache = writeRequestCache;
+        snapshot->fallbackUsingDb = fallbackUsingDb;
+        snapshot->preRequestFallback = preRequestFallback;
+        snapshot->showCachedInPreedit = showCachedInPreedit;
+        snapshot->batchRequests = batchRequests;
+        snapshot->deltaRequest = deltaRequest;
+        snapshot->cacheSegments = cacheSegments;
+        snapshot->batchWindow = batchWindow;
+        snapshot->batchMaxSize = batchMaxSize;
+        snapshot->deltaContext = deltaContext;
+        snapshot->deltaRequestMinPrefix = deltaRequestMinPrefix;
+        snapshot->splitRequestLength = splitRequestLength;
+        snapshot->cacheSegmentMinLength = cacheSegmentMinLength;
+        snapshot->cacheSegmentLimit = cacheSegmentLimit;
+        snapshot->lowPriorityNiceness = lowPriorityNiceness;
+        snapshot->fetcherBufferSize = fetcherBufferSize;
+
+        pthread_mutex_lock(&publishSnapshotLock);
+        Snapshot* oldSnapshot = (Snapshot*) g_atomic_pointer_get(&currentSnapshot);
+        g_atomic_pointer_set(&currentSnapshot, snapshot);
+        FullPinyinAdjustments* oldAdjustments = NULL;
+        if (stagedFullPinyinAdjustments) {
+            oldAdjustments = (FullPinyinAdjustments*) g_atomic_pointer_get(&currentFullPinyinAdjustments);
+            g_atomic_pointer_set(&currentFullPinyinAdjustments, stagedFullPinyinAdjustments);
+            stagedFullPinyinAdjustments = NULL;
+        }
+        gint epoch = g_atomic_int_get(&snapshotEpoch);
+        g_atomic_int_set(&snapshotEpoch, epoch + 1);
+        // readers are short, wait for those may still see old snapshot
+        while (g_atomic_int_get(&snapshotReaders[epoch & 1]) > 0) sched_yield();
+        pthread_mutex_unlock(&publishSnapshotLock);
+
+        DEBUG_PRINT(3, "[CONF] snapshot %d published\n", epoch + 1);
+        delete oldSnapshot;
+        delete oldAdjustments;
+    }
+
     // functions
 
     void staticInit() {
@@ -295,6 +541,11 @@ namespace Configuration {
 #if IBUS_CHECK_VERSION(1, 2, 98)
         g_object_ref_sink(extensionList);
 #endif
+
+        statsDumpPath = string(g_get_user_cache_dir()) + G_DIR_SEPARATOR_S "ibus" G_DIR_SEPARATOR_S "sogoupycc" G_DIR_SEPARATOR_S "stats";
+
+        // defaults, until config is applied
+        publishSnapshot();
     }
 
     void addConstantsToLua(LuaBinding& luaBinding) {
@@ -338,7 +589,14 @@ namespace Configuration {
             delete extensions.at(i);
         }
         extensions.clear();
+        extensionHotkeys.clear();
         g_object_unref(extensionList);
+        delete (Snapshot*) g_atomic_pointer_get(&currentSnapshot);
+        g_atomic_pointer_set(&currentSnapshot, NULL);
+        delete (FullPinyinAdjustments*) g_atomic_pointer_get(&currentFullPinyinAdjustments);
+        g_atomic_pointer_set(&currentFullPinyinAdjustments, NULL);
+        delete stagedFullPinyinAdjustments;
+        stagedFullPinyinAdjustments = NULL;
     }
 
     void activeExtension(string label) {
@@ -349,13 +607,11 @@ namespace Configuration {
     }
 
     bool activeExtension(unsigned keyval, unsigned keymask) {
-        for (size_t i = 0; i < extensions.size(); ++i) {
-            if (extensions.at(i)->matchKey(keyval, keymask)) {
-                extensions.at(i)->execute();
-                return true;
-            }
-        }
-        return false;
+        if (keyval == 0 || keyval == IBUS_VoidSymbol) return false;
+        std::tr1::unordered_map<unsigned long long, Extension*>::const_iterator it = extensionHotkeys.find(HOTKEY(keyval, keymask));
+        if (it == extensionHotkeys.end()) return false;
+        it->second->execute();
+        return true;
     }
 
     bool isPunctuationAutoWidth(char punc) {
@@ -363,15 +619,24 @@ namespace Configuration {
     }
 
     const string getFullPinyinTailAdjusted(const string& fullPinyinString) {
-        for (size_t i = 0; i < fullPinyinString.length(); i++) {
-            string s = LuaBinding::getStaticBinding().getValue((string("full_pinyin_adjustments.") + fullPinyinString.substr(i)).c_str(), "");
-            if (!s.empty())
-                return (fullPinyinString.substr(0, i) + s);
+        // hold a reader so adjustments are not freed under us
+        SnapshotReader reader;
+        UNUSED(reader);
+        const FullPinyinAdjustments* adjustments = (const FullPinyinAdjustments*) g_atomic_pointer_get(&currentFullPinyinAdjustments);
+        if (adjustments == NULL || adjustments->tails.empty()) return fullPinyinString;
+
+        // longest tail first, tails longer than any key can not match
+        size_t length = fullPinyinString.length();
+        for (size_t i = length > adjustments->maxTailLength ? length - adjustments->maxTailLength : 0; i < length; i++) {
+            std::tr1::unordered_map<string, string>::const_iterator it = adjustments->tails.find(fullPinyinString.substr(i));
+            if (it != adjustments->tails.end())
+                return (fullPinyinString.substr(0, i) + it->second);
         }
         return fullPinyinString;
     }
 
     const string getGlobalCache(const string& requestString, const bool includeWeak) {
+        Tracer::Span span("getGlobalCache");
         string content = LuaBinding::getStaticBinding().getValue(requestString.c_str(), "", "request_cache");
         if (content.substr(0, sizeof (WEAK_CACHE_PREFIX) - 1) == string(WEAK_CACHE_PREFIX)) {
             if (includeWeak) return content.substr(sizeof (WEAK_CACHE_PREFIX) - 1);
@@ -402,11 +667,13 @@ namespace Configuration {
         luaL_checktype(L, 3, LUA_TSTRING);
         luaL_checktype(L, 4, LUA_TSTRING);
 
-        // Extension::Extension(ImeKey key, unsigned int keymask, string script, string label)
+        // Extension::Extension(ImeKey key, unsigned int keymask, string script, string label, bool inWorker)
         ImeKey key = lua_tointeger(L, 1);
         unsigned int modifiers = lua_tointeger(L, 2);
         string label = lua_tostring(L, 3);
         string script = lua_tostring(L, 4);
+        // optional, script keeps nothing in ime table for static binding
+        bool inWorker = lua_toboolean(L, 5);
         // find existed same name Extension and delete it first
         for (vector<Extension*>::iterator it = extensions.begin(); it != extensions.end(); ++it) {
             if ((*it)->getLabel() == label) {
@@ -415,7 +682,14 @@ namespace Configuration {
                 break;
             }
         }
-        extensions.push_back(new Extension(key, modifiers, label, script));
+        Extension* extension = new Extension(key, modifiers, label, script, inWorker);
+        extensions.push_back(extension);
+
+        // earlier extensions take precedence, like they did in a linear scan
+        const set<unsigned int>& keys = extension->getKey().getKeys();
+        for (set<unsigned int>::const_iterator it = keys.begin(); it != keys.end(); ++it) {
+            extensionHotkeys.insert(std::make_pair(HOTKEY(*it, modifiers), extension));
+        }
         return 0;
     }
 
@@ -460,6 +734,14 @@ namespace Configuration {
         selectionTimout = (long long) lb.getValue("sel_timeout", (double) selectionTimout / XUtility::MICROSECOND_PER_SECOND) * XUtility::MICROSECOND_PER_SECOND;
         preRequestTimeout = lb.getValue("pre_request_timeout", (double) preRequestTimeout);
         requestTimeout = lb.getValue("request_timeout", (double) requestTimeout);
+        requestTimeoutPercentile = lb.getValue("request_timeout_percentile", requestTimeoutPercentile);
+        preRequestTimeoutPercentile = lb.getValue("pre_request_timeout_percentile", preRequestTimeoutPercentile);
+        hedgePercentile = lb.getValue("hedge_percentile", hedgePercentile);
+        adaptiveTimeoutMargin = lb.getValue("timeout_margin", adaptiveTimeoutMargin);
+        minimumTimeout = lb.getValue("min_timeout", minimumTimeout);
+        prefetchDelay = lb.getValue("prefetch_delay", prefetchDelay);
+        batchWindow = lb.getValue("batch_window", batchWindow);
+        statsDumpInterval = lb.getValue("stats_dump_interval", statsDumpInterval);
 
         // keys
         engModeKey.readFromLua(lb, "eng_mode_key");
@@ -482,12 +764,36 @@ namespace Configuration {
         fallbackUsingDb = lb.getValue("fallback_use_db", fallbackUsingDb);
         useAlternativePopen = lb.getValue("strict_timeout", useAlternativePopen);
         preRequestFallback = lb.getValue("fallback_pre_request", preRequestFallback);
+        adaptiveTimeout = lb.getValue("adaptive_timeout", adaptiveTimeout);
+        hedgeRequests = lb.getValue("hedge_requests", hedgeRequests);
+        cacheSegments = lb.getValue("cache_segments", cacheSegments);
+        deltaRequest = lb.getValue("delta_request", deltaRequest);
+        idlePrefetch = lb.getValue("idle_prefetch", idlePrefetch);
+        localPreview = lb.getValue("local_preview", localPreview);
+        batchRequests = lb.getValue("batch_requests", batchRequests);
+        tracing = lb.getValue("tracing", tracing);
         if (preRequestFallback || preRequest) writeRequestCache = true;
 
         // int, tolerances
         fallbackEngTolerance = lb.getValue("auto_eng_tolerance", fallbackEngTolerance);
         preRequestRetry = lb.getValue("pre_request_retry", preRequestRetry);
         preeditReservedPinyinCount = lb.getValue("preedit_reserved_pinyin", preeditReservedPinyinCount);
+        adaptiveTimeoutMinSamples = lb.getValue("adaptive_timeout_samples", adaptiveTimeoutMinSamples);
+        cacheSegmentMinLength = lb.getValue("cache_segment_min_length", cacheSegmentMinLength);
+        if (cacheSegmentMinLength < 1) cacheSegmentMinLength = 1;
+        cacheSegmentLimit = lb.getValue("cache_segment_limit", cacheSegmentLimit);
+        if (cacheSegmentLimit < 0) cacheSegmentLimit = 0;
+        deltaContext = lb.getValue("delta_context", deltaContext);
+        if (deltaContext < 0) deltaContext = 0;
+        deltaRequestMinPrefix = lb.getValue("delta_min_prefix", deltaRequestMinPrefix);
+        if (deltaRequestMinPrefix < 1) deltaRequestMinPrefix = 1;
+        splitRequestLength = lb.getValue("split_request_length", splitRequestLength);
+        lowPriorityNiceness = lb.getValue("low_priority_nice", lowPriorityNiceness);
+        batchMaxSize = lb.getValue("batch_max_size", batchMaxSize);
+        luaWorkerCount = lb.getValue("lua_workers", luaWorkerCount);
+        prefetchCandidates = lb.getValue("prefetch_candidates", prefetchCandidates);
+        prefetchRequestsPerMinute = lb.getValue("prefetch_requests_per_minute", prefetchRequestsPerMinute);
+        prefetchBytesPerMinute = lb.getValue("prefetch_bytes_per_minute", prefetchBytesPerMinute);
 
         // labels used in lookup table, ibus has 16 chars limition.
         {
@@ -521,6 +827,7 @@ namespace Configuration {
 
         // external script path
         fetcherPath = string(lb.getValue("fetcher_path", fetcherPath.c_str()));
+        statsDumpPath = string(lb.getValue("stats_dump_path", statsDumpPath.c_str()));
 
         // auto width punc and punc map
         autoWidthPunctuations = string(lb.getValue("punc_after_chinese", ".,?:"));
@@ -571,12 +878,49 @@ namespace Configuration {
             lua_pop(L, pushedCount);
         }
 
+        // full pinyin adjustments, compiled into a hash map so segmenter
+        // doesn't walk lua tables on each keystroke
+        FullPinyinAdjustments* adjustments = new FullPinyinAdjustments();
+        adjustments->maxTailLength = 0;
+        if (lb.getValueType("full_pinyin_adjustments") == LUA_TTABLE) {
+            DEBUG_PRINT(4, "[LUA] read full_pinyin_adjustments\n");
+            int pushedCount = lb.reachValue("full_pinyin_adjustments");
+            for (lua_pushnil(L); lua_next(L, -2) != 0; lua_pop(L, 1)) {
+                if (lua_type(L, -2) != LUA_TSTRING || lua_type(L, -1) != LUA_TSTRING) continue;
+                string tail = lua_tostring(L, -2);
+                string adjusted = lua_tostring(L, -1);
+                if (tail.empty() || adjusted.empty()) continue;
+                adjustments->tails[tail] = adjusted;
+                if (tail.length() > adjustments->maxTailLength) adjustments->maxTailLength = tail.length();
+            }
+            lua_pop(L, pushedCount);
+            DEBUG_PRINT(4, "[LUA] %d full pinyin adjustments, longest: %d\n", (int) adjustments->tails.size(), (int) adjustments->maxTailLength);
+        }
+        pthread_mutex_lock(&publishSnapshotLock);
+        delete stagedFullPinyinAdjustments;
+        stagedFullPinyinAdjustments = adjustments;
+        pthread_mutex_unlock(&publishSnapshotLock);
+
+        Tracer::setEnabled(tracing);
+        publishSnapshot();
+        return 0;
+    }
+
+    /**
+     * extensions are registered by static binding, scripts shared with
+     * workers call register_command there too, ignore it
+     * in: -
+     * out: -
+     */
+    static int l_registerCommandInWorker(lua_State *L) {
+        UNUSED(L);
         return 0;
     }
 
     void registerLuaFunctions() {
         // register lua C function
         LuaBinding::getStaticBinding().registerFunction(l_registerCommand, "register_command");
+        LuaBinding::registerWorkerFunction(l_registerCommandInWorker, "register_command");
         LuaBinding::getStaticBinding().registerFunction(l_applySettings, "apply_settings");
     }
 
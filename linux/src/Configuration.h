@@ -63,6 +63,7 @@ namespace Configuration {
         bool readFromLua(LuaBinding& luaBinding, const string& varName);
         const bool match(const unsigned int keyval) const;
         const string getLabel() const;
+        const set<unsigned int>& getKeys() const;
     private:
         std::set<unsigned int> keys;
         string label;
@@ -74,16 +75,29 @@ namespace Configuration {
 
     class Extension {
     public:
-        Extension(ImeKey key, unsigned int keymask, string label, string script);
+        /**
+         * @param inWorker script sets no ime values static binding needs,
+         *        they are not copied there when it runs in a lua worker
+         */
+        Extension(ImeKey key, unsigned int keymask, string label, string script, bool inWorker = false);
         ~Extension();
         const string getLabel() const;
+        /**
+         * run script in a lua worker if it is marked worker safe and its
+         * entry function is defined there, otherwise in static binding
+         * from main loop. returns immediately, scripts run in the order
+         * they are executed
+         */
         void execute() const;
         bool matchKey(unsigned int keyval, unsigned keymask) const;
+        const ImeKey& getKey() const;
+        const unsigned int getKeymask() const;
     private:
         Extension(const Extension& orig);
         ImeKey key;
         unsigned int keymask;
         string script, label;
+        bool inWorker;
         IBusProperty *prop;
     };
     // not part of setting, but save activeEngine
@@ -127,14 +141,63 @@ namespace Configuration {
     extern bool fallbackUsingDb;
     extern bool preRequestFallback;
     extern bool useAlternativePopen;
+    extern bool cacheSegments;
+    extern bool deltaRequest;
+    extern bool idlePrefetch;
+    extern bool localPreview;
+    extern bool batchRequests;
+    // record spans for ime.export_trace()
+    extern bool tracing;
 
     // tolerances
     extern int fallbackEngTolerance;
 
+    // shortest (in pinyins) aligned sub-phrase written to request cache,
+    // at most cacheSegmentLimit of them per response
+    extern int cacheSegmentMinLength, cacheSegmentLimit;
+
+    // delta request: only request pinyins after a cached prefix (at least
+    // deltaRequestMinPrefix long), with deltaContext pinyins as context
+    extern int deltaContext, deltaRequestMinPrefix;
+
+    // requests longer than this (in pinyins) are split and fetched concurrently
+    // 0 to disable
+    extern int splitRequestLength;
+
+    // nice value of fetcher processes for pre-requests and prefetches
+    extern int lowPriorityNiceness;
+
+    // idle prefetch: after prefetchDelay seconds without key press, request
+    // likely continuations of preedit, within budget per minute
+    extern double prefetchDelay;
+    extern int prefetchCandidates, prefetchRequestsPerMinute, prefetchBytesPerMinute;
+
+    // batched requests: when several requests are pending, a request waits
+    // batchWindow seconds for others and sends up to batchMaxSize of them
+    // in one fetcher call
+    extern double batchWindow;
+    extern int batchMaxSize;
+
+    // lua worker states for lua fetchers, 0 to use static binding only
+    extern int luaWorkerCount;
+
+    // metrics are written to statsDumpPath every statsDumpInterval seconds,
+    // empty path or non-positive interval disables it
+    extern string statsDumpPath;
+    extern double statsDumpInterval;
+
     // pre request timeout
     extern double preRequestTimeout;
     extern double requestTimeout;
 
+    // adaptive timeouts and hedged requests
+    // when enabled, timeouts above are upper limits
+    extern bool adaptiveTimeout;
+    extern bool hedgeRequests;
+    extern double requestTimeoutPercentile, preRequestTimeoutPercentile, hedgePercentile;
+    extern double adaptiveTimeoutMargin, minimumTimeout;
+    extern int adaptiveTimeoutMinSamples;
+
     // selection timeout tolerance
     extern long long selectionTimout;
 
@@ -151,6 +214,55 @@ namespace Configuration {
     // multi tone limit
     extern size_t multiToneLimit;
 
+    /**
+     * immutable copy of settings read outside main loop (request threads,
+     * lua workers). apply_settings builds a new one and publishes it with
+     * an atomic pointer swap, so readers always see a consistent set of
+     * values without locks
+     */
+    struct Snapshot {
+        string fetcherPath;
+        double requestTimeout, preRequestTimeout;
+        bool useAlternativePopen;
+        bool adaptiveTimeout, hedgeRequests;
+        double requestTimeoutPercentile, preRequestTimeoutPercentile, hedgePercentile;
+        double adaptiveTimeoutMargin, minimumTimeout;
+        int adaptiveTimeoutMinSamples;
+        int dbResultLimit, dbLengthLimit;
+        string dbOrder;
+        double dbLongPhraseAdjust, dbCompleteLongPhraseAdjust;
+        string statsDumpPath;
+        double statsDumpInterval;
+        bool writeRequestCache;
+        bool fallbackUsingDb, preRequestFallback, showCachedInPreedit;
+        bool batchRequests, deltaRequest, cacheSegments;
+        double batchWindow;
+        int batchMaxSize, deltaContext, deltaRequestMinPrefix, splitRequestLength, cacheSegmentMinLength, cacheSegmentLimit;
+        int lowPriorityNiceness, fetcherBufferSize;
+    };
+
+    /**
+     * read side of current snapshot, keep it short: apply_settings waits
+     * for readers of old snapshot before freeing it. copy the snapshot
+     * if it is needed across a long operation (a fetch, etc)
+     */
+    class SnapshotReader {
+    public:
+        SnapshotReader();
+        ~SnapshotReader();
+        const Snapshot* operator->() const;
+        const Snapshot& operator*() const;
+    private:
+        SnapshotReader(const SnapshotReader& orig);
+        const Snapshot* snapshot;
+        int epoch;
+    };
+
+    /**
+     * copy globals into a new snapshot and publish it
+     */
+    void publishSnapshot();
+
     // functions (callby LuaBinding, main, engine, database)
     void addConstantsToLua(LuaBinding& luaBinding);
     void staticInit();
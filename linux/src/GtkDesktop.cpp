@@ -0,0 +1,104 @@
+/*
+ * File:   GtkDesktop.cpp
+ * Author: WU Jun <quark@lihdd.net>
+ */
+
+#include "GtkDesktop.h"
+#include "defines.h"
+
+GtkDesktop::GtkDesktop() {
+    DEBUG_PRINT(1, "[XUTIL] GtkDesktop\n");
+    pthread_rwlock_init(&selectionRwLock, NULL);
+
+    primaryClipboard = gtk_clipboard_get(GDK_SELECTION_PRIMARY);
+    g_signal_connect(primaryClipboard, "owner-change", G_CALLBACK(updateSelection), this);
+    updatedTime = XUtility::getCurrentTime();
+
+    pthread_attr_t threadAttr;
+    pthread_attr_init(&threadAttr);
+    pthread_attr_setdetachstate(&threadAttr, PTHREAD_CREATE_DETACHED);
+    pthread_create(&gtkMainLoopThread, &threadAttr, &gtkMainLoop, NULL);
+    pthread_attr_destroy(&threadAttr);
+
+    // init libnotify
+    staticNotify = NULL;
+    notifyInited = notify_init("ibus-sogoupycc");
+    if (notifyInited) {
+        staticNotify = notify_notification_new("-", NULL, NULL, NULL);
+    }
+}
+
+GtkDesktop::GtkDesktop(const GtkDesktop& orig) {
+}
+
+GtkDesktop::~GtkDesktop() {
+    DEBUG_PRINT(1, "[XUTIL] ~GtkDesktop\n");
+    if (notifyInited) {
+        g_object_unref(G_OBJECT(staticNotify));
+        notify_uninit();
+        notifyInited = false;
+    }
+    gtk_main_quit();
+    // IMPROVE: other cleanning, how ever, seems this loop here never ends
+}
+
+void* GtkDesktop::gtkMainLoop(void*) {
+    gtk_main();
+    DEBUG_PRINT(1, "[XUTIL] gtk main loop exited\n");
+    return NULL;
+}
+
+void GtkDesktop::updateSelection(GtkClipboard* clipboard, GdkEvent* event, gpointer data) {
+    DEBUG_PRINT(5, "[XUTIL] selection update callback\n");
+    GtkDesktop* desktop = (GtkDesktop*) data;
+    UNUSED(event);
+
+    gchar *text = gtk_clipboard_wait_for_text(clipboard);
+    if (text) {
+        pthread_rwlock_wrlock(&desktop->selectionRwLock);
+        desktop->currentSelection = string((char*) text);
+        desktop->updatedTime = XUtility::getCurrentTime();
+        DEBUG_PRINT(4, "[XUTIL] selection update to: '%s'\n", desktop->currentSelection.c_str());
+        g_free(text);
+        pthread_rwlock_unlock(&desktop->selectionRwLock);
+    }
+}
+
+const string GtkDesktop::getSelection() {
+    DEBUG_PRINT(4, "[XUTIL] getSelection \n");
+    pthread_rwlock_rdlock(&selectionRwLock);
+    DEBUG_PRINT(5, "[XUTIL] getSelection: '%s'\n", currentSelection.c_str());
+    string r = currentSelection;
+    pthread_rwlock_unlock(&selectionRwLock);
+    return r;
+}
+
+const long long GtkDesktop::getSelectionUpdatedTime() {
+    DEBUG_PRINT(4, "[XUTIL] getSelectionUpdatedTime \n");
+    pthread_rwlock_rdlock(&selectionRwLock);
+    long long r = updatedTime;
+    pthread_rwlock_unlock(&selectionRwLock);
+    return r;
+}
+
+void GtkDesktop::setSelectionUpdatedTime(long long time) {
+    DEBUG_PRINT(4, "[XUTIL] setSelectionUpdatedTime \n");
+    pthread_rwlock_wrlock(&selectionRwLock);
+    updatedTime = time;
+    pthread_rwlock_unlock(&selectionRwLock);
+}
+
+bool GtkDesktop::showNotify(const char* summary, const char* body, const char* iconPath) {
+    if (!notifyInited) return false;
+    NotifyNotification *notify = notify_notification_new(summary, body, iconPath, NULL);
+    int r = notify_notification_show(notify, NULL);
+    g_object_unref(G_OBJECT(notify));
+    return (r != FALSE);
+}
+
+bool GtkDesktop::showStaticNotify(const char* summary, const char* body, const char* iconPath) {
+    if (!notifyInited) return false;
+    notify_notification_update(staticNotify, summary, body, iconPath);
+    int r = notify_notification_show(staticNotify, NULL);
+    return (r != FALSE);
+}
@@ -0,0 +1,48 @@
+/*
+ * File:   GtkDesktop.h
+ * Author: WU Jun <quark@lihdd.net>
+ *
+ * X selection (gtk) and notifies (libnotify) for ibus-sogoupycc, the
+ * only one linking them. see XUtility::Desktop
+ */
+
+#ifndef _GTKDESKTOP_H
+#define	_GTKDESKTOP_H
+
+#include <pthread.h>
+#include <gtk/gtk.h>
+#include <libnotify/notify.h>
+#include <libnotify/notification.h>
+#include "XUtility.h"
+
+class GtkDesktop : public XUtility::Desktop {
+public:
+    /**
+     * starts gtk main loop in a thread, gtk_init should be called before
+     */
+    GtkDesktop();
+    virtual ~GtkDesktop();
+
+    const string getSelection();
+    const long long getSelectionUpdatedTime();
+    void setSelectionUpdatedTime(long long time);
+    bool showNotify(const char* summary, const char* body, const char* iconPath);
+    bool showStaticNotify(const char* summary, const char* body, const char* iconPath);
+private:
+    GtkDesktop(const GtkDesktop& orig);
+
+    static void* gtkMainLoop(void*);
+    static void updateSelection(GtkClipboard* clipboard, GdkEvent* event, gpointer data);
+
+    GtkClipboard *primaryClipboard;
+    long long updatedTime;
+    string currentSelection;
+    pthread_t gtkMainLoopThread;
+    pthread_rwlock_t selectionRwLock;
+
+    bool notifyInited;
+    NotifyNotification *staticNotify;
+};
+
+#endif	/* _GTKDESKTOP_H */
+
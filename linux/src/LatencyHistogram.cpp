@@ -0,0 +1,127 @@
+/*
+ * File:   LatencyHistogram.cpp
+ * Author: WU Jun <quark@lihdd.net>
+ */
+
+#include <cmath>
+#include "LatencyHistogram.h"
+#include "defines.h"
+
+// buckets are log scaled: bucket i holds samples in
+// (BUCKET_MIN * BUCKET_RATIO ^ (i - 1), BUCKET_MIN * BUCKET_RATIO ^ i]
+// 40 buckets cover 10 ms .. 60 s
+#define BUCKET_MIN 0.01
+#define BUCKET_RATIO 1.25
+
+const int LatencyHistogram::BUCKET_COUNT = 40;
+
+pthread_mutex_t LatencyHistogram::histogramsLock;
+map<string, LatencyHistogram*> LatencyHistogram::histograms;
+
+LatencyHistogram::LatencyHistogram(const size_t windowSize) {
+    bucketCounts.resize(BUCKET_COUNT, 0);
+    samples.resize(windowSize > 0 ? windowSize : 1, 0);
+    sampleCount = 0;
+    nextSample = 0;
+    pthread_mutex_init(&mutex, NULL);
+}
+
+LatencyHistogram::LatencyHistogram(const LatencyHistogram& orig) {
+}
+
+LatencyHistogram::~LatencyHistogram() {
+    pthread_mutex_destroy(&mutex);
+}
+
+const int LatencyHistogram::getBucketIndex(const double seconds) {
+    if (seconds <= BUCKET_MIN) return 0;
+    int index = (int) ceil(log(seconds / BUCKET_MIN) / log(BUCKET_RATIO));
+    if (index >= BUCKET_COUNT) index = BUCKET_COUNT - 1;
+    return index;
+}
+
+const double LatencyHistogram::getBucketUpperBound(const int index) {
+    return BUCKET_MIN * pow(BUCKET_RATIO, index);
+}
+
+void LatencyHistogram::addSample(const double seconds) {
+    int bucket = getBucketIndex(seconds);
+    pthread_mutex_lock(&mutex);
+    if (sampleCount == samples.size()) {
+        // window is full, forget the oldest one
+        bucketCounts[samples[nextSample]]--;
+    } else {
+        sampleCount++;
+    }
+    samples[nextSample] = bucket;
+    bucketCounts[bucket]++;
+    nextSample = (nextSample + 1) % samples.size();
+    pthread_mutex_unlock(&mutex);
+    DEBUG_PRINT(5, "[LATENCY] addSample: %.3lf (bucket %d)\n", seconds, bucket);
+}
+
+const double LatencyHistogram::getPercentile(const double percentile) const {
+    double r = -1;
+    pthread_mutex_lock(&mutex);
+    if (sampleCount > 0) {
+        // rank of the sample we want, 1 based
+        size_t rank = (size_t) ceil(percentile * sampleCount);
+        if (rank < 1) rank = 1;
+        size_t accumulated = 0;
+        for (int i = 0; i < BUCKET_COUNT; ++i) {
+            accumulated += bucketCounts[i];
+            if (accumulated >= rank) {
+                r = getBucketUpperBound(i);
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&mutex);
+    return r;
+}
+
+const size_t LatencyHistogram::getSampleCount() const {
+    pthread_mutex_lock(&mutex);
+    size_t r = sampleCount;
+    pthread_mutex_unlock(&mutex);
+    return r;
+}
+
+LatencyHistogram& LatencyHistogram::getHistogram(const string& backend) {
+    pthread_mutex_lock(&histogramsLock);
+    map<string, LatencyHistogram*>::iterator it = histograms.find(backend);
+    LatencyHistogram* histogram;
+    if (it == histograms.end()) {
+        DEBUG_PRINT(3, "[LATENCY] new histogram for backend '%s'\n", backend.c_str());
+        histogram = new LatencyHistogram();
+        histograms[backend] = histogram;
+    } else {
+        histogram = it->second;
+    }
+    pthread_mutex_unlock(&histogramsLock);
+    return *histogram;
+}
+
+const vector<string> LatencyHistogram::getBackends() {
+    vector<string> r;
+    pthread_mutex_lock(&histogramsLock);
+    for (map<string, LatencyHistogram*>::const_iterator it = histograms.begin(); it != histograms.end(); ++it) {
+        r.push_back(it->first);
+    }
+    pthread_mutex_unlock(&histogramsLock);
+    return r;
+}
+
+void LatencyHistogram::staticInit() {
+    pthread_mutex_init(&histogramsLock, NULL);
+}
+
+void LatencyHistogram::staticDestruct() {
+    pthread_mutex_lock(&histogramsLock);
+    for (map<string, LatencyHistogram*>::iterator it = histograms.begin(); it != histograms.end(); ++it) {
+        delete it->second;
+    }
+    histograms.clear();
+    pthread_mutex_unlock(&histogramsLock);
+    pthread_mutex_destroy(&histogramsLock);
+}
@@ -0,0 +1,75 @@
+/*
+ * File:   LatencyHistogram.h
+ * Author: WU Jun <quark@lihdd.net>
+ *
+ * rolling latency histogram, one per fetch backend.
+ * used to derive timeouts and hedge delays from observed latencies
+ * instead of fixed numbers.
+ */
+
+#ifndef _LATENCYHISTOGRAM_H
+#define	_LATENCYHISTOGRAM_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <pthread.h>
+
+using std::string;
+using std::vector;
+using std::map;
+
+class LatencyHistogram {
+public:
+    /**
+     * @param windowSize only last windowSize samples are counted
+     */
+    LatencyHistogram(const size_t windowSize = 64);
+    virtual ~LatencyHistogram();
+
+    /**
+     * record a sample, in seconds. timed out fetches should be
+     * recorded with their timeout, so percentiles can grow.
+     */
+    void addSample(const double seconds);
+
+    /**
+     * @param percentile 0 - 1, e.g. 0.9 for p90
+     * @return upper bound of the bucket containing that percentile,
+     *         in seconds. negative if there is no sample.
+     */
+    const double getPercentile(const double percentile) const;
+    const size_t getSampleCount() const;
+
+    /**
+     * histogram of a backend (e.g. fetcher path), created on first use.
+     * histograms are never freed until staticDestruct().
+     */
+    static LatencyHistogram& getHistogram(const string& backend);
+    /**
+     * @return backends having a histogram
+     */
+    static const vector<string> getBackends();
+
+    static void staticInit();
+    static void staticDestruct();
+
+    static const int BUCKET_COUNT;
+private:
+    LatencyHistogram(const LatencyHistogram& orig);
+
+    static const int getBucketIndex(const double seconds);
+    static const double getBucketUpperBound(const int index);
+
+    // bucketCounts[i] counts samples in bucket i, samples is a ring of bucket indexes
+    vector<size_t> bucketCounts;
+    vector<int> samples;
+    size_t sampleCount, nextSample;
+    mutable pthread_mutex_t mutex;
+
+    static pthread_mutex_t histogramsLock;
+    static map<string, LatencyHistogram*> histograms;
+};
+
+#endif	/* _LATENCYHISTOGRAM_H */
+
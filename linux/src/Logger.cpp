@@ -0,0 +1,158 @@
+/*
+ * File:   Logger.cpp
+ * Author: WU Jun <quark@lihdd.net>
+ */
+
+#include <cstdio>
+#include <cstdarg>
+#include <algorithm>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <glib.h>
+#include "Logger.h"
+#include "ThreadRings.h"
+#include "XUtility.h"
+#include "defines.h"
+
+// a line longer than this is cut
+#define LOG_LINE_SIZE 240
+// writer wakes up this often (usec)
+#define WRITER_INTERVAL 50000
+
+const int Logger::RING_CAPACITY = 256;
+
+struct LogRecord {
+    long long time;
+    int line;
+    int threadId;
+    char text[LOG_LINE_SIZE];
+};
+
+static bool compareRecordTime(const LogRecord& a, const LogRecord& b) {
+    return a.time < b.time;
+}
+
+pthread_t Logger::writerThread;
+pthread_mutex_t Logger::writerLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t Logger::writerCond = PTHREAD_COND_INITIALIZER;
+volatile int Logger::writerRunning = 0;
+pthread_mutex_t Logger::outputLock = PTHREAD_MUTEX_INITIALIZER;
+volatile long long Logger::droppedCount = 0;
+
+ThreadRings& Logger::getRings() {
+    // logging may start before staticInit and go on during exit, so
+    // created on first use and never deleted
+    static ThreadRings* rings = new ThreadRings(sizeof (LogRecord), RING_CAPACITY);
+    return *rings;
+}
+
+void Logger::log(const int line, const char* format, ...) {
+    va_list args;
+    long long time = XUtility::getMonotonicTime();
+
+    if (!g_atomic_int_get(&writerRunning)) {
+        // before staticInit or after staticDestruct, tools without writer
+        pthread_mutex_lock(&outputLock);
+        fprintf(stderr, "[DEBUG] (%.3lf) L%03d (thread %d): ", (double) time / XUtility::MICROSECOND_PER_SECOND, line, (int) syscall(SYS_gettid));
+        va_start(args, format);
+        vfprintf(stderr, format, args);
+        va_end(args);
+        pthread_mutex_unlock(&outputLock);
+        return;
+    }
+
+    // single producer (owner thread), single consumer (writer, under rings lock)
+    ThreadRings& rings = getRings();
+    ThreadRing* ring = rings.getCurrentRing();
+    long long tail = ring->tail;
+    if (tail - __sync_fetch_and_add(&ring->head, 0) >= RING_CAPACITY) {
+        __sync_fetch_and_add(&droppedCount, 1);
+        return;
+    }
+
+    LogRecord& record = *(LogRecord*) rings.getItem(ring, tail);
+    record.time = time;
+    record.line = line;
+    record.threadId = ring->threadId;
+    va_start(args, format);
+    int length = vsnprintf(record.text, sizeof (record.text), format, args);
+    va_end(args);
+    // keep line ending of cut lines
+    if (length >= (int) sizeof (record.text)) record.text[sizeof (record.text) - 2] = '\n';
+
+    // full barrier, record is visible before tail
+    __sync_fetch_and_add(&ring->tail, 1);
+}
+
+void Logger::writeQueuedLines() {
+    vector<LogRecord> records;
+
+    ThreadRings& rings = getRings();
+    rings.lock();
+    for (size_t i = 0; i < rings.getRings().size(); ++i) {
+        ThreadRing* ring = rings.getRings()[i];
+        long long head = ring->head, tail = __sync_fetch_and_add(&ring->tail, 0);
+        for (long long p = head; p < tail; ++p) records.push_back(*(LogRecord*) rings.getItem(ring, p));
+        __sync_lock_test_and_set(&ring->head, tail);
+    }
+    rings.unlock();
+
+    long long dropped = __sync_lock_test_and_set(&droppedCount, 0);
+    if (records.empty() && dropped == 0) return;
+
+    // lines of different threads, print in time order
+    std::stable_sort(records.begin(), records.end(), compareRecordTime);
+
+    pthread_mutex_lock(&outputLock);
+    for (size_t i = 0; i < records.size(); ++i) {
+        const LogRecord& record = records[i];
+        fprintf(stderr, "[DEBUG] (%.3lf) L%03d (thread %d): %s", (double) record.time / XUtility::MICROSECOND_PER_SECOND, record.line, record.threadId, record.text);
+    }
+    if (dropped > 0) fprintf(stderr, "[DEBUG] %lld lines dropped\n", dropped);
+    fflush(stderr);
+    pthread_mutex_unlock(&outputLock);
+}
+
+void Logger::flush() {
+    writeQueuedLines();
+}
+
+void* Logger::writerThreadFunc(void* data) {
+    UNUSED(data);
+    pthread_mutex_lock(&writerLock);
+    while (g_atomic_int_get(&writerRunning)) {
+        long long wakeTime = XUtility::getCurrentTime() + WRITER_INTERVAL;
+        struct timespec wakeTimespec;
+        wakeTimespec.tv_sec = wakeTime / XUtility::MICROSECOND_PER_SECOND;
+        wakeTimespec.tv_nsec = (wakeTime % XUtility::MICROSECOND_PER_SECOND) * 1000;
+        pthread_cond_timedwait(&writerCond, &writerLock, &wakeTimespec);
+
+        pthread_mutex_unlock(&writerLock);
+        writeQueuedLines();
+        pthread_mutex_lock(&writerLock);
+    }
+    pthread_mutex_unlock(&writerLock);
+    return NULL;
+}
+
+void Logger::staticInit() {
+    pthread_mutex_lock(&writerLock);
+    g_atomic_int_set(&writerRunning, 1);
+    if (pthread_create(&writerThread, NULL, writerThreadFunc, NULL)) {
+        perror("[ERROR] can not create log writer thread");
+        g_atomic_int_set(&writerRunning, 0);
+    }
+    pthread_mutex_unlock(&writerLock);
+}
+
+void Logger::staticDestruct() {
+    pthread_mutex_lock(&writerLock);
+    bool joinable = g_atomic_int_get(&writerRunning);
+    g_atomic_int_set(&writerRunning, 0);
+    pthread_cond_signal(&writerCond);
+    pthread_mutex_unlock(&writerLock);
+    if (joinable) pthread_join(writerThread, NULL);
+
+    // lines queued after writer exited
+    writeQueuedLines();
+}
@@ -0,0 +1,56 @@
+/*
+ * File:   Logger.h
+ * Author: WU Jun <quark@lihdd.net>
+ *
+ * debug log behind DEBUG_PRINT. callers only format into a ring owned by
+ * their thread, a background thread writes rings to stderr, so logging
+ * doesn't block in locked regions or lua callbacks.
+ */
+
+#ifndef _LOGGER_H
+#define	_LOGGER_H
+
+#include <vector>
+#include <pthread.h>
+
+using std::vector;
+
+class ThreadRings;
+
+class Logger {
+public:
+    /**
+     * format and queue a line, printf style. if writer thread is not
+     * running, write to stderr directly. lines are dropped (and counted)
+     * if writer can not keep up.
+     */
+    static void log(const int line, const char* format, ...);
+
+    /**
+     * write all queued lines now
+     */
+    static void flush();
+
+    static void staticInit();
+    static void staticDestruct();
+
+    static const int RING_CAPACITY;
+private:
+    Logger();
+    Logger(const Logger& orig);
+
+    static ThreadRings& getRings();
+    static void* writerThreadFunc(void* data);
+    static void writeQueuedLines();
+
+    static pthread_t writerThread;
+    static pthread_mutex_t writerLock;
+    static pthread_cond_t writerCond;
+    static volatile int writerRunning;
+    // only one thread writes to stderr at a time
+    static pthread_mutex_t outputLock;
+    static volatile long long droppedCount;
+};
+
+#endif	/* _LOGGER_H */
+
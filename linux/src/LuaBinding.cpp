@@ -12,6 +12,8 @@
 #include <cstring>
 #include <cstdlib>
 #include <cassert>
+#include <set>
+#include <unistd.h>
 #include <ibus.h>
 
 // Lua C functions
@@ -21,12 +23,82 @@
 int LuaBinding::l_executeScript(lua_State * L) {
     DEBUG_PRINT(2, "[LUABIND] l_executeScript\n");
     luaL_checktype(L, 1, LUA_TSTRING);
-    LuaBinding& lb = *luaStates[L];
+    LuaBinding& lb = getLuaBinding(L);
     int r = lb.doString(lua_tostring(L, 1));
     lua_pushboolean(L, r == 0);
     return 1;
 }
 
+int LuaBinding::l_registerWorkerScript(lua_State * L) {
+    DEBUG_PRINT(2, "[LUABIND] l_registerWorkerScript\n");
+    luaL_checktype(L, 1, LUA_TSTRING);
+    pthread_mutex_lock(&workersLock);
+    workerScripts.push_back(lua_tostring(L, 1));
+    pthread_mutex_unlock(&workersLock);
+    return 0;
+}
+
+int LuaBinding::l_post(lua_State * L) {
+    DEBUG_PRINT(2, "[LUABIND] l_post\n");
+    luaL_checktype(L, 1, LUA_TSTRING);
+    luaL_checktype(L, 2, LUA_TSTRING);
+    pthread_mutex_lock(&postedMessagesLock);
+    bool dispatchScheduled = !postedMessages.empty();
+    postedMessages.push_back(pair<string, string > (lua_tostring(L, 1), lua_tostring(L, 2)));
+    pthread_mutex_unlock(&postedMessagesLock);
+    if (!dispatchScheduled) g_idle_add(dispatchPostedMessages, NULL);
+    return 0;
+}
+
+int LuaBinding::l_callInMainLoop(lua_State * L) {
+    DEBUG_PRINT(2, "[LUABIND] l_callInMainLoop\n");
+    int resultCount = 0;
+    bool failed = false;
+    {
+        // locals are gone before lua_error longjmps
+        MainLoopCall call;
+        call.funcName = lua_tostring(L, lua_upvalueindex(1));
+        call.finished = false;
+        for (int i = 1; i <= lua_gettop(L); ++i) {
+            LuaValue value;
+            if (!toLuaValue(L, i, value)) {
+                call.error = call.funcName + ": only nil, boolean, number and string can be passed to main loop";
+                break;
+            }
+            call.args.push_back(value);
+        }
+
+        if (call.error.empty()) {
+            LuaBinding& worker = getLuaBinding(L);
+            if (worker.trackingValues) {
+                map<string, LuaValue> values = worker.getLibraryValues();
+                for (map<string, LuaValue>::const_iterator it = values.begin(); it != values.end(); ++it) {
+                    map<string, LuaValue>::const_iterator start = worker.scriptStartValues.find(it->first);
+                    if (start == worker.scriptStartValues.end() || !isSameLuaValue(start->second, it->second)) call.values.push_back(*it);
+                }
+                worker.scriptStartValues.swap(values);
+            }
+
+            DEBUG_PRINT(3, "[LUABIND] worker calls %s in main loop\n", call.funcName.c_str());
+            g_idle_add(callInMainLoop, (gpointer) & call);
+            pthread_mutex_lock(&mainLoopCallsLock);
+            while (!call.finished) pthread_cond_wait(&mainLoopCallFinishedCond, &mainLoopCallsLock);
+            pthread_mutex_unlock(&mainLoopCallsLock);
+        }
+
+        if (!call.error.empty()) {
+            lua_pushstring(L, call.error.c_str());
+            failed = true;
+        } else {
+            lua_checkstack(L, call.results.size());
+            for (size_t i = 0; i < call.results.size(); ++i) pushLuaValue(L, call.results[i]);
+            resultCount = call.results.size();
+        }
+    }
+    if (failed) return lua_error(L);
+    return resultCount;
+}
+
 int LuaBinding::l_printStack(lua_State *L) {
     DEBUG_PRINT(3, "[LUABIND] l_printStack\n");
     int c;
@@ -59,7 +131,7 @@ int LuaBinding::l_printStack(lua_State *L) {
 
 int LuaBinding::l_bitand(lua_State *L) {
     DEBUG_PRINT(3, "[LUABIND] l_bitand\n");
-    LuaBinding* lib = luaStates[L];
+    LuaBinding* lib = &getLuaBinding(L);
     pthread_mutex_lock(&lib->luaStateAtomMutex);
     luaL_checktype(L, 1, LUA_TNUMBER);
     luaL_checktype(L, 2, LUA_TNUMBER);
@@ -72,7 +144,7 @@ int LuaBinding::l_bitand(lua_State *L) {
 
 int LuaBinding::l_bitxor(lua_State *L) {
     DEBUG_PRINT(3, "[LUA] l_bitxor\n");
-    LuaBinding* lib = luaStates[L];
+    LuaBinding* lib = &getLuaBinding(L);
     pthread_mutex_lock(&lib->luaStateAtomMutex);
     luaL_checktype(L, 1, LUA_TNUMBER);
     luaL_checktype(L, 2, LUA_TNUMBER);
@@ -84,7 +156,7 @@ int LuaBinding::l_bitxor(lua_State *L) {
 
 int LuaBinding::l_bitor(lua_State *L) {
     DEBUG_PRINT(2, "[LUA] l_bitor\n");
-    LuaBinding* lib = luaStates[L];
+    LuaBinding* lib = &getLuaBinding(L);
     pthread_mutex_lock(&lib->luaStateAtomMutex);
     luaL_checktype(L, 1, LUA_TNUMBER);
     luaL_checktype(L, 2, LUA_TNUMBER);
@@ -111,6 +183,8 @@ const struct luaL_Reg LuaBinding::luaLibraryReg[] = {
     //{"get_selection", LuaBinding::l_getSelection},
     //{"notify", LuaBinding::l_notify},
     {"execute", LuaBinding::l_executeScript},
+    {"register_worker_script", LuaBinding::l_registerWorkerScript},
+    {"post", LuaBinding::l_post},
     //{"commit", Engine::l_commitText},
     //{"request", Engine::l_sendRequest},
     //{"register_command", Configuration::l_registerCommand},
@@ -120,6 +194,22 @@ const struct luaL_Reg LuaBinding::luaLibraryReg[] = {
 // LuaBinding class
 
 map<const lua_State*, LuaBinding*> LuaBinding::luaStates;
+pthread_mutex_t LuaBinding::luaStatesLock = PTHREAD_MUTEX_INITIALIZER;
+
+pthread_mutex_t LuaBinding::workersLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t LuaBinding::workerReleasedCond = PTHREAD_COND_INITIALIZER;
+vector<LuaBinding*> LuaBinding::idleWorkers;
+size_t LuaBinding::workerCount = 0;
+vector<string> LuaBinding::workerScripts;
+vector<pair<string, lua_CFunction> > LuaBinding::workerFunctions;
+map<string, size_t> LuaBinding::workerMissingFunctions;
+
+pthread_mutex_t LuaBinding::postedMessagesLock = PTHREAD_MUTEX_INITIALIZER;
+deque<pair<string, string> > LuaBinding::postedMessages;
+
+vector<string> LuaBinding::staticFunctionNames;
+pthread_mutex_t LuaBinding::mainLoopCallsLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t LuaBinding::mainLoopCallFinishedCond = PTHREAD_COND_INITIALIZER;
 
 const char LuaBinding::LIB_NAME[] = IME_LIBRARY_NAME;
 const string LuaBinding::LibraryName = LuaBinding::LIB_NAME;
@@ -161,7 +251,12 @@ LuaBinding::LuaBinding() {
     // insert into static map, let lib function be able to lookup this class
     // L - this one-to-one relation. (Now it takes O(logN) to lookup 'this'
     // from L. Any way to make it more smooth?)
+    pthread_mutex_lock(&luaStatesLock);
     luaStates[L] = this;
+    pthread_mutex_unlock(&luaStatesLock);
+
+    loadedWorkerScriptCount = 0;
+    trackingValues = false;
 }
 
 void LuaBinding::staticInit() {
@@ -176,9 +271,239 @@ void LuaBinding::loadStaticConfigure() {
 
 void LuaBinding::staticDestruct() {
     DEBUG_PRINT(1, "[LUABIND] Static Destroy\n");
+    pthread_mutex_lock(&workersLock);
+    // busy workers are released soon, wait for them. they may wait for
+    // main loop (l_callInMainLoop), keep it going
+    while (idleWorkers.size() < workerCount) {
+        pthread_mutex_unlock(&workersLock);
+        while (g_main_context_iteration(NULL, FALSE));
+        usleep(1000);
+        pthread_mutex_lock(&workersLock);
+    }
+    for (size_t i = 0; i < idleWorkers.size(); ++i) delete idleWorkers[i];
+    idleWorkers.clear();
+    workerCount = 0;
+    pthread_mutex_unlock(&workersLock);
     delete staticLuaBinding;
 }
 
+LuaBinding* LuaBinding::acquireWorker(const char* funcName) {
+    LuaBinding* worker = NULL;
+    size_t scriptCount;
+
+    pthread_mutex_lock(&workersLock);
+    // no scripts registered since workers were found missing it
+    if (funcName) {
+        map<string, size_t>::const_iterator it = workerMissingFunctions.find(funcName);
+        if (it != workerMissingFunctions.end() && it->second == workerScripts.size()) {
+            pthread_mutex_unlock(&workersLock);
+            return NULL;
+        }
+    }
+    for (;;) {
+        if (!idleWorkers.empty()) {
+            worker = idleWorkers.back();
+            idleWorkers.pop_back();
+            break;
+        }
+        if (Configuration::luaWorkerCount <= 0) break;
+        if (workerCount < (size_t) Configuration::luaWorkerCount) {
+            // create it outside lock
+            workerCount++;
+            break;
+        }
+        pthread_cond_wait(&workerReleasedCond, &workersLock);
+    }
+    scriptCount = workerScripts.size();
+    vector<pair<string, lua_CFunction> > functions;
+    vector<string> mainLoopFunctions;
+    if (!worker) functions = workerFunctions, mainLoopFunctions = staticFunctionNames;
+    pthread_mutex_unlock(&workersLock);
+
+    if (!worker && Configuration::luaWorkerCount > 0) {
+        DEBUG_PRINT(2, "[LUABIND] new worker state\n");
+        worker = new LuaBinding();
+        std::set<string> names;
+        for (size_t i = 0; i < functions.size(); ++i) {
+            worker->registerFunction(functions[i].second, functions[i].first.c_str());
+            names.insert(functions[i].first);
+        }
+        // the rest of static binding functions are called in main loop
+        for (size_t i = 0; i < mainLoopFunctions.size(); ++i) {
+            if (names.count(mainLoopFunctions[i]) == 0) worker->registerMainLoopFunction(mainLoopFunctions[i].c_str());
+        }
+    }
+    if (!worker) return NULL;
+
+    // load scripts registered after last time
+    for (; worker->loadedWorkerScriptCount < scriptCount; worker->loadedWorkerScriptCount++) {
+        pthread_mutex_lock(&workersLock);
+        string path = workerScripts[worker->loadedWorkerScriptCount];
+        pthread_mutex_unlock(&workersLock);
+
+        DEBUG_PRINT(3, "[LUABIND] worker loads %s\n", path.c_str());
+        if (luaL_dofile(worker->L, path.c_str())) {
+            fprintf(stderr, "%s\n", lua_tostring(worker->L, -1));
+            lua_pop(worker->L, 1);
+        }
+    }
+
+    // all workers load same scripts, one tells for all
+    if (funcName && worker->getValueType(funcName, "_G") != LUA_TFUNCTION) {
+        DEBUG_PRINT(3, "[LUABIND] %s is not defined in workers\n", funcName);
+        pthread_mutex_lock(&workersLock);
+        workerMissingFunctions[funcName] = scriptCount;
+        pthread_mutex_unlock(&workersLock);
+        releaseWorker(worker);
+        return NULL;
+    }
+    return worker;
+}
+
+void LuaBinding::registerWorkerFunction(const lua_CFunction func, const char * funcName) {
+    DEBUG_PRINT(1, "[LUABIND] addWorkerFunction: %s\n", funcName);
+    pthread_mutex_lock(&workersLock);
+    workerFunctions.push_back(pair<string, lua_CFunction > (funcName, func));
+    pthread_mutex_unlock(&workersLock);
+}
+
+void LuaBinding::releaseWorker(LuaBinding* worker) {
+    pthread_mutex_lock(&workersLock);
+    idleWorkers.push_back(worker);
+    // staticDestruct may wait too
+    pthread_cond_broadcast(&workerReleasedCond);
+    pthread_mutex_unlock(&workersLock);
+}
+
+int LuaBinding::dispatchPostedMessages(void* data) {
+    UNUSED(data);
+    deque<pair<string, string> > messages;
+    pthread_mutex_lock(&postedMessagesLock);
+    messages.swap(postedMessages);
+    pthread_mutex_unlock(&postedMessagesLock);
+
+    for (size_t i = 0; i < messages.size(); ++i) {
+        DEBUG_PRINT(3, "[LUABIND] posted: %s\n", messages[i].first.c_str());
+        staticLuaBinding->callLuaFunction(messages[i].first.c_str(), "s", messages[i].second.c_str());
+    }
+    // run once
+    return FALSE;
+}
+
+int LuaBinding::callInMainLoop(void* data) {
+    MainLoopCall* call = (MainLoopCall*) data;
+    LuaBinding& lb = *staticLuaBinding;
+    lua_State* L = lb.L;
+
+    pthread_mutex_lock(&lb.luaStateFunctionMutex);
+    int top = lua_gettop(L);
+    lua_checkstack(L, call->args.size() + 3);
+    lua_getglobal(L, LIB_NAME);
+    for (size_t i = 0; i < call->values.size(); ++i) {
+        pushLuaValue(L, call->values[i].second);
+        lua_setfield(L, -2, call->values[i].first.c_str());
+    }
+    lua_getfield(L, -1, call->funcName.c_str());
+    for (size_t i = 0; i < call->args.size(); ++i) pushLuaValue(L, call->args[i]);
+    if (lua_pcall(L, call->args.size(), LUA_MULTRET, 0)) {
+        const char* message = lua_tostring(L, -1);
+        call->error = message ? message : call->funcName + ": error in main loop";
+    } else {
+        for (int i = top + 2; i <= lua_gettop(L); ++i) {
+            LuaValue value;
+            // others (tables, functions) can not leave static binding
+            if (!toLuaValue(L, i, value)) value.type = LUA_TNIL;
+            call->results.push_back(value);
+        }
+    }
+    lua_settop(L, top);
+    pthread_mutex_unlock(&lb.luaStateFunctionMutex);
+
+    pthread_mutex_lock(&mainLoopCallsLock);
+    call->finished = true;
+    pthread_cond_broadcast(&mainLoopCallFinishedCond);
+    pthread_mutex_unlock(&mainLoopCallsLock);
+    // run once
+    return FALSE;
+}
+
+bool LuaBinding::toLuaValue(lua_State* L, int index, LuaValue& value) {
+    value.type = lua_type(L, index);
+    switch (value.type) {
+        case LUA_TNIL:
+            return true;
+        case LUA_TBOOLEAN:
+            value.boolean = lua_toboolean(L, index);
+            return true;
+        case LUA_TNUMBER:
+            value.number = lua_tonumber(L, index);
+            return true;
+        case LUA_TSTRING:
+            value.text = string(lua_tostring(L, index), lua_objlen(L, index));
+            return true;
+    }
+    return false;
+}
+
+void LuaBinding::pushLuaValue(lua_State* L, const LuaValue& value) {
+    switch (value.type) {
+        case LUA_TBOOLEAN:
+            lua_pushboolean(L, value.boolean);
+            break;
+        case LUA_TNUMBER:
+            lua_pushnumber(L, value.number);
+            break;
+        case LUA_TSTRING:
+            lua_pushlstring(L, value.text.data(), value.text.length());
+            break;
+        default:
+            lua_pushnil(L);
+    }
+}
+
+bool LuaBinding::isSameLuaValue(const LuaValue& a, const LuaValue& b) {
+    if (a.type != b.type) return false;
+    switch (a.type) {
+        case LUA_TBOOLEAN:
+            return a.boolean == b.boolean;
+        case LUA_TNUMBER:
+            return a.number == b.number;
+        case LUA_TSTRING:
+            return a.text == b.text;
+    }
+    return true;
+}
+
+map<string, LuaBinding::LuaValue> LuaBinding::getLibraryValues() {
+    map<string, LuaValue> r;
+    pthread_mutex_lock(&luaStateAtomMutex);
+    lua_checkstack(L, 3);
+    lua_getglobal(L, LIB_NAME);
+    if (lua_istable(L, -1)) {
+        for (lua_pushnil(L); lua_next(L, -2) != 0; lua_pop(L, 1)) {
+            LuaValue value;
+            // do not use lua_tostring on key, it confuses lua_next
+            if (lua_type(L, -2) == LUA_TSTRING && toLuaValue(L, -1, value)) r[lua_tostring(L, -2)] = value;
+        }
+    }
+    lua_pop(L, 1);
+    pthread_mutex_unlock(&luaStateAtomMutex);
+    return r;
+}
+
+void LuaBinding::registerMainLoopFunction(const char* funcName) {
+    DEBUG_PRINT(3, "[LUABIND] addMainLoopFunction: %s\n", funcName);
+    pthread_mutex_lock(&luaStateAtomMutex);
+    lua_checkstack(L, 3);
+    lua_getglobal(L, LIB_NAME);
+    lua_pushstring(L, funcName);
+    lua_pushstring(L, funcName);
+    lua_pushcclosure(L, l_callInMainLoop, 1);
+    lua_settable(L, -3);
+    lua_pop(L, 1);
+    pthread_mutex_unlock(&luaStateAtomMutex);
+}
+
 const lua_State* LuaBinding::getLuaState() const {
     return L;
 }
@@ -201,6 +526,17 @@ int LuaBinding::doString(const char* luaScript, bool locked) {
     return r;
 }
 
+int LuaBinding::doStringInWorker(const char* luaScript) {
+    pthread_mutex_lock(&luaStateFunctionMutex);
+    scriptStartValues = getLibraryValues();
+    trackingValues = true;
+    int r = doString(luaScript, false);
+    trackingValues = false;
+    scriptStartValues.clear();
+    pthread_mutex_unlock(&luaStateFunctionMutex);
+    return r;
+}
+
 int LuaBinding::callLuaFunction(const char * const funcName, const char* sig, ...) {
     DEBUG_PRINT(2, "[LUABIND] callLua: %s (%s)\n", funcName, sig);
 
@@ -290,6 +626,11 @@ aborting:
 
 void LuaBinding::registerFunction(const lua_CFunction func, const char * funcName) {
     DEBUG_PRINT(1, "[LUABIND] addFunction: %s\n", funcName);
+    if (this == staticLuaBinding) {
+        pthread_mutex_lock(&workersLock);
+        staticFunctionNames.push_back(funcName);
+        pthread_mutex_unlock(&workersLock);
+    }
 
     pthread_mutex_lock(&luaStateAtomMutex);
     lua_checkstack(L, 3);
@@ -400,6 +741,23 @@ double LuaBinding::getValue(const char* varName, const double defaultValue, cons
     return r;
 }
 
+vector<string> LuaBinding::getTableKeys(const char* libName) {
+    DEBUG_PRINT(4, "[LUABIND] getTableKeys: %s\n", libName);
+    vector<string> r;
+    pthread_mutex_lock(&luaStateAtomMutex);
+    lua_checkstack(L, 3);
+    lua_getglobal(L, libName);
+    if (lua_istable(L, -1)) {
+        for (lua_pushnil(L); lua_next(L, -2) != 0; lua_pop(L, 1)) {
+            // do not use lua_tostring on key, it confuses lua_next
+            if (lua_type(L, -2) == LUA_TSTRING) r.push_back(lua_tostring(L, -2));
+        }
+    }
+    lua_pop(L, 1);
+    pthread_mutex_unlock(&luaStateAtomMutex);
+    return r;
+}
+
 int LuaBinding::getValueType(const char* varName, const char* libName) {
     DEBUG_PRINT(4, "[LUABIND] getValueType: %s.%s\n", libName, varName);
     pthread_mutex_lock(&luaStateAtomMutex);
@@ -462,7 +820,9 @@ LuaBinding::LuaBinding(const LuaBinding& orig) {
 
 LuaBinding::~LuaBinding() {
     DEBUG_PRINT(1, "[LUABIND] Destroy\n");
+    pthread_mutex_lock(&luaStatesLock);
     luaStates.erase(L);
+    pthread_mutex_unlock(&luaStatesLock);
     lua_close(L);
     pthread_mutex_destroy(&luaStateAtomMutex);
     pthread_mutex_destroy(&luaStateFunctionMutex);
@@ -475,8 +835,11 @@ LuaBinding& LuaBinding::getStaticBinding() {
 }
 
 LuaBinding& LuaBinding::getLuaBinding(lua_State* L) {
-    if (luaStates.find(L) == luaStates.end()) return getStaticBinding();
-    return *luaStates.find(L)->second;
+    pthread_mutex_lock(&luaStatesLock);
+    map<const lua_State*, LuaBinding*>::iterator it = luaStates.find(L);
+    LuaBinding* r = (it == luaStates.end()) ? staticLuaBinding : it->second;
+    pthread_mutex_unlock(&luaStatesLock);
+    return *r;
 }
 
 pthread_mutex_t* LuaBinding::getAtomMutex() {
@@ -15,11 +15,16 @@ extern "C" {
 }
 
 #include <map>
+#include <deque>
 #include <string>
+#include <vector>
+#include <pthread.h>
 
 using std::map;
+using std::deque;
 using std::pair;
 using std::string;
+using std::vector;
 
 class LuaBinding {
 public:
@@ -38,6 +43,10 @@ public:
     bool getValue(const char* varName, const bool defaultValue = false, const char* libName = LIB_NAME);
     double getValue(const char* varName, const double defaultValue, const char* libName = LIB_NAME);
     int getValueType(const char* varName, const char* libName = LIB_NAME);
+    /**
+     * string keys of a global table, empty if it is not a table
+     */
+    vector<string> getTableKeys(const char* libName = LIB_NAME);
 
     void setValue(const char* varName, const int value, const char* libName = LIB_NAME);
     void setValue(const char* varName, const char value[], const char* libName = LIB_NAME);
@@ -45,6 +54,13 @@ public:
 
     virtual ~LuaBinding();
     int doString(const char* luaScript, bool locked = false);
+    /**
+     * run script in this worker like static binding would. functions only
+     * static binding has are called in main loop (see l_callInMainLoop),
+     * ime values script sets are copied there before each such call, for
+     * ime.apply_settings, etc
+     */
+    int doStringInWorker(const char* luaScript);
 
     /**
      * allow .name (string key)
@@ -88,6 +104,24 @@ public:
     static LuaBinding& getStaticBinding();
     static LuaBinding& getLuaBinding(lua_State *L);
 
+    /**
+     * worker lua states, for background work such as lua fetchers.
+     * each worker is an isolated lua state with scripts registered by
+     * ime.register_worker_script loaded, it talks to static binding
+     * only via ime.post(func, str).
+     * @param funcName if not NULL, a worker is only returned if it defines
+     *        this global function. workers known to miss it are not waited for
+     * @return an idle worker, blocks if all are busy, NULL if disabled or
+     *         funcName is not defined in workers
+     */
+    static LuaBinding* acquireWorker(const char* funcName = NULL);
+    static void releaseWorker(LuaBinding* worker);
+    /**
+     * register a function into LIB_NAME table of every worker created later.
+     * it is called in worker threads, so it must be thread safe
+     */
+    static void registerWorkerFunction(const lua_CFunction func, const char * funcName);
+
     pthread_mutex_t* getAtomMutex();
 private:
     LuaBinding(const LuaBinding& orig);
@@ -98,6 +132,59 @@ private:
     lua_State* L;
     static const struct luaL_Reg luaLibraryReg[];
     static map<const lua_State*, LuaBinding*> luaStates;
+    static pthread_mutex_t luaStatesLock;
+
+    // workers
+    static pthread_mutex_t workersLock;
+    static pthread_cond_t workerReleasedCond;
+    static vector<LuaBinding*> idleWorkers;
+    static size_t workerCount;
+    static vector<string> workerScripts;
+    static vector<pair<string, lua_CFunction> > workerFunctions;
+    // global functions workers do not define => workerScripts.size() then
+    static map<string, size_t> workerMissingFunctions;
+    // how many of workerScripts are loaded, workers only
+    size_t loadedWorkerScriptCount;
+
+    // messages posted by workers: (function name, string)
+    static pthread_mutex_t postedMessagesLock;
+    static deque<pair<string, string> > postedMessages;
+    static int dispatchPostedMessages(void* data);
+
+    // values passed between a worker and main loop, nil, boolean,
+    // number or string
+    struct LuaValue {
+        int type;
+        bool boolean;
+        double number;
+        string text;
+    };
+    struct MainLoopCall {
+        string funcName;
+        vector<LuaValue> args, results;
+        // ime values set by worker script
+        vector<pair<string, LuaValue> > values;
+        string error;
+        bool finished;
+    };
+    // functions registered in static binding, workers call those they
+    // do not have in main loop
+    static vector<string> staticFunctionNames;
+    static pthread_mutex_t mainLoopCallsLock;
+    static pthread_cond_t mainLoopCallFinishedCond;
+    // ime values when doStringInWorker started, workers only
+    map<string, LuaValue> scriptStartValues;
+    bool trackingValues;
+
+    static bool toLuaValue(lua_State* L, int index, LuaValue& value);
+    static void pushLuaValue(lua_State* L, const LuaValue& value);
+    static bool isSameLuaValue(const LuaValue& a, const LuaValue& b);
+    /**
+     * string keyed nil, boolean, number and string values of LIB_NAME table
+     */
+    map<string, LuaValue> getLibraryValues();
+    void registerMainLoopFunction(const char* funcName);
+    static int callInMainLoop(void* data);
 
     /**
      * in: int, int
@@ -126,6 +213,25 @@ private:
      * out: bool
      */
     static int l_executeScript(lua_State * L);
+    /**
+     * load a script into every worker state
+     * in: string (file path)
+     * out: -
+     */
+    static int l_registerWorkerScript(lua_State * L);
+    /**
+     * call a function in static binding from main loop, later
+     * in: string (function name), string
+     * out: -
+     */
+    static int l_post(lua_State * L);
+    /**
+     * worker side of a function only static binding has, calls it in main
+     * loop and waits. upvalue: function name
+     * in: nil, boolean, number or string, ...
+     * out: same types
+     */
+    static int l_callInMainLoop(lua_State * L);
 };
 
 #endif	/* _LUAIBUSBINDING_H */
@@ -0,0 +1,274 @@
+/*
+ * File:   Metrics.cpp
+ * Author: WU Jun <quark@lihdd.net>
+ */
+
+#include <cstdio>
+#include <cmath>
+#include <ctime>
+#include <sstream>
+#include <iomanip>
+#include "Metrics.h"
+#include "Configuration.h"
+#include "XUtility.h"
+#include "defines.h"
+
+using std::ostringstream;
+
+// values below SUB_BUCKET_COUNT have their own bucket, above that each
+// power of 2 is split into SUB_BUCKET_COUNT buckets. 608 buckets cover
+// up to 2^41 (about 25 days in usec), larger values go to the last one
+#define SUB_BUCKET_BITS 4
+#define SUB_BUCKET_COUNT (1 << SUB_BUCKET_BITS)
+#define MAX_EXPONENT 40
+
+const int Metrics::Histogram::BUCKET_COUNT = SUB_BUCKET_COUNT * (MAX_EXPONENT - SUB_BUCKET_BITS + 2);
+
+pthread_mutex_t Metrics::metricsLock = PTHREAD_MUTEX_INITIALIZER;
+map<string, Metrics::Counter*> Metrics::counters;
+map<string, Metrics::Histogram*> Metrics::histograms;
+
+pthread_t Metrics::dumpThread;
+pthread_mutex_t Metrics::dumpLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t Metrics::dumpCond = PTHREAD_COND_INITIALIZER;
+bool Metrics::dumpThreadRunning = false;
+
+// 64 bit atomic read, plain read may tear on 32 bit machines
+#define ATOMIC_GET(x) __sync_fetch_and_add(&(x), 0)
+
+Metrics::Counter::Counter() {
+    value = 0;
+}
+
+void Metrics::Counter::add(const long long delta) {
+    __sync_fetch_and_add(&value, delta);
+}
+
+const long long Metrics::Counter::get() const {
+    return ATOMIC_GET(const_cast<volatile long long&> (value));
+}
+
+Metrics::Histogram::Histogram() {
+    bucketCounts = new long long[BUCKET_COUNT];
+    for (int i = 0; i < BUCKET_COUNT; ++i) bucketCounts[i] = 0;
+    count = sum = max = 0;
+}
+
+Metrics::Histogram::~Histogram() {
+    delete[] bucketCounts;
+}
+
+const int Metrics::Histogram::getBucketIndex(const long long value) {
+    if (value < SUB_BUCKET_COUNT) return value < 0 ? 0 : (int) value;
+    int exponent = 63 - __builtin_clzll((unsigned long long) value);
+    if (exponent > MAX_EXPONENT) return BUCKET_COUNT - 1;
+    return SUB_BUCKET_COUNT * (exponent - SUB_BUCKET_BITS + 1) + (int) ((value >> (exponent - SUB_BUCKET_BITS)) & (SUB_BUCKET_COUNT - 1));
+}
+
+const long long Metrics::Histogram::getBucketUpperBound(const int index) {
+    if (index < SUB_BUCKET_COUNT) return index;
+    int shift = index / SUB_BUCKET_COUNT - 1;
+    long long lowerBound = ((long long) (SUB_BUCKET_COUNT + index % SUB_BUCKET_COUNT)) << shift;
+    return lowerBound + (1LL << shift) - 1;
+}
+
+void Metrics::Histogram::record(long long value) {
+    if (value < 0) value = 0;
+    __sync_fetch_and_add(&bucketCounts[getBucketIndex(value)], 1);
+    __sync_fetch_and_add(&count, 1);
+    __sync_fetch_and_add(&sum, value);
+    for (;;) {
+        long long oldMax = ATOMIC_GET(max);
+        if (value <= oldMax || __sync_bool_compare_and_swap(&max, oldMax, value)) break;
+    }
+}
+
+const long long Metrics::Histogram::getCount() const {
+    return ATOMIC_GET(const_cast<volatile long long&> (count));
+}
+
+const long long Metrics::Histogram::getSum() const {
+    return ATOMIC_GET(const_cast<volatile long long&> (sum));
+}
+
+const long long Metrics::Histogram::getMax() const {
+    return ATOMIC_GET(const_cast<volatile long long&> (max));
+}
+
+const long long Metrics::Histogram::getPercentile(const double percentile) const {
+    // buckets may be updated meanwhile, count them instead of using count
+    long long total = 0;
+    for (int i = 0; i < BUCKET_COUNT; ++i) total += ATOMIC_GET(bucketCounts[i]);
+    if (total == 0) return 0;
+
+    // rank of the sample we want, 1 based
+    long long rank = (long long) ceil(percentile * total);
+    if (rank < 1) rank = 1;
+    long long accumulated = 0;
+    for (int i = 0; i < BUCKET_COUNT; ++i) {
+        accumulated += ATOMIC_GET(bucketCounts[i]);
+        if (accumulated >= rank) {
+            long long r = getBucketUpperBound(i);
+            long long maxValue = getMax();
+            return (maxValue > 0 && r > maxValue) ? maxValue : r;
+        }
+    }
+    return getMax();
+}
+
+Metrics::Counter& Metrics::getCounter(const string& name) {
+    pthread_mutex_lock(&metricsLock);
+    Counter*& counter = counters[name];
+    if (counter == NULL) counter = new Counter();
+    pthread_mutex_unlock(&metricsLock);
+    return *counter;
+}
+
+Metrics::Histogram& Metrics::getHistogram(const string& name) {
+    pthread_mutex_lock(&metricsLock);
+    Histogram*& histogram = histograms[name];
+    if (histogram == NULL) histogram = new Histogram();
+    pthread_mutex_unlock(&metricsLock);
+    return *histogram;
+}
+
+const string Metrics::dump() {
+    ostringstream buffer;
+    pthread_mutex_lock(&metricsLock);
+    for (map<string, Counter*>::const_iterator it = counters.begin(); it != counters.end(); ++it) {
+        buffer << "counter " << it->first << " " << it->second->get() << "\n";
+    }
+
+    // "cache.<layer>.hit" with "cache.<layer>.miss" => hit ratio of that layer
+    buffer << std::fixed << std::setprecision(3);
+    for (map<string, Counter*>::const_iterator it = counters.begin(); it != counters.end(); ++it) {
+        const string& name = it->first;
+        if (name.compare(0, 6, "cache.") != 0 || name.length() < 4 || name.compare(name.length() - 4, 4, ".hit") != 0) continue;
+        string layer = name.substr(0, name.length() - 4);
+        map<string, Counter*>::const_iterator miss = counters.find(layer + ".miss");
+        long long hitCount = it->second->get(), missCount = miss == counters.end() ? 0 : miss->second->get();
+        if (hitCount + missCount > 0) buffer << "ratio " << layer << ".hit_ratio " << (double) hitCount / (hitCount + missCount) << "\n";
+    }
+
+    for (map<string, Histogram*>::const_iterator it = histograms.begin(); it != histograms.end(); ++it) {
+        const Histogram& h = *it->second;
+        long long count = h.getCount();
+        buffer << "histogram " << it->first << " count=" << count;
+        if (count > 0) {
+            buffer << " mean=" << (double) h.getSum() / count << " p50=" << h.getPercentile(0.5) << " p90=" << h.getPercentile(0.9)
+                    << " p99=" << h.getPercentile(0.99) << " max=" << h.getMax();
+        }
+        buffer << "\n";
+    }
+    pthread_mutex_unlock(&metricsLock);
+
+    return buffer.str();
+}
+
+int Metrics::l_stats(lua_State* L) {
+    DEBUG_PRINT(2, "[LUA] l_stats\n");
+    lua_newtable(L);
+    pthread_mutex_lock(&metricsLock);
+    for (map<string, Counter*>::const_iterator it = counters.begin(); it != counters.end(); ++it) {
+        lua_pushnumber(L, (lua_Number) it->second->get());
+        lua_setfield(L, -2, it->first.c_str());
+    }
+    for (map<string, Histogram*>::const_iterator it = histograms.begin(); it != histograms.end(); ++it) {
+        const Histogram& h = *it->second;
+        long long count = h.getCount();
+        lua_newtable(L);
+        lua_pushnumber(L, (lua_Number) count);
+        lua_setfield(L, -2, "count");
+        lua_pushnumber(L, (lua_Number) h.getSum());
+        lua_setfield(L, -2, "sum");
+        lua_pushnumber(L, count > 0 ? (lua_Number) h.getSum() / count : 0);
+        lua_setfield(L, -2, "mean");
+        lua_pushnumber(L, (lua_Number) h.getMax());
+        lua_setfield(L, -2, "max");
+        lua_pushnumber(L, (lua_Number) h.getPercentile(0.5));
+        lua_setfield(L, -2, "p50");
+        lua_pushnumber(L, (lua_Number) h.getPercentile(0.9));
+        lua_setfield(L, -2, "p90");
+        lua_pushnumber(L, (lua_Number) h.getPercentile(0.99));
+        lua_setfield(L, -2, "p99");
+        lua_setfield(L, -2, it->first.c_str());
+    }
+    pthread_mutex_unlock(&metricsLock);
+
+    return 1;
+}
+
+void Metrics::writeDumpFile(const string& path) {
+    // write aside and rename, readers never see a half written file
+    string tempPath = path + ".tmp";
+    FILE* file = fopen(tempPath.c_str(), "w");
+    if (!file) {
+        DEBUG_PRINT(2, "[METRICS] can not write %s\n", tempPath.c_str());
+        return;
+    }
+    fprintf(file, "# %lld\n", (long long) time(NULL));
+    string content = dump();
+    fwrite(content.data(), 1, content.length(), file);
+    if (fclose(file) == 0) rename(tempPath.c_str(), path.c_str());
+}
+
+void* Metrics::dumpThreadFunc(void* data) {
+    UNUSED(data);
+    pthread_mutex_lock(&dumpLock);
+    while (dumpThreadRunning) {
+        double interval;
+        string path;
+        {
+            Configuration::SnapshotReader settings;
+            interval = settings->statsDumpInterval;
+            path = settings->statsDumpPath;
+        }
+        // disabled, check again later in case settings change
+        bool enabled = interval > 0 && !path.empty();
+        if (!enabled) interval = 10;
+
+        long long wakeTime = XUtility::getCurrentTime() + (long long) (interval * XUtility::MICROSECOND_PER_SECOND);
+        struct timespec wakeTimespec;
+        wakeTimespec.tv_sec = wakeTime / XUtility::MICROSECOND_PER_SECOND;
+        wakeTimespec.tv_nsec = (wakeTime % XUtility::MICROSECOND_PER_SECOND) * 1000;
+        while (dumpThreadRunning && pthread_cond_timedwait(&dumpCond, &dumpLock, &wakeTimespec) == 0);
+        if (!dumpThreadRunning || !enabled) continue;
+
+        pthread_mutex_unlock(&dumpLock);
+        writeDumpFile(path);
+        pthread_mutex_lock(&dumpLock);
+    }
+    pthread_mutex_unlock(&dumpLock);
+    return NULL;
+}
+
+void Metrics::registerLuaFunctions() {
+    LuaBinding::getStaticBinding().registerFunction(l_stats, "stats");
+}
+
+void Metrics::staticInit() {
+    // needs Configuration snapshot, init after Configuration
+    pthread_mutex_lock(&dumpLock);
+    dumpThreadRunning = true;
+    if (pthread_create(&dumpThread, NULL, dumpThreadFunc, NULL)) {
+        perror("[ERROR] can not create metrics dump thread");
+        dumpThreadRunning = false;
+    }
+    pthread_mutex_unlock(&dumpLock);
+}
+
+void Metrics::staticDestruct() {
+    pthread_mutex_lock(&dumpLock);
+    bool joinable = dumpThreadRunning;
+    dumpThreadRunning = false;
+    pthread_cond_signal(&dumpCond);
+    pthread_mutex_unlock(&dumpLock);
+    if (joinable) pthread_join(dumpThread, NULL);
+
+    pthread_mutex_lock(&metricsLock);
+    for (map<string, Counter*>::iterator it = counters.begin(); it != counters.end(); ++it) delete it->second;
+    counters.clear();
+    for (map<string, Histogram*>::iterator it = histograms.begin(); it != histograms.end(); ++it) delete it->second;
+    histograms.clear();
+    pthread_mutex_unlock(&metricsLock);
+}
@@ -0,0 +1,105 @@
+/*
+ * File:   Metrics.h
+ * Author: WU Jun <quark@lihdd.net>
+ *
+ * named counters and histograms, updated lock free from any thread.
+ * exposed to lua as ime.stats() and dumped to a file periodically.
+ */
+
+#ifndef _METRICS_H
+#define	_METRICS_H
+
+#include <string>
+#include <map>
+#include <pthread.h>
+
+#include "LuaBinding.h"
+
+using std::string;
+using std::map;
+
+class Metrics {
+public:
+
+    class Counter {
+    public:
+        Counter();
+        void add(const long long delta = 1);
+        const long long get() const;
+    private:
+        Counter(const Counter& orig);
+        volatile long long value;
+    };
+
+    /**
+     * hdr style histogram of non-negative integers: 16 linear sub buckets
+     * per power of 2, so any value is kept within ~6% precision.
+     * latencies are recorded in usec.
+     */
+    class Histogram {
+    public:
+        Histogram();
+        virtual ~Histogram();
+        void record(long long value);
+        const long long getCount() const;
+        const long long getSum() const;
+        const long long getMax() const;
+        /**
+         * @param percentile 0 - 1
+         * @return upper bound of the bucket containing that percentile,
+         *         0 if there is no sample
+         */
+        const long long getPercentile(const double percentile) const;
+
+        static const int BUCKET_COUNT;
+    private:
+        Histogram(const Histogram& orig);
+        static const int getBucketIndex(const long long value);
+        static const long long getBucketUpperBound(const int index);
+
+        volatile long long *bucketCounts;
+        volatile long long count, sum, max;
+    };
+
+    /**
+     * created on first use, never freed until staticDestruct().
+     * lookups take a lock, cache the reference in hot paths
+     */
+    static Counter& getCounter(const string& name);
+    static Histogram& getHistogram(const string& name);
+
+    /**
+     * one metric per line, cache hit ratios are derived from
+     * counters named "cache.<layer>.hit" and "cache.<layer>.miss".
+     * fetch latencies of each backend are histogram "fetch.<backend>"
+     */
+    static const string dump();
+
+    static void registerLuaFunctions();
+    static void staticInit();
+    static void staticDestruct();
+private:
+    Metrics();
+    Metrics(const Metrics& orig);
+
+    static void* dumpThreadFunc(void* data);
+    static void writeDumpFile(const string& path);
+
+    /**
+     * out: table, counters are numbers, histograms are tables
+     * {count, sum, mean, max, p50, p90, p99}
+     */
+    static int l_stats(lua_State* L);
+
+    static pthread_mutex_t metricsLock;
+    static map<string, Counter*> counters;
+    static map<string, Histogram*> histograms;
+
+    static pthread_t dumpThread;
+    static pthread_mutex_t dumpLock;
+    static pthread_cond_t dumpCond;
+    static bool dumpThreadRunning;
+};
+
+#endif	/* _METRICS_H */
+
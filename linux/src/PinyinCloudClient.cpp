@@ -10,81 +10,100 @@
 #include <cstdio>
 #include <dirent.h>
 #include <sys/wait.h>
+#include <sched.h>
+#include <glib.h>
 #include "defines.h"
 #include "PinyinUtility.h"
+#include "Metrics.h"
+#include "Tracer.h"
 
 using std::pair;
 
-/**
- * data passed to thread which will fetch result
- */
-struct RequestThreadData {
-    PinyinCloudRequest* newRequest;
-    PinyinCloudClient* client;
-};
+// request slot states, low 2 bits of slot word, request id in the rest
+#define REQUEST_STATE_PENDING 0
+#define REQUEST_STATE_WRITING 1
+#define REQUEST_STATE_RESPONSED 2
+#define REQUEST_STATE_CANCELLED 3
+#define REQUEST_STATE_MASK 3
+#define REQUEST_WORD(id, state) ((gint) ((((id) & 0x3fffffffu) << 2) | (state)))
+#define REQUEST_WORD_STATE(word) ((word) & REQUEST_STATE_MASK)
 
 bool PinyinCloudClient::preRequestBusy = false;
+volatile int PinyinCloudClient::runningPreRequestCount = 0;
 multimap<string, string> PinyinCloudClient::cloudMemoryDatabase;
 pthread_rwlock_t PinyinCloudClient::cloudMemoryDatabaseLock;
+pthread_key_t PinyinCloudClient::fetchContextKey;
+pthread_mutex_t PinyinCloudClient::runningFetchesLock;
+list<FetchContext*> PinyinCloudClient::runningFetches;
+pthread_mutex_t PinyinCloudClient::fetchJobsLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t PinyinCloudClient::fetchJobsCond = PTHREAD_COND_INITIALIZER;
+deque<PinyinCloudClient::FetchJob> PinyinCloudClient::fetchJobs[PRIORITY_COMMIT + 1];
+int PinyinCloudClient::fetchThreadCount = 0;
+int PinyinCloudClient::idleFetchThreadCount = 0;
+int PinyinCloudClient::busyFetchThreadCount = 0;
+
+void runRequest(const PinyinCloudClient::FetchJob& job) {
+    DEBUG_PRINT(2, "[CLOUD] run request\n");
+    PinyinCloudRequest *request = job.request;
+    PinyinCloudClient *client = job.client;
+    size_t slotIndex = job.slotIndex;
+
+    // removed or answered in advance while queued, nobody needs the fetch
+    if (g_atomic_int_get(&client->requestRing[slotIndex].word) == REQUEST_WORD(request->requestId, REQUEST_STATE_PENDING)) {
+        DEBUG_PRINT(3, "[CLOUD.REQTHREAD] prepare to call fetch func\n");
+
+        // this may takes time
+        FetchContext context;
+        context.requestString = request->requestString;
+        context.priority = request->priority;
+        context.cancelled = false;
+        context.parent = NULL;
+        PinyinCloudClient::beginFetch(&context);
+        string responseString;
+        {
+            Tracer::Span span("fetch");
+            responseString = request->fetchFunc(request->fetchParam, request->requestString);
+        }
+        PinyinCloudClient::endFetch(&context);
 
-void* requestThreadFunc(void *data) {
-    DEBUG_PRINT(2, "[CLOUD] enter request thread\n");
-    PinyinCloudRequest *request = ((RequestThreadData*) data)->newRequest;
-    PinyinCloudClient *client = ((RequestThreadData*) data)->client;
-    delete (RequestThreadData*) data;
-
-    DEBUG_PRINT(3, "[CLOUD.REQTHREAD] prepare to call fetch func\n");
-
-    // this may takes time
-    string responseString = request->fetchFunc(request->fetchParam, request->requestString);
-
-    DEBUG_PRINT(4, "[CLOUD.REQTHREAD] waiting to wrie back response: %s\n", responseString.c_str());
-    // write response back
-
-    pthread_rwlock_wrlock(&client->requestsLock);
-
-
-    DEBUG_PRINT(4, "[CLOUD.REQTHREAD] writing response: %s\n", responseString.c_str());
-    // find that request according to request id (any better ways?)
-    for (deque<PinyinCloudRequest>::reverse_iterator it = client->requests.rbegin(); it != client->requests.rend(); ++it) {
-        if (it->requestId == request->requestId) {
-            // set it to 'responsed'
-
-            it->responseString = responseString;
-            it->responsed = true;
-            pthread_rwlock_unlock(&client->requestsLock);
+        DEBUG_PRINT(4, "[CLOUD.REQTHREAD] writing response: %s\n", responseString.c_str());
+        // write response back, no global lock, only own slot is touched
+        if (client->writeResponse(slotIndex, request->requestId, responseString)) {
             // callback, cleanning and done
-            // note that unlock before callback
-
             if (request->callbackFunc) {
                 DEBUG_PRINT(4, "[CLOUD.REQTHREAD] prepare execute callback\n");
                 (*request->callbackFunc)(request->callbackParam);
             }
-
-            delete request;
-            DEBUG_PRINT(3, "[CLOUD.REQTHREAD] Exiting...\n");
-            pthread_exit(0);
+        } else {
+            // removed (user call remove request...) or answered in advance
+            // in this case, just do nothing
+            DEBUG_PRINT(3, "[CLOUD.REQTHREAD] request invalid. ignore\n");
         }
+    } else {
+        DEBUG_PRINT(3, "[CLOUD.REQTHREAD] request invalid before fetch. ignore\n");
     }
+    g_atomic_int_add(&client->runningThreadCount, -1);
 
-    // not found from list (this could happen if user call remove request...)
-    // in this case, just do nothing
-    DEBUG_PRINT(3, "[CLOUD.REQTHREAD] request invalid. ignore\n");
-    pthread_rwlock_unlock(&client->requestsLock);
     delete request;
-
-    DEBUG_PRINT(3, "[CLOUD.REQTHREAD] Exiting...\n");
-    pthread_exit(0);
 }
 
-void* preRequestThreadFunc(void *data) {
-    DEBUG_PRINT(2, "[CLOUD] enter pre-request thread\n");
-    PinyinCloudRequest *request = (PinyinCloudRequest*) data;
-
+void runPreRequest(PinyinCloudRequest* request) {
+    DEBUG_PRINT(2, "[CLOUD] run pre-request\n");
     DEBUG_PRINT(3, "[CLOUD.PREREQ] prepare to call fetch func\n");
 
     // this may takes time
-    string responseString = request->fetchFunc(request->fetchParam, request->requestString);
+    FetchContext context;
+    context.requestString = request->requestString;
+    context.priority = request->priority;
+    context.cancelled = false;
+    context.parent = NULL;
+    PinyinCloudClient::beginFetch(&context);
+    string responseString;
+    {
+        Tracer::Span span("preFetch");
+        responseString = request->fetchFunc(request->fetchParam, request->requestString);
+    }
+    PinyinCloudClient::endFetch(&context);
     PinyinCloudClient::preRequestBusy = false;
 
     UNUSED(responseString);
@@ -93,18 +112,91 @@ void* preRequestThreadFunc(void *data) {
         DEBUG_PRINT(4, "[CLOUD.PREREQ] prepare execute callback\n");
         (*request->callbackFunc)(request->callbackParam);
     }
+    g_atomic_int_add(&PinyinCloudClient::runningPreRequestCount, -1);
 
     delete request;
-    DEBUG_PRINT(3, "[CLOUD.PREREQ] Exiting...\n");
-    pthread_exit(0);
 }
 
-void PinyinCloudClient::preRequest(const string requestString, FetchFunc fetchFunc, void* fetchParam, ResponseCallbackFunc callbackFunc, void* callbackParam) {
+void* fetchThreadFunc(void *data) {
+    UNUSED(data);
+    DEBUG_PRINT(2, "[CLOUD] enter fetch thread\n");
+    pthread_mutex_lock(&PinyinCloudClient::fetchJobsLock);
+    for (;;) {
+        // highest priority first. lower ones leave some threads to commits
+        PinyinCloudClient::FetchJob job;
+        bool found = false;
+        for (int priority = PRIORITY_COMMIT; priority >= 0 && !found; --priority) {
+            deque<PinyinCloudClient::FetchJob>& jobs = PinyinCloudClient::fetchJobs[priority];
+            if (jobs.empty()) continue;
+            if (priority < PRIORITY_COMMIT && PinyinCloudClient::busyFetchThreadCount >= PinyinCloudClient::FETCH_THREAD_LIMIT - PinyinCloudClient::COMMIT_RESERVED_THREADS) break;
+            job = jobs.front();
+            jobs.pop_front();
+            found = true;
+        }
+        if (!found) {
+            PinyinCloudClient::idleFetchThreadCount++;
+            pthread_cond_wait(&PinyinCloudClient::fetchJobsCond, &PinyinCloudClient::fetchJobsLock);
+            PinyinCloudClient::idleFetchThreadCount--;
+            continue;
+        }
+        PinyinCloudClient::busyFetchThreadCount++;
+        pthread_mutex_unlock(&PinyinCloudClient::fetchJobsLock);
+
+        if (job.client) runRequest(job);
+        else runPreRequest(job.request);
+
+        pthread_mutex_lock(&PinyinCloudClient::fetchJobsLock);
+        PinyinCloudClient::busyFetchThreadCount--;
+        // a lower priority job may be runnable now, for an idle thread
+        if (PinyinCloudClient::idleFetchThreadCount > 0) pthread_cond_signal(&PinyinCloudClient::fetchJobsCond);
+    }
+    return NULL;
+}
+
+bool PinyinCloudClient::dispatch(const FetchJob& job) {
+    static Metrics::Histogram& dispatchQueueDepth = Metrics::getHistogram("fetch.dispatch_queue_depth");
+    bool dispatched = true;
+    pthread_mutex_lock(&fetchJobsLock);
+    deque<FetchJob>& jobs = fetchJobs[job.request->priority];
+    jobs.push_back(job);
+    dispatchQueueDepth.record(fetchJobs[PRIORITY_PREFETCH].size() + fetchJobs[PRIORITY_PREVIEW].size() + fetchJobs[PRIORITY_COMMIT].size());
+    if (idleFetchThreadCount > 0) {
+        // every idle thread may pass a job it can not run yet, wake all
+        pthread_cond_broadcast(&fetchJobsCond);
+    } else if (fetchThreadCount < FETCH_THREAD_LIMIT) {
+        DEBUG_PRINT(3, "[CLOUD] new fetch thread\n");
+        pthread_t fetchThread;
+        pthread_attr_t fetchThreadAttr;
+        pthread_attr_init(&fetchThreadAttr);
+        pthread_attr_setdetachstate(&fetchThreadAttr, PTHREAD_CREATE_DETACHED);
+        if (pthread_create(&fetchThread, &fetchThreadAttr, &fetchThreadFunc, NULL) == 0) {
+            fetchThreadCount++;
+        } else {
+            perror("[ERROR] can not create fetch thread");
+        }
+        pthread_attr_destroy(&fetchThreadAttr);
+    }
+    if (fetchThreadCount == 0) {
+        // nobody will take it
+        jobs.pop_back();
+        dispatched = false;
+    }
+    pthread_mutex_unlock(&fetchJobsLock);
+    return dispatched;
+}
+
+void PinyinCloudClient::preRequest(const string requestString, FetchFunc fetchFunc, void* fetchParam, ResponseCallbackFunc callbackFunc, void* callbackParam, RequestPriority priority) {
     // ignore empty string request
     if (requestString.empty()) return;
 
     // preRequestBusy is for generally reduce requests, no need for strict locking
     if (preRequestBusy) return;
+
+    // do not compete with requests user is waiting for
+    if (priority < PRIORITY_COMMIT && isFetchRunning((RequestPriority) (priority + 1))) {
+        DEBUG_PRINT(3, "[CLOUD] preRequest skipped, higher priority fetch running\n");
+        return;
+    }
     preRequestBusy = true;
 
     DEBUG_PRINT(3, "[CLOUD] new preRequest: %s\n", requestString.c_str());
@@ -116,166 +208,240 @@ void PinyinCloudClient::preRequest(const string requestString, FetchFunc fetchFu
     request->responsed = false;
     request->fetchFunc = fetchFunc;
     request->fetchParam = fetchParam;
-
-    DEBUG_PRINT(4, "[CLOUD] going to create thread (preRequest)\n");
-
-    // launch thread
-    pthread_t requestThread;
-    pthread_attr_t preRequestThreadAttr;
-    int ret;
-
-    pthread_attr_init(&preRequestThreadAttr);
-    pthread_attr_setdetachstate(&preRequestThreadAttr, PTHREAD_CREATE_DETACHED);
-
-    ret = pthread_create(&requestThread, &preRequestThreadAttr, &preRequestThreadFunc, (void*) request);
-    pthread_attr_destroy(&preRequestThreadAttr);
-    DEBUG_PRINT(3, "[CLOUD] new preRequest thread: 0x%x\n", (int) requestThread);
-
-    if (ret != 0) {
-        perror("[ERROR] can not create preRequest thread");
+    request->priority = priority;
+
+    DEBUG_PRINT(4, "[CLOUD] going to dispatch (preRequest)\n");
+    FetchJob job;
+    job.request = request;
+    job.client = NULL;
+    job.slotIndex = 0;
+
+    g_atomic_int_inc(&runningPreRequestCount);
+    if (!dispatch(job)) {
+        g_atomic_int_add(&runningPreRequestCount, -1);
+        preRequestBusy = false;
         delete request;
-    };
-    // request will be deleted in preRequestThread.
+    }
+    // request will be deleted by fetch thread
 }
 
-void PinyinCloudClient::request(const string requestString, FetchFunc fetchFunc, void* fetchParam, ResponseCallbackFunc callbackFunc, void* callbackParam) {
+void PinyinCloudClient::request(const string requestString, FetchFunc fetchFunc, void* fetchParam, ResponseCallbackFunc callbackFunc, void* callbackParam, RequestPriority priority) {
     // ignore empty string request
     if (requestString.empty()) return;
 
     DEBUG_PRINT(2, "[CLOUD] new request: %s\n", requestString.c_str());
-    PinyinCloudRequest *request = new PinyinCloudRequest;
-    request->requestString = requestString;
-    request->callbackFunc = callbackFunc;
-    request->callbackParam = callbackParam;
-    request->requestId = (nextRequestId++);
-    request->responsed = false;
-    request->fetchFunc = fetchFunc;
-    request->fetchParam = fetchParam;
-
-
-    RequestThreadData *data = new RequestThreadData;
-    data->newRequest = request;
-    data->client = this;
-
-    // push into queue first, lock down request for writing
-    pthread_rwlock_wrlock(&requestsLock);
-
-    requests.push_back(*request);
-    pthread_rwlock_unlock(&requestsLock);
-
-    DEBUG_PRINT(4, "[CLOUD.REQUEST] going to create thread\n");
-    // launch thread
-    pthread_t requestThread;
-    pthread_attr_t requestThreadAttr;
-    int ret;
-
-    pthread_attr_init(&requestThreadAttr);
-    pthread_attr_setdetachstate(&requestThreadAttr, PTHREAD_CREATE_DETACHED);
-
-    ret = pthread_create(&requestThread, &requestThreadAttr, &requestThreadFunc, (void*) data);
-    pthread_attr_destroy(&requestThreadAttr);
-    DEBUG_PRINT(1, "[CLOUD.REQUEST] new thread: 0x%x\n", (int) requestThread);
-
-    if (ret != 0) {
-        perror("[ERROR] can not create request thread");
-        // find and remove that request (no reverse iterator, better ways?)
-
-        pthread_rwlock_wrlock(&requestsLock);
-        for (deque<PinyinCloudRequest>::iterator it = requests.begin(); it != requests.end(); ++it) {
-            if (it->requestId == request->requestId) {
-                requests.erase(it);
-                break;
-            }
-        }
-        pthread_rwlock_unlock(&requestsLock);
-
+    Tracer::Span span("PinyinCloudClient::request");
+    if ((size_t) g_atomic_int_get(&requestCount) >= REQUEST_RING_CAPACITY) {
+        static Metrics::Counter& droppedRequests = Metrics::getCounter("fetch.dropped_requests");
+        droppedRequests.add();
+        DEBUG_PRINT(1, "[CLOUD] too many requests, request '%s' dropped\n", requestString.c_str());
+        return;
+    }
 
-        delete request;
-        delete data;
-    };
-    // request and data will be deleted in requestThread.
+    cancelOverlappedFetches(requestString, priority);
+
+    static Metrics::Histogram& queueDepth = Metrics::getHistogram("request_queue_depth");
+    queueDepth.record(g_atomic_int_get(&requestCount));
+
+    // fill tail slot, then publish it
+    size_t slotIndex = tailPosition % REQUEST_RING_CAPACITY;
+    PinyinCloudRequestSlot& slot = requestRing[slotIndex];
+    PinyinCloudRequest& request = slot.request;
+    request.requestString = requestString;
+    request.responseString.clear();
+    request.callbackFunc = callbackFunc;
+    request.callbackParam = callbackParam;
+    request.requestId = (nextRequestId++);
+    request.responsed = false;
+    request.fetchFunc = fetchFunc;
+    request.fetchParam = fetchParam;
+    request.priority = priority;
+
+    pthread_mutex_lock(&pendingRequestsLock);
+    pendingRequests.insert(pair<string, pair<size_t, unsigned int> >(requestString, pair<size_t, unsigned int>(slotIndex, request.requestId)));
+    pthread_mutex_unlock(&pendingRequestsLock);
+
+    g_atomic_int_set(&slot.word, REQUEST_WORD(request.requestId, REQUEST_STATE_PENDING));
+    tailPosition++;
+    g_atomic_int_inc(&requestCount);
+
+    FetchJob job;
+    job.request = new PinyinCloudRequest(request);
+    job.client = this;
+    job.slotIndex = slotIndex;
+
+    DEBUG_PRINT(4, "[CLOUD.REQUEST] going to dispatch\n");
+    g_atomic_int_inc(&runningThreadCount);
+    if (!dispatch(job)) {
+        g_atomic_int_add(&runningThreadCount, -1);
+        // it is the last one
+        removeLastRequest();
+        delete job.request;
+    }
+    // request will be deleted by fetch thread
 }
 
 PinyinCloudClient::PinyinCloudClient() {
     DEBUG_PRINT(1, "[CLOUD] Init\n");
 
     nextRequestId = 0;
-    pthread_rwlock_init(&requestsLock, NULL);
+    headPosition = tailPosition = 0;
+    requestCount = 0;
+    runningThreadCount = 0;
+    for (size_t i = 0; i < REQUEST_RING_CAPACITY; ++i) {
+        requestRing[i].word = REQUEST_STATE_CANCELLED;
+    }
+    pthread_mutex_init(&pendingRequestsLock, NULL);
 }
 
-void PinyinCloudClient::readLock() {
-    DEBUG_PRINT(2, "[CLOUD] Read lock\n");
-    pthread_rwlock_rdlock(&requestsLock);
+const size_t PinyinCloudClient::getRequestCount() const {
+    size_t count = g_atomic_int_get(&requestCount);
+    DEBUG_PRINT(3, "[CLOUD] getRequestCount: %d\n", (int) count);
+    return count;
 }
 
-void PinyinCloudClient::unlock() {
-    DEBUG_PRINT(2, "[CLOUD] Read unlock\n");
-    pthread_rwlock_unlock(&requestsLock);
+const size_t PinyinCloudClient::getRunningThreadCount() const {
+    return g_atomic_int_get(&runningThreadCount);
 }
 
-const size_t PinyinCloudClient::getRequestCount() const {
+const size_t PinyinCloudClient::getRunningPreRequestCount() {
+    return g_atomic_int_get(&runningPreRequestCount);
+}
+
+const size_t PinyinCloudClient::getPendingRequestCount() {
+    pthread_mutex_lock(&pendingRequestsLock);
+    size_t count = pendingRequests.size();
+    pthread_mutex_unlock(&pendingRequestsLock);
+    return count;
+}
+
+vector<PinyinCloudRequest> PinyinCloudClient::getRequestsSnapshot() {
+    vector<PinyinCloudRequest> r;
+    r.reserve(tailPosition - headPosition);
+    for (size_t position = headPosition; position != tailPosition; ++position) {
+        PinyinCloudRequestSlot& slot = requestRing[position % REQUEST_RING_CAPACITY];
+        // response may be being written, only read it once state is responsed
+        r.push_back(PinyinCloudRequest());
+        PinyinCloudRequest& request = r.back();
+        request.requestString = slot.request.requestString;
+        request.callbackFunc = slot.request.callbackFunc;
+        request.callbackParam = slot.request.callbackParam;
+        request.fetchFunc = slot.request.fetchFunc;
+        request.fetchParam = slot.request.fetchParam;
+        request.requestId = slot.request.requestId;
+        request.priority = slot.request.priority;
+        request.responsed = (REQUEST_WORD_STATE(g_atomic_int_get(&slot.word)) == REQUEST_STATE_RESPONSED);
+        if (request.responsed) request.responseString = slot.request.responseString;
+    }
+    return r;
+}
+
+bool PinyinCloudClient::writeResponse(const size_t slotIndex, const unsigned int requestId, const string& responseString, ResponseCallbackFunc* pCallbackFunc, void** pCallbackParam) {
+    PinyinCloudRequestSlot& slot = requestRing[slotIndex];
+    if (!g_atomic_int_compare_and_exchange(&slot.word, REQUEST_WORD(requestId, REQUEST_STATE_PENDING), REQUEST_WORD(requestId, REQUEST_STATE_WRITING))) {
+        return false;
+    }
+
+    // main loop waits while writing, slot is ours now
+    slot.request.responseString = responseString;
+    slot.request.responsed = true;
+    if (pCallbackFunc) *pCallbackFunc = slot.request.callbackFunc;
+    if (pCallbackParam) *pCallbackParam = slot.request.callbackParam;
+
+    pthread_mutex_lock(&pendingRequestsLock);
+    typedef multimap<string, pair<size_t, unsigned int> >::iterator Iterator;
+    pair<Iterator, Iterator> range = pendingRequests.equal_range(slot.request.requestString);
+    for (Iterator it = range.first; it != range.second; ++it) {
+        if (it->second.second == requestId) {
+            pendingRequests.erase(it);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&pendingRequestsLock);
 
-    DEBUG_PRINT(3, "[CLOUD] getRequestCount: %d\n", requests.size());
-    return requests.size();
+    g_atomic_int_set(&slot.word, REQUEST_WORD(requestId, REQUEST_STATE_RESPONSED));
+    return true;
 }
 
-const PinyinCloudRequest& PinyinCloudClient::getRequest(size_t index) const {
-    DEBUG_PRINT(5, "[CLOUD] getRequest # %d\n", index);
-    if (index < requests.size() && index >= 0) return requests[index];
-    else return requests[requests.size() - 1];
+void PinyinCloudClient::releaseSlot(PinyinCloudRequestSlot& slot) {
+    for (;;) {
+        gint word = g_atomic_int_get(&slot.word);
+        switch (REQUEST_WORD_STATE(word)) {
+            case REQUEST_STATE_WRITING:
+                // a response is being written, it is short
+                sched_yield();
+                continue;
+            case REQUEST_STATE_PENDING:
+                if (!g_atomic_int_compare_and_exchange(&slot.word, word, (word & ~REQUEST_STATE_MASK) | REQUEST_STATE_CANCELLED)) continue;
+                {
+                    pthread_mutex_lock(&pendingRequestsLock);
+                    typedef multimap<string, pair<size_t, unsigned int> >::iterator Iterator;
+                    pair<Iterator, Iterator> range = pendingRequests.equal_range(slot.request.requestString);
+                    for (Iterator it = range.first; it != range.second; ++it) {
+                        if (it->second.second == slot.request.requestId) {
+                            pendingRequests.erase(it);
+                            break;
+                        }
+                    }
+                    pthread_mutex_unlock(&pendingRequestsLock);
+                }
+                break;
+        }
+        break;
+    }
 }
 
 void PinyinCloudClient::removeFirstRequest(int count) {
     if (count > 0) {
         DEBUG_PRINT(3, "[CLOUD] Remove first %d request\n", count);
-        pthread_rwlock_wrlock(&requestsLock);
-        for (int i = 0; i < count; ++i) {
-            if (requests.size() > 0) requests.pop_front();
-            else break;
+        for (int i = 0; i < count && headPosition != tailPosition; ++i) {
+            releaseSlot(requestRing[headPosition % REQUEST_RING_CAPACITY]);
+            headPosition++;
+            g_atomic_int_add(&requestCount, -1);
         }
-        pthread_rwlock_unlock(&requestsLock);
     }
 }
 
 void PinyinCloudClient::removeLastRequest() {
     DEBUG_PRINT(3, "[CLOUD] Remove last request\n");
-    pthread_rwlock_wrlock(&requestsLock);
-    if (requests.size() > 0) requests.pop_back();
-    pthread_rwlock_unlock(&requestsLock);
+    if (headPosition != tailPosition) {
+        tailPosition--;
+        releaseSlot(requestRing[tailPosition % REQUEST_RING_CAPACITY]);
+        g_atomic_int_add(&requestCount, -1);
+    }
 }
 
 vector<PinyinCloudRequest> PinyinCloudClient::exportAndRemoveAllRequest() {
-    vector<PinyinCloudRequest> r;
     DEBUG_PRINT(3, "[CLOUD] exportAndRemoveAllRequest\n");
-    pthread_rwlock_wrlock(&requestsLock);
-    for (size_t i = 0; i < requests.size(); ++i) {
-        r.push_back(requests[i]);
-    }
-    requests.clear();
-    pthread_rwlock_unlock(&requestsLock);
+    vector<PinyinCloudRequest> r = getRequestsSnapshot();
+    removeFirstRequest(r.size());
     return r;
 }
 
 void PinyinCloudClient::updateRequestInAdvance(const string requestString, const string responseString) {
     DEBUG_PRINT(3, "[CLOUD] updateRequestInAdvance\n");
-    pthread_rwlock_wrlock(&requestsLock);
-    for (size_t i = 0; i < requests.size(); ++i) {
-        PinyinCloudRequest& request = requests[i];
-        if (request.responsed == false && requests[i].requestString == requestString) {
-            request.requestId = ++nextRequestId;
-            request.responseString = responseString;
-            request.responsed = true;
-            // unlock before callback
-            pthread_rwlock_unlock(&requestsLock);
-            if (request.callbackFunc) {
-                DEBUG_PRINT(4, "[CLOUD.UPDATE.INADVANCE] prepare execute callback\n");
-                (*request.callbackFunc)(request.callbackParam);
-            }
-            return;
-        }
+    // take first pending one with same request string
+    size_t slotIndex = 0;
+    unsigned int requestId = 0;
+    bool found = false;
+    pthread_mutex_lock(&pendingRequestsLock);
+    multimap<string, pair<size_t, unsigned int> >::iterator it = pendingRequests.find(requestString);
+    if (it != pendingRequests.end()) {
+        slotIndex = it->second.first;
+        requestId = it->second.second;
+        found = true;
+    }
+    pthread_mutex_unlock(&pendingRequestsLock);
+
+    if (!found) return;
+
+    // its own request thread will find it responsed and give up
+    ResponseCallbackFunc callbackFunc = NULL;
+    void* callbackParam = NULL;
+    if (writeResponse(slotIndex, requestId, responseString, &callbackFunc, &callbackParam) && callbackFunc) {
+        DEBUG_PRINT(4, "[CLOUD.UPDATE.INADVANCE] prepare execute callback\n");
+        (*callbackFunc)(callbackParam);
     }
-    pthread_rwlock_unlock(&requestsLock);
-    return;
 }
 
 PinyinCloudClient::PinyinCloudClient(const PinyinCloudClient& orig) {
@@ -283,19 +449,99 @@ PinyinCloudClient::PinyinCloudClient(const PinyinCloudClient& orig) {
 
 PinyinCloudClient::~PinyinCloudClient() {
     DEBUG_PRINT(1, "[CLOUD] Destroy\n");
-    pthread_rwlock_destroy(&requestsLock);
+    pthread_mutex_destroy(&pendingRequestsLock);
 }
 
 void PinyinCloudClient::staticInit() {
     pthread_rwlock_init(&cloudMemoryDatabaseLock, NULL);
+    pthread_mutex_init(&runningFetchesLock, NULL);
+    pthread_key_create(&fetchContextKey, NULL);
 }
 
 void PinyinCloudClient::staticDestruct() {
     pthread_rwlock_destroy(&cloudMemoryDatabaseLock);
+    pthread_mutex_destroy(&runningFetchesLock);
+    pthread_key_delete(fetchContextKey);
+}
+
+// running fetches, priority and cancellation
+
+void PinyinCloudClient::beginFetch(FetchContext* context) {
+    pthread_setspecific(fetchContextKey, (void*) context);
+    pthread_mutex_lock(&runningFetchesLock);
+    if (context->parent && context->parent->cancelled) context->cancelled = true;
+    runningFetches.push_back(context);
+    pthread_mutex_unlock(&runningFetchesLock);
+}
+
+void PinyinCloudClient::endFetch(FetchContext* context) {
+    pthread_mutex_lock(&runningFetchesLock);
+    runningFetches.remove(context);
+    pthread_mutex_unlock(&runningFetchesLock);
+    pthread_setspecific(fetchContextKey, NULL);
+}
+
+const bool PinyinCloudClient::isCurrentFetchCancelled() {
+    FetchContext* context = (FetchContext*) pthread_getspecific(fetchContextKey);
+    return context && context->cancelled;
+}
+
+volatile bool* PinyinCloudClient::getCurrentFetchCancelledFlag() {
+    FetchContext* context = (FetchContext*) pthread_getspecific(fetchContextKey);
+    return context ? &context->cancelled : NULL;
+}
+
+FetchContext* PinyinCloudClient::getCurrentFetchContext() {
+    return (FetchContext*) pthread_getspecific(fetchContextKey);
+}
+
+const RequestPriority PinyinCloudClient::getCurrentFetchPriority() {
+    FetchContext* context = (FetchContext*) pthread_getspecific(fetchContextKey);
+    return context ? context->priority : PRIORITY_COMMIT;
+}
+
+void PinyinCloudClient::cancelOverlappedFetches(const string& requestString, RequestPriority priority) {
+    pthread_mutex_lock(&runningFetchesLock);
+    for (list<FetchContext*>::iterator it = runningFetches.begin(); it != runningFetches.end(); ++it) {
+        FetchContext* context = *it;
+        if (context->priority >= priority || context->cancelled) continue;
+        const string& shorter = context->requestString.length() < requestString.length() ? context->requestString : requestString;
+        const string& longer = context->requestString.length() < requestString.length() ? requestString : context->requestString;
+        if (longer.compare(0, shorter.length(), shorter) == 0) {
+            DEBUG_PRINT(3, "[CLOUD] cancel fetch '%s' (priority %d)\n", context->requestString.c_str(), (int) context->priority);
+            context->cancelled = true;
+        }
+    }
+    // helpers go with fetches they help
+    for (list<FetchContext*>::iterator it = runningFetches.begin(); it != runningFetches.end(); ++it) {
+        if ((*it)->parent && (*it)->parent->cancelled) (*it)->cancelled = true;
+    }
+    pthread_mutex_unlock(&runningFetchesLock);
+}
+
+const bool PinyinCloudClient::isFetchRunning(RequestPriority minimumPriority) {
+    bool r = false;
+    pthread_mutex_lock(&runningFetchesLock);
+    for (list<FetchContext*>::iterator it = runningFetches.begin(); it != runningFetches.end(); ++it) {
+        if ((*it)->priority >= minimumPriority) {
+            r = true;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&runningFetchesLock);
+    if (r) return r;
+
+    pthread_mutex_lock(&fetchJobsLock);
+    for (int priority = minimumPriority; priority <= PRIORITY_COMMIT; ++priority) {
+        if (!fetchJobs[priority].empty()) r = true;
+    }
+    pthread_mutex_unlock(&fetchJobsLock);
+    return r;
 }
 
 vector<string> PinyinCloudClient::queryMemoryDatabase(const string& pinyins) {
     DEBUG_PRINT(3, "[CLOUD] queryMemoryDatabase: '%s'\n", pinyins.c_str());
+    Tracer::Span span("queryMemoryDatabase");
     vector<string> r;
     pthread_rwlock_rdlock(&cloudMemoryDatabaseLock);
     pair< multimap<string, string>::const_iterator, multimap<string, string>::const_iterator> range
@@ -305,6 +551,22 @@ vector<string> PinyinCloudClient::queryMemoryDatabase(const string& pinyins) {
         r.push_back(it->second);
     }
     pthread_rwlock_unlock(&cloudMemoryDatabaseLock);
+
+    static Metrics::Counter& hits = Metrics::getCounter("cache.cloud_words.hit");
+    static Metrics::Counter& misses = Metrics::getCounter("cache.cloud_words.miss");
+    (r.empty() ? misses : hits).add();
+    return r;
+}
+
+vector<string> PinyinCloudClient::queryMemoryDatabaseKeys(const string& prefix) {
+    DEBUG_PRINT(3, "[CLOUD] queryMemoryDatabaseKeys: '%s'\n", prefix.c_str());
+    vector<string> r;
+    pthread_rwlock_rdlock(&cloudMemoryDatabaseLock);
+    for (multimap<string, string>::const_iterator it = cloudMemoryDatabase.lower_bound(prefix); it != cloudMemoryDatabase.end(); ++it) {
+        if (it->first.compare(0, prefix.length(), prefix) != 0) break;
+        r.push_back(it->first);
+    }
+    pthread_rwlock_unlock(&cloudMemoryDatabaseLock);
     return r;
 }
 
@@ -7,21 +7,41 @@
  * for flexibility.
  * 
  * as designed, it should be instantiated per engine session.
+ *
+ * requests are kept in a fixed size ring. only one thread (main loop)
+ * adds, removes and reads requests; fetch threads write responses
+ * into their own slots, guarded by a per-slot atomic state word.
+ *
+ * fetches of all clients go through one dispatch queue, ordered by
+ * priority, run by at most FETCH_THREAD_LIMIT fetch threads.
  */
 
 #ifndef _PinyinCloudClient_H
 #define	_PinyinCloudClient_H
 
-#include <deque>
 #include <string>
 #include <vector>
 #include <pthread.h>
 #include <map>
+#include <list>
+#include <deque>
 
-using std::deque;
 using std::vector;
 using std::string;
 using std::multimap;
+using std::pair;
+using std::list;
+using std::deque;
+
+/**
+ * higher priority requests go first. when a request arrives, running
+ * fetches with lower priority and overlapping request string are cancelled.
+ */
+enum RequestPriority {
+    PRIORITY_PREFETCH = 0, // speculative, nobody is waiting for it
+    PRIORITY_PREVIEW = 1, // pre-request, shown in preedit
+    PRIORITY_COMMIT = 2 // commit or correction, user is waiting
+};
 
 typedef void (*ResponseCallbackFunc)(void*);
 typedef string(*FetchFunc)(void*, const string&);
@@ -34,6 +54,26 @@ struct PinyinCloudRequest {
     FetchFunc fetchFunc;
     void* callbackParam, *fetchParam;
     unsigned int requestId;
+    RequestPriority priority;
+};
+
+/**
+ * slot in request ring, word is (requestId << 2) | REQUEST_STATE_*
+ */
+struct PinyinCloudRequestSlot {
+    volatile int word;
+    PinyinCloudRequest request;
+};
+
+/**
+ * a fetch running in a fetch thread
+ */
+struct FetchContext {
+    string requestString;
+    RequestPriority priority;
+    volatile bool cancelled;
+    // fetch this one helps (a chunk of a split request), cancelled with it
+    FetchContext* parent;
 };
 
 class PinyinCloudClient {
@@ -42,53 +82,157 @@ public:
     virtual ~PinyinCloudClient();
 
     /**
-     * perform a read lock before calling this.
+     * no lock needed
      */
     const size_t getRequestCount() const;
     /**
-     * perform a read lock op before calling this.
+     * requests not responsed yet, thread safe
      */
-    const PinyinCloudRequest& getRequest(size_t index) const;
-
+    const size_t getPendingRequestCount();
     /**
-     * lock for reading purpose
-     * this should not take a long time until readUnlock() !
+     * requests queued for or running in fetch threads, responsed or removed
+     * ones included. fetch and callback params of requests are in use
+     * until it is 0
      */
-    void readLock();
-    void unlock();
+    const size_t getRunningThreadCount() const;
+    /**
+     * copy of all requests, main loop only
+     */
+    vector<PinyinCloudRequest> getRequestsSnapshot();
 
     /**
-     * push a request to request queue, start a sub process to fetch result
+     * push a request to request queue, dispatch it to a fetch thread
      * callbackFunc can be NULL, fetchFunc can't
+     * request, remove* and export* are main loop only
+     */
+    void request(const string requestString, FetchFunc fetchFunc, void* fetchParam, ResponseCallbackFunc callbackFunc, void* callbackParam, RequestPriority priority = PRIORITY_COMMIT);
+    /**
+     * thread safe, answer a pending request with same request string
      */
-    void request(const string requestString, FetchFunc fetchFunc, void* fetchParam, ResponseCallbackFunc callbackFunc, void* callbackParam);
     void updateRequestInAdvance(const string requestString, const string responseString);
-    static void preRequest(const string requestString, FetchFunc fetchFunc, void* fetchParam, ResponseCallbackFunc callbackFunc, void* callbackParam);
+    /**
+     * skipped if busy or a fetch with higher priority is running
+     */
+    static void preRequest(const string requestString, FetchFunc fetchFunc, void* fetchParam, ResponseCallbackFunc callbackFunc, void* callbackParam, RequestPriority priority = PRIORITY_PREVIEW);
     void removeFirstRequest(int count = 1);
     void removeLastRequest();
     vector<PinyinCloudRequest> exportAndRemoveAllRequest();
 
+    /**
+     * like getRunningThreadCount, for pre-requests of all clients
+     */
+    static const size_t getRunningPreRequestCount();
+
     static void staticInit();
     static void staticDestruct();
 
     static vector<string> queryMemoryDatabase(const string& pinyins);
+    /**
+     * pinyins of words in memory database starting with prefix,
+     * one per word, so a pinyin may appear several times
+     */
+    static vector<string> queryMemoryDatabaseKeys(const string& prefix);
     static void addToMemoryDatabase(const string& pinyins, const string& content);
     static bool preRequestBusy;
+
+    /**
+     * fetch functions and backends call these to know about the fetch
+     * running in current thread. outside fetch threads, priority is
+     * PRIORITY_COMMIT and it is never cancelled.
+     */
+    static const bool isCurrentFetchCancelled();
+    static const RequestPriority getCurrentFetchPriority();
+    /**
+     * @return context of fetch running in current thread, NULL if none
+     */
+    static FetchContext* getCurrentFetchContext();
+    /**
+     * fetch threads call these around a fetch. threads helping a fetch
+     * call them with parent set, parent should outlive them
+     */
+    static void beginFetch(FetchContext* context);
+    static void endFetch(FetchContext* context);
+    /**
+     * @return cancelled flag of fetch running in current thread, NULL if none
+     */
+    static volatile bool* getCurrentFetchCancelledFlag();
+    /**
+     * cancel running fetches with lower priority whose request string
+     * is a prefix of requestString or vice versa
+     */
+    static void cancelOverlappedFetches(const string& requestString, RequestPriority priority);
+    /**
+     * queued fetches count as running
+     */
+    static const bool isFetchRunning(RequestPriority minimumPriority);
     
 private:
     /**
      *  this is private and should not be used.
      */
     PinyinCloudClient(const PinyinCloudClient& orig);
-    friend void* preRequestThreadFunc(void *data);
-    friend void* requestThreadFunc(void *data);
 
-    deque<PinyinCloudRequest> requests;
-    pthread_rwlock_t requestsLock;
+    /**
+     * request (client is not NULL) or pre-request waiting for a fetch thread
+     */
+    struct FetchJob {
+        PinyinCloudRequest* request;
+        PinyinCloudClient* client;
+        size_t slotIndex;
+    };
+    friend void* fetchThreadFunc(void *data);
+    friend void runPreRequest(PinyinCloudRequest* request);
+    friend void runRequest(const FetchJob& job);
+    /**
+     * queue job, start a fetch thread if none is idle
+     * @return false if there is no fetch thread to run it
+     */
+    static bool dispatch(const FetchJob& job);
+
+    /**
+     * write response into slot, thread safe
+     * @return false if that request is removed or already responsed
+     */
+    bool writeResponse(const size_t slotIndex, const unsigned int requestId, const string& responseString, ResponseCallbackFunc* pCallbackFunc = NULL, void** pCallbackParam = NULL);
+    /**
+     * mark slot as cancelled, wait if a response is being written
+     */
+    void releaseSlot(PinyinCloudRequestSlot& slot);
+
+    static const size_t REQUEST_RING_CAPACITY = 256;
+    // fetch threads, lower priority fetches leave COMMIT_RESERVED_THREADS
+    // of them to commits
+    static const int FETCH_THREAD_LIMIT = 8;
+    static const int COMMIT_RESERVED_THREADS = 2;
+
+    // ring, live requests are in slots [headPosition, tailPosition) (mod capacity)
+    // request ids only increase, so a stale request thread never matches a reused slot
+    PinyinCloudRequestSlot requestRing[REQUEST_RING_CAPACITY];
+    mutable volatile int requestCount;
+    // increased when a request is queued, decreased by fetch threads after
+    // callback, the last time they touch this
+    mutable volatile int runningThreadCount;
+    size_t headPosition, tailPosition;
     unsigned int nextRequestId;
 
+    // pending request strings => (slot index, request id), for updateRequestInAdvance
+    multimap<string, pair<size_t, unsigned int> > pendingRequests;
+    pthread_mutex_t pendingRequestsLock;
+
     static pthread_rwlock_t cloudMemoryDatabaseLock;
     static multimap<string, string> cloudMemoryDatabase;
+
+    static volatile int runningPreRequestCount;
+
+    static pthread_key_t fetchContextKey;
+    static pthread_mutex_t runningFetchesLock;
+    static list<FetchContext*> runningFetches;
+
+    // dispatch queue, one deque per priority
+    static pthread_mutex_t fetchJobsLock;
+    static pthread_cond_t fetchJobsCond;
+    static deque<FetchJob> fetchJobs[PRIORITY_COMMIT + 1];
+    static int fetchThreadCount, idleFetchThreadCount, busyFetchThreadCount;
 };
 
 
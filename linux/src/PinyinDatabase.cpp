@@ -14,6 +14,8 @@
 #include "PinyinSequence.h"
 #include "Configuration.h"
 #include "PinyinCloudClient.h"
+#include "Metrics.h"
+#include "Tracer.h"
 
 #define DB_CACHE_SIZE "16384"
 #define DB_PREFETCH_LEN 6 
@@ -78,6 +80,9 @@ void PinyinDatabase::query(const PinyinSequence& pinyins, CandidateList& candida
     DEBUG_PRINT(3, "[PYDB] query: %s\n", pinyins.toString().c_str());
     if (!db) return;
 
+    static Metrics::Histogram& queryTime = Metrics::getHistogram("db_query_us");
+    Tracer::Span span("PinyinDatabase::query", &queryTime);
+
     ostringstream queryWhere;
     ostringstream query;
     int lengthMax = lengthLimit;
@@ -186,6 +191,9 @@ string PinyinDatabase::greedyConvert(const PinyinSequence& pinyins, const double
     string r = "";
     if (!db) return r;
 
+    static Metrics::Histogram& convertTime = Metrics::getHistogram("db_greedy_convert_us");
+    Tracer::Span span("PinyinDatabase::greedyConvert", &convertTime);
+
     if (sqlite3_threadsafe()) {
         DEBUG_PRINT(3, "[PYDB] sqlite3 is thread safe\n");
     } else {
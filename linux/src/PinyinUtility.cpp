@@ -8,6 +8,7 @@
 #include "PinyinUtility.h"
 #include "defines.h"
 #include "Configuration.h"
+#include "Tracer.h"
 
 // no "ve" here in validPinyins, all "ue"
 const set<string> PinyinUtility::validPinyins = setInitializer<string>("ba")("bo")("bai")("bei")("bao")("ban")("ben")("bang")("beng")("bi")("bie")("biao")("bian")("bin")("bing")("bu")("ci")("ca")("ce")("cai")("cao")("cou")("can")("cen")("cang")("ceng")("cu")("cuo")("cui")("cuan")("cun")("cong")("chi")("cha")("che")("chai")("chao")("chou")("chan")("chen")("chang")("cheng")("chu")("chuo")("chuai")("chui")("chuan")("chuang")("chun")("chong")("da")("de")("dei")("dai")("dao")("dou")("dan")("dang")("deng")("di")("die")("diao")("diu")("dian")("ding")("du")("duo")("dui")("duan")("dun")("dong")("fa")("fo")("fei")("fou")("fan")("fen")("fang")("feng")("fu")("ga")("ge")("gai")("gei")("gao")("gou")("gan")("gen")("gang")("geng")("gu")("gua")("guo")("guai")("gui")("guan")("gun")("guang")("gong")("ha")("he")("hai")("hei")("hao")("hou")("han")("hen")("hang")("heng")("hu")("hua")("huo")("huai")("hui")("huan")("hun")("huang")("hong")("ji")("jia")("jie")("jiao")("jiu")("jian")("jin")("jing")("jiang")("ju")("jue")("juan")("jun")("jiong")("ka")("ke")("kai")("kao")("kou")("kan")("ken")("kang")("keng")("ku")("kua")("kuo")("kuai")("kui")("kuan")("kun")("kuang")("kong")("la")("le")("lai")("lei")("lao")("lan")("lang")("leng")("li")("ji")("lie")("liao")("liu")("lian")("lin")("liang")("ling")("lou")("lu")("luo")("luan")("lun")("long")("lv")("lue")("ma")("mo")("me")("mai")("mei")("mao")("mou")("man")("men")("mang")("meng")("mi")("mie")("miao")("miu")("mian")("min")("ming")("mu")("na")("ne")("nai")("nei")("nao")("nou")("nan")("nen")("nang")("neng")("ni")("nie")("niao")("niu")("nian")("nin")("niang")("ning")("nu")("nuo")("nuan")("nong")("nv")("nue")("pa")("po")("pai")("pei")("pao")("pou")("pan")("pen")("pang")("peng")("pi")("pie")("piao")("pian")("pin")("ping")("pu")("qi")("qia")("qie")("qiao")("qiu")("qian")("qin")("qiang")("qing")("qu")("que")("quan")("qun")("qiong")("ri")("re")("rao")("rou")("ran")("ren")("rang")("reng")("ru")("ruo")("rui")("ruan")("run")("rong")("si")("sa")("se")("sai")("san")("sao")("sou")("sen")("sang")("seng")("su")("suo")("sui")("suan")("sun")("song")("shi")("sha")("she")("shai")("shei")("shao")("shou")("shan")("shen")("shang")("sheng")("shu")("shua")("shuo")("shuai")("shui")("shuan")("shun")("shuang")("ta")("te")("tai")("tao")("tou")("tan")("tang")("teng")("ti")("tie")("tiao")("tian")("ting")("tu")("tuan")("tuo")("tui")("tun")("tong")("wu")("wa")("wo")("wai")("wei")("wan")("wen")("wang")("weng")("xi")("xia")("xie")("xiao")("xiu")("xian")("xin")("xiang")("xing")("xu")("xue")("xuan")("xun")("xiong")("yi")("ya")("yo")("ye")("yai")("yao")("you")("yan")("yin")("yang")("ying")("yu")("yue")("yuan")("yun")("yong")("yu")("yue")("yuan")("yun")("yong")("zi")("za")("ze")("zai")("zao")("zei")("zou")("zan")("zen")("zang")("zeng")("zu")("zuo")("zui")("zun")("zuan")("zong")("zhi")("zha")("zhe")("zhai")("zhao")("zhou")("zhan")("zhen")("zhang")("zheng")("zhu")("zhua")("zhuo")("zhuai")("zhuang")("zhui")("zhuan")("zhun")("zhong")("a")("e")("ei")("ai")("ei")("ao")("o")("ou")("an")("en")("ang")("eng")("er")();
@@ -26,7 +27,9 @@ PinyinUtility::PinyinUtility(const PinyinUtility& orig) {
 PinyinUtility::~PinyinUtility() {
 }
 
-const string PinyinUtility::separatePinyins(const string& pinyins) {
+const string PinyinUtility::separatePinyins(const string& pinyins, TailAdjustFunction tailAdjust) {
+    Tracer::Span span("separatePinyins");
+    if (tailAdjust == NULL) tailAdjust = Configuration::getFullPinyinTailAdjusted;
     string r;
     string unparsedPinyins = pinyins;
 
@@ -47,7 +50,7 @@ const string PinyinUtility::separatePinyins(const string& pinyins) {
                     // confirm separate
                     r += unparsedPinyins.substr(0, i);
                     // use Configuration::getFullPinyinTailAdjusted to adjust full pinyins
-                    r = Configuration::getFullPinyinTailAdjusted(r);
+                    r = tailAdjust(r);
                     if (nextChar == "'") r += "'";
                     unparsedPinyins.erase(0, i);
                     breaked = true;
@@ -69,6 +72,58 @@ const string PinyinUtility::separatePinyins(const string& pinyins) {
     return r;
 }
 
+const vector<string> PinyinUtility::splitCharacters(const string& characters) {
+    vector<string> r;
+    const gchar* begin = characters.c_str();
+    const gchar* end = begin + characters.length();
+    for (const gchar* p = begin; p < end;) {
+        const gchar* next = g_utf8_next_char(p);
+        if (next > end) next = end;
+        r.push_back(string(p, next - p));
+        p = next;
+    }
+    return r;
+}
+
+const size_t PinyinUtility::alignCharactersToPinyins(const string& characters, const PinyinSequence& pinyins, vector<int>& alignment) {
+    vector<string> chars = splitCharacters(characters);
+    size_t n = chars.size(), m = pinyins.size();
+
+    alignment.assign(n, -1);
+    if (n == 0 || m == 0) return 0;
+
+    // LCS-like dp, matched[i][j]: max aligned count of chars[i..] with pinyins[j..]
+    vector<vector<int> > matched(n + 1, vector<int>(m + 1, 0));
+    vector<vector<char> > isMatch(n, vector<char>(m, 0));
+    for (size_t i = 0; i < n; ++i)
+        for (size_t j = 0; j < m; ++j)
+            isMatch[i][j] = isCharacterPinyinMatch(chars[i], pinyins[j]);
+
+    for (size_t i = n; i-- > 0;) {
+        for (size_t j = m; j-- > 0;) {
+            int best = matched[i + 1][j] > matched[i][j + 1] ? matched[i + 1][j] : matched[i][j + 1];
+            if (isMatch[i][j] && matched[i + 1][j + 1] + 1 >= best) best = matched[i + 1][j + 1] + 1;
+            matched[i][j] = best;
+        }
+    }
+
+    // trace back, prefer diagonal
+    size_t count = 0;
+    for (size_t i = 0, j = 0; i < n && j < m;) {
+        if (isMatch[i][j] && matched[i][j] == matched[i + 1][j + 1] + 1) {
+            alignment[i] = j;
+            count++, i++, j++;
+        } else if (matched[i + 1][j] >= matched[i][j + 1]) {
+            i++;
+        } else {
+            j++;
+        }
+    }
+
+    DEBUG_PRINT(5, "[UTIL] alignCharactersToPinyins: '%s' => '%s': %d / %d aligned\n", characters.c_str(), pinyins.toString().c_str(), (int) count, (int) n);
+    return count;
+}
+
 const bool PinyinUtility::isRecognisedCharacter(const string& character) {
     return gb2312characterMap.find(character) != gb2312characterMap.end();
 }
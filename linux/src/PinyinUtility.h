@@ -13,6 +13,7 @@
 #include <set>
 #include <map>
 #include <string>
+#include <vector>
 #include "PinyinSequence.h"
 
 using std::map;
@@ -20,9 +21,12 @@ using std::multimap;
 using std::set;
 using std::string;
 using std::pair;
+using std::vector;
 
 class PinyinUtility {
 public:
+    typedef const string (*TailAdjustFunction)(const string& fullPinyinString);
+
     PinyinUtility();
     virtual ~PinyinUtility();
 
@@ -41,8 +45,22 @@ public:
     /**
      * add essential space as seperator (greedy)
      * "womenzaizheliparseerror" => "wo men zai zhe li pa r se er r o r"
+     * @param tailAdjust applied after each syllable, NULL to use
+     *        Configuration::getFullPinyinTailAdjusted
+     */
+    static const string separatePinyins(const string& pinyins, TailAdjustFunction tailAdjust = NULL);
+    /**
+     * map each character back to the pinyin it comes from (monotonic, keeps
+     * as many matches as possible). "我们在这里", "wo men zai zhe li" => 0 1 2 3 4
+     * @param alignment alignment[i] is index in pinyins of i-th character,
+     *        -1 if that character can not be aligned
+     * @return count of aligned characters
+     */
+    static const size_t alignCharactersToPinyins(const string& characters, const PinyinSequence& pinyins, vector<int>& alignment);
+    /**
+     * split utf-8 string into characters
      */
-    static const string separatePinyins(const string& pinyins);
+    static const vector<string> splitCharacters(const string& characters);
     static const int VALID_PINYIN_MAX_LENGTH;
 
     static void staticInit();
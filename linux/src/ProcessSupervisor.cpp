@@ -0,0 +1,421 @@
+/*
+ * File:   ProcessSupervisor.cpp
+ * Author: WU Jun <quark@lihdd.net>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include "ProcessSupervisor.h"
+#include "XUtility.h"
+#include "defines.h"
+
+// timer wheel: TIMER_WHEEL_SIZE slots, one slot per TICK_USEC.
+// timers further than one round are rescheduled when their slot comes
+#define TICK_USEC 10000LL
+#define TIMER_WHEEL_SIZE 64
+
+// original one and hedged one
+#define MAX_CHILD_COUNT 2
+
+// epoll user data: job id in high 32 bits, child index and event kind in low bits.
+// job ids start from 1, so 0 is used by wakeup pipe
+#define EPOLL_TAG_WAKEUP 0ULL
+#define EPOLL_TAG(id, child, isPidfd) (((uint64_t) (id) << 32) | ((child) << 1) | ((isPidfd) ? 1 : 0))
+#define EPOLL_TAG_ID(tag) ((unsigned int) ((tag) >> 32))
+#define EPOLL_TAG_CHILD(tag) ((int) (((tag) >> 1) & 0x7f))
+#define EPOLL_TAG_IS_PIDFD(tag) (((tag) & 1) != 0)
+
+#define READ_BUFFER_SIZE 4096
+
+struct SupervisedJob {
+    unsigned int id;
+    string command;
+    int niceness;
+    volatile bool* cancelled;
+    // usec, XUtility::getMonotonicTime()
+    long long timeStart, timeDeadline, timeHedge;
+
+    pid_t pids[MAX_CHILD_COUNT];
+    int outfds[MAX_CHILD_COUNT];
+    int pidfds[MAX_CHILD_COUNT];
+    string outputs[MAX_CHILD_COUNT];
+    int childCount, runningCount;
+
+    // result, protected by mutex
+    string output;
+    bool finished;
+    pthread_mutex_t mutex;
+    pthread_cond_t finishedCond;
+};
+
+pthread_t ProcessSupervisor::supervisorThread;
+pthread_mutex_t ProcessSupervisor::incomingJobsLock;
+deque<SupervisedJob*> ProcessSupervisor::incomingJobs;
+int ProcessSupervisor::epollFd = -1;
+int ProcessSupervisor::wakeupFds[2] = {-1, -1};
+volatile bool ProcessSupervisor::running = false;
+bool ProcessSupervisor::pidfdSupported = true;
+map<unsigned int, SupervisedJob*> ProcessSupervisor::activeJobs;
+unsigned int ProcessSupervisor::nextJobId = 1;
+vector<pid_t> ProcessSupervisor::zombies;
+vector<vector<unsigned int> > ProcessSupervisor::timerWheel;
+long long ProcessSupervisor::lastTick = 0;
+
+static bool isOutputMeaningful(const string& output) {
+    // fetcher writes an empty line to indicate failure
+    return output.find_first_not_of(" \r\n\t") != string::npos;
+}
+
+static int openPidfd(pid_t pid) {
+#ifdef __NR_pidfd_open
+    return (int) syscall(__NR_pidfd_open, pid, 0);
+#else
+    UNUSED(pid);
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/**
+ * fork and exec command in its own process group, stdout goes to *outfd
+ * @return pid, or -1 on failure
+ */
+static pid_t spawnChild(const char* command, int* outfd, const int niceness) {
+    int pOut[2];
+    if (pipe2(pOut, O_CLOEXEC) != 0) return -1;
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(pOut[0]);
+        close(pOut[1]);
+        return -1;
+    }
+
+    if (pid == 0) {
+        // only async-signal-safe calls here, parent has other threads
+        setpgid(0, 0);
+
+        // low priority fetches should not steal cpu from others
+        if (niceness > 0) UNUSED(nice(niceness));
+
+        int nullfd = open("/dev/null", O_RDONLY);
+        if (nullfd >= 0) dup2(nullfd, STDIN_FILENO);
+        dup2(pOut[1], STDOUT_FILENO);
+
+        execl("/bin/sh", "sh", "-c", command, (char*) NULL);
+        _exit(127);
+    }
+
+    // also set it here, child may not have run yet when we kill it
+    setpgid(pid, pid);
+    close(pOut[1]);
+    fcntl(pOut[0], F_SETFL, O_NONBLOCK);
+    *outfd = pOut[0];
+    return pid;
+}
+
+const string ProcessSupervisor::execute(const string& command, const long long timeoutUsec, const long long hedgeDelayUsec, const int niceness, volatile bool* cancelled) {
+    if (!running || timeoutUsec <= 0) return "";
+
+    SupervisedJob* job = new SupervisedJob();
+    job->id = 0;
+    job->command = command;
+    job->niceness = niceness;
+    job->cancelled = cancelled;
+    job->timeStart = XUtility::getMonotonicTime();
+    job->timeDeadline = job->timeStart + timeoutUsec;
+    job->timeHedge = (hedgeDelayUsec > 0 && hedgeDelayUsec < timeoutUsec) ? job->timeStart + hedgeDelayUsec : -1;
+    job->childCount = job->runningCount = 0;
+    job->finished = false;
+    pthread_mutex_init(&job->mutex, NULL);
+    pthread_cond_init(&job->finishedCond, NULL);
+
+    pthread_mutex_lock(&incomingJobsLock);
+    incomingJobs.push_back(job);
+    pthread_mutex_unlock(&incomingJobsLock);
+
+    char wakeup = 0;
+    UNUSED(write(wakeupFds[1], &wakeup, 1));
+
+    pthread_mutex_lock(&job->mutex);
+    while (!job->finished) pthread_cond_wait(&job->finishedCond, &job->mutex);
+    string output = job->output;
+    pthread_mutex_unlock(&job->mutex);
+
+    pthread_cond_destroy(&job->finishedCond);
+    pthread_mutex_destroy(&job->mutex);
+    delete job;
+
+    return output;
+}
+
+void ProcessSupervisor::scheduleTimer(SupervisedJob* job, const long long time) {
+    long long tick = time / TICK_USEC;
+    if (tick <= lastTick) tick = lastTick + 1;
+    if (tick > lastTick + TIMER_WHEEL_SIZE) tick = lastTick + TIMER_WHEEL_SIZE;
+    timerWheel[tick % TIMER_WHEEL_SIZE].push_back(job->id);
+}
+
+void ProcessSupervisor::launchChild(SupervisedJob* job) {
+    int child = job->childCount;
+    int outfd;
+    pid_t pid = spawnChild(job->command.c_str(), &outfd, job->niceness);
+    if (pid <= 0) {
+        perror("fail to fork @ ProcessSupervisor");
+        return;
+    }
+
+    job->pids[child] = pid;
+    job->outfds[child] = outfd;
+    job->pidfds[child] = -1;
+    job->childCount++, job->runningCount++;
+
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.u64 = EPOLL_TAG(job->id, child, false);
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, outfd, &event);
+
+    if (pidfdSupported) {
+        int pidfd = openPidfd(pid);
+        if (pidfd >= 0) {
+            job->pidfds[child] = pidfd;
+            event.data.u64 = EPOLL_TAG(job->id, child, true);
+            epoll_ctl(epollFd, EPOLL_CTL_ADD, pidfd, &event);
+        } else if (errno == ENOSYS) {
+            DEBUG_PRINT(2, "[SUPERVISOR] pidfd not supported, rely on pipes only\n");
+            pidfdSupported = false;
+        }
+    }
+}
+
+void ProcessSupervisor::startJob(SupervisedJob* job, const long long now) {
+    job->id = nextJobId++;
+    if (nextJobId == 0) nextJobId = 1;
+
+    launchChild(job);
+    if (job->childCount == 0) {
+        finishJob(job);
+        return;
+    }
+
+    // after an idle epoll_wait lastTick is stale, a timer scheduled from it
+    // would fire early (or late, by up to a wheel turn). nothing else is on
+    // the wheel, resync it to now
+    if (activeJobs.empty()) lastTick = now / TICK_USEC;
+    activeJobs[job->id] = job;
+    scheduleTimer(job, (job->timeHedge > 0 && job->timeHedge < job->timeDeadline) ? job->timeHedge : job->timeDeadline);
+    DEBUG_PRINT(4, "[SUPERVISOR] job %u started, queued %.3lf s\n", job->id, (double) (now - job->timeStart) / XUtility::MICROSECOND_PER_SECOND);
+}
+
+void ProcessSupervisor::handleChildEvent(SupervisedJob* job, const int child, const bool exited) {
+    if (exited && job->pidfds[child] >= 0) {
+        // pidfd stays readable, do not watch it any more
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, job->pidfds[child], NULL);
+        close(job->pidfds[child]);
+        job->pidfds[child] = -1;
+    }
+    if (job->outfds[child] < 0) return;
+
+    // drain pipe
+    for (;;) {
+        char receiveBuffer[READ_BUFFER_SIZE];
+        ssize_t readBytes = read(job->outfds[child], receiveBuffer, sizeof (receiveBuffer));
+        if (readBytes > 0) {
+            job->outputs[child].append(receiveBuffer, readBytes);
+            continue;
+        }
+        if (readBytes < 0 && errno == EINTR) continue;
+        if (readBytes < 0 && errno == EAGAIN && !exited) return;
+        // eof, or child has exited (its children may still hold the pipe)
+        break;
+    }
+
+    epoll_ctl(epollFd, EPOLL_CTL_DEL, job->outfds[child], NULL);
+    close(job->outfds[child]);
+    job->outfds[child] = -1;
+    job->runningCount--;
+
+    // first meaningful answer wins
+    if (isOutputMeaningful(job->outputs[child])) {
+        job->output = job->outputs[child];
+        finishJob(job);
+    } else if (job->runningCount == 0) {
+        job->output = job->outputs[0];
+        finishJob(job);
+    }
+}
+
+void ProcessSupervisor::handleTimers(const long long now) {
+    long long currentTick = now / TICK_USEC;
+
+    for (long long tick = lastTick + 1; tick <= currentTick && tick <= lastTick + TIMER_WHEEL_SIZE; ++tick) {
+        vector<unsigned int> jobIds;
+        jobIds.swap(timerWheel[tick % TIMER_WHEEL_SIZE]);
+
+        for (size_t i = 0; i < jobIds.size(); ++i) {
+            // job may have finished already
+            map<unsigned int, SupervisedJob*>::iterator it = activeJobs.find(jobIds[i]);
+            if (it == activeJobs.end()) continue;
+            SupervisedJob* job = it->second;
+
+            if (now >= job->timeDeadline) {
+                DEBUG_PRINT(3, "[SUPERVISOR] job %u timeout\n", job->id);
+                job->output = job->outputs[0];
+                finishJob(job);
+                continue;
+            }
+            if (job->timeHedge > 0 && now >= job->timeHedge) {
+                job->timeHedge = -1;
+                if (job->childCount < MAX_CHILD_COUNT && job->runningCount > 0) {
+                    launchChild(job);
+                    DEBUG_PRINT(2, "[SUPERVISOR] hedged request launched after %.3lf s\n", (double) (now - job->timeStart) / XUtility::MICROSECOND_PER_SECOND);
+                }
+            }
+            scheduleTimer(job, job->timeHedge > 0 ? job->timeHedge : job->timeDeadline);
+        }
+    }
+    lastTick = currentTick;
+
+    // a request with higher priority has taken over
+    for (map<unsigned int, SupervisedJob*>::iterator it = activeJobs.begin(); it != activeJobs.end();) {
+        SupervisedJob* job = (it++)->second;
+        if (job->cancelled && *job->cancelled) {
+            DEBUG_PRINT(2, "[SUPERVISOR] job %u cancelled\n", job->id);
+            job->output = job->outputs[0];
+            finishJob(job);
+        }
+    }
+}
+
+void ProcessSupervisor::finishJob(SupervisedJob* job) {
+    for (int i = 0; i < job->childCount; ++i) {
+        if (job->outfds[i] >= 0) {
+            epoll_ctl(epollFd, EPOLL_CTL_DEL, job->outfds[i], NULL);
+            close(job->outfds[i]);
+            job->outfds[i] = -1;
+        }
+        if (job->pidfds[i] >= 0) {
+            epoll_ctl(epollFd, EPOLL_CTL_DEL, job->pidfds[i], NULL);
+            close(job->pidfds[i]);
+            job->pidfds[i] = -1;
+        }
+        // whole process group, fetcher may have started its own children
+        kill(-job->pids[i], SIGKILL);
+        kill(job->pids[i], SIGKILL);
+        zombies.push_back(job->pids[i]);
+    }
+    activeJobs.erase(job->id);
+    reapChildren();
+
+    pthread_mutex_lock(&job->mutex);
+    job->finished = true;
+    pthread_cond_signal(&job->finishedCond);
+    pthread_mutex_unlock(&job->mutex);
+}
+
+void ProcessSupervisor::reapChildren() {
+    for (size_t i = 0; i < zombies.size();) {
+        if (waitpid(zombies[i], NULL, WNOHANG) != 0) {
+            // reaped, or not our child any more
+            zombies[i] = zombies.back();
+            zombies.pop_back();
+        } else {
+            ++i;
+        }
+    }
+}
+
+void* ProcessSupervisor::supervisorThreadFunc(void* data) {
+    UNUSED(data);
+    const int maxEvents = 16;
+    struct epoll_event events[maxEvents];
+
+    lastTick = XUtility::getMonotonicTime() / TICK_USEC;
+
+    while (running) {
+        // sleep until something happens if there is nothing to watch
+        int timeout = (activeJobs.empty() && zombies.empty()) ? -1 : (int) (TICK_USEC / 1000);
+        int eventCount = epoll_wait(epollFd, events, maxEvents, timeout);
+        if (eventCount < 0 && errno != EINTR) {
+            perror("epoll_wait @ ProcessSupervisor");
+            break;
+        }
+
+        long long now = XUtility::getMonotonicTime();
+
+        for (int i = 0; i < eventCount; ++i) {
+            uint64_t tag = events[i].data.u64;
+            if (tag == EPOLL_TAG_WAKEUP) {
+                char buffer[64];
+                while (read(wakeupFds[0], buffer, sizeof (buffer)) > 0);
+
+                deque<SupervisedJob*> jobs;
+                pthread_mutex_lock(&incomingJobsLock);
+                jobs.swap(incomingJobs);
+                pthread_mutex_unlock(&incomingJobsLock);
+                for (size_t j = 0; j < jobs.size(); ++j) startJob(jobs[j], now);
+                continue;
+            }
+
+            map<unsigned int, SupervisedJob*>::iterator it = activeJobs.find(EPOLL_TAG_ID(tag));
+            if (it == activeJobs.end()) continue;
+            handleChildEvent(it->second, EPOLL_TAG_CHILD(tag), EPOLL_TAG_IS_PIDFD(tag));
+        }
+
+        handleTimers(now);
+        if (!zombies.empty()) reapChildren();
+    }
+    return NULL;
+}
+
+void ProcessSupervisor::staticInit() {
+    pthread_mutex_init(&incomingJobsLock, NULL);
+    timerWheel.resize(TIMER_WHEEL_SIZE);
+
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (epollFd < 0 || pipe2(wakeupFds, O_CLOEXEC | O_NONBLOCK) != 0) {
+        perror("can not create ProcessSupervisor");
+        return;
+    }
+
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.u64 = EPOLL_TAG_WAKEUP;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeupFds[0], &event);
+
+    running = true;
+    if (pthread_create(&supervisorThread, NULL, supervisorThreadFunc, NULL)) {
+        perror("can not create ProcessSupervisor thread");
+        running = false;
+    }
+}
+
+void ProcessSupervisor::staticDestruct() {
+    if (running) {
+        running = false;
+        char wakeup = 0;
+        UNUSED(write(wakeupFds[1], &wakeup, 1));
+        pthread_join(supervisorThread, NULL);
+    }
+
+    // release waiting callers
+    pthread_mutex_lock(&incomingJobsLock);
+    for (size_t i = 0; i < incomingJobs.size(); ++i) finishJob(incomingJobs[i]);
+    incomingJobs.clear();
+    pthread_mutex_unlock(&incomingJobsLock);
+    while (!activeJobs.empty()) finishJob(activeJobs.begin()->second);
+
+    if (epollFd >= 0) close(epollFd);
+    if (wakeupFds[0] >= 0) close(wakeupFds[0]);
+    if (wakeupFds[1] >= 0) close(wakeupFds[1]);
+    epollFd = wakeupFds[0] = wakeupFds[1] = -1;
+    pthread_mutex_destroy(&incomingJobsLock);
+}
@@ -0,0 +1,78 @@
+/*
+ * File:   ProcessSupervisor.h
+ * Author: WU Jun <quark@lihdd.net>
+ *
+ * one thread owns all fetcher children. it watches their pipes and
+ * exits with epoll (and pidfd if kernel supports), enforces deadlines
+ * and hedge delays with a timer wheel, and kills a child with its
+ * whole process group.
+ */
+
+#ifndef _PROCESSSUPERVISOR_H
+#define	_PROCESSSUPERVISOR_H
+
+#include <string>
+#include <map>
+#include <vector>
+#include <deque>
+#include <pthread.h>
+#include <sys/types.h>
+
+using std::string;
+using std::map;
+using std::vector;
+using std::deque;
+
+struct SupervisedJob;
+
+class ProcessSupervisor {
+public:
+    /**
+     * run command using /bin/sh, wait until it answers, or timeout,
+     * or *cancelled becomes true. calling thread is blocked.
+     * @param timeoutUsec timeout in usec, must be positive
+     * @param hedgeDelayUsec if positive and command doesn't answer in this time,
+     *        run a same command again and take whichever answers first
+     * @param niceness nice value of children
+     * @param cancelled can be NULL
+     * @return first meaningful (not blank) output, or output of first
+     *         child if none is meaningful
+     */
+    static const string execute(const string& command, const long long timeoutUsec, const long long hedgeDelayUsec = -1, const int niceness = 0, volatile bool* cancelled = NULL);
+
+    static void staticInit();
+    static void staticDestruct();
+private:
+    ProcessSupervisor();
+    ProcessSupervisor(const ProcessSupervisor& orig);
+
+    static void* supervisorThreadFunc(void* data);
+
+    // called in supervisor thread
+    static void startJob(SupervisedJob* job, const long long now);
+    static void launchChild(SupervisedJob* job);
+    static void handleChildEvent(SupervisedJob* job, const int child, const bool exited);
+    static void handleTimers(const long long now);
+    static void finishJob(SupervisedJob* job);
+    static void reapChildren();
+    static void scheduleTimer(SupervisedJob* job, const long long time);
+
+    static pthread_t supervisorThread;
+    static pthread_mutex_t incomingJobsLock;
+    static deque<SupervisedJob*> incomingJobs;
+    static int epollFd, wakeupFds[2];
+    static volatile bool running;
+    static bool pidfdSupported;
+
+    // only touched by supervisor thread
+    static map<unsigned int, SupervisedJob*> activeJobs;
+    static unsigned int nextJobId;
+    // killed children not reaped yet
+    static vector<pid_t> zombies;
+    // timer wheel, each slot holds job ids
+    static vector<vector<unsigned int> > timerWheel;
+    static long long lastTick;
+};
+
+#endif	/* _PROCESSSUPERVISOR_H */
+
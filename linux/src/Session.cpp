@@ -0,0 +1,192 @@
+/*
+ * File:   Session.cpp
+ * Author: WU Jun <quark@lihdd.net>
+ */
+
+#include <cstdio>
+#include <unistd.h>
+#include <glib.h>
+#include "Session.h"
+#include "defines.h"
+#include "LuaBinding.h"
+#include "Configuration.h"
+#include "PinyinUtility.h"
+#include "PinyinCloudClient.h"
+#include "PinyinDatabase.h"
+#include "DoublePinyinScheme.h"
+#include "LatencyHistogram.h"
+#include "ProcessSupervisor.h"
+#include "Metrics.h"
+#include "Tracer.h"
+#include "XUtility.h"
+
+Session::Session() {
+    preeditCursor = 0;
+    lookupTableVisible = false;
+    engine = ImeEngine::createHeadlessEngine(this);
+}
+
+Session::Session(const Session& orig) {
+}
+
+Session::~Session() {
+    // request threads use engine until they return, fetches give up
+    // after their timeouts. callbacks may post to main loop, keep it going
+    while (ImeEngine::getRunningFetchCount(engine) > 0) {
+        dispatchPendingUpdates();
+        usleep(1000);
+    }
+    ImeEngine::destroyHeadlessEngine(engine);
+}
+
+const bool Session::processKeyEvent(const unsigned int keyval, const unsigned int state, const unsigned int keycode) {
+    bool r = ImeEngine::processKeyEvent(engine, keyval, keycode, state);
+    dispatchPendingUpdates();
+    return r;
+}
+
+const bool Session::typeKey(const unsigned int keyval, const unsigned int state) {
+    bool r = processKeyEvent(keyval, state);
+    processKeyEvent(keyval, state | IBUS_RELEASE_MASK);
+    return r;
+}
+
+void Session::typeKeys(const string& keys) {
+    // printable ascii keyvals are ascii codes
+    for (size_t i = 0; i < keys.length(); ++i) typeKey((unsigned char) keys[i]);
+}
+
+void Session::dispatchPendingUpdates() {
+    while (g_main_context_iteration(NULL, FALSE));
+}
+
+const bool Session::waitForRequests(const long long timeoutUsec) {
+    long long deadline = XUtility::getMonotonicTime() + timeoutUsec;
+    for (;;) {
+        dispatchPendingUpdates();
+        if (ImeEngine::getRequestCount(engine) == 0) return true;
+        if (XUtility::getMonotonicTime() > deadline) return false;
+        usleep(1000);
+    }
+}
+
+const string& Session::getPreedit() const {
+    return preedit;
+}
+
+const unsigned int Session::getPreeditCursor() const {
+    return preeditCursor;
+}
+
+const vector<string>& Session::getCandidates() const {
+    return candidates;
+}
+
+const bool Session::isLookupTableVisible() const {
+    return lookupTableVisible;
+}
+
+const string& Session::getAuxiliaryText() const {
+    return auxiliaryText;
+}
+
+const vector<string> Session::takeCommits() {
+    vector<string> r;
+    r.swap(commits);
+    return r;
+}
+
+const size_t Session::getRequestCount() const {
+    return ImeEngine::getRequestCount(engine);
+}
+
+void Session::commitText(const string& text) {
+    DEBUG_PRINT(3, "[SESSION] commit: %s\n", text.c_str());
+    if (!text.empty()) commits.push_back(text);
+}
+
+void Session::updatePreedit(const string& text, IBusAttrList* attributes, const unsigned int cursor, const bool visible) {
+    UNUSED(attributes);
+    preedit = visible ? text : "";
+    preeditCursor = visible ? cursor : 0;
+}
+
+void Session::updateLookupTable(IBusLookupTable* table, const vector<string>& candidates, const bool visible) {
+    UNUSED(table);
+    this->candidates = candidates;
+    lookupTableVisible = visible;
+}
+
+void Session::updateAuxiliaryText(const string& text, const bool visible) {
+    auxiliaryText = visible ? text : "";
+}
+
+void Session::updateProperties(IBusPropList* properties) {
+    UNUSED(properties);
+}
+
+int Session::staticInit(const string& luaScript) {
+    if (!g_thread_supported()) g_thread_init(NULL);
+    g_type_init();
+    Logger::staticInit();
+
+    LuaBinding::staticInit();
+    registerDebugLuaFunction();
+    ImeEngine::registerLuaFunctions();
+    Configuration::registerLuaFunctions();
+    XUtility::registerLuaFunctions();
+    DoublePinyinScheme::registerLuaFunctions();
+    PinyinDatabase::registerLuaFunctions();
+    PinyinUtility::registerLuaFunctions();
+    Metrics::registerLuaFunctions();
+    Tracer::registerLuaFunctions();
+
+    Configuration::staticInit();
+    PinyinCloudClient::staticInit();
+    PinyinUtility::staticInit();
+    PinyinDatabase::staticInit();
+    LatencyHistogram::staticInit();
+    ProcessSupervisor::staticInit();
+    // no stats dump thread, it would overwrite stats of running ime
+    Tracer::staticInit();
+
+    if (luaScript.empty()) return 0;
+    return LuaBinding::getStaticBinding().doString(luaScript.c_str());
+}
+
+const string Session::getToolConfigScript(const string& configPath, const bool loadDatabases) {
+    return string(loadDatabases ? "" : "do_not_load_database = true ")
+            + "do_not_update_fetcher = true do_not_load_remote_script = true do_not_load_user_config = true "
+            + "dofile('" + configPath + "') ime.apply_settings()";
+}
+
+int Session::readWordList(const string& path, vector<pair<string, string> >& words) {
+    FILE* file = fopen(path.c_str(), "r");
+    if (!file) return -1;
+
+    int count = 0;
+    char line[1024];
+    while (fgets(line, sizeof (line), file)) {
+        string s = line;
+        while (!s.empty() && (s[s.length() - 1] == '\n' || s[s.length() - 1] == '\r')) s.erase(s.length() - 1);
+        size_t tab = s.find('\t');
+        if (s.empty() || s[0] == '#' || tab == string::npos) continue;
+        words.push_back(pair<string, string > (s.substr(0, tab), s.substr(tab + 1)));
+        count++;
+    }
+    fclose(file);
+    return count;
+}
+
+void Session::staticDestruct() {
+    Configuration::staticDestruct();
+    PinyinCloudClient::staticDestruct();
+    PinyinDatabase::staticDestruct();
+    PinyinUtility::staticDestruct();
+    LatencyHistogram::staticDestruct();
+    ProcessSupervisor::staticDestruct();
+    Metrics::staticDestruct();
+    Tracer::staticDestruct();
+    LuaBinding::staticDestruct();
+    Logger::staticDestruct();
+}
@@ -0,0 +1,97 @@
+/*
+ * File:   Session.h
+ * Author: WU Jun <quark@lihdd.net>
+ *
+ * headless input session: feed keys, read preedit, candidates and
+ * commits. needs no ibus-daemon, X or gtk, for benchmarks and tools.
+ */
+
+#ifndef _SESSION_H
+#define	_SESSION_H
+
+#include <string>
+#include <vector>
+#include <utility>
+#include "engine.h"
+
+using std::string;
+using std::vector;
+using std::pair;
+
+class Session : public ImeEngine::EngineOutput {
+public:
+    Session();
+    virtual ~Session();
+
+    /**
+     * @return true if key is consumed by ime
+     */
+    const bool processKeyEvent(const unsigned int keyval, const unsigned int state = 0, const unsigned int keycode = 0);
+    /**
+     * press and release a key
+     */
+    const bool typeKey(const unsigned int keyval, const unsigned int state = 0);
+    /**
+     * type each character of keys
+     */
+    void typeKeys(const string& keys);
+
+    /**
+     * handle updates posted by request threads, does not block
+     */
+    void dispatchPendingUpdates();
+    /**
+     * dispatch until all requests are answered and rendered
+     * @return false if timed out
+     */
+    const bool waitForRequests(const long long timeoutUsec);
+
+    const string& getPreedit() const;
+    const unsigned int getPreeditCursor() const;
+    const vector<string>& getCandidates() const;
+    const bool isLookupTableVisible() const;
+    const string& getAuxiliaryText() const;
+    /**
+     * @return texts committed since last call
+     */
+    const vector<string> takeCommits();
+    const size_t getRequestCount() const;
+
+    // EngineOutput
+    virtual void commitText(const string& text);
+    virtual void updatePreedit(const string& text, IBusAttrList* attributes, const unsigned int cursor, const bool visible);
+    virtual void updateLookupTable(IBusLookupTable* table, const vector<string>& candidates, const bool visible);
+    virtual void updateAuxiliaryText(const string& text, const bool visible);
+    virtual void updateProperties(IBusPropList* properties);
+
+    /**
+     * init everything sessions need except ibus, X and gtk, then run
+     * luaScript in static binding (e.g. load config and apply settings)
+     * @return 0 if luaScript runs ok
+     */
+    static int staticInit(const string& luaScript = "");
+    static void staticDestruct();
+
+    /**
+     * lua script loading config the way tools need: no user config,
+     * fetcher update or remote scripts, settings applied at last
+     * @param loadDatabases load databases config lists too
+     */
+    static const string getToolConfigScript(const string& configPath, const bool loadDatabases = false);
+    /**
+     * one word per line: pinyins, tab, text. lines starting with # are skipped
+     * @return count of words read, -1 if file can not be read
+     */
+    static int readWordList(const string& path, vector<pair<string, string> >& words);
+private:
+    Session(const Session& orig);
+
+    IBusSgpyccEngine* engine;
+    string preedit, auxiliaryText;
+    unsigned int preeditCursor;
+    vector<string> candidates, commits;
+    bool lookupTableVisible;
+};
+
+#endif	/* _SESSION_H */
+
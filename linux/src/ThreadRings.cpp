@@ -0,0 +1,74 @@
+/*
+ * File:   ThreadRings.cpp
+ * Author: WU Jun <quark@lihdd.net>
+ */
+
+#include <unistd.h>
+#include <sys/syscall.h>
+#include "ThreadRings.h"
+
+ThreadRings::ThreadRings(const size_t itemSize, const int capacity) {
+    this->itemSize = itemSize;
+    this->capacity = capacity;
+    pthread_key_create(&ringKey, releaseRing);
+    pthread_mutex_init(&ringsLock, NULL);
+}
+
+ThreadRings::ThreadRings(const ThreadRings& orig) {
+}
+
+ThreadRings::~ThreadRings() {
+    // detached threads may still hold their rings, rings are left to exit
+    pthread_key_delete(ringKey);
+}
+
+ThreadRing* ThreadRings::getCurrentRing() {
+    ThreadRing* ring = (ThreadRing*) pthread_getspecific(ringKey);
+    if (ring) return ring;
+
+    // request threads come and go, reuse rings of exited threads
+    pthread_mutex_lock(&ringsLock);
+    if (!freeRings.empty()) {
+        ring = freeRings.back();
+        freeRings.pop_back();
+    } else {
+        ring = new ThreadRing();
+        ring->items = new char[itemSize * capacity];
+        ring->head = ring->tail = 0;
+        ring->owner = this;
+        rings.push_back(ring);
+    }
+    pthread_mutex_unlock(&ringsLock);
+
+    ring->threadId = (int) syscall(SYS_gettid);
+    pthread_setspecific(ringKey, ring);
+    return ring;
+}
+
+void* ThreadRings::getItem(ThreadRing* ring, const long long position) const {
+    return ring->items + (position % capacity) * itemSize;
+}
+
+const int ThreadRings::getCapacity() const {
+    return capacity;
+}
+
+void ThreadRings::lock() {
+    pthread_mutex_lock(&ringsLock);
+}
+
+void ThreadRings::unlock() {
+    pthread_mutex_unlock(&ringsLock);
+}
+
+const vector<ThreadRing*>& ThreadRings::getRings() const {
+    return rings;
+}
+
+void ThreadRings::releaseRing(void* data) {
+    ThreadRing* ring = (ThreadRing*) data;
+    ThreadRings* owner = ring->owner;
+    pthread_mutex_lock(&owner->ringsLock);
+    owner->freeRings.push_back(ring);
+    pthread_mutex_unlock(&owner->ringsLock);
+}
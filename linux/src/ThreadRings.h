@@ -0,0 +1,64 @@
+/*
+ * File:   ThreadRings.h
+ * Author: WU Jun <quark@lihdd.net>
+ *
+ * per-thread rings of fixed size items, for recorders that must not take
+ * a lock on the recording side (Logger, Tracer). each thread gets its own
+ * ring on first use, only it writes there. rings of exited threads are
+ * reused, never freed, readers go through all of them.
+ */
+
+#ifndef _THREADRINGS_H
+#define	_THREADRINGS_H
+
+#include <vector>
+#include <pthread.h>
+
+using std::vector;
+
+class ThreadRings;
+
+struct ThreadRing {
+    // capacity items, item at position p is at p % capacity
+    char* items;
+    // positions, owner advances tail after writing an item. head is
+    // free for the reader to use (consumed position, etc)
+    volatile long long head, tail;
+    // kernel thread id of owner
+    int threadId;
+    ThreadRings* owner;
+};
+
+class ThreadRings {
+public:
+    ThreadRings(const size_t itemSize, const int capacity);
+    virtual ~ThreadRings();
+
+    /**
+     * ring of calling thread, created (or reused) on first use
+     */
+    ThreadRing* getCurrentRing();
+    void* getItem(ThreadRing* ring, const long long position) const;
+    const int getCapacity() const;
+
+    /**
+     * rings are only added while unlocked, readers lock around getRings()
+     */
+    void lock();
+    void unlock();
+    const vector<ThreadRing*>& getRings() const;
+private:
+    ThreadRings(const ThreadRings& orig);
+
+    static void releaseRing(void* ring);
+
+    size_t itemSize;
+    int capacity;
+    pthread_key_t ringKey;
+    pthread_mutex_t ringsLock;
+    // all rings ever created, freeRings are of exited threads
+    vector<ThreadRing*> rings, freeRings;
+};
+
+#endif	/* _THREADRINGS_H */
+
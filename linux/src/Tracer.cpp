@@ -0,0 +1,125 @@
+/*
+ * File:   Tracer.cpp
+ * Author: WU Jun <quark@lihdd.net>
+ */
+
+#include <cstdio>
+#include <unistd.h>
+#include <glib.h>
+#include "Tracer.h"
+#include "ThreadRings.h"
+#include "XUtility.h"
+#include "defines.h"
+
+const int Tracer::RING_CAPACITY = 2048;
+
+struct TraceEvent {
+    const char* name;
+    long long startTime, duration;
+    int threadId;
+};
+
+volatile int Tracer::enabled = 0;
+
+ThreadRings& Tracer::getRings() {
+    // never deleted, spans may still end during exit
+    static ThreadRings* rings = new ThreadRings(sizeof (TraceEvent), RING_CAPACITY);
+    return *rings;
+}
+
+Tracer::Span::Span(const char* name, Metrics::Histogram* histogram) {
+    this->name = name;
+    this->histogram = histogram;
+    traced = g_atomic_int_get(&enabled) != 0;
+    startTime = (traced || histogram) ? XUtility::getMonotonicTime() : -1;
+}
+
+Tracer::Span::Span(const Span& orig) {
+}
+
+Tracer::Span::~Span() {
+    if (startTime < 0) return;
+    long long duration = XUtility::getMonotonicTime() - startTime;
+    if (histogram) histogram->record(duration);
+    if (!traced) return;
+
+    // only owner thread writes. a span is written into its slot first,
+    // then published by advancing tail
+    ThreadRings& rings = getRings();
+    ThreadRing* ring = rings.getCurrentRing();
+    TraceEvent& event = *(TraceEvent*) rings.getItem(ring, ring->tail);
+    event.name = name;
+    event.startTime = startTime;
+    event.duration = duration;
+    event.threadId = ring->threadId;
+    // full barrier, event is visible before tail
+    __sync_fetch_and_add(&ring->tail, 1);
+}
+
+void Tracer::setEnabled(const bool enabled) {
+    g_atomic_int_set(&Tracer::enabled, enabled ? 1 : 0);
+}
+
+const bool Tracer::isEnabled() {
+    return g_atomic_int_get(&enabled) != 0;
+}
+
+const int Tracer::exportTrace(const string& path) {
+    DEBUG_PRINT(2, "[TRACE] exportTrace: %s\n", path.c_str());
+    FILE* file = fopen(path.c_str(), "w");
+    if (!file) return -1;
+
+    int count = 0;
+    int processId = (int) getpid();
+    vector<TraceEvent> events;
+    fprintf(file, "{\"traceEvents\":[");
+
+    ThreadRings& rings = getRings();
+    rings.lock();
+    for (size_t i = 0; i < rings.getRings().size(); ++i) {
+        ThreadRing* ring = rings.getRings()[i];
+        long long end = __sync_fetch_and_add(&ring->tail, 0);
+        long long begin = end > RING_CAPACITY ? end - RING_CAPACITY : 0;
+        events.clear();
+        for (long long p = begin; p < end; ++p) events.push_back(*(TraceEvent*) rings.getItem(ring, p));
+        // owner may have overwritten oldest ones while copying, drop them.
+        // slot of newEnd is being written, so valid ones start after it
+        long long newEnd = __sync_fetch_and_add(&ring->tail, 0);
+        long long firstValid = newEnd - RING_CAPACITY + 1;
+        size_t skipped = firstValid > begin ? (size_t) (firstValid - begin) : 0;
+
+        for (size_t j = skipped; j < events.size(); ++j) {
+            const TraceEvent& event = events[j];
+            fprintf(file, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,\"pid\":%d,\"tid\":%d}",
+                    count > 0 ? "," : "", event.name, event.startTime, event.duration, processId, event.threadId);
+            count++;
+        }
+    }
+    rings.unlock();
+
+    fprintf(file, "\n],\"displayTimeUnit\":\"ms\"}\n");
+    if (fclose(file) != 0) return -1;
+    return count;
+}
+
+int Tracer::l_exportTrace(lua_State* L) {
+    DEBUG_PRINT(2, "[LUA] l_exportTrace\n");
+    string path;
+    if (lua_type(L, 1) == LUA_TSTRING) path = lua_tostring(L, 1);
+    else path = string(g_get_user_cache_dir()) + G_DIR_SEPARATOR_S "ibus" G_DIR_SEPARATOR_S "sogoupycc" G_DIR_SEPARATOR_S "trace.json";
+    lua_pushinteger(L, exportTrace(path));
+    return 1;
+}
+
+void Tracer::registerLuaFunctions() {
+    LuaBinding::getStaticBinding().registerFunction(l_exportTrace, "export_trace");
+}
+
+void Tracer::staticInit() {
+    getRings();
+}
+
+void Tracer::staticDestruct() {
+    // detached threads may still hold their rings, rings are left to exit
+    setEnabled(false);
+}
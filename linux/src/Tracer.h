@@ -0,0 +1,77 @@
+/*
+ * File:   Tracer.h
+ * Author: WU Jun <quark@lihdd.net>
+ *
+ * span tracing. each thread records spans into its own ring, no lock
+ * on the recording side. rings can be exported as chrome trace json
+ * (chrome://tracing, perfetto) to see which stage of a keystroke is slow.
+ */
+
+#ifndef _TRACER_H
+#define	_TRACER_H
+
+#include <string>
+#include <vector>
+#include <pthread.h>
+
+#include "LuaBinding.h"
+#include "Metrics.h"
+
+using std::string;
+using std::vector;
+
+class ThreadRings;
+
+class Tracer {
+public:
+
+    /**
+     * record a span from construction to destruction.
+     * name must be a string literal (only the pointer is kept)
+     * @param histogram if not NULL, duration (usec) is also recorded
+     *        there, whether tracing is enabled or not
+     */
+    class Span {
+    public:
+        Span(const char* name, Metrics::Histogram* histogram = NULL);
+        ~Span();
+    private:
+        Span(const Span& orig);
+        const char* name;
+        Metrics::Histogram* histogram;
+        bool traced;
+        long long startTime;
+    };
+
+    static void setEnabled(const bool enabled);
+    static const bool isEnabled();
+
+    /**
+     * write spans still in rings to path, in chrome trace event format
+     * @return count of spans written, -1 if file can not be written
+     */
+    static const int exportTrace(const string& path);
+
+    static void registerLuaFunctions();
+    static void staticInit();
+    static void staticDestruct();
+
+    // spans each thread keeps, older ones are overwritten
+    static const int RING_CAPACITY;
+private:
+    Tracer();
+    Tracer(const Tracer& orig);
+
+    static ThreadRings& getRings();
+
+    /**
+     * in: string path (optional, default: USERCACHEDIR/trace.json)
+     * out: int count of spans written, -1 if fails
+     */
+    static int l_exportTrace(lua_State* L);
+
+    static volatile int enabled;
+};
+
+#endif	/* _TRACER_H */
+
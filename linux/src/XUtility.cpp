@@ -5,140 +5,92 @@
 
 #include "XUtility.h"
 #include <sys/timex.h>
-#include <gtk/gtk.h>
-#include <libnotify/notify.h>
-#include <libnotify/notification.h>
+#include <time.h>
 #include "Configuration.h"
 #include "defines.h"
 
 
 namespace XUtility {
-    static GtkClipboard *primaryClipboard;
 
-    static long long updatedTime;
-    static string currentSelection;
+    /**
+     * no X here, selection is kept in memory
+     */
+    class MemoryDesktop : public Desktop {
+    public:
 
-    static pthread_t gtkMainLoopThread;
-    static pthread_rwlock_t selectionRwLock;
+        MemoryDesktop() {
+            updatedTime = 0;
+            pthread_mutex_init(&selectionLock, NULL);
+        }
 
-    static bool staticInited = false;
-    static bool running = false;
-    static bool notifyInited = false;
+        const string getSelection() {
+            pthread_mutex_lock(&selectionLock);
+            string r = selection;
+            pthread_mutex_unlock(&selectionLock);
+            return r;
+        }
 
-    static NotifyNotification *staticNotify = NULL;
+        const long long getSelectionUpdatedTime() {
+            pthread_mutex_lock(&selectionLock);
+            long long r = updatedTime;
+            pthread_mutex_unlock(&selectionLock);
+            return r;
+        }
 
-    const long long MICROSECOND_PER_SECOND = 1000000;
+        void setSelectionUpdatedTime(long long time) {
+            pthread_mutex_lock(&selectionLock);
+            updatedTime = time;
+            pthread_mutex_unlock(&selectionLock);
+        }
 
-    void* gtkMainLoop(void*) {
-        gtk_main();
-        DEBUG_PRINT(1, "[XUTIL] gtk main loop exited\n");
-        return NULL;
-    }
+        bool showNotify(const char* summary, const char* body, const char* iconPath) {
+            DEBUG_PRINT(2, "[XUTIL] notify without desktop: %s, %s\n", summary, body ? body : "");
+            UNUSED(iconPath);
+            return false;
+        }
 
-    void staticDestruct() {
-        DEBUG_PRINT(1, "[XUTIL] staticDestruct\n");
-        if (staticInited) {
-            running = false;
-            if (notifyInited) {
-                g_object_unref(G_OBJECT(staticNotify));
-                notify_uninit();
-                notifyInited = false;
-            }
-            gtk_main_quit();
-            pthread_rwlock_destroy(&selectionRwLock);
-            // IMPROVE: other cleanning, how ever, seems this loop here never ends
+        bool showStaticNotify(const char* summary, const char* body, const char* iconPath) {
+            return showNotify(summary, body, iconPath);
         }
+    private:
+        string selection;
+        long long updatedTime;
+        pthread_mutex_t selectionLock;
+    };
+
+    static MemoryDesktop memoryDesktop;
+    static Desktop* volatile currentDesktop = &memoryDesktop;
+
+    const long long MICROSECOND_PER_SECOND = 1000000;
+
+    void setDesktop(Desktop* desktop) {
+        DEBUG_PRINT(1, "[XUTIL] setDesktop\n");
+        currentDesktop = desktop ? desktop : &memoryDesktop;
     }
 
-    void* updateSelection() {
-        DEBUG_PRINT(5, "[XUTIL] selection update callback\n");
-
-        gchar *text = gtk_clipboard_wait_for_text(primaryClipboard);
-        if (text) {
-            pthread_rwlock_wrlock(&selectionRwLock);
-            currentSelection = string((char*) text);
-            updatedTime = getCurrentTime();
-            DEBUG_PRINT(4, "[XUTIL] selection update to: '%s'\n", currentSelection.c_str());
-            g_free(text);
-            pthread_rwlock_unlock(&selectionRwLock);
-        }
-        return NULL;
+    const string getSelection() {
+        return currentDesktop->getSelection();
     }
 
-    void staticInit() {
-        if (staticInited) return;
-        // this probably won't be call that frequently -,- no lock here
-        staticInited = true;
-        DEBUG_PRINT(1, "[XUTIL] staticInit\n");
-
-        primaryClipboard = gtk_clipboard_get(GDK_SELECTION_PRIMARY);
-        g_signal_connect(primaryClipboard, "owner-change", G_CALLBACK(updateSelection), NULL);
-        updatedTime = getCurrentTime();
-
-        pthread_attr_t threadAttr;
-        pthread_attr_init(&threadAttr);
-        pthread_attr_setdetachstate(&threadAttr, PTHREAD_CREATE_DETACHED);
-        pthread_create(&gtkMainLoopThread, &threadAttr, &gtkMainLoop, NULL);
-        pthread_attr_destroy(&threadAttr);
-
-        pthread_rwlock_init(&selectionRwLock, NULL);
-        running = true;
-
-        // init libnotify
-        notifyInited = notify_init("ibus-sogoupycc");
-        if (notifyInited) {
-            staticNotify = notify_notification_new("-", NULL, NULL, NULL);
-        }
+    const long long getSelectionUpdatedTime() {
+        return currentDesktop->getSelectionUpdatedTime();
+    }
 
-        staticInited = true;
+    void setSelectionUpdatedTime(long long time) {
+        currentDesktop->setSelectionUpdatedTime(time);
     }
 
     bool showNotify(const char* summary, const char* body, const char* iconPath) {
         DEBUG_PRINT(2, "[XUTIL] showNotify(%s, %s, %s)\n", summary, body, iconPath);
-        if (Configuration::staticNotification) return showStaticNotify(summary, body, iconPath);
-        if (!notifyInited) return false;
         if (summary == NULL || summary[0] == '\0') return false;
-        NotifyNotification *notify = notify_notification_new(summary, body, iconPath, NULL);
-        int r = notify_notification_show(notify, NULL);
-        g_object_unref(G_OBJECT(notify));
-        return (r != FALSE);
+        if (Configuration::staticNotification) return currentDesktop->showStaticNotify(summary, body, iconPath);
+        return currentDesktop->showNotify(summary, body, iconPath);
     }
 
     bool showStaticNotify(const char* summary, const char* body, const char* iconPath) {
         DEBUG_PRINT(2, "[XUTIL] showStaticNotify(%s, %s, %s)\n", summary, body, iconPath);
-        if (!notifyInited) return false;
         if (summary == NULL || summary[0] == '\0') return false;
-        notify_notification_update(staticNotify, summary, body, iconPath);
-        int r = notify_notification_show(staticNotify, NULL);
-        return (r != FALSE);
-    }
-
-    const long long getSelectionUpdatedTime() {
-        staticInit();
-        DEBUG_PRINT(4, "[XUTIL] getSelectionUpdatedTime \n");
-        pthread_rwlock_rdlock(&selectionRwLock);
-        DEBUG_PRINT(5, "[XUTIL] getSelectionUpdatedTime -- get read lock\n");
-        long long r = updatedTime;
-        pthread_rwlock_unlock(&selectionRwLock);
-        return r;
-    }
-
-    void setSelectionUpdatedTime(long long time) {
-        staticInit();
-        DEBUG_PRINT(4, "[XUTIL] setSelectionUpdatedTime \n");
-        pthread_rwlock_rdlock(&selectionRwLock);
-        updatedTime = time;
-        pthread_rwlock_unlock(&selectionRwLock);
-    }
-
-    const string getSelection() {
-        staticInit();
-        DEBUG_PRINT(4, "[XUTIL] getSelection \n");
-        pthread_rwlock_rdlock(&selectionRwLock);
-        DEBUG_PRINT(5, "[XUTIL] getSelection: '%s'\n", currentSelection.c_str());
-        string r = currentSelection;
-        pthread_rwlock_unlock(&selectionRwLock);
-        return r;
+        return currentDesktop->showStaticNotify(summary, body, iconPath);
     }
 
     const long long getCurrentTime() {
@@ -147,6 +99,12 @@ namespace XUtility {
         return t.time.tv_usec + t.time.tv_sec * 1000000LL;
     }
 
+    const long long getMonotonicTime() {
+        struct timespec t;
+        clock_gettime(CLOCK_MONOTONIC, &t);
+        return t.tv_nsec / 1000 + t.tv_sec * 1000000LL;
+    }
+
     /**
      * show notify
      * in: string summary, string body(optional), string icon_path(optional)
@@ -182,5 +140,7 @@ namespace XUtility {
     void registerLuaFunctions() {
         LuaBinding::getStaticBinding().registerFunction(l_notify, "notify");
         LuaBinding::getStaticBinding().registerFunction(l_getSelection, "get_selection");
+        LuaBinding::registerWorkerFunction(l_notify, "notify");
+        LuaBinding::registerWorkerFunction(l_getSelection, "get_selection");
     }
 }
\ No newline at end of file
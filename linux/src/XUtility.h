@@ -2,7 +2,7 @@
  * File:   XUtility.cpp
  * Author: WU Jun <quark@lihdd.net>
  *
- * access to X selection clipboard and maintain notifies
+ * access to X selection clipboard and notifies, time
  */
 
 
@@ -20,18 +20,41 @@ using std::string;
 
 namespace XUtility {
 
+    /**
+     * X selection and notifies, provided by ibus-sogoupycc (gtk, libnotify).
+     * without one (tools, headless sessions) selection is empty and
+     * notifies are only logged
+     */
+    class Desktop {
+    public:
+        virtual ~Desktop() {}
+        virtual const string getSelection() = 0;
+        virtual const long long getSelectionUpdatedTime() = 0;
+        virtual void setSelectionUpdatedTime(long long time) = 0;
+        virtual bool showNotify(const char* summary, const char* body, const char* iconPath) = 0;
+        virtual bool showStaticNotify(const char* summary, const char* body, const char* iconPath) = 0;
+    };
+
+    /**
+     * set before engines are created, desktop is not owned
+     * @param desktop NULL to use in-memory one
+     */
+    void setDesktop(Desktop* desktop);
+
     const string getSelection();
     const long long getSelectionUpdatedTime();
     void setSelectionUpdatedTime(long long time = 0);
     const long long getCurrentTime();
+    /**
+     * usec from CLOCK_MONOTONIC, cheap (vdso) and never jumps,
+     * use it to measure durations
+     */
+    const long long getMonotonicTime();
     bool showNotify(const char* summary, const char* body = "", const char* iconPath = APP_ICON);
     bool showStaticNotify(const char* summary, const char* body = "", const char* iconPath = APP_ICON);
 
     extern const long long MICROSECOND_PER_SECOND;
 
-    void staticDestruct();
-    void staticInit();
-
     void registerLuaFunctions();
 };
 
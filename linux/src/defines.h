@@ -26,11 +26,17 @@
 #endif
 
 #include "XUtility.h"
+#include "Logger.h"
 
 // for debugging
 extern int globalDebugLevel;
 
-#define DEBUG_PRINT(level, ...) if (globalDebugLevel >= level) fprintf(stderr, "[DEBUG] (%.3lf) L%03d (thread 0x%x): ", (double)XUtility::getCurrentTime() / XUtility::MICROSECOND_PER_SECOND, __LINE__, (int)pthread_self()),fprintf(stderr,__VA_ARGS__),fflush(stderr);
+// levels above this are compiled out, release builds set it lower
+#ifndef DEBUG_LEVEL_MAX
+#define DEBUG_LEVEL_MAX 10
+#endif
+
+#define DEBUG_PRINT(level, ...) if ((level) <= DEBUG_LEVEL_MAX && globalDebugLevel >= (level)) Logger::log(__LINE__, __VA_ARGS__);
 
 void registerDebugLuaFunction();
 
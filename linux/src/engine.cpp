@@ -11,11 +11,10 @@
 #include <iomanip>
 #include <cassert>
 #include <vector>
-#include <dirent.h>
-#include <fcntl.h>
+#include <map>
+#include <algorithm>
 #include <unistd.h>
 #include <sys/types.h>
-#include <sys/wait.h>
 
 #include "defines.h"
 #include "engine.h"
@@ -27,12 +26,19 @@
 #include "PinyinUtility.h"
 #include "PinyinDatabase.h"
 #include "DoublePinyinScheme.h"
+#include "LatencyHistogram.h"
+#include "ProcessSupervisor.h"
+#include "Metrics.h"
+#include "Tracer.h"
 
-typedef struct _IBusSgpyccEngine IBusSgpyccEngine;
 typedef struct _IBusSgpyccEngineClass IBusSgpyccEngineClass;
 
 using std::vector;
 using std::string;
+using std::map;
+using std::pair;
+using std::sort;
+using std::find;
 using std::istringstream;
 using std::ostringstream;
 using Configuration::PunctuationMap;
@@ -74,6 +80,24 @@ struct _IBusSgpyccEngine {
     bool lastInputIsChinese;
     int preRequestRetry;
 
+    // idle prefetch timer (glib source id, 0 if none) and requests sent since last key
+    guint prefetchTimer;
+    vector<string>* prefetchedRequests;
+
+    // last local preview, pinyins and converted characters
+    string *localPreviewPinyins, *localPreviewCharacters;
+
+    // updates posted by request threads, handled in main loop (PENDING_* bits)
+    volatile gint pendingUpdates;
+
+    // last rendered states, d-bus calls are skipped if nothing changes
+    // visibilities: -1 unknown, 0 hidden, 1 shown
+    // renderedPreedit is text, attributes and cursor, empty if unknown
+    string *renderedPreedit, *renderedAuxiliaryText;
+    int renderedPreeditVisible, renderedAuxiliaryTextVisible, renderedLookupTableVisible, renderedProperties;
+    // lookupTableVersion increases when candidates change
+    guint lookupTableVersion, renderedLookupTableVersion, renderedLookupTableCursor;
+
     // lua binding
     // now it is indeed global
     LuaBinding* luaBinding;
@@ -90,6 +114,9 @@ struct _IBusSgpyccEngine {
     // punc map (have states, should store here)
     // edit: use global, for punc_map may be updated
     PunctuationMap *punctuationMap;
+
+    // everything shown goes to output, which is ibusOutput unless headless
+    ImeEngine::EngineOutput *output, *ibusOutput;
 };
 
 struct _IBusSgpyccEngineClass {
@@ -98,18 +125,36 @@ struct _IBusSgpyccEngineClass {
 
 static IBusEngineClass *parentClass = NULL;
 
-// statistics (static vars, otherwise data may not enough)
-static int totalRequestCount = 0;
-static int totalFailedRequestCount = 0;
-static int totalPreRequestCount = 0;
-static int totalFailedPreRequestCount = 0;
-static double totalResponseTime = .0;
-static double maximumResponseTime = .0;
+// statistics, shared by all engines, created on first use
+struct EngineMetrics {
+    Metrics::Counter &requests, &failedRequests, &preRequests, &failedPreRequests;
+    Metrics::Counter &requestCacheHits, &requestCacheMisses;
+    // usec
+    Metrics::Histogram &keyEventTime, &preeditRenderTime, &responseTime;
+
+    EngineMetrics() :
+    requests(Metrics::getCounter("fetch.requests")),
+    failedRequests(Metrics::getCounter("fetch.failed_requests")),
+    preRequests(Metrics::getCounter("fetch.pre_requests")),
+    failedPreRequests(Metrics::getCounter("fetch.failed_pre_requests")),
+    requestCacheHits(Metrics::getCounter("cache.request.hit")),
+    requestCacheMisses(Metrics::getCounter("cache.request.miss")),
+    keyEventTime(Metrics::getHistogram("key_event_us")),
+    preeditRenderTime(Metrics::getHistogram("preedit_render_us")),
+    responseTime(Metrics::getHistogram("fetch_response_us")) {
+    }
+};
+
+static EngineMetrics& getEngineMetrics() {
+    static EngineMetrics metrics;
+    return metrics;
+}
 
 // init funcs
 static void engineClassInit(IBusSgpyccEngineClass *klass);
 static void engineInit(IBusSgpyccEngine *engine);
 static void engineDestroy(IBusSgpyccEngine *engine);
+static void engineFreeMembers(IBusSgpyccEngine *engine);
 
 // signals
 static gboolean engineProcessKeyEvent(IBusSgpyccEngine *engine, guint32 keyval, guint32 keycode, guint32 state);
@@ -127,6 +172,9 @@ static void engineCursorDown(IBusSgpyccEngine *engine);
 static void enginePropertyActive(IBusSgpyccEngine *engine, const gchar *prop_name, guint prop_state);
 
 static void engineUpdatePreedit(IBusSgpyccEngine *engine);
+// thread safe, ask main loop to update preedit or run preRequestCallback
+static void enginePostUpdatePreedit(IBusSgpyccEngine *engine);
+static void enginePostPreRequestCallback(IBusSgpyccEngine *engine);
 static void engineUpdateProperties(IBusSgpyccEngine * engine);
 static void engineUpdateAuxiliaryText(IBusSgpyccEngine * engine, string prefix = "");
 static void engineCommitText(IBusSgpyccEngine * engine, string content = "");
@@ -135,6 +183,12 @@ static void engineCommitText(IBusSgpyccEngine * engine, string content = "");
 inline static void engineClearLookupTable(IBusSgpyccEngine *engine);
 inline static void engineAppendLookupTable(IBusSgpyccEngine *engine, const string& candidate, int color = INVALID_COLOR);
 
+// diff-aware updates, only call ibus if different from last rendered
+static void engineInvalidateRendered(IBusSgpyccEngine *engine);
+static void engineShowLookupTable(IBusSgpyccEngine *engine);
+static void engineHideLookupTable(IBusSgpyccEngine *engine);
+static void engineHideAuxiliaryText(IBusSgpyccEngine *engine);
+
 // fetcher functions (callback by cloudClient)
 static string directFetcher(void* data, const string& requestString);
 static string externalFetcher(void* data, const string& requestString);
@@ -142,6 +196,22 @@ static string luaFetcher(void* voidData, const string & requestString);
 static string preFetcher(void* voidData, const string& requestString);
 static void preRequestCallback(IBusSgpyccEngine* engine);
 
+// idle prefetch
+static void engineSchedulePrefetch(IBusSgpyccEngine* engine);
+static gboolean enginePrefetchTimeout(gpointer data);
+static const vector<string> predictContinuations(IBusSgpyccEngine* engine, const string& pinyins);
+static string parseFetcherOutput(const string& output, vector<string>& words);
+static void storeFetcherOutput(const Configuration::Snapshot& settings, IBusSgpyccEngine* engine, const PinyinSequence& ps, const string& res, const vector<string>& words);
+static string fetchFromCloud(const Configuration::Snapshot& settings, IBusSgpyccEngine* engine, const string& backend, const string& requestString, const double timeout, const bool batchable = true);
+
+// result of a fetch stage, only FETCH_NOT_APPLICABLE lets caller try another stage
+enum FetchStatus {
+    FETCH_SUCCEEDED, FETCH_FAILED, FETCH_NOT_APPLICABLE
+};
+static FetchStatus fetchDeltaFromCloud(const Configuration::Snapshot& settings, IBusSgpyccEngine* engine, const string& backend, const string& requestString, const double timeout, string& res);
+static const double getRemainingTime(const long long deadline);
+static FetchStatus fetchSplitFromCloud(const Configuration::Snapshot& settings, IBusSgpyccEngine* engine, const string& backend, const string& requestString, const double timeout, string& res, bool& complete);
+
 // request cache
 static const string getRequestCache(IBusSgpyccEngine* engine, const string& requestString, const bool includeWeak = false);
 static void writeRequestCache(IBusSgpyccEngine* engine, const string& requsetSring, const string& content, const bool weak = false);
@@ -149,7 +219,8 @@ static void writeRequestCache(IBusSgpyccEngine* engine, const string& requsetSri
 // paritical convert (using cache)
 static const string getPartialCacheConvert(IBusSgpyccEngine* engine, const string& pinyins, string* remainingPinyins = NULL, const bool includeWeak = false, const size_t reservedPinyinCount = 0);
 static const vector<string> getPartialCacheConverts(IBusSgpyccEngine* engine, const string& pinyins);
-static const string getGreedyLocalCovert(IBusSgpyccEngine* engine, const string& pinyins);
+static const string getGreedyLocalCovert(const Configuration::Snapshot& settings, IBusSgpyccEngine* engine, const string& pinyins);
+static const string getLocalPreview(IBusSgpyccEngine* engine, const string& pinyins, string* pRemainingPinyins, const size_t reservedPinyinCount = 0);
 static const vector<string> queryCloudMemoryDatabase(const string& pinyins);
 
 inline void ibus_object_unref(gpointer object) {
@@ -158,6 +229,59 @@ inline void ibus_object_unref(gpointer object) {
 #endif
 }
 
+/**
+ * output of engines created by ibus, owned by engine
+ */
+class IBusEngineOutput : public ImeEngine::EngineOutput {
+public:
+
+    IBusEngineOutput(IBusEngine* engine) {
+        this->engine = engine;
+    }
+
+    virtual void commitText(const string& text) {
+        IBusText *commitText = ibus_text_new_from_string(text.c_str());
+        if (commitText) {
+            ibus_engine_commit_text(engine, commitText);
+            ibus_object_unref(commitText);
+        } else {
+            fprintf(stderr, "[ERROR] can not create commitText.\n");
+        }
+    }
+
+    virtual void updatePreedit(const string& text, IBusAttrList* attributes, const unsigned int cursor, const bool visible) {
+        IBusText *preeditText = ibus_text_new_from_string(text.c_str());
+        // text releases attributes with itself, caller keeps its own reference
+        preeditText->attrs = (IBusAttrList*) g_object_ref(attributes);
+        ibus_engine_update_preedit_text(engine, preeditText, cursor, visible ? TRUE : FALSE);
+        ibus_object_unref(preeditText);
+    }
+
+    virtual void updateLookupTable(IBusLookupTable* table, const vector<string>& candidates, const bool visible) {
+        UNUSED(candidates);
+        if (visible) ibus_engine_update_lookup_table(engine, table, TRUE);
+        else ibus_engine_hide_lookup_table(engine);
+    }
+
+    virtual void updateAuxiliaryText(const string& text, const bool visible) {
+        if (!visible) {
+            ibus_engine_hide_auxiliary_text(engine);
+            return;
+        }
+        IBusText* auxiliaryText = ibus_text_new_from_string(text.c_str());
+        ibus_engine_update_auxiliary_text(engine, auxiliaryText, TRUE);
+        ibus_object_unref(auxiliaryText);
+    }
+
+    virtual void updateProperties(IBusPropList* properties) {
+        ibus_engine_register_properties(engine, properties);
+    }
+private:
+    IBusEngineOutput(const IBusEngineOutput& orig);
+
+    IBusEngine* engine;
+};
+
 // entry function, indeed
 
 GType ibusSgpyccEngineGetType(void) {
@@ -215,17 +339,18 @@ static void engineClassInit(IBusSgpyccEngineClass *klass) {
 
 static void engineCommitAll(IBusSgpyccEngine *engine) {
     string requestsResult;
+    Configuration::Snapshot settings = *Configuration::SnapshotReader();
     std::vector<PinyinCloudRequest> requests = engine->cloudClient->exportAndRemoveAllRequest();
     for (std::vector<PinyinCloudRequest>::iterator it = requests.begin(); it != requests.end(); ++it) {
         if (it->responsed && !it->responseString.empty()) {
             requestsResult += it->responseString;
         } else {
-            requestsResult += getGreedyLocalCovert(engine, it->requestString);
+            requestsResult += getGreedyLocalCovert(settings, engine, it->requestString);
         }
     }
     // convert preedit as well
     if (!engine->activePreedit->empty()) {
-        engine->cloudClient->request(*engine->activePreedit, externalFetcher, (void*) engine, (ResponseCallbackFunc) engineUpdatePreedit, (void*) engine);
+        engine->cloudClient->request(*engine->activePreedit, externalFetcher, (void*) engine, (ResponseCallbackFunc) enginePostUpdatePreedit, (void*) engine);
         *engine->preedit = "";
         *engine->activePreedit = "";
     }
@@ -273,7 +398,17 @@ static void engineInit(IBusSgpyccEngine *engine) {
     engine->lastKeyval = 0;
     engine->lastInputIsChinese = false;
     engine->preRequestRetry = Configuration::preRequestRetry;
-
+    engine->prefetchTimer = 0;
+    engine->prefetchedRequests = new vector<string>();
+    engine->localPreviewPinyins = new string();
+    engine->localPreviewCharacters = new string();
+    engine->pendingUpdates = 0;
+    engine->renderedPreedit = new string();
+    engine->renderedAuxiliaryText = new string();
+    engine->lookupTableVersion = 0;
+    engineInvalidateRendered(engine);
+    engine->ibusOutput = new IBusEngineOutput((IBusEngine*) engine);
+    engine->output = engine->ibusOutput;
 
     // lookup table
     engine->candicateCount = 0;
@@ -326,8 +461,20 @@ static void engineInit(IBusSgpyccEngine *engine) {
 }
 
 static void engineDestroy(IBusSgpyccEngine *engine) {
-#define DELETE_G_OBJECT(x) if(x != NULL) g_object_unref(x), x = NULL;
     DEBUG_PRINT(1, "[ENGINE] Destroy\n");
+    engineFreeMembers(engine);
+    IBUS_OBJECT_CLASS(parentClass)->destroy((IBusObject *) engine);
+}
+
+static void engineFreeMembers(IBusSgpyccEngine *engine) {
+#define DELETE_G_OBJECT(x) if(x != NULL) g_object_unref(x), x = NULL;
+    // request threads use engine and its client until they return,
+    // fetches give up after their timeouts. callbacks only post idles
+    while (ImeEngine::getRunningFetchCount(engine) > 0) usleep(1000);
+
+    if (engine->prefetchTimer) g_source_remove(engine->prefetchTimer);
+    // one idle per source removed
+    while (g_idle_remove_by_data((gpointer) engine));
     pthread_mutex_destroy(&engine->processKeyMutex);
     pthread_mutex_destroy(&engine->commitMutex);
     pthread_mutex_destroy(&engine->updatePreeditMutex);
@@ -341,6 +488,12 @@ static void engineDestroy(IBusSgpyccEngine *engine) {
     delete engine->correctings;
     delete engine->lastActivePreedit;
     delete engine->lastPreRequestString;
+    delete engine->prefetchedRequests;
+    delete engine->localPreviewPinyins;
+    delete engine->localPreviewCharacters;
+    delete engine->renderedPreedit;
+    delete engine->renderedAuxiliaryText;
+    delete engine->ibusOutput;
 
     // delete other things
     // delete engine->punctuationMap; // now global
@@ -352,7 +505,6 @@ static void engineDestroy(IBusSgpyccEngine *engine) {
     DELETE_G_OBJECT(engine->requestingProp);
     DELETE_G_OBJECT(engine->extensionMenuProp);
 #undef DELETE_G_OBJECT
-    IBUS_OBJECT_CLASS(parentClass)->destroy((IBusObject *) engine);
 }
 
 // ibus_lookup_table_get_number_of_candidates() is not available in ibus-1.2.0.20090927, provided by ubuntu 9.10
@@ -370,15 +522,69 @@ inline static void engineAppendLookupTable(IBusSgpyccEngine *engine, const strin
     ibus_object_unref(candidateText);
 
     engine->candicateCount++;
+    engine->lookupTableVersion++;
 }
 
 inline static void engineClearLookupTable(IBusSgpyccEngine *engine) {
     ibus_lookup_table_clear(engine->table);
     engine->candicateCount = 0;
+    engine->lookupTableVersion++;
+}
+
+static const vector<string> getLookupTableCandidates(IBusSgpyccEngine *engine) {
+    vector<string> candidates;
+    for (int i = 0; i < engine->candicateCount; ++i) {
+        IBusText* text = ibus_lookup_table_get_candidate(engine->table, i);
+        candidates.push_back(text && text->text ? text->text : "");
+    }
+    return candidates;
+}
+
+static void engineInvalidateRendered(IBusSgpyccEngine *engine) {
+    engine->renderedPreedit->clear();
+    engine->renderedAuxiliaryText->clear();
+    engine->renderedPreeditVisible = -1;
+    engine->renderedAuxiliaryTextVisible = -1;
+    engine->renderedLookupTableVisible = -1;
+    engine->renderedProperties = -1;
+    engine->renderedLookupTableVersion = engine->lookupTableVersion - 1;
+    engine->renderedLookupTableCursor = 0;
+}
+
+static void engineShowLookupTable(IBusSgpyccEngine *engine) {
+    guint cursor = ibus_lookup_table_get_cursor_pos(engine->table);
+    if (engine->renderedLookupTableVisible == 1 && engine->renderedLookupTableVersion == engine->lookupTableVersion
+            && engine->renderedLookupTableCursor == cursor) return;
+    engine->output->updateLookupTable(engine->table, getLookupTableCandidates(engine), true);
+    engine->renderedLookupTableVisible = 1;
+    engine->renderedLookupTableVersion = engine->lookupTableVersion;
+    engine->renderedLookupTableCursor = cursor;
+}
+
+static void engineHideLookupTable(IBusSgpyccEngine *engine) {
+    if (engine->renderedLookupTableVisible == 0) return;
+    engine->output->updateLookupTable(engine->table, getLookupTableCandidates(engine), false);
+    engine->renderedLookupTableVisible = 0;
+}
+
+static void engineHideAuxiliaryText(IBusSgpyccEngine *engine) {
+    if (engine->renderedAuxiliaryTextVisible == 0) return;
+    engine->output->updateAuxiliaryText(*engine->renderedAuxiliaryText, false);
+    engine->renderedAuxiliaryTextVisible = 0;
+}
+
+static const string getAttributesSignature(IBusAttrList *attrList) {
+    ostringstream signature;
+    for (guint i = 0; i < attrList->attributes->len; ++i) {
+        IBusAttribute *attr = g_array_index(attrList->attributes, IBusAttribute*, i);
+        signature << attr->type << ':' << attr->value << ':' << attr->start_index << ':' << attr->end_index << ';';
+    }
+    return signature.str();
 }
 
 static gboolean engineProcessKeyEvent(IBusSgpyccEngine *engine, guint32 keyval, guint32 keycode, guint32 state) {
     DEBUG_PRINT(1, "[ENGINE] ProcessKeyEvent(%d, %d, 0x%x)\n", keyval, keycode, state);
+    Tracer::Span span("engineProcessKeyEvent", &getEngineMetrics().keyEventTime);
 
 #define USING_MASKS (IBUS_SHIFT_MASK | IBUS_LOCK_MASK | IBUS_CONTROL_MASK | IBUS_MOD1_MASK | IBUS_MOD4_MASK | IBUS_MOD5_MASK | IBUS_SUPER_MASK | IBUS_HYPER_MASK | IBUS_RELEASE_MASK | IBUS_META_MASK)
     // check extension hot key first
@@ -387,6 +593,12 @@ static gboolean engineProcessKeyEvent(IBusSgpyccEngine *engine, guint32 keyval,
         return TRUE;
     }
 
+    // user is typing, prefetch later
+    if ((state & IBUS_RELEASE_MASK) == 0) engineSchedulePrefetch(engine);
+
+    // settings shared with request threads, same ones for whole key event
+    Configuration::Snapshot settings = *Configuration::SnapshotReader();
+
     // pthread_mutex_lock(&engine->processKeyMutex);
     gboolean res = FALSE;
 engineProcessKeyEventStart:
@@ -409,7 +621,7 @@ engineProcessKeyEventStart:
             // not found, submit 'pinyin' (it is indeed not a valid pinyin)
             engine->correctings->removeAt(0);
             if (!isChineseCharacter && !engine->correctings->empty()) pinyin += " ";
-            engine->cloudClient->request(pinyin, directFetcher, (void*) engine, (ResponseCallbackFunc) engineUpdatePreedit, (void*) engine);
+            engine->cloudClient->request(pinyin, directFetcher, (void*) engine, (ResponseCallbackFunc) enginePostUpdatePreedit, (void*) engine);
             engine->lastInputIsChinese = true;
         }
     }
@@ -432,7 +644,7 @@ engineProcessKeyEventStart:
             goto engineProcessKeyEventStart;
         } else if (keyval == IBUS_Escape) {
             // cancel correcting, submit all remaining
-            engine->cloudClient->request(engine->correctings->toString(), directFetcher, (void*) engine, (ResponseCallbackFunc) engineUpdatePreedit, (void*) engine);
+            engine->cloudClient->request(engine->correctings->toString(), directFetcher, (void*) engine, (ResponseCallbackFunc) enginePostUpdatePreedit, (void*) engine);
             engine->correctings->clear();
             engine->commitedConvertingCharacters->clear();
             engine->commitedConvertingPinyins->clear();
@@ -469,7 +681,7 @@ engineProcessKeyEventStart:
                     // user select a phrase, commit it
                     int length = g_utf8_strlen(candidate->text, -1);
                     // use cloud client commit, do not direct commit !
-                    engine->cloudClient->request(candidate->text, directFetcher, (void*) engine, (ResponseCallbackFunc) engineUpdatePreedit, (void*) engine);
+                    engine->cloudClient->request(candidate->text, directFetcher, (void*) engine, (ResponseCallbackFunc) enginePostUpdatePreedit, (void*) engine);
                     engine->lastInputIsChinese = true;
                     // remove pinyin section from commitingPinyins
                     for (int i = 0; i < length; ++i) {
@@ -495,7 +707,7 @@ engineProcessKeyEventStart:
             engineClearLookupTable(engine);
 
             // default: use external dict / cloud results if possible
-            string dbOrder = Configuration::dbOrder;
+            string dbOrder = settings.dbOrder;
 
             // construct cand items
             set<string> candidateSet;
@@ -575,7 +787,7 @@ engineProcessKeyEventStart:
                             for (size_t i = 0;; i++) {
                                 string pinyins = PinyinUtility::charactersToPinyins(characters, i, false);
                                 if (pinyins.empty()) break;
-                                it->second->query(pinyins, cl, Configuration::dbResultLimit, Configuration::dbLongPhraseAdjust, Configuration::dbLengthLimit);
+                                it->second->query(pinyins, cl, settings.dbResultLimit, settings.dbLongPhraseAdjust, settings.dbLengthLimit);
                             }
                         }
                         for (CandidateList::iterator it = cl.begin(); it != cl.end(); ++it) {
@@ -598,7 +810,7 @@ engineProcessKeyEventStart:
 
             res = TRUE;
         }
-        ibus_engine_update_lookup_table((IBusEngine*) engine, engine->table, TRUE);
+        engineShowLookupTable(engine);
     } else {
         // not in correction mode :p
 
@@ -606,7 +818,7 @@ engineProcessKeyEventStart:
         if (!engine->commitedConvertingCharacters->empty()) {
             // rtrim, assuming string::npos + 1 == 0
             engine->commitedConvertingCharacters->erase(engine->commitedConvertingCharacters->find_last_not_of(" \n\r\t") + 1);
-            if (!engine->commitedConvertingCharacters->empty() && Configuration::writeRequestCache) {
+            if (!engine->commitedConvertingCharacters->empty() && settings.writeRequestCache) {
                 writeRequestCache(engine, *engine->commitedConvertingPinyins, *engine->commitedConvertingCharacters);
             }
             XUtility::setSelectionUpdatedTime();
@@ -615,17 +827,15 @@ engineProcessKeyEventStart:
         }
 
         // hide lookup table
-        ibus_engine_hide_lookup_table((IBusEngine*) engine);
-        ibus_engine_hide_auxiliary_text((IBusEngine*) engine);
+        engineHideLookupTable(engine);
+        engineHideAuxiliaryText(engine);
 
         while (res == FALSE) { // use while here to make 'break' available, orig use (if)
             // ignore some masks (Issue 8, Comment #11)
             state = state & USING_MASKS;
 
             // check force comit all key
-            engine->cloudClient->readLock();
             int requestCount = engine->cloudClient->getRequestCount();
-            engine->cloudClient->unlock();
 
             // normally do not handle release event, but watch for eng mode toggling
             if ((state & IBUS_RELEASE_MASK) == IBUS_RELEASE_MASK && engine->lastKeyval == keyval) {
@@ -669,7 +879,7 @@ engineProcessKeyEventStart:
 
             if (!engine->preedit->empty() && Configuration::commitRawPreeditKey.match(keyval)) {
                 // raw commit preedit
-                engine->cloudClient->request(*(engine->preedit), directFetcher, (void*) engine, (ResponseCallbackFunc) engineUpdatePreedit, (void*) engine);
+                engine->cloudClient->request(*(engine->preedit), directFetcher, (void*) engine, (ResponseCallbackFunc) enginePostUpdatePreedit, (void*) engine);
                 *(engine->preedit) = "";
                 *(engine->activePreedit) = "";
                 engine->lastInputIsChinese = false;
@@ -703,7 +913,7 @@ engineProcessKeyEventStart:
                         *engine->preedit = "";
                         *engine->correctings = *engine->activePreedit;
                         *engine->lastPreRequestString = *engine->activePreedit;
-                        PinyinCloudClient::preRequest(*engine->lastPreRequestString, preFetcher, (void*) engine, (ResponseCallbackFunc) preRequestCallback, (void*) engine);
+                        PinyinCloudClient::preRequest(*engine->lastPreRequestString, preFetcher, (void*) engine, (ResponseCallbackFunc) enginePostPreRequestCallback, (void*) engine);
                         *engine->activePreedit = "";
                         // clear candidates, prepare for new candidates
                         engineClearLookupTable(engine);
@@ -810,10 +1020,10 @@ engineProcessKeyEventStart:
                         if (engine->preedit->length() > 0) {
                             engine->requesting = true;
                             engineUpdateProperties(engine);
-                            engine->cloudClient->request(*engine->activePreedit, externalFetcher, (void*) engine, (ResponseCallbackFunc) engineUpdatePreedit, (void*) engine);
+                            engine->cloudClient->request(*engine->activePreedit, externalFetcher, (void*) engine, (ResponseCallbackFunc) enginePostUpdatePreedit, (void*) engine);
                             *engine->preedit = "";
                         }
-                        engine->cloudClient->request(punctuation, directFetcher, (void*) engine, (ResponseCallbackFunc) engineUpdatePreedit, (void*) engine);
+                        engine->cloudClient->request(punctuation, directFetcher, (void*) engine, (ResponseCallbackFunc) enginePostUpdatePreedit, (void*) engine);
                         handled = true;
                     }
                 }
@@ -823,7 +1033,7 @@ engineProcessKeyEventStart:
                 if (fallbackToEng) {
                     engine->engMode = true;
                     engineUpdateProperties(engine);
-                    engine->cloudClient->request(*engine->preedit, directFetcher, (void*) engine, (ResponseCallbackFunc) engineUpdatePreedit, (void*) engine);
+                    engine->cloudClient->request(*engine->preedit, directFetcher, (void*) engine, (ResponseCallbackFunc) enginePostUpdatePreedit, (void*) engine);
                     *engine->activePreedit = "";
                 } else if (Configuration::useDoublePinyin && fallbackToFullPinyin == false) {
                     *engine->activePreedit = DoublePinyinScheme::getDefaultDoublePinyinScheme().query(*engine->preedit);
@@ -843,7 +1053,7 @@ engineProcessKeyEventStart:
 
                         *engine->lastPreRequestString = preRequestString;
                         engine->preRequestRetry = Configuration::preRequestRetry;
-                        PinyinCloudClient::preRequest(preRequestString, preFetcher, (void*) engine, (ResponseCallbackFunc) preRequestCallback, (void*) engine);
+                        PinyinCloudClient::preRequest(preRequestString, preFetcher, (void*) engine, (ResponseCallbackFunc) enginePostPreRequestCallback, (void*) engine);
                         engineUpdateProperties(engine);
                     }
                     // now inputing chineses
@@ -860,11 +1070,11 @@ engineProcessKeyEventStart:
                 if (engine->preedit->length() > 0) {
                     engine->requesting = true;
                     engineUpdateProperties(engine);
-                    engine->cloudClient->request(*engine->activePreedit, externalFetcher, (void*) engine, (ResponseCallbackFunc) engineUpdatePreedit, (void*) engine);
+                    engine->cloudClient->request(*engine->activePreedit, externalFetcher, (void*) engine, (ResponseCallbackFunc) enginePostUpdatePreedit, (void*) engine);
                     *engine->preedit = "";
                     *engine->activePreedit = "";
                 }
-                engine->cloudClient->request(keychrs, directFetcher, (void*) engine, (ResponseCallbackFunc) engineUpdatePreedit, (void*) engine);
+                engine->cloudClient->request(keychrs, directFetcher, (void*) engine, (ResponseCallbackFunc) enginePostUpdatePreedit, (void*) engine);
                 if (keychr != 0 && keychr < 127 && isalnum(keychr)) engine->lastInputIsChinese = false;
 
                 res = TRUE;
@@ -890,21 +1100,30 @@ static void enginePropertyActive(IBusSgpyccEngine *engine, const gchar *propName
     } else if (strcmp(propName, "requestingIndicator") == 0) {
         // show avg response time ... info
         ostringstream statisticsBuffer;
-        if (totalRequestCount + totalPreRequestCount == 0) {
+        EngineMetrics& metrics = getEngineMetrics();
+        long long requestCount = metrics.requests.get(), preRequestCount = metrics.preRequests.get();
+        if (requestCount + preRequestCount == 0) {
             statisticsBuffer << "现在还没有数据\n";
         } else {
-            statisticsBuffer << "已发送请求: " << totalRequestCount << " 个\n失败的请求: " << totalFailedRequestCount << " 个\n";
-            statisticsBuffer << "已发送预请求: " << totalPreRequestCount << " 个\n失败的预请求: " << totalFailedPreRequestCount << " 个\n";
-            if (totalRequestCount + totalPreRequestCount - totalFailedRequestCount - totalFailedRequestCount > 0) {
+            statisticsBuffer << "已发送请求: " << requestCount << " 个\n失败的请求: " << metrics.failedRequests.get() << " 个\n";
+            statisticsBuffer << "已发送预请求: " << preRequestCount << " 个\n失败的预请求: " << metrics.failedPreRequests.get() << " 个\n";
+            long long responseCount = metrics.responseTime.getCount();
+            if (responseCount > 0) {
+                statisticsBuffer << std::fixed << std::setprecision(3);
+                statisticsBuffer << "成功请求的平均响应时间: " << (double) metrics.responseTime.getSum() / responseCount / XUtility::MICROSECOND_PER_SECOND
+                        << " 秒\n最慢响应时间: " << (double) metrics.responseTime.getMax() / XUtility::MICROSECOND_PER_SECOND << " 秒\n";
+            }
+            LatencyHistogram& histogram = LatencyHistogram::getHistogram(Configuration::SnapshotReader()->fetcherPath);
+            if (histogram.getSampleCount() > 0) {
                 statisticsBuffer << std::fixed << std::setprecision(3);
-                statisticsBuffer << "成功请求的平均响应时间: " << totalResponseTime / (totalRequestCount + totalPreRequestCount - totalFailedRequestCount - totalFailedRequestCount) << " 秒\n最慢响应时间: " << maximumResponseTime << " 秒\n";
+                statisticsBuffer << "近期响应时间 (p50 / p90 / p99): " << histogram.getPercentile(0.5) << " / " << histogram.getPercentile(0.9) << " / " << histogram.getPercentile(0.99) << " 秒\n";
             }
         }
         if (Configuration::showNotification) {
             XUtility::showNotify("统计数据", statisticsBuffer.str().c_str());
         } else {
-            engine->cloudClient->request("\n==== 统计数据 ====\n", directFetcher, (void*) engine, (ResponseCallbackFunc) engineUpdatePreedit, (void*) engine);
-            engine->cloudClient->request(statisticsBuffer.str().c_str(), directFetcher, (void*) engine, (ResponseCallbackFunc) engineUpdatePreedit, (void*) engine);
+            engine->cloudClient->request("\n==== 统计数据 ====\n", directFetcher, (void*) engine, (ResponseCallbackFunc) enginePostUpdatePreedit, (void*) engine);
+            engine->cloudClient->request(statisticsBuffer.str().c_str(), directFetcher, (void*) engine, (ResponseCallbackFunc) enginePostUpdatePreedit, (void*) engine);
         }
     } else if (propName[0] == '.') {
         // extension action
@@ -928,13 +1147,21 @@ static void engineUpdateProperties(IBusSgpyccEngine * engine) {
     ibus_property_set_sensitive(engine->requestingProp, engine->enabled);
     ibus_property_set_sensitive(engine->extensionMenuProp, engine->enabled && (Configuration::activeEngine != NULL));
 
-    ibus_engine_register_properties((IBusEngine*) engine, engine->propList);
+    // skip if all states above are same as last time
+    int properties = (engine->engMode ? 1 : 0) | ((engine->requesting || PinyinCloudClient::preRequestBusy) ? 2 : 0)
+            | (engine->enabled ? 4 : 0) | ((Configuration::activeEngine != NULL) ? 8 : 0);
+    if (properties == engine->renderedProperties) return;
+    engine->renderedProperties = properties;
+
+    engine->output->updateProperties(engine->propList);
 }
 
 static void engineFocusIn(IBusSgpyccEngine* engine) {
     DEBUG_PRINT(2, "[ENGINE] Event: FocusIn\n");
     engine->hasFocus = true;
     Configuration::activeEngine = (typeof (Configuration::activeEngine))engine;
+    // client may have changed, render everything again
+    engineInvalidateRendered(engine);
     engineUpdateProperties(engine);
     engineUpdatePreedit(engine);
 }
@@ -943,6 +1170,7 @@ static void engineFocusOut(IBusSgpyccEngine * engine) {
     DEBUG_PRINT(2, "[ENGINE] Event: FocusOut\n");
     engineCommitAll(engine);
     engine->hasFocus = false;
+    if (engine->prefetchTimer) g_source_remove(engine->prefetchTimer), engine->prefetchTimer = 0;
     Configuration::activeEngine = NULL;
 }
 
@@ -991,16 +1219,17 @@ static void engineUpdateAuxiliaryText(IBusSgpyccEngine * engine, string prefix)
     ostringstream auxiliaryText;
     guint pageCount = (engine->candicateCount + ibus_lookup_table_get_page_size(engine->table) - 1) / ibus_lookup_table_get_page_size(engine->table);
     auxiliaryText << prefix << "  " << engine->tablePageNumber + 1 << " / " << pageCount;
-    IBusText* text = ibus_text_new_from_string(auxiliaryText.str().c_str());
-    ibus_engine_update_auxiliary_text((IBusEngine*) engine, text, TRUE);
-    ibus_object_unref(text);
+    if (engine->renderedAuxiliaryTextVisible == 1 && *engine->renderedAuxiliaryText == auxiliaryText.str()) return;
+    engine->output->updateAuxiliaryText(auxiliaryText.str(), true);
+    *engine->renderedAuxiliaryText = auxiliaryText.str();
+    engine->renderedAuxiliaryTextVisible = 1;
 }
 
 static void enginePageUp(IBusSgpyccEngine * engine) {
     DEBUG_PRINT(2, "[ENGINE] PageUp\n");
     if (!engine->correctings->empty()) {
         if (ibus_lookup_table_page_up(engine->table)) engine->tablePageNumber--;
-        ibus_engine_update_lookup_table((IBusEngine*) engine, engine->table, TRUE);
+        engineShowLookupTable(engine);
         engineUpdateAuxiliaryText(engine, (*engine->correctings)[0]);
     }
 }
@@ -1009,7 +1238,7 @@ static void enginePageDown(IBusSgpyccEngine * engine) {
     DEBUG_PRINT(2, "[ENGINE] PageDown\n");
     if (!engine->correctings->empty()) {
         if (ibus_lookup_table_page_down(engine->table)) engine->tablePageNumber++;
-        ibus_engine_update_lookup_table((IBusEngine*) engine, engine->table, TRUE);
+        engineShowLookupTable(engine);
         engineUpdateAuxiliaryText(engine, (*engine->correctings)[0]);
     }
 }
@@ -1018,7 +1247,7 @@ static void engineCursorUp(IBusSgpyccEngine * engine) {
     DEBUG_PRINT(2, "[ENGINE] Event: CursorUp\n");
     if (!engine->correctings->empty()) {
         ibus_lookup_table_cursor_up(engine->table);
-        ibus_engine_update_lookup_table((IBusEngine*) engine, engine->table, TRUE);
+        engineShowLookupTable(engine);
     }
 }
 
@@ -1026,19 +1255,13 @@ static void engineCursorDown(IBusSgpyccEngine * engine) {
     DEBUG_PRINT(2, "[ENGINE] Event: CursorDown\n");
     if (!engine->correctings->empty()) {
         ibus_lookup_table_cursor_down(engine->table);
-        ibus_engine_update_lookup_table((IBusEngine*) engine, engine->table, TRUE);
+        engineShowLookupTable(engine);
     }
 }
 
 static void engineCommitText(IBusSgpyccEngine * engine, string content) {
     pthread_mutex_lock(&engine->commitMutex);
-    IBusText *commitText = ibus_text_new_from_string(content.c_str());
-    if (commitText) {
-        ibus_engine_commit_text((IBusEngine *) engine, commitText);
-        ibus_object_unref(commitText);
-    } else {
-        fprintf(stderr, "[ERROR] can not create commitText.\n");
-    }
+    engine->output->commitText(content);
     pthread_mutex_unlock(&engine->commitMutex);
 }
 
@@ -1060,8 +1283,8 @@ static const vector<string> getPartialCacheConverts(IBusSgpyccEngine* engine, co
     return r;
 }
 
+// callers check showCachedInPreedit, main loop reads global, request threads their snapshot
 static const string getPartialCacheConvert(IBusSgpyccEngine* engine, const string& pinyins, string* pRemainingPinyins, const bool includeWeak, const size_t reservedPinyinCount) {
-    if (Configuration::showCachedInPreedit == false) return pinyins;
     // check pre request result
     PinyinSequence ps = pinyins;
     for (size_t i = ps.size() - reservedPinyinCount; i > 0; i--) {
@@ -1089,16 +1312,46 @@ static const string getPartialCacheConvert(IBusSgpyccEngine* engine, const strin
     }
 }
 
-static const string getGreedyLocalCovert(IBusSgpyccEngine* engine, const string& pinyins) {
-    string remainingPinyins, partialConvertedCharacters;
-    partialConvertedCharacters = getPartialCacheConvert(engine, pinyins, &remainingPinyins);
+static const string getGreedyLocalCovert(const Configuration::Snapshot& settings, IBusSgpyccEngine* engine, const string& pinyins) {
+    UNUSED(engine);
     if (PinyinDatabase::getPinyinDatabases().size() > 0)
         return PinyinDatabase::getPinyinDatabases().begin()->second->
-            greedyConvert(pinyins, Configuration::dbCompleteLongPhraseAdjust);
+            greedyConvert(pinyins, settings.dbCompleteLongPhraseAdjust);
     else
         return pinyins;
 }
 
+static const string getLocalPreview(IBusSgpyccEngine* engine, const string& pinyins, string* pRemainingPinyins, const size_t reservedPinyinCount) {
+    *pRemainingPinyins = pinyins;
+    if (PinyinDatabase::getPinyinDatabases().size() == 0) return "";
+
+    // only complete pinyins, last reservedPinyinCount ones are left
+    PinyinSequence ps = pinyins;
+    size_t convertCount = ps.size() > reservedPinyinCount ? ps.size() - reservedPinyinCount : 0;
+    if (convertCount > 0 && !PinyinUtility::isValidPinyin(ps[convertCount - 1])) convertCount--;
+    if (convertCount == 0) return "";
+
+    string convertPinyins = ps.toString(0, convertCount);
+    *pRemainingPinyins = ps.toString(convertCount, 0);
+
+    // called once or more per key, remember last one
+    string r;
+    // no snapshot reader held across db query
+    double longPhraseAdjust = Configuration::SnapshotReader()->dbCompleteLongPhraseAdjust;
+    pthread_mutex_lock(&engine->updatePreeditMutex);
+    if (*engine->localPreviewPinyins == convertPinyins) {
+        r = *engine->localPreviewCharacters;
+    } else {
+        r = PinyinDatabase::getPinyinDatabases().begin()->second->greedyConvert(convertPinyins, longPhraseAdjust);
+        *engine->localPreviewPinyins = convertPinyins;
+        *engine->localPreviewCharacters = r;
+    }
+    pthread_mutex_unlock(&engine->updatePreeditMutex);
+
+    if (r.empty()) *pRemainingPinyins = pinyins;
+    return r;
+}
+
 static const vector<string> queryCloudMemoryDatabase(const string& pinyins) {
     vector<string> r;
     PinyinSequence ps = pinyins;
@@ -1113,10 +1366,12 @@ static const vector<string> queryCloudMemoryDatabase(const string& pinyins) {
 static void engineUpdatePreedit(IBusSgpyccEngine * engine) {
     // this function need a mutex lock, it will pop first several finished requests from cloudClient
     DEBUG_PRINT(1, "[ENGINE] Event: Update Preedit\n");
+    Tracer::Span span("engineUpdatePreedit", &getEngineMetrics().preeditRenderTime);
     // pthread_mutex_lock(&engine->updatePreeditMutex);
 
-    engine->cloudClient->readLock();
-    size_t requestCount = engine->cloudClient->getRequestCount();
+    // render a snapshot, do not hold the lock during d-bus calls
+    vector<PinyinCloudRequest> requests = engine->cloudClient->getRequestsSnapshot();
+    size_t requestCount = requests.size();
 
     // contains entire preedit text
     string preedit;
@@ -1136,7 +1391,7 @@ static void engineUpdatePreedit(IBusSgpyccEngine * engine) {
 #endif
     for (size_t i = 0; i < requestCount; ++i) {
         size_t currReqLen;
-        const PinyinCloudRequest& request = engine->cloudClient->getRequest(i);
+        const PinyinCloudRequest& request = requests[i];
         if (!request.responsed) canCommitToClient = false;
 
         if (canCommitToClient) {
@@ -1171,7 +1426,7 @@ static void engineUpdatePreedit(IBusSgpyccEngine * engine) {
 
     // append current preedit (not belong to a request, still editable, active)
     string activePreedit = *engine->activePreedit;
-    string remainingPinyins;
+    string remainingPinyins, localPreview;
     bool isLocalDatabaseResult = false;
     if (!engine->correctings->empty()) {
         // only show convertingPinyins as activePreedit
@@ -1184,12 +1439,16 @@ static void engineUpdatePreedit(IBusSgpyccEngine * engine) {
         } else {
             activePreedit = getPartialCacheConvert(engine, activePreedit, &remainingPinyins, false, Configuration::preeditReservedPinyinCount);
         }
+        // pinyins not in cache, show local database result until cloud one arrives
+        if (Configuration::localPreview && !remainingPinyins.empty()) {
+            localPreview = getLocalPreview(engine, remainingPinyins, &remainingPinyins, Configuration::preeditReservedPinyinCount);
+        }
     } else {
         remainingPinyins = activePreedit;
         activePreedit = "";
     }
-    if (!remainingPinyins.empty() && !activePreedit.empty()) remainingPinyins = string(" ") + remainingPinyins;
-    preedit += activePreedit + remainingPinyins;
+    if (!remainingPinyins.empty() && !(activePreedit + localPreview).empty()) remainingPinyins = string(" ") + remainingPinyins;
+    preedit += activePreedit + localPreview + remainingPinyins;
 
     // create IBusText-type preeditText
     size_t preeditFullLen = g_utf8_strlen(preedit.c_str(), -1);
@@ -1203,19 +1462,26 @@ static void engineUpdatePreedit(IBusSgpyccEngine * engine) {
         if (Configuration::correctingBackColor != INVALID_COLOR) ibus_attr_list_append(textAttrList, ibus_attr_background_new(Configuration::correctingBackColor, preeditLen, preeditFullLen));
         if (Configuration::correctingForeColor != INVALID_COLOR) ibus_attr_list_append(textAttrList, ibus_attr_foreground_new(Configuration::correctingForeColor, preeditLen, preeditFullLen));
     } else {
-        // (partial converted) + remainingPinyins
+        // (partial converted) + (local preview) + remainingPinyins
         size_t remainingPinyinsLen = g_utf8_strlen(remainingPinyins.c_str(), -1);
-        if (preeditLen < preeditFullLen - remainingPinyinsLen) {
+        size_t localPreviewLen = g_utf8_strlen(localPreview.c_str(), -1);
+        size_t localPreviewStart = preeditFullLen - remainingPinyinsLen - localPreviewLen;
+        if (preeditLen < localPreviewStart) {
             if (Configuration::preRequestFallback && isLocalDatabaseResult) {
                 // local database result
-                if (Configuration::localDbBackColor != INVALID_COLOR) ibus_attr_list_append(textAttrList, ibus_attr_background_new(Configuration::localDbBackColor, preeditLen, preeditFullLen - remainingPinyinsLen));
-                if (Configuration::localDbForeColor != INVALID_COLOR) ibus_attr_list_append(textAttrList, ibus_attr_foreground_new(Configuration::localDbForeColor, preeditLen, preeditFullLen - remainingPinyinsLen));
+                if (Configuration::localDbBackColor != INVALID_COLOR) ibus_attr_list_append(textAttrList, ibus_attr_background_new(Configuration::localDbBackColor, preeditLen, localPreviewStart));
+                if (Configuration::localDbForeColor != INVALID_COLOR) ibus_attr_list_append(textAttrList, ibus_attr_foreground_new(Configuration::localDbForeColor, preeditLen, localPreviewStart));
             } else {
                 // cloud cache result
-                if (Configuration::cloudCacheBackColor != INVALID_COLOR) ibus_attr_list_append(textAttrList, ibus_attr_background_new(Configuration::cloudCacheBackColor, preeditLen, preeditFullLen - remainingPinyinsLen));
-                if (Configuration::cloudCacheForeColor != INVALID_COLOR) ibus_attr_list_append(textAttrList, ibus_attr_foreground_new(Configuration::cloudCacheForeColor, preeditLen, preeditFullLen - remainingPinyinsLen));
+                if (Configuration::cloudCacheBackColor != INVALID_COLOR) ibus_attr_list_append(textAttrList, ibus_attr_background_new(Configuration::cloudCacheBackColor, preeditLen, localPreviewStart));
+                if (Configuration::cloudCacheForeColor != INVALID_COLOR) ibus_attr_list_append(textAttrList, ibus_attr_foreground_new(Configuration::cloudCacheForeColor, preeditLen, localPreviewStart));
             }
         }
+        if (localPreviewLen > 0) {
+            // local preview, replaced by cloud result later
+            if (Configuration::localDbBackColor != INVALID_COLOR) ibus_attr_list_append(textAttrList, ibus_attr_background_new(Configuration::localDbBackColor, localPreviewStart, localPreviewStart + localPreviewLen));
+            if (Configuration::localDbForeColor != INVALID_COLOR) ibus_attr_list_append(textAttrList, ibus_attr_foreground_new(Configuration::localDbForeColor, localPreviewStart, localPreviewStart + localPreviewLen));
+        }
         if (remainingPinyinsLen > 0) {
             if (Configuration::preeditBackColor != INVALID_COLOR) ibus_attr_list_append(textAttrList, ibus_attr_background_new(Configuration::preeditBackColor, preeditFullLen - remainingPinyinsLen, preeditFullLen));
             if (Configuration::preeditForeColor != INVALID_COLOR) ibus_attr_list_append(textAttrList, ibus_attr_foreground_new(Configuration::preeditForeColor, preeditFullLen - remainingPinyinsLen, preeditFullLen));
@@ -1224,31 +1490,26 @@ static void engineUpdatePreedit(IBusSgpyccEngine * engine) {
     ibus_attr_list_append(textAttrList, ibus_attr_underline_new(IBUS_ATTR_UNDERLINE_SINGLE, preeditLen, preeditFullLen));
 
     DEBUG_PRINT(5, "[ENGINE.UpdatePreedit] attr length: %d\n", textAttrList->attributes->len);
-    IBusText *preeditText;
-    preeditText = ibus_text_new_from_string(preedit.c_str());
-    preeditText->attrs = textAttrList;
-
-    // finally, update preedit
-    if (engine->correctings->empty()) {
-        // cursor at rightmost
-        ibus_engine_update_preedit_text((IBusEngine *) engine, preeditText, preeditFullLen, TRUE);
-    } else {
-        // cursor at left of active preedit
-        ibus_engine_update_preedit_text((IBusEngine *) engine, preeditText, preeditLen, TRUE);
-    }
 
-    if (preedit.empty()) {
-        ibus_engine_hide_preedit_text((IBusEngine *) engine);
+    // cursor at rightmost, or at left of active preedit when correcting
+    guint cursor = engine->correctings->empty() ? preeditFullLen : preeditLen;
+    int visible = preedit.empty() ? 0 : 1;
+    // everything ibus gets, a change of attributes or cursor alone is rendered too
+    ostringstream renderKey;
+    renderKey << preedit << '\0' << getAttributesSignature(textAttrList) << '\0' << cursor;
+    string rendered = renderKey.str();
+
+    if (rendered != *engine->renderedPreedit || visible != engine->renderedPreeditVisible) {
+        // finally, update preedit
+        engine->output->updatePreedit(preedit, textAttrList, cursor, visible);
+        *engine->renderedPreedit = rendered;
+        engine->renderedPreeditVisible = visible;
     } else {
-        ibus_engine_show_preedit_text((IBusEngine *) engine);
+        DEBUG_PRINT(4, "[ENGINE.UpdatePreedit] unchanged, skipped\n");
     }
+    g_object_unref(textAttrList);
 
-    // remember to unref text
-    ibus_object_unref(preeditText);
-
-    engine->cloudClient->unlock();
-
-    // pop finishedCount from requeset queue, no lock here, it's safe.
+    // pop finishedCount from requeset queue, only main loop pops, it's safe.
     engine->cloudClient->removeFirstRequest(finishedCount);
 
     // update properties
@@ -1261,25 +1522,195 @@ static void engineUpdatePreedit(IBusSgpyccEngine * engine) {
     // pthread_mutex_unlock(&engine->updatePreeditMutex);
 }
 
+// idle prefetch
+
+// budget of all engines, in a minute. only touched in main loop
+static long long prefetchBudgetStart = 0;
+static int prefetchBudgetRequests = 0, prefetchBudgetBytes = 0;
+
+static bool consumePrefetchBudget(const size_t bytes) {
+    long long now = XUtility::getCurrentTime();
+    if (now - prefetchBudgetStart >= 60LL * XUtility::MICROSECOND_PER_SECOND) {
+        prefetchBudgetStart = now;
+        prefetchBudgetRequests = 0, prefetchBudgetBytes = 0;
+    }
+    if (prefetchBudgetRequests + 1 > Configuration::prefetchRequestsPerMinute
+            || prefetchBudgetBytes + (int) bytes > Configuration::prefetchBytesPerMinute) return false;
+    prefetchBudgetRequests++, prefetchBudgetBytes += bytes;
+    return true;
+}
+
+static void engineSchedulePrefetch(IBusSgpyccEngine* engine) {
+    if (engine->prefetchTimer) g_source_remove(engine->prefetchTimer), engine->prefetchTimer = 0;
+    engine->prefetchedRequests->clear();
+    if (Configuration::idlePrefetch && !engine->engMode && Configuration::prefetchDelay > 0)
+        engine->prefetchTimer = g_timeout_add((guint) (Configuration::prefetchDelay * 1000), enginePrefetchTimeout, (gpointer) engine);
+}
+
+/**
+ * request one likely continuation of active preedit each time
+ * @return FALSE to stop
+ */
+static gboolean enginePrefetchTimeout(gpointer data) {
+    IBusSgpyccEngine* engine = (typeof (engine)) data;
+    if (!Configuration::idlePrefetch || !engine->hasFocus || engine->engMode
+            || engine->correctings->size() > 0 || engine->activePreedit->empty()) {
+        engine->prefetchTimer = 0;
+        return FALSE;
+    }
+
+    // wait for running pre-requests and requests
+    if (PinyinCloudClient::preRequestBusy || PinyinCloudClient::isFetchRunning(PRIORITY_PREVIEW)) return TRUE;
+
+    vector<string> candidates = predictContinuations(engine, *engine->activePreedit);
+    for (size_t i = 0; i < candidates.size(); ++i) {
+        const string& candidate = candidates[i];
+        if (find(engine->prefetchedRequests->begin(), engine->prefetchedRequests->end(), candidate) != engine->prefetchedRequests->end()) continue;
+        if (!consumePrefetchBudget(candidate.length())) break;
+
+        DEBUG_PRINT(2, "[ENGINE] prefetch: %s\n", candidate.c_str());
+        engine->prefetchedRequests->push_back(candidate);
+        PinyinCloudClient::preRequest(candidate, preFetcher, (void*) engine, NULL, NULL, PRIORITY_PREFETCH);
+        return TRUE;
+    }
+
+    // nothing to do, or out of budget
+    engine->prefetchTimer = 0;
+    return FALSE;
+}
+
+// continuation index: pinyins following a pinyin (key "a") or two pinyins
+// (key "a b") in request cache keys, with counts. keys written through
+// writeRequestCache are indexed as they are written, keys already in
+// request_cache (loaded by config) by one scan at first prediction
+static pthread_mutex_t continuationIndexLock = PTHREAD_MUTEX_INITIALIZER;
+static map<string, map<string, int> > continuationIndex;
+static bool continuationIndexSeeded = false;
+
+/**
+ * continuationIndexLock must be held
+ */
+static void indexContinuations(const string& requestString) {
+    PinyinSequence ps = requestString;
+    for (size_t j = 0; j + 1 < ps.size(); ++j) {
+        if (!PinyinUtility::isValidPinyin(ps[j + 1])) continue;
+        continuationIndex[ps[j]][ps[j + 1]]++;
+        if (j > 0) continuationIndex[ps[j - 1] + " " + ps[j]][ps[j + 1]]++;
+    }
+}
+
+/**
+ * guess what user will type after pinyins, from pinyins following last
+ * one or two pinyins in request cache keys and cloud words.
+ * @return uncached requests, most likely first
+ */
+static const vector<string> predictContinuations(IBusSgpyccEngine* engine, const string& pinyins) {
+    vector<string> r;
+    PinyinSequence ps = pinyins;
+    if (ps.size() == 0 || !PinyinUtility::isValidPinyin(ps[ps.size() - 1])) return r;
+
+    string last = ps[ps.size() - 1];
+    string beforeLast = ps.size() > 1 ? ps[ps.size() - 2] : "";
+    map<string, int> scores;
+
+    // request cache, longer context match scores more
+    pthread_mutex_lock(&continuationIndexLock);
+    if (!continuationIndexSeeded) {
+        vector<string> keys = engine->luaBinding->getTableKeys("request_cache");
+        for (size_t i = 0; i < keys.size(); ++i) indexContinuations(keys[i]);
+        continuationIndexSeeded = true;
+    }
+    const string contexts[] = {last, beforeLast + " " + last};
+    for (size_t i = 0; i < 2; ++i) {
+        map<string, map<string, int> >::const_iterator it = continuationIndex.find(contexts[i]);
+        if (it == continuationIndex.end()) continue;
+        for (map<string, int>::const_iterator next = it->second.begin(); next != it->second.end(); ++next) scores[next->first] += next->second;
+    }
+    pthread_mutex_unlock(&continuationIndexLock);
+
+    // cloud words
+    vector<string> wordKeys = PinyinCloudClient::queryMemoryDatabaseKeys(last + " ");
+    for (size_t i = 0; i < wordKeys.size(); ++i) {
+        PinyinSequence wordPs = wordKeys[i];
+        if (wordPs.size() > 1) scores[wordPs[1]]++;
+    }
+
+    vector<pair<int, string> > ranked;
+    for (map<string, int>::iterator it = scores.begin(); it != scores.end(); ++it) {
+        ranked.push_back(pair<int, string > (-it->second, it->first));
+    }
+    sort(ranked.begin(), ranked.end());
+
+    for (size_t i = 0; i < ranked.size() && (int) r.size() < Configuration::prefetchCandidates; ++i) {
+        string request = pinyins + " " + ranked[i].second;
+        if (getRequestCache(engine, request, true).empty()) r.push_back(request);
+    }
+    DEBUG_PRINT(4, "[ENGINE] predictContinuations: %d candidates\n", (int) r.size());
+    return r;
+}
+
 // request cache read and write
 
 static const string getRequestCache(IBusSgpyccEngine* engine, const string& requestString, const bool includeWeak) {
+    Tracer::Span span("getRequestCache");
     string content = engine->luaBinding->getValue(requestString.c_str(), "", "request_cache");
     if (content.substr(0, sizeof (WEAK_CACHE_PREFIX) - 1) == string(WEAK_CACHE_PREFIX)) {
-        if (includeWeak) return content.substr(sizeof (WEAK_CACHE_PREFIX) - 1);
-        else return "";
-    } else {
-
-        return content;
+        if (includeWeak) content = content.substr(sizeof (WEAK_CACHE_PREFIX) - 1);
+        else content = "";
     }
+    return content;
 }
 
 static void writeRequestCache(IBusSgpyccEngine* engine, const string& requsetSring, const string& content, const bool weak) {
+    // write and index together, a seeding scan sees a key either in cache or in index
+    pthread_mutex_lock(&continuationIndexLock);
+    bool isNewKey = engine->luaBinding->getValue(requsetSring.c_str(), "", "request_cache").empty();
     if (weak) {
         engine->luaBinding->setValue(requsetSring.c_str(), (string(WEAK_CACHE_PREFIX) + content).c_str(), "request_cache");
     } else {
         engine->luaBinding->setValue(requsetSring.c_str(), content.c_str(), "request_cache");
     }
+    if (isNewKey && continuationIndexSeeded) indexContinuations(requsetSring);
+    pthread_mutex_unlock(&continuationIndexLock);
+}
+
+// main loop marshalling
+
+#define PENDING_UPDATE_PREEDIT 1
+#define PENDING_PRE_REQUEST_CALLBACK 2
+
+static gboolean engineHandlePendingUpdates(gpointer data) {
+    IBusSgpyccEngine* engine = (typeof (engine)) data;
+    gint pending;
+    do {
+        pending = g_atomic_int_get(&engine->pendingUpdates);
+    } while (!g_atomic_int_compare_and_exchange(&engine->pendingUpdates, pending, 0));
+
+    DEBUG_PRINT(3, "[ENGINE] handle pending updates: 0x%x\n", pending);
+    // preRequestCallback updates preedit itself
+    if (pending & PENDING_PRE_REQUEST_CALLBACK) preRequestCallback(engine);
+    else if (pending & PENDING_UPDATE_PREEDIT) engineUpdatePreedit(engine);
+    return FALSE;
+}
+
+/**
+ * set pending bits, the first one since last handling adds an idle source,
+ * so a burst of responses is rendered once
+ */
+static void enginePostUpdates(IBusSgpyccEngine* engine, const gint updates) {
+    gint pending;
+    do {
+        pending = g_atomic_int_get(&engine->pendingUpdates);
+    } while (!g_atomic_int_compare_and_exchange(&engine->pendingUpdates, pending, pending | updates));
+    if (pending == 0) g_idle_add(engineHandlePendingUpdates, (gpointer) engine);
+}
+
+static void enginePostUpdatePreedit(IBusSgpyccEngine* engine) {
+    enginePostUpdates(engine, PENDING_UPDATE_PREEDIT);
+}
+
+static void enginePostPreRequestCallback(IBusSgpyccEngine* engine) {
+    enginePostUpdates(engine, PENDING_PRE_REQUEST_CALLBACK);
 }
 
 // callback by PinyinCloudClient
@@ -1306,7 +1737,7 @@ static void preRequestCallback(IBusSgpyccEngine* engine) {
             }
 
             if (engine->preRequestRetry > 0 && Configuration::getGlobalCache(preRequestString, false).empty()) {
-                PinyinCloudClient::preRequest(preRequestString, preFetcher, (void*) engine, (ResponseCallbackFunc) preRequestCallback, (void*) engine);
+                PinyinCloudClient::preRequest(preRequestString, preFetcher, (void*) engine, (ResponseCallbackFunc) enginePostPreRequestCallback, (void*) engine);
             }
         }
     } else {
@@ -1314,149 +1745,571 @@ static void preRequestCallback(IBusSgpyccEngine* engine) {
         PinyinSequence ps = *engine->lastPreRequestString;
         if (ps.size() > 1) {
             *engine->lastPreRequestString = ps.toString(1);
-            PinyinCloudClient::preRequest(*engine->lastPreRequestString, preFetcher, (void*) engine, (ResponseCallbackFunc) preRequestCallback, (void*) engine);
+            PinyinCloudClient::preRequest(*engine->lastPreRequestString, preFetcher, (void*) engine, (ResponseCallbackFunc) enginePostPreRequestCallback, (void*) engine);
         }
     }
     engineUpdateProperties(engine);
 }
 
-// alternative popen impl. by me with timeout control
+// Timed output fetcher
+// @param timeout timeout in usec (1e-6 sec), if less than or equal to 0, use trad popen() no timeout
+// @param hedgeDelayUsec if positive and command doesn't answer in this time, run a same command
+//        again (hedged request) and take whichever answers first. ignored if trad popen() is used
+// @return output in limited time
 
-// popen2 function originally by chipx86 on Tue Jan 10 23:40:00 -0500 2006
-// http://snippets.dzone.com/posts/show/1134
+const string getExecuteOutputWithTimeout(const Configuration::Snapshot& settings, const string command, const long long timeoutUsec = -1, const long long hedgeDelayUsec = -1) {
+    string output = "";
 
-pid_t popen2(const char *command, int *infd, int *outfd) {
-    const int WRITE = 1, READ = WRITE ^ 1;
-    int pIn[2], pOut[2];
-    pid_t pid;
+    if (timeoutUsec > 0) {
+        int niceness = PinyinCloudClient::getCurrentFetchPriority() < PRIORITY_COMMIT ? settings.lowPriorityNiceness : 0;
+        output = ProcessSupervisor::execute(command, timeoutUsec, hedgeDelayUsec, niceness, PinyinCloudClient::getCurrentFetchCancelledFlag());
+    } else {
+        // use traditional popen
+        FILE* fresponse = popen(command.c_str(), "r");
+        char response[settings.fetcherBufferSize];
+        // NOTE: pipe may be empty and closed during this read (say, a empty fetcher script)
+        // this may cause program to stop.
+        while (!feof(fresponse)) {
+            UNUSED(fgets(response, sizeof (response), fresponse));
+            output += response;
+        }
+        pclose(fresponse);
+    }
+    return output;
+}
 
-    if (pipe(pIn) != 0 || pipe(pOut) != 0) return -1;
+// adaptive timeouts
 
-    pid = fork();
+/**
+ * timeout derived from latency histogram of backend
+ * @param maximumTimeout configured timeout, used as upper limit
+ *        and when there are not enough samples
+ * @return timeout in seconds
+ */
+static double getFetchTimeout(const Configuration::Snapshot& settings, const string& backend, const double percentile, const double maximumTimeout) {
+    if (!settings.adaptiveTimeout) return maximumTimeout;
 
-    if (pid < 0) return pid; // error
-    if (pid == 0) {
-        close(pIn[WRITE]);
-        close(pOut[READ]);
-        dup2(pIn[READ], READ); // dup2 already close the first fd.
-        dup2(pOut[WRITE], WRITE);
+    LatencyHistogram& histogram = LatencyHistogram::getHistogram(backend);
+    if (histogram.getSampleCount() < (size_t) settings.adaptiveTimeoutMinSamples) return maximumTimeout;
 
-        execl("/bin/sh", "sh", "-c", command, NULL);
-        perror("fail to exec @ popen2");
-        exit(EXIT_FAILURE);
-    }
+    double timeout = histogram.getPercentile(percentile) * settings.adaptiveTimeoutMargin;
+    if (timeout < settings.minimumTimeout) timeout = settings.minimumTimeout;
+    if (timeout > maximumTimeout) timeout = maximumTimeout;
+    DEBUG_PRINT(3, "[ENGINE] adaptive timeout: %.3lf s\n", timeout);
+    return timeout;
+}
 
-    infd ? (*infd = pIn[WRITE]) : close(pIn[WRITE]);
-    outfd ? (*outfd = pOut[READ]) : close(pOut[READ]);
+/**
+ * @return hedge delay in usec, negative if should not hedge
+ */
+static long long getHedgeDelay(const Configuration::Snapshot& settings, const string& backend, const double timeout) {
+    if (!settings.hedgeRequests) return -1;
 
-    close(pIn[READ]);
-    close(pOut[WRITE]);
+    LatencyHistogram& histogram = LatencyHistogram::getHistogram(backend);
+    if (histogram.getSampleCount() < (size_t) settings.adaptiveTimeoutMinSamples) return -1;
 
-    return pid;
+    double delay = histogram.getPercentile(settings.hedgePercentile);
+    if (delay <= 0 || delay >= timeout) return -1;
+    return (long long) (delay * XUtility::MICROSECOND_PER_SECOND);
 }
 
-void killProcessTree(pid_t pid, int sig = SIGTERM) {
-    // stupid method to look into /proc and find all children procresses
-    // it is a union-set problem if we only want to look /proc once to decide
-    // what processes to be killed.
-    // currently not using union-set method because it will normally
-    // introduce STL map/set ...
+/**
+ * LatencyHistogram keeps recent samples for timeouts, Metrics all of them
+ * for statistics, as "fetch.<backend>" in usec
+ */
+static void recordFetchLatency(const string& backend, const double requestTime, const double timeout, const bool succeeded) {
+    double latency;
+    if (succeeded) {
+        latency = requestTime;
+    } else if (requestTime >= timeout * 0.95) {
+        // timed out, real latency is at least timeout
+        latency = timeout;
+    } else {
+        // fast failures (network down, etc) tell nothing about latency
+        return;
+    }
+    LatencyHistogram::getHistogram(backend).addSample(latency);
+    Metrics::getHistogram("fetch." + backend).record((long long) (latency * XUtility::MICROSECOND_PER_SECOND));
+}
 
-    DIR *dir;
-    struct dirent *dirEntry;
+// fetcher output
 
-    if ((dir = opendir("/proc")) == NULL) {
-        kill(pid, sig);
-        perror("can't access /proc");
-        return; // not a fatal error
+/**
+ * @param words words (> 1 char) provided by cloud server
+ * @return first line, which should be full convert result. empty if fails
+ */
+static string parseFetcherOutput(const string& output, vector<string>& words) {
+    string res;
+    istringstream content(output);
+    for (string line; getline(content, line);) {
+        if (line.empty()) continue;
+        if (res.empty()) {
+            res = line;
+            continue;
+        }
+        if (g_utf8_strlen(line.c_str(), -1) > 1) words.push_back(line);
     }
+    return res;
+}
 
-    while ((dirEntry = readdir(dir)) != NULL) {
-        if (dirEntry->d_name[0] != '.') {
-            char filename[strlen(dirEntry->d_name) + sizeof ("/proc//stat")];
-            snprintf(filename, sizeof (filename), "/proc/%s/stat", dirEntry->d_name);
-            FILE *statFile = fopen(filename, "r");
-            if (statFile) {
-                pid_t ppid, currentPid;
-                // 4th value is ppid (2.6.32), may change when kernel upgrades
-                sscanf(dirEntry->d_name, "%d", &currentPid);
-                fscanf(statFile, "%*s %*s %*s %d", &ppid);
-                if (ppid == pid) {
-                    // recusively kill
-                    killProcessTree(currentPid, sig);
+/**
+ * store what cloud server says into request cache and cloud memory database.
+ * full result is aligned to pinyins, so that its aligned sub-phrases
+ * can be cached too, and words are stored with the pinyins they come from.
+ * sub-phrases cut at word boundaries are cached strong, others weak.
+ * existing caches are never overwritten by weak ones.
+ */
+static void storeFetcherOutput(const Configuration::Snapshot& settings, IBusSgpyccEngine* engine, const PinyinSequence& ps, const string& res, const vector<string>& words) {
+    vector<int> alignment;
+    vector<string> characters = PinyinUtility::splitCharacters(res);
+    if (!res.empty()) PinyinUtility::alignCharactersToPinyins(res, ps, alignment);
+    // pinyin positions where words located in full result start or end
+    vector<bool> wordBoundaries(ps.size() + 1, false);
+    wordBoundaries[0] = wordBoundaries[ps.size()] = true;
+
+    for (size_t i = 0; i < words.size(); ++i) {
+        const string& word = words[i];
+        size_t length = g_utf8_strlen(word.c_str(), -1);
+        if (length > ps.size()) continue;
+
+        // locate word in full result first, it tells where the word is
+        int start = -1;
+        size_t pos = res.find(word);
+        if (pos != string::npos) {
+            size_t offset = g_utf8_strlen(res.c_str(), pos);
+            if (offset + length <= alignment.size() && alignment[offset] >= 0) {
+                start = alignment[offset];
+                for (size_t j = 1; j < length; ++j) {
+                    if (alignment[offset + j] != start + (int) j) {
+                        start = -1;
+                        break;
+                    }
                 }
-                fclose(statFile);
             }
+            if (start >= 0) wordBoundaries[start] = wordBoundaries[start + length] = true;
         }
+        // then any pinyins match
+        for (size_t j = 0; start < 0 && j + length <= ps.size(); ++j) {
+            if (PinyinUtility::isCharactersPinyinsMatch(word, ps.toString(j, length))) start = j;
+        }
+        if (start >= 0) PinyinCloudClient::addToMemoryDatabase(ps.toString(start, length), word);
     }
-    kill(pid, sig);
-    closedir(dir);
-}
 
+    if (!settings.cacheSegments || !settings.writeRequestCache || res.empty()) return;
+
+    // aligned runs: characters[c, c + l) <=> ps[alignment[c], alignment[c] + l).
+    // every sub-phrase of a run is a candidate, prefixes and suffixes of the
+    // full result as well as phrases in the middle of it. one cut inside a
+    // word gives half a word, only those cut at word boundaries are strong
+    vector<pair<string, string> > strongSegments, weakSegments;
+    for (size_t c = 0; c < alignment.size();) {
+        if (alignment[c] < 0) {
+            c++;
+            continue;
+        }
+        size_t runLength = 1;
+        while (c + runLength < alignment.size() && alignment[c + runLength] == alignment[c] + (int) runLength) runLength++;
+
+        for (size_t i = 0; i < runLength; ++i) {
+            string segment;
+            for (size_t l = 1; i + l <= runLength; ++l) {
+                segment += characters[c + i + l - 1];
+                if ((int) l < settings.cacheSegmentMinLength || l >= ps.size()) continue;
+                size_t start = alignment[c] + i;
+                if (wordBoundaries[start] && wordBoundaries[start + l]) strongSegments.push_back(pair<string, string > (ps.toString(start, l), segment));
+                else weakSegments.push_back(pair<string, string > (ps.toString(start, l), segment));
+            }
+        }
+        c += runLength;
+    }
 
-// Timed output fetcher
-// @param timeout timeout in usec (1e-6 sec), if less than or equal to 0, use trad popen() no timeout
-// @return output in limited time
+    // long responses have many sub-phrases, strong ones go first
+    size_t segmentCount = 0;
+    for (size_t i = 0; i < strongSegments.size() && (int) segmentCount < settings.cacheSegmentLimit; ++i) {
+        if (!getRequestCache(engine, strongSegments[i].first).empty()) continue;
+        writeRequestCache(engine, strongSegments[i].first, strongSegments[i].second);
+        segmentCount++;
+    }
+    for (size_t i = 0; i < weakSegments.size() && (int) segmentCount < settings.cacheSegmentLimit; ++i) {
+        if (!getRequestCache(engine, weakSegments[i].first, true).empty()) continue;
+        writeRequestCache(engine, weakSegments[i].first, weakSegments[i].second, true);
+        segmentCount++;
+    }
+    DEBUG_PRINT(4, "[ENGINE] storeFetcherOutput: %d segments cached\n", (int) segmentCount);
+}
 
-const string getExecuteOutputWithTimeout(const string command, const long long timeoutUsec = -1) {
-    string output = "";
+// batched requests
 
-    if (timeoutUsec > 0) {
-        int infd, outfd;
-        pid_t pidCommand;
+// fetcher writes this line after output of each item in batch mode
+#define FETCHER_BATCH_SEPARATOR "\x1e"
 
-        if ((pidCommand = popen2(command.c_str(), &infd, &outfd)) <= 0) return output;
-        close(infd);
+struct FetchBatch {
+    string backend;
+    vector<string> requestStrings;
+    vector<string> outputs;
+    // false if fetcher does not understand batch mode
+    bool supported;
+    bool finished;
+    int memberCount;
+    pthread_cond_t changedCond;
+};
 
-        fd_set selectedFds;
-        FD_ZERO(&selectedFds);
-        FD_SET(outfd, &selectedFds);
+static pthread_mutex_t fetchBatchLock = PTHREAD_MUTEX_INITIALIZER;
+// batch still accepting members, NULL if none
+static FetchBatch* openFetchBatch = NULL;
 
-        struct timeval timeLeft;
-        timeLeft.tv_sec = timeoutUsec / 1000000;
-        timeLeft.tv_usec = timeoutUsec % 1000000;
+/**
+ * leave a batch, last one deletes it. fetchBatchLock must be held
+ */
+static void leaveFetchBatch(FetchBatch* batch) {
+    if (--batch->memberCount == 0) {
+        pthread_cond_destroy(&batch->changedCond);
+        delete batch;
+    }
+}
 
-        long long timeDeadline = XUtility::getCurrentTime() + timeoutUsec;
+/**
+ * send requestString together with other pending requests in one fetcher
+ * call. the first thread opens a batch and waits batchWindow
+ * for others (followers), then runs fetcher for all of them.
+ * @param output output of fetcher for requestString, in normal format
+ * @return FETCH_NOT_APPLICABLE if not batched, caller should run fetcher
+ *         itself. FETCH_FAILED if batch fetcher fails or times out, that
+ *         already took the time, caller should not run fetcher again
+ */
+static FetchStatus getBatchedFetcherOutput(const Configuration::Snapshot& settings, IBusSgpyccEngine* engine, const string& backend, const string& requestString, const double timeout, string& output) {
+    pthread_mutex_lock(&fetchBatchLock);
+
+    FetchBatch* batch = openFetchBatch;
+    if (batch && batch->backend == backend && (int) batch->requestStrings.size() < settings.batchMaxSize) {
+        // follower, leader does the job
+        size_t index = batch->requestStrings.size();
+        batch->requestStrings.push_back(requestString);
+        batch->memberCount++;
+        pthread_cond_broadcast(&batch->changedCond);
+        while (!batch->finished) pthread_cond_wait(&batch->changedCond, &fetchBatchLock);
+
+        FetchStatus status = batch->supported ? (index < batch->outputs.size() ? FETCH_SUCCEEDED : FETCH_FAILED) : FETCH_NOT_APPLICABLE;
+        if (status == FETCH_SUCCEEDED) output = batch->outputs[index];
+        leaveFetchBatch(batch);
+        pthread_mutex_unlock(&fetchBatchLock);
+        return status;
+    }
 
-        fcntl(outfd, F_SETFL, O_NONBLOCK);
+    // nothing to batch with
+    if (batch || engine->cloudClient->getPendingRequestCount() <= 1) {
+        pthread_mutex_unlock(&fetchBatchLock);
+        return FETCH_NOT_APPLICABLE;
+    }
 
-        while (select(outfd + 1, &selectedFds, NULL, NULL, &timeLeft) > 0) {
-            // get response
-            char receiveBuffer[Configuration::fetcherBufferSize];
-            receiveBuffer[0] = 0;
-            int readBytes = read(outfd, receiveBuffer, sizeof (receiveBuffer) - 1);
-            if (readBytes > 0) {
-                receiveBuffer[readBytes] = 0;
-                output += receiveBuffer;
+    // leader, wait for others
+    batch = new FetchBatch();
+    batch->backend = backend;
+    batch->requestStrings.push_back(requestString);
+    batch->supported = true;
+    batch->finished = false;
+    batch->memberCount = 1;
+    pthread_cond_init(&batch->changedCond, NULL);
+    openFetchBatch = batch;
+
+    long long windowEnd = XUtility::getCurrentTime() + (long long) (settings.batchWindow * XUtility::MICROSECOND_PER_SECOND);
+    struct timespec windowEndTime;
+    windowEndTime.tv_sec = windowEnd / XUtility::MICROSECOND_PER_SECOND;
+    windowEndTime.tv_nsec = (windowEnd % XUtility::MICROSECOND_PER_SECOND) * 1000;
+    while ((int) batch->requestStrings.size() < settings.batchMaxSize
+            && pthread_cond_timedwait(&batch->changedCond, &fetchBatchLock, &windowEndTime) == 0);
+    openFetchBatch = NULL;
+    vector<string> requestStrings = batch->requestStrings;
+    pthread_mutex_unlock(&fetchBatchLock);
+
+    vector<string> outputs;
+    bool supported = true;
+    if (requestStrings.size() > 1) {
+        DEBUG_PRINT(2, "[ENGINE] batched fetch: %d requests\n", (int) requestStrings.size());
+
+        // every member waits for the batch, it gets no more time than
+        // a single request
+        char timeLimitBuffer[64];
+        snprintf(timeLimitBuffer, sizeof (timeLimitBuffer), " '-%.4lf'", timeout);
+        string command = backend + " --batch" + timeLimitBuffer;
+        for (size_t i = 0; i < requestStrings.size(); ++i) command += " '" + requestStrings[i] + "'";
+
+        // no hedging, a batch is already expensive
+        string batchOutput = getExecuteOutputWithTimeout(settings, command,
+                settings.useAlternativePopen ?
+                (long long) (timeout * XUtility::MICROSECOND_PER_SECOND) : -1);
+
+        // split records
+        string record;
+        istringstream content(batchOutput);
+        for (string line; getline(content, line);) {
+            if (line == FETCHER_BATCH_SEPARATOR) {
+                outputs.push_back(record);
+                record.clear();
             } else {
-                // no more to read, child process is now a zombie.
-                break;
+                record += line + "\n";
             }
-            // update timeLeft, check timeout
-            long long timeNow = XUtility::getCurrentTime();
-            if (timeNow >= timeDeadline) break;
-            timeLeft.tv_sec = (timeDeadline - timeNow) / 1000000;
-            timeLeft.tv_usec = (timeDeadline - timeNow) % 1000000;
         }
-        // timeout or empty response or done
-        close(outfd);
-        killProcessTree(pidCommand, SIGKILL);
-
-        // clean zombies, they should be already killed.
-        waitpid(pidCommand, NULL, 0);
+        // an old fetcher answers batch as a single request, without separators
+        if (outputs.empty() && !batchOutput.empty() && batchOutput.find_first_not_of(" \r\n\t") != string::npos) {
+            DEBUG_PRINT(1, "[ENGINE] fetcher does not support batch mode\n");
+            supported = false;
+        }
     } else {
-        // use traditional popen
-        FILE* fresponse = popen(command.c_str(), "r");
-        char response[Configuration::fetcherBufferSize];
-        // NOTE: pipe may be empty and closed during this read (say, a empty fetcher script)
-        // this may cause program to stop.
-        while (!feof(fresponse)) {
-            UNUSED(fgets(response, sizeof (response), fresponse));
-            output += response;
+        supported = false;
+    }
+
+    pthread_mutex_lock(&fetchBatchLock);
+    batch->outputs = outputs;
+    batch->supported = supported;
+    batch->finished = true;
+    pthread_cond_broadcast(&batch->changedCond);
+    FetchStatus status = supported ? (outputs.empty() ? FETCH_FAILED : FETCH_SUCCEEDED) : FETCH_NOT_APPLICABLE;
+    if (status == FETCH_SUCCEEDED) output = outputs[0];
+    leaveFetchBatch(batch);
+    pthread_mutex_unlock(&fetchBatchLock);
+    return status;
+}
+
+// in-process fetcher backends
+
+struct FetcherBackendEntry {
+    ImeEngine::FetcherBackend backend;
+    void* param;
+};
+
+static pthread_rwlock_t fetcherBackendsLock = PTHREAD_RWLOCK_INITIALIZER;
+static map<string, FetcherBackendEntry> fetcherBackends;
+
+/**
+ * @return false if no in-process backend is registered as backend
+ */
+static bool getFetcherBackendOutput(const string& backend, const string& requestString, const double timeout, string& output) {
+    pthread_rwlock_rdlock(&fetcherBackendsLock);
+    map<string, FetcherBackendEntry>::const_iterator it = fetcherBackends.find(backend);
+    bool found = (it != fetcherBackends.end());
+    FetcherBackendEntry entry;
+    if (found) entry = it->second;
+    pthread_rwlock_unlock(&fetcherBackendsLock);
+
+    if (found) output = entry.backend(entry.param, requestString, timeout);
+    return found;
+}
+
+/**
+ * run fetcher once, store its output and record its latency
+ * @param batchable false if requestString must not be batched with others
+ * @return full convert result, empty if fails
+ */
+static string fetchFromCloud(const Configuration::Snapshot& settings, IBusSgpyccEngine* engine, const string& backend, const string& requestString, const double timeout, const bool batchable) {
+    char timeLimitBuffer[64];
+    snprintf(timeLimitBuffer, sizeof (timeLimitBuffer), " '-%.4lf'", timeout);
+
+    long long startMicrosecond = XUtility::getCurrentTime();
+
+    // only requests user is waiting for are batched, others may be cancelled
+    // in-process backends are cheap to call, never batched
+    string output;
+    bool inProcess = getFetcherBackendOutput(backend, requestString, timeout, output);
+    // a failed batch is not run again alone
+    bool batched = !inProcess && batchable && settings.batchRequests && PinyinCloudClient::getCurrentFetchPriority() == PRIORITY_COMMIT
+            && getBatchedFetcherOutput(settings, engine, backend, requestString, timeout, output) != FETCH_NOT_APPLICABLE;
+    if (!inProcess && !batched) {
+        output = getExecuteOutputWithTimeout(settings,
+                string(backend + " '" + requestString + "'" + timeLimitBuffer),
+                settings.useAlternativePopen ?
+                (long long) (timeout * XUtility::MICROSECOND_PER_SECOND) : -1,
+                getHedgeDelay(settings, backend, timeout));
+    }
+
+    vector<string> words;
+    string res = parseFetcherOutput(output, words);
+    storeFetcherOutput(settings, engine, requestString, res, words);
+
+    // cancelled fetches tell nothing about latency, neither do batched ones
+    if (!batched && !PinyinCloudClient::isCurrentFetchCancelled())
+        recordFetchLatency(backend, (XUtility::getCurrentTime() - startMicrosecond) / (double) XUtility::MICROSECOND_PER_SECOND, timeout, !res.empty());
+    return res;
+}
+
+/**
+ * if a prefix of requestString is cached, only request the rest, with
+ * deltaContext pinyins before it as context. context
+ * characters in response must agree with cached prefix, otherwise the
+ * server segments differently and the delta result is dropped.
+ * @param res cached prefix + converted rest
+ * @return FETCH_NOT_APPLICABLE if nothing usable is cached or context
+ *         mismatches, FETCH_FAILED if fetching the rest fails
+ */
+static FetchStatus fetchDeltaFromCloud(const Configuration::Snapshot& settings, IBusSgpyccEngine* engine, const string& backend, const string& requestString, const double timeout, string& res) {
+    PinyinSequence ps = requestString;
+    if (ps.size() < 2) return FETCH_NOT_APPLICABLE;
+
+    // longest strong cached prefix
+    size_t prefixLength = 0;
+    string prefix;
+    for (size_t i = ps.size() - 1; (int) i >= settings.deltaRequestMinPrefix; i--) {
+        prefix = getRequestCache(engine, ps.toString(0, i));
+        if (!prefix.empty()) {
+            prefixLength = i;
+            break;
         }
-        pclose(fresponse);
     }
-    return output;
+    if (prefixLength == 0) return FETCH_NOT_APPLICABLE;
+
+    // context characters are located by position, need one character per pinyin
+    vector<string> prefixCharacters = PinyinUtility::splitCharacters(prefix);
+    if (prefixCharacters.size() != prefixLength) return FETCH_NOT_APPLICABLE;
+
+    size_t contextLength = (size_t) settings.deltaContext;
+    if (contextLength > prefixLength) contextLength = prefixLength;
+
+    string deltaRequestString = ps.toString(prefixLength - contextLength, 0);
+    DEBUG_PRINT(3, "[ENGINE] delta request: '%s' + '%s'\n", prefix.c_str(), deltaRequestString.c_str());
+
+    string delta = getRequestCache(engine, deltaRequestString);
+    if (delta.empty()) delta = fetchFromCloud(settings, engine, backend, deltaRequestString, timeout);
+    if (delta.empty()) return FETCH_FAILED;
+
+    vector<string> deltaCharacters = PinyinUtility::splitCharacters(delta);
+    if (deltaCharacters.size() <= contextLength) return FETCH_NOT_APPLICABLE;
+
+    res = prefix;
+    for (size_t i = 0; i < deltaCharacters.size(); ++i) {
+        if (i < contextLength) {
+            if (deltaCharacters[i] != prefixCharacters[prefixLength - contextLength + i]) {
+                DEBUG_PRINT(3, "[ENGINE] delta request: context mismatch, dropped\n");
+                res.clear();
+                return FETCH_NOT_APPLICABLE;
+            }
+        } else {
+            res += deltaCharacters[i];
+        }
+    }
+    return FETCH_SUCCEEDED;
+}
+
+/**
+ * @return seconds before deadline (a getCurrentTime() value), 0 if passed
+ */
+static const double getRemainingTime(const long long deadline) {
+    long long remaining = deadline - XUtility::getCurrentTime();
+    return remaining > 0 ? (double) remaining / XUtility::MICROSECOND_PER_SECOND : 0;
+}
+
+// split requests
+
+struct SplitFetchData {
+    const Configuration::Snapshot* settings;
+    IBusSgpyccEngine* engine;
+    string backend;
+    string requestString;
+    string response;
+    double timeout;
+    // fetch being split, NULL outside fetch threads
+    FetchContext* parentContext;
+};
+
+static void fetchSplitChunk(SplitFetchData* fetchData) {
+    // chunks of one request, not others waiting to be batched
+    fetchData->response = fetchFromCloud(*fetchData->settings, fetchData->engine, fetchData->backend, fetchData->requestString, fetchData->timeout, false);
+}
+
+static void* splitFetchThreadFunc(void* data) {
+    SplitFetchData* fetchData = (typeof (fetchData)) data;
+    // same priority as the request, cancelled with it
+    FetchContext context;
+    context.requestString = fetchData->requestString;
+    context.priority = fetchData->parentContext ? fetchData->parentContext->priority : PRIORITY_COMMIT;
+    context.cancelled = false;
+    context.parent = fetchData->parentContext;
+    PinyinCloudClient::beginFetch(&context);
+    fetchSplitChunk(fetchData);
+    PinyinCloudClient::endFetch(&context);
+    return NULL;
+}
+
+/**
+ * split long request into chunks of at most splitRequestLength
+ * pinyins, fetch them concurrently and join results in order. a chunk
+ * boundary is placed after the longest cached prefix, if any, so that part
+ * needs no fetch. failed chunks fall back to cache or local db separately.
+ * @param res joined result
+ * @param complete set to false if some chunk falls back
+ * @return FETCH_NOT_APPLICABLE if request is not long, FETCH_FAILED if all
+ *         chunks fail
+ */
+static FetchStatus fetchSplitFromCloud(const Configuration::Snapshot& settings, IBusSgpyccEngine* engine, const string& backend, const string& requestString, const double timeout, string& res, bool& complete) {
+    PinyinSequence ps = requestString;
+    size_t splitLength = (size_t) settings.splitRequestLength;
+    if (settings.splitRequestLength <= 0 || ps.size() <= splitLength) return FETCH_NOT_APPLICABLE;
+
+    // boundaries, chunk i is ps[boundaries[i], boundaries[i + 1])
+    vector<size_t> boundaries;
+    boundaries.push_back(0);
+    for (size_t i = ps.size() - 1; i > 0; i--) {
+        if (!getRequestCache(engine, ps.toString(0, i)).empty()) {
+            boundaries.push_back(i);
+            break;
+        }
+    }
+    // split the rest evenly
+    size_t start = boundaries.back();
+    size_t chunkCount = (ps.size() - start + splitLength - 1) / splitLength;
+    for (size_t i = 1; i < chunkCount; ++i) {
+        boundaries.push_back(start + (ps.size() - start) * i / chunkCount);
+    }
+    boundaries.push_back(ps.size());
+
+    size_t count = boundaries.size() - 1;
+    DEBUG_PRINT(3, "[ENGINE] split request '%s' into %d chunks\n", requestString.c_str(), (int) count);
+
+    vector<SplitFetchData> fetchDatas(count);
+    vector<pthread_t> threads(count);
+    vector<bool> threadCreated(count, false);
+    // chunks answered by cache need no thread
+    vector<size_t> fetchIndexes;
+    for (size_t i = 0; i < count; ++i) {
+        fetchDatas[i].settings = &settings;
+        fetchDatas[i].engine = engine;
+        fetchDatas[i].backend = backend;
+        fetchDatas[i].requestString = ps.toString(boundaries[i], boundaries[i + 1] - boundaries[i]);
+        fetchDatas[i].timeout = timeout;
+        fetchDatas[i].parentContext = PinyinCloudClient::getCurrentFetchContext();
+        fetchDatas[i].response = getRequestCache(engine, fetchDatas[i].requestString);
+        if (fetchDatas[i].response.empty()) fetchIndexes.push_back(i);
+    }
+    // run the last chunk in this thread, in fetch context it already has
+    for (size_t j = 0; j + 1 < fetchIndexes.size(); ++j) {
+        size_t i = fetchIndexes[j];
+        threadCreated[i] = (pthread_create(&threads[i], NULL, &splitFetchThreadFunc, (void*) &fetchDatas[i]) == 0);
+        if (!threadCreated[i]) fetchSplitChunk(&fetchDatas[i]);
+    }
+    if (!fetchIndexes.empty()) fetchSplitChunk(&fetchDatas[fetchIndexes.back()]);
+    for (size_t i = 0; i < count; ++i) {
+        if (threadCreated[i]) pthread_join(threads[i], NULL);
+    }
+
+    string joined;
+    size_t failedCount = 0;
+    complete = true;
+    for (size_t i = 0; i < count; ++i) {
+        string& response = fetchDatas[i].response;
+        if (response.empty()) {
+            failedCount++;
+            complete = false;
+            if (PinyinDatabase::getPinyinDatabases().size() > 0) {
+                response = getGreedyLocalCovert(settings, engine, fetchDatas[i].requestString);
+            } else {
+                response = getRequestCache(engine, fetchDatas[i].requestString, true);
+                if (response.empty()) response = fetchDatas[i].requestString;
+            }
+        }
+        joined += response;
+    }
+    if (failedCount == count) return FETCH_FAILED;
+    res = joined;
+    return FETCH_SUCCEEDED;
 }
 
 // kinds of fetchers callback by PinyinCloudClient
@@ -1467,57 +2320,54 @@ string externalFetcher(void* data, const string & requestString) {
 
     // may cause dead lock if called from call lua function
     string res = getRequestCache(engine, requestString);
+    // hit ratio is of lookups user waits for, not of probes of delta and
+    // split requests, segment caching or fallbacks
+    if (res.empty()) getEngineMetrics().requestCacheMisses.add();
+    else getEngineMetrics().requestCacheHits.add();
 
     if (res.empty()) {
-        PinyinSequence ps = requestString;
-
-        char timeLimitBuffer[64];
-        snprintf(timeLimitBuffer, sizeof (timeLimitBuffer), " '-%.4lf'", Configuration::requestTimeout);
+        Configuration::Snapshot settings = *Configuration::SnapshotReader();
+        string backend = settings.fetcherPath;
+        double timeout = getFetchTimeout(settings, backend, settings.requestTimeoutPercentile, settings.requestTimeout);
 
         // timing, for statistics
         long long startMicrosecond = XUtility::getCurrentTime();
-
-        istringstream content(getExecuteOutputWithTimeout
-                (string((Configuration::fetcherPath) + " '" + requestString + "'" + timeLimitBuffer),
-                Configuration::useAlternativePopen ?
-                (long long) (Configuration::requestTimeout * XUtility::MICROSECOND_PER_SECOND) : -1));
-
-        for (string line; getline(content, line);) {
-            if (line.empty()) continue;
-            if (res.empty()) {
-                // first result should be full convert result
-                res = line;
-                continue;
-            }
-            size_t length = g_utf8_strlen(line.c_str(), -1);
-            if (length > 1) {
-                // store word ( > 1 char) provided by cloud server
-                PinyinCloudClient::addToMemoryDatabase(ps.toString(0, length), line);
-            }
-        }
+        // all stages together take no longer than timeout
+        long long deadline = startMicrosecond + (long long) (timeout * XUtility::MICROSECOND_PER_SECOND);
+
+        // split requests may partially fall back, their results are written weak
+        bool complete = true;
+        FetchStatus status = FETCH_NOT_APPLICABLE;
+        if (settings.deltaRequest) status = fetchDeltaFromCloud(settings, engine, backend, requestString, timeout, res);
+        if (status == FETCH_NOT_APPLICABLE) status = fetchSplitFromCloud(settings, engine, backend, requestString, getRemainingTime(deadline), res, complete);
+        // a failed stage already used the time, do not try again with the whole phrase
+        double remainingTime = getRemainingTime(deadline);
+        if (status == FETCH_NOT_APPLICABLE && remainingTime > 0) res = fetchFromCloud(settings, engine, backend, requestString, remainingTime);
 
         // update statistics
-        totalRequestCount++;
-        double requestTime = (XUtility::getCurrentTime() - startMicrosecond) / (double) XUtility::MICROSECOND_PER_SECOND;
-        totalResponseTime += requestTime;
-        if (requestTime > maximumResponseTime) maximumResponseTime = requestTime;
+        EngineMetrics& metrics = getEngineMetrics();
+        metrics.requests.add();
+        long long requestTime = XUtility::getCurrentTime() - startMicrosecond;
+        if (!res.empty()) metrics.responseTime.record(requestTime);
 
         // try read cache, or use local db if fails
         if (res.empty()) res = getRequestCache(engine, requestString);
 
         if (res.empty()) {
             // empty, means fails
-            totalFailedRequestCount++;
+            metrics.failedRequests.add();
             // try local db, no lock here because db is not allowed to unload currently
-            if (Configuration::fallbackUsingDb && PinyinDatabase::getPinyinDatabases().size() > 0) {
-                res = getGreedyLocalCovert(engine, requestString);
-            } else {
+            if (settings.fallbackUsingDb && PinyinDatabase::getPinyinDatabases().size() > 0) {
+                res = getGreedyLocalCovert(settings, engine, requestString);
+            } else if (settings.showCachedInPreedit) {
                 // try partial convert
                 res = getPartialCacheConvert(engine, requestString);
+            } else {
+                res = requestString;
             }
         } else {
-            if (Configuration::writeRequestCache && requestString != res) {
-                writeRequestCache(engine, requestString, res);
+            if (settings.writeRequestCache && requestString != res) {
+                writeRequestCache(engine, requestString, res, !complete);
             }
         }
     }
@@ -1537,44 +2387,31 @@ static string preFetcher(void* data, const string& requestString) {
     string res = getRequestCache(engine, requestString);
 
     if (res.empty()) {
-        char timeLimitBuffer[64];
-        snprintf(timeLimitBuffer, sizeof (timeLimitBuffer), " '-%.4lf'", Configuration::preRequestTimeout);
-
-        PinyinSequence ps = requestString;
+        Configuration::Snapshot settings = *Configuration::SnapshotReader();
+        string backend = settings.fetcherPath;
+        double timeout = getFetchTimeout(settings, backend, settings.preRequestTimeoutPercentile, settings.preRequestTimeout);
 
         // for statistics
         long long startMicrosecond = XUtility::getCurrentTime();
 
-        // can't use is co = xx, but is co(xx) ... look up C++ standard ?
-        istringstream content(getExecuteOutputWithTimeout
-                (string((Configuration::fetcherPath) + " '" + requestString + "'" + timeLimitBuffer),
-                Configuration::useAlternativePopen ?
-                (long long) (Configuration::preRequestTimeout * XUtility::MICROSECOND_PER_SECOND) : -1));
+        res = fetchFromCloud(settings, engine, backend, requestString, timeout);
 
-        for (string line; getline(content, line);) {
-            if (line.empty()) continue;
-            if (res.empty()) {
-                // first result should be full convert result
-                res = line;
-                continue;
-            }
-            size_t length = g_utf8_strlen(line.c_str(), -1);
-            if (length > 1) {
-                // store word ( > 1 char) provided by cloud server
-                PinyinCloudClient::addToMemoryDatabase(ps.toString(0, length), line);
-            }
-        }
+        // cancelled by a request with higher priority, no fallback
+        if (res.empty() && PinyinCloudClient::isCurrentFetchCancelled()) return requestString;
 
-        totalPreRequestCount++;
+        EngineMetrics& metrics = getEngineMetrics();
+        metrics.preRequests.add();
         if (res.empty()) {
-            totalFailedPreRequestCount++;
+            metrics.failedPreRequests.add();
             res = getRequestCache(engine, requestString, true);
             if (res.empty()) {
-                if (Configuration::preRequestFallback && PinyinDatabase::getPinyinDatabases().size() > 0) {
+                // nobody waits for prefetch, do not bother local db
+                if (settings.preRequestFallback && PinyinDatabase::getPinyinDatabases().size() > 0
+                        && PinyinCloudClient::getCurrentFetchPriority() > PRIORITY_PREFETCH) {
                     // weak cache greedy result
-                    res = getGreedyLocalCovert(engine, requestString);
+                    res = getGreedyLocalCovert(settings, engine, requestString);
                     // write weak
-                    if (Configuration::writeRequestCache && requestString != res) writeRequestCache(engine, requestString, res, true);
+                    if (settings.writeRequestCache && requestString != res) writeRequestCache(engine, requestString, res, true);
                 } else {
                     // empty, means fails
                     res = requestString;
@@ -1582,11 +2419,9 @@ static string preFetcher(void* data, const string& requestString) {
             }
         } else {
             // success, update statistics
-            double requestTime = (XUtility::getCurrentTime() - startMicrosecond) / (double) XUtility::MICROSECOND_PER_SECOND;
-            totalResponseTime += requestTime;
-            if (requestTime > maximumResponseTime) maximumResponseTime = requestTime;
+            metrics.responseTime.record(XUtility::getCurrentTime() - startMicrosecond);
 
-            if (Configuration::writeRequestCache && requestString != res) writeRequestCache(engine, requestString, res);
+            if (settings.writeRequestCache && requestString != res) writeRequestCache(engine, requestString, res);
             engine->cloudClient->updateRequestInAdvance(requestString, res);
         }
     }
@@ -1602,7 +2437,15 @@ static string luaFetcher(void* voidData, const string & requestString) {
     DEBUG_PRINT(2, "[ENGINE] luaFunc(%s)\n", requestString.c_str());
     LuaFuncData *data = (LuaFuncData*) voidData;
     string response;
-    data->engine->luaBinding->callLuaFunction(data->luaFuncName.c_str(), "s>s", requestString.c_str(), &response);
+    // prefer a worker state, so lua fetchers run in parallel and do not
+    // block main state. fetchers only known to main state still run there
+    LuaBinding* worker = LuaBinding::acquireWorker(data->luaFuncName.c_str());
+    if (worker) {
+        worker->callLuaFunction(data->luaFuncName.c_str(), "s>s", requestString.c_str(), &response);
+        LuaBinding::releaseWorker(worker);
+    } else {
+        data->engine->luaBinding->callLuaFunction(data->luaFuncName.c_str(), "s>s", requestString.c_str(), &response);
+    }
     delete (LuaFuncData*) data;
     // fails?
     if (response.empty()) response = requestString;
@@ -1612,19 +2455,42 @@ static string luaFetcher(void* voidData, const string & requestString) {
 
 namespace ImeEngine {
 
+    static void commitText(const string& text) {
+        IBusSgpyccEngine* engine = (IBusSgpyccEngine*) Configuration::activeEngine;
+        if (!engine || !engine->enabled) return;
+
+        engine->cloudClient->request(text, directFetcher, (void*) engine, (ResponseCallbackFunc) enginePostUpdatePreedit, (void*) engine);
+        engine->lastInputIsChinese = false;
+    }
+
+    static gboolean commitPostedText(gpointer data) {
+        string* text = (string*) data;
+        commitText(*text);
+        delete text;
+        // run once
+        return FALSE;
+    }
+
     static int l_commitText(lua_State * L) {
         lua_tostring(L, 1);
         DEBUG_PRINT(1, "[ENGINE] l_commitText: %s\n", lua_tostring(L, 1));
         luaL_checkstring(L, 1);
-        IBusSgpyccEngine* engine = (IBusSgpyccEngine*) Configuration::activeEngine;
-        if (!engine || !engine->enabled) return 0;
-
-        engine->cloudClient->request(string(lua_tostring(L, 1)), directFetcher, (void*) engine, (ResponseCallbackFunc) engineUpdatePreedit, (void*) engine);
-        engine->lastInputIsChinese = false;
+        commitText(lua_tostring(L, 1));
 
         return 0; // return 0 value to lua code
     }
 
+    /**
+     * ime.commit in worker states, requests are main loop only
+     */
+    static int l_postCommitText(lua_State * L) {
+        DEBUG_PRINT(1, "[ENGINE] l_postCommitText: %s\n", lua_tostring(L, 1));
+        luaL_checkstring(L, 1);
+        g_idle_add(commitPostedText, (gpointer) new string(lua_tostring(L, 1)));
+
+        return 0;
+    }
+
     static int l_sendRequest(lua_State * L) {
         luaL_checkstring(L, 1);
         DEBUG_PRINT(1, "[ENGINE] l_sendRequest: %s\n", lua_tostring(L, 1));
@@ -1636,9 +2502,9 @@ namespace ImeEngine {
             LuaFuncData *data = new LuaFuncData();
             data->luaFuncName = lua_tostring(L, 2);
             data->engine = engine;
-            engine->cloudClient->request(string(lua_tostring(L, 1)), luaFetcher, (void*) data, (ResponseCallbackFunc) engineUpdatePreedit, (void*) engine);
+            engine->cloudClient->request(string(lua_tostring(L, 1)), luaFetcher, (void*) data, (ResponseCallbackFunc) enginePostUpdatePreedit, (void*) engine);
         } else {
-            engine->cloudClient->request(string(lua_tostring(L, 1)), externalFetcher, (void*) engine, (ResponseCallbackFunc) engineUpdatePreedit, (void*) engine);
+            engine->cloudClient->request(string(lua_tostring(L, 1)), externalFetcher, (void*) engine, (ResponseCallbackFunc) enginePostUpdatePreedit, (void*) engine);
         }
 
         // delete selection
@@ -1650,5 +2516,74 @@ namespace ImeEngine {
     void registerLuaFunctions() {
         LuaBinding::getStaticBinding().registerFunction(l_commitText, "commit");
         LuaBinding::getStaticBinding().registerFunction(l_sendRequest, "request");
+        LuaBinding::registerWorkerFunction(l_postCommitText, "commit");
+    }
+
+    // headless engines
+
+    IBusSgpyccEngine* createHeadlessEngine(EngineOutput* output) {
+        DEBUG_PRINT(1, "[ENGINE] createHeadlessEngine\n");
+        // an engine object like ones ibus creates, but on no connection
+        static int headlessEngineCount = 0;
+        ostringstream path;
+        path << "/org/freedesktop/IBus/Engine/Headless/" << ++headlessEngineCount;
+#if IBUS_CHECK_VERSION(1, 3, 99)
+        IBusSgpyccEngine* engine = (IBusSgpyccEngine*) g_object_new(IBUS_TYPE_SGPYCC_ENGINE, "object-path", path.str().c_str(), NULL);
+#else
+        IBusSgpyccEngine* engine = (IBusSgpyccEngine*) g_object_new(IBUS_TYPE_SGPYCC_ENGINE, "path", path.str().c_str(), NULL);
+#endif
+#if IBUS_CHECK_VERSION(1, 2, 98)
+        g_object_ref_sink(engine);
+#endif
+        engine->output = output;
+        engineEnable(engine);
+        engineFocusIn(engine);
+        return engine;
+    }
+
+    void destroyHeadlessEngine(IBusSgpyccEngine* engine) {
+        DEBUG_PRINT(1, "[ENGINE] destroyHeadlessEngine\n");
+        if (Configuration::activeEngine == (void*) engine) Configuration::activeEngine = NULL;
+        ibus_object_destroy((IBusObject*) engine);
+        g_object_unref(engine);
+    }
+
+    const bool processKeyEvent(IBusSgpyccEngine* engine, const unsigned int keyval, const unsigned int keycode, const unsigned int state) {
+        return engineProcessKeyEvent(engine, keyval, keycode, state);
+    }
+
+    void focusIn(IBusSgpyccEngine* engine) {
+        engineFocusIn(engine);
+    }
+
+    void focusOut(IBusSgpyccEngine* engine) {
+        engineFocusOut(engine);
+    }
+
+    void reset(IBusSgpyccEngine* engine) {
+        engineReset(engine);
+    }
+
+    const size_t getRequestCount(IBusSgpyccEngine* engine) {
+        return engine->cloudClient->getRequestCount();
+    }
+
+    const size_t getRunningFetchCount(IBusSgpyccEngine* engine) {
+        return engine->cloudClient->getRunningThreadCount() + PinyinCloudClient::getRunningPreRequestCount();
+    }
+
+    void registerFetcherBackend(const string& name, FetcherBackend backend, void* param) {
+        FetcherBackendEntry entry;
+        entry.backend = backend;
+        entry.param = param;
+        pthread_rwlock_wrlock(&fetcherBackendsLock);
+        fetcherBackends[name] = entry;
+        pthread_rwlock_unlock(&fetcherBackendsLock);
+    }
+
+    void unregisterFetcherBackend(const string& name) {
+        pthread_rwlock_wrlock(&fetcherBackendsLock);
+        fetcherBackends.erase(name);
+        pthread_rwlock_unlock(&fetcherBackendsLock);
     }
 }
\ No newline at end of file
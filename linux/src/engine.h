@@ -9,15 +9,82 @@
 #define _ENGINE_H
 
 #include <ibus.h>
+#include <string>
+#include <vector>
 #include "LuaBinding.h"
 
+using std::string;
+using std::vector;
+
 #define IBUS_TYPE_SGPYCC_ENGINE (ibusSgpyccEngineGetType())
 
+typedef struct _IBusSgpyccEngine IBusSgpyccEngine;
+
 GType ibusSgpyccEngineGetType(void);
 
 namespace ImeEngine {
     // lua C functions
     extern void registerLuaFunctions();
+
+    /**
+     * receives everything an engine shows. engines created by ibus send
+     * it to ibus through an output of their own. called in main loop.
+     * ibus objects are owned by engine, outputs take references if needed
+     */
+    class EngineOutput {
+    public:
+        virtual ~EngineOutput() {}
+        virtual void commitText(const string& text) = 0;
+        /**
+         * @param attributes colors and underline of text
+         */
+        virtual void updatePreedit(const string& text, IBusAttrList* attributes, const unsigned int cursor, const bool visible) = 0;
+        /**
+         * @param table has candidates with labels, colors, page and cursor
+         * @param candidates texts of candidates in table
+         */
+        virtual void updateLookupTable(IBusLookupTable* table, const vector<string>& candidates, const bool visible) = 0;
+        virtual void updateAuxiliaryText(const string& text, const bool visible) = 0;
+        virtual void updateProperties(IBusPropList* properties) = 0;
+    };
+
+    /**
+     * engine without ibus connection, enabled and focused, everything
+     * it shows goes to output. see Session
+     */
+    IBusSgpyccEngine* createHeadlessEngine(EngineOutput* output);
+    /**
+     * fetches of engine should be finished before, see getRunningFetchCount
+     */
+    void destroyHeadlessEngine(IBusSgpyccEngine* engine);
+
+    const bool processKeyEvent(IBusSgpyccEngine* engine, const unsigned int keyval, const unsigned int keycode, const unsigned int state);
+    void focusIn(IBusSgpyccEngine* engine);
+    void focusOut(IBusSgpyccEngine* engine);
+    void reset(IBusSgpyccEngine* engine);
+    /**
+     * @return count of requests in engine's queue, answered or not
+     */
+    const size_t getRequestCount(IBusSgpyccEngine* engine);
+    /**
+     * @return count of request and pre-request threads that may still use
+     *         engine. pre-requests of other engines are counted too
+     */
+    const size_t getRunningFetchCount(IBusSgpyccEngine* engine);
+
+    /**
+     * fetcher running in process, takes and gives what fetcher script does:
+     * output is full result on first line then words, empty if fails.
+     * called in request threads, should give up after timeout (sec) and
+     * when PinyinCloudClient::isCurrentFetchCancelled()
+     */
+    typedef string(*FetcherBackend)(void* param, const string& requestString, const double timeout);
+    /**
+     * while registered, fetcher_path equal to name calls backend instead
+     * of running a command. unregister only when no fetch is running
+     */
+    void registerFetcherBackend(const string& name, FetcherBackend backend, void* param);
+    void unregisterFetcherBackend(const string& name);
 }
 
 #endif  /* _ENGINE_H */
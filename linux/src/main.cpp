@@ -24,9 +24,15 @@
 #include "Configuration.h"
 #include "PinyinDatabase.h"
 #include "DoublePinyinScheme.h"
+#include "LatencyHistogram.h"
+#include "ProcessSupervisor.h"
+#include "Metrics.h"
+#include "Tracer.h"
+#include "GtkDesktop.h"
 
 static IBusBus *bus = NULL; // Connect with IBus daemon.
 static IBusFactory *factory = NULL;
+static GtkDesktop *desktop = NULL;
 
 static void ibus_disconnected_cb(IBusBus *bus, gpointer user_data) {
     ibus_quit();
@@ -71,8 +77,9 @@ static void ibusRegister(bool callByIbus) {
 }
 
 void* staticInitThreadFunc(void*) {
-    // static selection clipboard monitor
-    XUtility::staticInit();
+    // selection clipboard monitor and notifies
+    desktop = new GtkDesktop();
+    XUtility::setDesktop(desktop);
 
     DEBUG_PRINT(1, "[MAIN] staticInitThreadFunc: start to load config.lua\n");
     // load global config (may contain dict loading and online update checking)
@@ -100,6 +107,9 @@ int main(int argc, char *argv[]) {
 
     if ((argc > 1 && strstr(argv[1], "-d")) || getenv("DEBUG")) globalDebugLevel = 10;
 
+    // debug output goes through log writer thread from now on
+    Logger::staticInit();
+
     // call dbus and glib, gdk multi thread init functions
     g_thread_init(NULL);
     gdk_threads_init();
@@ -121,6 +131,8 @@ int main(int argc, char *argv[]) {
     DoublePinyinScheme::registerLuaFunctions();
     PinyinDatabase::registerLuaFunctions();
     PinyinUtility::registerLuaFunctions();
+    Metrics::registerLuaFunctions();
+    Tracer::registerLuaFunctions();
 
 
     // static inits
@@ -128,6 +140,10 @@ int main(int argc, char *argv[]) {
     PinyinCloudClient::staticInit();
     PinyinUtility::staticInit();
     PinyinDatabase::staticInit();
+    LatencyHistogram::staticInit();
+    ProcessSupervisor::staticInit();
+    Metrics::staticInit();
+    Tracer::staticInit();
     
     // register ime
     ibusRegister(argc > 1 && strstr(argv[1], "-i"));
@@ -152,14 +168,20 @@ int main(int argc, char *argv[]) {
     DEBUG_PRINT(1, "[MAIN] Exiting from ibus_main() ...\n");
 
     // clean up static vars
-    XUtility::staticDestruct();
+    XUtility::setDesktop(NULL);
+    if (desktop) delete desktop;
     Configuration::staticDestruct();
     PinyinCloudClient::staticDestruct();
     PinyinDatabase::staticDestruct();
     PinyinUtility::staticDestruct();
+    LatencyHistogram::staticDestruct();
+    ProcessSupervisor::staticDestruct();
+    Metrics::staticDestruct();
+    Tracer::staticDestruct();
 
     LuaBinding::staticDestruct();
 
+    Logger::staticDestruct();
     return 0;
 }
 
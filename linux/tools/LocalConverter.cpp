@@ -0,0 +1,144 @@
+/*
+ * File:   LocalConverter.cpp
+ * Author: WU Jun <quark@lihdd.net>
+ */
+
+#include <vector>
+#include <map>
+#include <glib.h>
+
+#include "LocalConverter.h"
+#include "defines.h"
+#include "Session.h"
+#include "Configuration.h"
+#include "LuaBinding.h"
+#include "PinyinSequence.h"
+#include "PinyinCloudClient.h"
+
+using std::vector;
+using std::map;
+
+// request_cache copied by snapshotRequestCache, read only after that
+static map<string, string> requestCacheSnapshot;
+static bool requestCacheSnapshotted = false;
+
+static const string getRequestCache(const string& pinyins) {
+    if (!requestCacheSnapshotted) return Configuration::getGlobalCache(pinyins, true);
+    map<string, string>::const_iterator it = requestCacheSnapshot.find(pinyins);
+    return it == requestCacheSnapshot.end() ? "" : it->second;
+}
+
+/**
+ * pinyins nothing converts are kept, without separators
+ */
+static const string joinPinyins(const string& pinyins) {
+    PinyinSequence ps = pinyins;
+    string res;
+    for (size_t i = 0; i < ps.size(); ++i) res += ps[i];
+    return res;
+}
+
+/**
+ * longest prefix of pinyins from startIndex known by cache or cloud words
+ * @param length out, pinyins covered, 0 if none
+ */
+static const string getLongestKnownPrefix(const PinyinSequence& ps, const size_t startIndex, const bool useCache, const bool useWords, size_t& length) {
+    for (length = ps.size() - startIndex; length > 0; length--) {
+        string pinyins = ps.toString(startIndex, length);
+        if (useCache) {
+            string cache = getRequestCache(pinyins);
+            if (!cache.empty()) return cache;
+        }
+        if (useWords) {
+            vector<string> words = PinyinCloudClient::queryMemoryDatabase(pinyins);
+            if (!words.empty()) return words[0];
+        }
+    }
+    return "";
+}
+
+static const string convertKnownPrefixes(PinyinDatabase* database, const string& pinyins, const double longPhraseAdjust, const bool useCache, const bool useWords) {
+    PinyinSequence ps = pinyins;
+    string res, unknownPinyins;
+    for (size_t i = 0; i < ps.size();) {
+        size_t length;
+        string converted = getLongestKnownPrefix(ps, i, useCache, useWords, length);
+        if (length == 0) {
+            unknownPinyins += (unknownPinyins.empty() ? "" : " ") + ps[i++];
+            continue;
+        }
+        if (!unknownPinyins.empty()) {
+            res += database ? database->greedyConvert(unknownPinyins, longPhraseAdjust) : joinPinyins(unknownPinyins);
+            unknownPinyins.clear();
+        }
+        res += converted;
+        i += length;
+    }
+    if (!unknownPinyins.empty()) res += database ? database->greedyConvert(unknownPinyins, longPhraseAdjust) : joinPinyins(unknownPinyins);
+    return res;
+}
+
+const string LocalConverter::convertGreedy(PinyinDatabase* database, const string& pinyins, const double longPhraseAdjust) {
+    if (!database) return joinPinyins(pinyins);
+    return database->greedyConvert(pinyins, longPhraseAdjust);
+}
+
+const string LocalConverter::convertFirstCandidate(PinyinDatabase* database, const string& pinyins, const double longPhraseAdjust) {
+    PinyinSequence ps = pinyins;
+    string res;
+    for (size_t i = 0; i < ps.size();) {
+        CandidateList candidates;
+        if (database) database->query(ps.toString(i, 0), candidates, 1, longPhraseAdjust);
+        size_t length = candidates.empty() ? 0 : g_utf8_strlen(candidates.begin()->second.c_str(), -1);
+        if (length == 0 || i + length > ps.size()) {
+            res += ps[i++];
+            continue;
+        }
+        res += candidates.begin()->second;
+        i += length;
+    }
+    return res;
+}
+
+const string LocalConverter::convertRequestCache(PinyinDatabase* database, const string& pinyins, const double longPhraseAdjust) {
+    UNUSED(database);
+    UNUSED(longPhraseAdjust);
+    return convertKnownPrefixes(NULL, pinyins, 0, true, false);
+}
+
+const string LocalConverter::convertCloudWords(PinyinDatabase* database, const string& pinyins, const double longPhraseAdjust) {
+    UNUSED(database);
+    UNUSED(longPhraseAdjust);
+    return convertKnownPrefixes(NULL, pinyins, 0, false, true);
+}
+
+const string LocalConverter::convertCombined(PinyinDatabase* database, const string& pinyins, const double longPhraseAdjust) {
+    return convertKnownPrefixes(database, pinyins, longPhraseAdjust, true, true);
+}
+
+LocalConverter::ConvertFunction LocalConverter::getConvertFunction(const string& name) {
+    if (name == "greedy") return convertGreedy;
+    if (name == "candidate") return convertFirstCandidate;
+    if (name == "cache") return convertRequestCache;
+    if (name == "words") return convertCloudWords;
+    if (name == "combined") return convertCombined;
+    return NULL;
+}
+
+size_t LocalConverter::snapshotRequestCache() {
+    requestCacheSnapshot.clear();
+    vector<string> keys = LuaBinding::getStaticBinding().getTableKeys("request_cache");
+    for (size_t i = 0; i < keys.size(); ++i) {
+        string cache = Configuration::getGlobalCache(keys[i], true);
+        if (!cache.empty()) requestCacheSnapshot[keys[i]] = cache;
+    }
+    requestCacheSnapshotted = true;
+    return requestCacheSnapshot.size();
+}
+
+int LocalConverter::loadCloudWords(const string& path) {
+    vector<pair<string, string> > words;
+    int count = Session::readWordList(path, words);
+    for (size_t i = 0; i < words.size(); ++i) PinyinCloudClient::addToMemoryDatabase(PinyinSequence(words[i].first).toString(), words[i].second);
+    return count;
+}
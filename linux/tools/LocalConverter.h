@@ -0,0 +1,67 @@
+/*
+ * File:   LocalConverter.h
+ * Author: WU Jun <quark@lihdd.net>
+ *
+ * whole sentence conversion without cloud, from phrase database, request
+ * cache and cloud memory words. shared by sgpycc-eval and sgpycc-convert.
+ *
+ * database is a parameter so each worker thread can use its own sqlite
+ * connection. NULL database keeps pinyins database would convert.
+ */
+
+#ifndef _LOCALCONVERTER_H
+#define	_LOCALCONVERTER_H
+
+#include <string>
+#include "PinyinDatabase.h"
+
+using std::string;
+
+namespace LocalConverter {
+    typedef const string(*ConvertFunction)(PinyinDatabase* database, const string& pinyins, const double longPhraseAdjust);
+
+    /**
+     * what user gets if cloud fails (fallback_use_db)
+     */
+    const string convertGreedy(PinyinDatabase* database, const string& pinyins, const double longPhraseAdjust);
+    /**
+     * what user gets choosing first lookup table candidate until all converted
+     */
+    const string convertFirstCandidate(PinyinDatabase* database, const string& pinyins, const double longPhraseAdjust);
+    /**
+     * longest cached prefix, again and again, like partial cache convert
+     * of engine. pinyins not cached are kept
+     */
+    const string convertRequestCache(PinyinDatabase* database, const string& pinyins, const double longPhraseAdjust);
+    /**
+     * longest word in cloud memory database, pinyins without word are kept
+     */
+    const string convertCloudWords(PinyinDatabase* database, const string& pinyins, const double longPhraseAdjust);
+    /**
+     * request cache, then cloud words, then greedy database for the rest
+     */
+    const string convertCombined(PinyinDatabase* database, const string& pinyins, const double longPhraseAdjust);
+
+    /**
+     * @param name greedy, candidate, cache, words or combined
+     * @return NULL if name is unknown
+     */
+    ConvertFunction getConvertFunction(const string& name);
+
+    /**
+     * one line per word: pinyins (separated by space), tab, text
+     * @return count of words, -1 if file can not be read
+     */
+    int loadCloudWords(const string& path);
+
+    /**
+     * copy request_cache (weak entries included) out of lua. later cache
+     * lookups read the copy, threads do not queue on lua state lock.
+     * call once request_cache is filled, before threads start
+     * @return count of entries
+     */
+    size_t snapshotRequestCache();
+};
+
+#endif	/* _LOCALCONVERTER_H */
+
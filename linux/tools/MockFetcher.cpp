@@ -0,0 +1,283 @@
+/*
+ * File:   MockFetcher.cpp
+ * Author: WU Jun <quark@lihdd.net>
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <cctype>
+#include <vector>
+#include <unistd.h>
+
+#include "MockFetcher.h"
+#include "Session.h"
+#include "defines.h"
+#include "engine.h"
+#include "PinyinSequence.h"
+#include "PinyinDatabase.h"
+#include "PinyinCloudClient.h"
+#include "XUtility.h"
+
+using std::vector;
+
+// cancellation is checked this often (usec) while sleeping
+#define MOCK_SLEEP_STEP 2000
+
+MockFetcher::MockFetcher(const string& name) {
+    this->name = name;
+    distribution = LATENCY_FIXED;
+    latencyMean = latencyJitter = failureRate = 0;
+    maxWordLength = 0;
+    fetchCount = failureCount = timeoutCount = cancelCount = 0;
+    randomState = 1;
+    pthread_mutex_init(&randomLock, NULL);
+    ImeEngine::registerFetcherBackend(name, fetch, (void*) this);
+}
+
+MockFetcher::MockFetcher(const MockFetcher& orig) {
+}
+
+MockFetcher::~MockFetcher() {
+    ImeEngine::unregisterFetcherBackend(name);
+    pthread_mutex_destroy(&randomLock);
+}
+
+const string& MockFetcher::getName() const {
+    return name;
+}
+
+void MockFetcher::setLatency(const LatencyDistribution distribution, const double mean, const double jitter) {
+    this->distribution = distribution;
+    latencyMean = mean;
+    latencyJitter = jitter;
+}
+
+bool MockFetcher::setLatency(const string& spec) {
+    vector<string> fields = splitString(spec, ':');
+    if (fields.size() < 2 || fields.size() > 3) return false;
+
+    double mean = atof(fields[1].c_str()) / 1000, jitter = fields.size() > 2 ? atof(fields[2].c_str()) / 1000 : 0;
+    if (mean < 0 || jitter < 0) return false;
+
+    if (fields[0] == "fixed") setLatency(LATENCY_FIXED, mean);
+    else if (fields[0] == "uniform") setLatency(LATENCY_UNIFORM, mean, jitter);
+    else if (fields[0] == "exp") setLatency(LATENCY_EXPONENTIAL, mean);
+    else if (fields[0] == "lognormal") setLatency(LATENCY_LOGNORMAL, mean, jitter);
+    else return false;
+    return true;
+}
+
+void MockFetcher::setFailureRate(const double rate) {
+    failureRate = rate;
+}
+
+void MockFetcher::setSeed(const unsigned int seed) {
+    pthread_mutex_lock(&randomLock);
+    randomState = seed;
+    pthread_mutex_unlock(&randomLock);
+}
+
+void MockFetcher::addWord(const string& pinyins, const string& text) {
+    PinyinSequence ps = pinyins;
+    if (ps.size() == 0) return;
+    words[ps.toString()] = text;
+    if (ps.size() > maxWordLength) maxWordLength = ps.size();
+}
+
+int MockFetcher::loadWords(const string& path) {
+    vector<pair<string, string> > wordList;
+    int count = Session::readWordList(path, wordList);
+    for (size_t i = 0; i < wordList.size(); ++i) addWord(wordList[i].first, wordList[i].second);
+    return count;
+}
+
+const string MockFetcher::convertWords(const string& requestString, vector<pair<string, string> >& wordsFound) {
+    PinyinSequence ps = requestString;
+    string res, unknownPinyins;
+
+    // longest word first, pinyins no word covers go to local db
+    for (size_t i = 0; i <= ps.size(); ++i) {
+        size_t length = maxWordLength;
+        if (length > ps.size() - i) length = ps.size() - i;
+        map<string, string>::const_iterator it = words.end();
+        for (; length > 0; length--) {
+            it = words.find(ps.toString(i, length));
+            if (it != words.end()) break;
+        }
+
+        if (length == 0 && i < ps.size()) {
+            unknownPinyins += (unknownPinyins.empty() ? "" : " ") + ps[i];
+            continue;
+        }
+
+        if (!unknownPinyins.empty()) {
+            res += PinyinDatabase::getPinyinDatabases().empty() ? unknownPinyins
+                    : PinyinDatabase::getPinyinDatabases().begin()->second->greedyConvert(unknownPinyins);
+            unknownPinyins.clear();
+        }
+        if (length == 0) break;
+
+        res += it->second;
+        wordsFound.push_back(pair<string, string > (it->second, it->first));
+        i += length - 1;
+    }
+    return res;
+}
+
+const string MockFetcher::convert(const string& requestString) {
+    vector<pair<string, string> > wordsFound;
+    string res = convertWords(requestString, wordsFound);
+    if (res.empty()) return "";
+
+    res += "\n";
+    for (size_t i = 0; i < wordsFound.size(); ++i) {
+        if (wordsFound[i].second.find(' ') != string::npos) res += wordsFound[i].first + "\n";
+    }
+    return res;
+}
+
+const string MockFetcher::getImeCallback(const string& requestString) {
+    vector<pair<string, string> > wordsFound;
+    string res = convertWords(requestString, wordsFound);
+    PinyinSequence ps = requestString;
+
+    string content = res + "：" + ps.toString(0, 0, '\'');
+    for (size_t i = 0; i < wordsFound.size(); ++i) {
+        content += "+" + wordsFound[i].first + "：" + PinyinSequence(wordsFound[i].second).toString(0, 0, '\'');
+    }
+
+    // escape like server does, everything not alphanumeric
+    string escaped;
+    char buffer[4];
+    for (size_t i = 0; i < content.length(); ++i) {
+        unsigned char c = (unsigned char) content[i];
+        if (isalnum(c)) {
+            escaped += (char) c;
+        } else {
+            snprintf(buffer, sizeof (buffer), "%%%02X", c);
+            escaped += buffer;
+        }
+    }
+    return "ime_callback(\"" + escaped + "\")";
+}
+
+const string MockFetcher::parseImeCallback(const string& response) {
+    const string prefix = "ime_callback(\"";
+    size_t start = response.find(prefix);
+    if (start == string::npos) return "";
+    start += prefix.length();
+    size_t end = response.find('"', start);
+    if (end == string::npos) return "";
+
+    string content;
+    for (size_t i = start; i < end; ++i) {
+        if (response[i] == '%' && i + 2 < end) {
+            content += (char) strtol(response.substr(i + 1, 2).c_str(), NULL, 16);
+            i += 2;
+        } else {
+            content += response[i];
+        }
+    }
+
+    // first word, then words after '+', each followed by its pinyins
+    const string separator = "：";
+    size_t pos = content.find(separator);
+    // fetcher script takes a first word of 2 bytes or less as invalid
+    if (pos == string::npos || pos <= 2) return "";
+    string output = content.substr(0, pos) + "\n";
+    for (size_t plus = content.find('+', pos); plus != string::npos; plus = content.find('+', plus + 1)) {
+        size_t wordEnd = content.find(separator, plus);
+        if (wordEnd == string::npos) break;
+        output += content.substr(plus + 1, wordEnd - plus - 1) + "\n";
+    }
+    return output;
+}
+
+const long long MockFetcher::getFetchCount() const {
+    return fetchCount;
+}
+
+const long long MockFetcher::getFailureCount() const {
+    return failureCount;
+}
+
+const long long MockFetcher::getTimeoutCount() const {
+    return timeoutCount;
+}
+
+const long long MockFetcher::getCancelCount() const {
+    return cancelCount;
+}
+
+const double MockFetcher::getRandom() {
+    pthread_mutex_lock(&randomLock);
+    double r = (double) rand_r(&randomState) / ((double) RAND_MAX + 1);
+    pthread_mutex_unlock(&randomLock);
+    return r;
+}
+
+const double MockFetcher::getLatency() {
+    double latency = latencyMean;
+    switch (distribution) {
+        case LATENCY_FIXED:
+            break;
+        case LATENCY_UNIFORM:
+            latency = latencyMean + latencyJitter * (2 * getRandom() - 1);
+            break;
+        case LATENCY_EXPONENTIAL:
+            latency = -latencyMean * log(1 - getRandom());
+            break;
+        case LATENCY_LOGNORMAL:
+        {
+            if (latencyMean <= 0) break;
+            // mu and sigma of underlying normal, from mean and stddev
+            double sigma2 = log(1 + (latencyJitter * latencyJitter) / (latencyMean * latencyMean));
+            double mu = log(latencyMean) - sigma2 / 2;
+            // box-muller
+            double u1 = 1 - getRandom(), u2 = getRandom();
+            double z = sqrt(-2 * log(u1)) * cos(2 * M_PI * u2);
+            latency = exp(mu + sqrt(sigma2) * z);
+            break;
+        }
+    }
+    return latency < 0 ? 0 : latency;
+}
+
+const MockFetcher::Outcome MockFetcher::wait(const double timeout) {
+    __sync_fetch_and_add(&fetchCount, 1);
+
+    double latency = getLatency();
+    bool failed = getRandom() < failureRate;
+    bool timedOut = timeout > 0 && latency > timeout;
+    if (timedOut) latency = timeout;
+
+    // sleep like waiting for network, give up if cancelled
+    long long wakeTime = XUtility::getMonotonicTime() + (long long) (latency * XUtility::MICROSECOND_PER_SECOND);
+    for (long long now = XUtility::getMonotonicTime(); now < wakeTime; now = XUtility::getMonotonicTime()) {
+        if (PinyinCloudClient::isCurrentFetchCancelled()) {
+            __sync_fetch_and_add(&cancelCount, 1);
+            return OUTCOME_CANCELLED;
+        }
+        usleep(wakeTime - now < MOCK_SLEEP_STEP ? wakeTime - now : MOCK_SLEEP_STEP);
+    }
+
+    if (timedOut) {
+        __sync_fetch_and_add(&timeoutCount, 1);
+        return OUTCOME_TIMED_OUT;
+    }
+    if (failed) {
+        __sync_fetch_and_add(&failureCount, 1);
+        return OUTCOME_FAILED;
+    }
+    return OUTCOME_OK;
+}
+
+string MockFetcher::fetch(void* param, const string& requestString, const double timeout) {
+    MockFetcher* fetcher = (MockFetcher*) param;
+    if (fetcher->wait(timeout) != OUTCOME_OK) return "";
+
+    DEBUG_PRINT(4, "[MOCK] fetch(%s)\n", requestString.c_str());
+    // round trip through server response shape
+    return parseImeCallback(fetcher->getImeCallback(requestString));
+}
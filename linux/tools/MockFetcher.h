@@ -0,0 +1,135 @@
+/*
+ * File:   MockFetcher.h
+ * Author: WU Jun <quark@lihdd.net>
+ *
+ * in-process stand-in for fetcher script, registered as an engine fetcher
+ * backend. answers from a word list (and local db if loaded) after an
+ * injected latency, fails at a given rate. for benchmarks and tools.
+ *
+ * answers are built in the shape cloud server gives (ime_callback) and
+ * parsed back like fetcher script does, MockServer serves the same shape
+ * over http to the real fetcher script.
+ */
+
+#ifndef _MOCKFETCHER_H
+#define	_MOCKFETCHER_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <pthread.h>
+
+using std::string;
+using std::vector;
+using std::map;
+using std::pair;
+
+class MockFetcher {
+public:
+    enum LatencyDistribution {
+        LATENCY_FIXED, // always mean
+        LATENCY_UNIFORM, // mean +- jitter
+        LATENCY_EXPONENTIAL, // jitter is ignored
+        LATENCY_LOGNORMAL // jitter is standard deviation
+    };
+
+    enum Outcome {
+        OUTCOME_OK,
+        OUTCOME_FAILED,
+        OUTCOME_TIMED_OUT,
+        OUTCOME_CANCELLED
+    };
+
+    /**
+     * registered as fetcher backend name, set ime.fetcher_path to it
+     */
+    MockFetcher(const string& name = "mock");
+    virtual ~MockFetcher();
+
+    const string& getName() const;
+
+    /**
+     * @param mean, jitter seconds
+     */
+    void setLatency(const LatencyDistribution distribution, const double mean, const double jitter = 0);
+    /**
+     * parse "fixed:mean", "uniform:mean:jitter", "exp:mean" or
+     * "lognormal:mean:stddev", times in ms
+     * @return false if spec is invalid
+     */
+    bool setLatency(const string& spec);
+    /**
+     * @param rate 0 - 1, failed fetches give empty output
+     */
+    void setFailureRate(const double rate);
+    void setSeed(const unsigned int seed);
+
+    /**
+     * @param pinyins separated by space
+     */
+    void addWord(const string& pinyins, const string& text);
+    /**
+     * one word per line: pinyins (separated by space), tab, text
+     * @return count of words loaded, -1 if file can not be read
+     */
+    int loadWords(const string& path);
+
+    /**
+     * what fetcher script writes for requestString, without delay
+     */
+    const string convert(const string& requestString);
+    /**
+     * what cloud server responses for requestString, without delay:
+     * ime_callback("<url escaped full：pinyins+word：pinyins...>")
+     */
+    const string getImeCallback(const string& requestString);
+    /**
+     * parse server response like fetcher script does
+     * @return fetcher output, empty if response is invalid
+     */
+    static const string parseImeCallback(const string& response);
+
+    /**
+     * count a fetch, sleep for an injected latency and decide its outcome.
+     * @param timeout seconds, not limited if <= 0
+     */
+    const Outcome wait(const double timeout = 0);
+
+    const long long getFetchCount() const;
+    const long long getFailureCount() const;
+    const long long getTimeoutCount() const;
+    const long long getCancelCount() const;
+private:
+    MockFetcher(const MockFetcher& orig);
+
+    static string fetch(void* param, const string& requestString, const double timeout);
+    /**
+     * @return 0 - 1, thread safe
+     */
+    const double getRandom();
+    /**
+     * @return seconds
+     */
+    const double getLatency();
+    /**
+     * @param words (text, pinyins) of words found, in order
+     * @return full result
+     */
+    const string convertWords(const string& requestString, vector<pair<string, string> >& words);
+
+    string name;
+    LatencyDistribution distribution;
+    double latencyMean, latencyJitter, failureRate;
+
+    pthread_mutex_t randomLock;
+    unsigned int randomState;
+
+    // words are added before fetches start
+    map<string, string> words;
+    size_t maxWordLength;
+
+    volatile long long fetchCount, failureCount, timeoutCount, cancelCount;
+};
+
+#endif	/* _MOCKFETCHER_H */
+
@@ -0,0 +1,254 @@
+/*
+ * File:   MockServer.cpp
+ * Author: WU Jun <quark@lihdd.net>
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "MockServer.h"
+#include "defines.h"
+#include "PinyinUtility.h"
+
+using std::map;
+
+struct ConnectionData {
+    MockServer* server;
+    int fd;
+};
+
+static const string unescapeUrl(const string& s) {
+    string res;
+    for (size_t i = 0; i < s.length(); ++i) {
+        if (s[i] == '%' && i + 2 < s.length()) {
+            res += (char) strtol(s.substr(i + 1, 2).c_str(), NULL, 16);
+            i += 2;
+        } else if (s[i] == '+') {
+            res += ' ';
+        } else {
+            res += s[i];
+        }
+    }
+    return res;
+}
+
+/**
+ * @return query parameters of path, unescaped
+ */
+static map<string, string> parseQuery(const string& path) {
+    map<string, string> params;
+    size_t pos = path.find('?');
+    while (pos != string::npos) {
+        size_t end = path.find('&', pos + 1);
+        string param = path.substr(pos + 1, end == string::npos ? string::npos : end - pos - 1);
+        size_t equal = param.find('=');
+        if (equal != string::npos) params[param.substr(0, equal)] = unescapeUrl(param.substr(equal + 1));
+        pos = end;
+    }
+    return params;
+}
+
+static const char* getStatusText(const int status) {
+    switch (status) {
+        case 200: return "OK";
+        case 400: return "Bad Request";
+        case 404: return "Not Found";
+        default: return "Service Unavailable";
+    }
+}
+
+MockServer::MockServer(MockFetcher& fetcher, const string& key) : fetcher(fetcher) {
+    this->key = key;
+    listenFd = -1;
+    port = 0;
+    running = false;
+    connectionCount = 0;
+    requestCount = 0;
+    pthread_mutex_init(&connectionsLock, NULL);
+    pthread_cond_init(&connectionsCond, NULL);
+}
+
+MockServer::MockServer(const MockServer& orig) : fetcher(orig.fetcher) {
+}
+
+MockServer::~MockServer() {
+    stop();
+    pthread_cond_destroy(&connectionsCond);
+    pthread_mutex_destroy(&connectionsLock);
+}
+
+bool MockServer::start(const int port) {
+    if (running) return true;
+
+    listenFd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listenFd < 0) return false;
+    int reuse = 1;
+    setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof (reuse));
+
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof (address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+    socklen_t addressLength = sizeof (address);
+    if (bind(listenFd, (struct sockaddr*) &address, sizeof (address)) || listen(listenFd, 64)
+            || getsockname(listenFd, (struct sockaddr*) &address, &addressLength)) {
+        close(listenFd);
+        listenFd = -1;
+        return false;
+    }
+    this->port = ntohs(address.sin_port);
+
+    running = true;
+    if (pthread_create(&acceptThread, NULL, acceptThreadFunc, (void*) this)) {
+        running = false;
+        close(listenFd);
+        listenFd = -1;
+        return false;
+    }
+    DEBUG_PRINT(1, "[MOCK] server listening on %s\n", getUrl().c_str());
+    return true;
+}
+
+void MockServer::stop() {
+    if (!running) return;
+    running = false;
+
+    // wakes accept() up
+    shutdown(listenFd, SHUT_RDWR);
+    pthread_join(acceptThread, NULL);
+    close(listenFd);
+    listenFd = -1;
+
+    pthread_mutex_lock(&connectionsLock);
+    while (connectionCount > 0) pthread_cond_wait(&connectionsCond, &connectionsLock);
+    pthread_mutex_unlock(&connectionsLock);
+}
+
+const int MockServer::getPort() const {
+    return port;
+}
+
+const string MockServer::getUrl() const {
+    char buffer[64];
+    snprintf(buffer, sizeof (buffer), "http://127.0.0.1:%d", port);
+    return buffer;
+}
+
+const long long MockServer::getRequestCount() const {
+    return requestCount;
+}
+
+void* MockServer::acceptThreadFunc(void* data) {
+    MockServer* server = (MockServer*) data;
+    while (server->running) {
+        int fd = accept(server->listenFd, NULL, NULL);
+        if (fd < 0) continue;
+
+        // one thread per connection, fetcher script sends one request each
+        ConnectionData* connection = new ConnectionData();
+        connection->server = server;
+        connection->fd = fd;
+        pthread_mutex_lock(&server->connectionsLock);
+        server->connectionCount++;
+        pthread_mutex_unlock(&server->connectionsLock);
+
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, connectionThreadFunc, (void*) connection) == 0) {
+            pthread_detach(thread);
+        } else {
+            connectionThreadFunc((void*) connection);
+        }
+    }
+    return NULL;
+}
+
+void* MockServer::connectionThreadFunc(void* data) {
+    ConnectionData* connection = (ConnectionData*) data;
+    MockServer* server = connection->server;
+    server->serveConnection(connection->fd);
+    close(connection->fd);
+    delete connection;
+
+    pthread_mutex_lock(&server->connectionsLock);
+    if (--server->connectionCount == 0) pthread_cond_broadcast(&server->connectionsCond);
+    pthread_mutex_unlock(&server->connectionsLock);
+    return NULL;
+}
+
+void MockServer::serveConnection(const int fd) {
+    // only request line matters, read until end of headers
+    string request;
+    char buffer[1024];
+    while (request.find("\r\n\r\n") == string::npos && request.length() < 16384) {
+        ssize_t size = read(fd, buffer, sizeof (buffer));
+        if (size <= 0) break;
+        request.append(buffer, size);
+    }
+
+    char method[16], path[4096];
+    if (sscanf(request.c_str(), "%15s %4095s", method, path) != 2) return;
+    __sync_fetch_and_add(&requestCount, 1);
+
+    int status = 200;
+    string body = handleRequest(path, status);
+    DEBUG_PRINT(3, "[MOCK] %s %s => %d\n", method, path, status);
+
+    char header[256];
+    snprintf(header, sizeof (header), "HTTP/1.0 %d %s\r\nContent-Type: text/javascript; charset=utf-8\r\n"
+            "Content-Length: %d\r\nConnection: close\r\n\r\n",
+            status, getStatusText(status), (int) body.length());
+    string response = header + body;
+    for (size_t written = 0; written < response.length();) {
+        ssize_t size = write(fd, response.data() + written, response.length() - written);
+        if (size <= 0) break;
+        written += size;
+    }
+}
+
+const string MockServer::handleRequest(const string& path, int& status) {
+    string name = path.substr(0, path.find('?'));
+    map<string, string> params = parseQuery(path);
+
+    if (name == "/web_ime/patch.php") {
+        return "ime_patch_key = \"" + key + "\";";
+    }
+
+    if (name == "/api/py") {
+        // no ime_callback for a wrong key, fetcher script counts it as failed
+        if (params["key"] != key) return "ime_query_res=\"\";";
+
+        MockFetcher::Outcome outcome = fetcher.wait();
+        if (outcome != MockFetcher::OUTCOME_OK) {
+            status = 503;
+            return "";
+        }
+
+        string query;
+        for (size_t i = 0; i < params["query"].length(); ++i) {
+            char c = params["query"][i];
+            if (c >= 'a' && c <= 'z') query += c;
+        }
+        return fetcher.getImeCallback(PinyinUtility::separatePinyins(query));
+    }
+
+    if (name == "/control") {
+        if (params.count("latency") && !fetcher.setLatency(params["latency"])) {
+            status = 400;
+            return "invalid latency\n";
+        }
+        if (params.count("failure")) fetcher.setFailureRate(atof(params["failure"].c_str()));
+        if (params.count("seed")) fetcher.setSeed((unsigned int) atoi(params["seed"].c_str()));
+        return "ok\n";
+    }
+
+    status = 404;
+    return "";
+}
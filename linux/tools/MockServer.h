@@ -0,0 +1,68 @@
+/*
+ * File:   MockServer.h
+ * Author: WU Jun <quark@lihdd.net>
+ *
+ * local http stand-in for cloud server, answers what fetcher script asks
+ * (key and /api/py) with a MockFetcher. point fetcher script to it with
+ * SGPYCC_FETCHER_SERVER=<getUrl()>.
+ *
+ *   GET /web_ime/patch.php              key
+ *   GET /api/py?key=<key>&query=<py>    ime_callback("..."), 503 if failed
+ *   GET /control?latency=<spec>&failure=<rate>&seed=<n>
+ */
+
+#ifndef _MOCKSERVER_H
+#define	_MOCKSERVER_H
+
+#include <string>
+#include <pthread.h>
+
+#include "MockFetcher.h"
+
+using std::string;
+
+class MockServer {
+public:
+    MockServer(MockFetcher& fetcher, const string& key = "mockkey");
+    virtual ~MockServer();
+
+    /**
+     * listen on 127.0.0.1 and serve in background threads
+     * @param port 0 picks a free port
+     * @return false if can not listen
+     */
+    bool start(const int port = 0);
+    /**
+     * stop listening and wait for connections being served
+     */
+    void stop();
+
+    const int getPort() const;
+    const string getUrl() const;
+    const long long getRequestCount() const;
+private:
+    MockServer(const MockServer& orig);
+
+    static void* acceptThreadFunc(void* data);
+    static void* connectionThreadFunc(void* data);
+    void serveConnection(const int fd);
+    /**
+     * @param status out, http status code
+     * @return response body
+     */
+    const string handleRequest(const string& path, int& status);
+
+    MockFetcher& fetcher;
+    string key;
+    int listenFd, port;
+    volatile bool running;
+    pthread_t acceptThread;
+
+    pthread_mutex_t connectionsLock;
+    pthread_cond_t connectionsCond;
+    int connectionCount;
+    volatile long long requestCount;
+};
+
+#endif	/* _MOCKSERVER_H */
+
@@ -0,0 +1,266 @@
+/*
+ * File:   bench.cpp
+ * Author: WU Jun <quark@lihdd.net>
+ *
+ * micro benchmarks of linguistic primitives on the per keystroke path.
+ * each benchmark runs until it takes at least -t seconds, reports ns/op
+ * and allocs/op (malloc calls of the benchmark thread, std::string and
+ * sqlite included).
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <glib.h>
+
+#include "defines.h"
+#include "Session.h"
+#include "PinyinUtility.h"
+#include "PinyinSequence.h"
+#include "PinyinDatabase.h"
+#include "DoublePinyinScheme.h"
+#include "XUtility.h"
+
+using std::string;
+using std::vector;
+
+// allocation counting, malloc of this program wraps glibc's
+
+static __thread long long allocationCount = 0;
+
+extern "C" {
+    void* __libc_malloc(size_t size);
+    void* __libc_calloc(size_t count, size_t size);
+    void* __libc_realloc(void* pointer, size_t size);
+
+    void* malloc(size_t size) {
+        allocationCount++;
+        return __libc_malloc(size);
+    }
+
+    void* calloc(size_t count, size_t size) {
+        allocationCount++;
+        return __libc_calloc(count, size);
+    }
+
+    void* realloc(void* pointer, size_t size) {
+        allocationCount++;
+        return __libc_realloc(pointer, size);
+    }
+}
+
+// inputs, like what user types
+
+static const char* fullPinyinInputs[] = {
+    "womenzaizheli", "xiangeizhongguorenminyinhang", "jinganglianggenanguodejianggang",
+    "zhonghuarenmingongheguowansui", "xinanxinganxinangxiangeixinao", "nihao", "shijie",
+};
+
+static const char* separatedPinyinInputs[] = {
+    "wo men zai zhe li", "zhong hua ren min gong he guo", "ni hao", "ji suan ji",
+    "xian zai shi shen me shi hou", "da jia hao", "wo men kan dao le",
+};
+
+static const char* characterInputs[][2] = {
+    {"我们在这里", "wo men zai zhe li"},
+    {"中华人民共和国", "zhong hua ren min gong he guo"},
+    {"你好", "ni hao"},
+    {"计算机", "ji suan ji"},
+    {"现在是什么时候", "xian zai shi shen me shi hou"},
+};
+
+// ms pinyin style (zh = v, sh = u), depends on scheme in config
+static const char* doublePinyinInputs[] = {
+    "womfzdveli", "vshwrfmn", "nihk", "jisrji", "uijx",
+};
+
+#define COUNT_OF(array) (sizeof (array) / sizeof (array[0]))
+
+// keep results alive, so calls are not optimized out
+static volatile size_t sink;
+
+static PinyinDatabase* database = NULL;
+
+// time and allocations are counted from here, benchmarks with setup
+// call startBenchmarkTimer again after it
+static long long benchmarkStartTime;
+
+static void startBenchmarkTimer() {
+    allocationCount = 0;
+    benchmarkStartTime = XUtility::getMonotonicTime();
+}
+
+static void benchSeparatePinyins(long long iterations) {
+    for (long long i = 0; i < iterations; ++i)
+        sink += PinyinUtility::separatePinyins(fullPinyinInputs[i % COUNT_OF(fullPinyinInputs)]).length();
+}
+
+static void benchIsCharactersPinyinsMatch(long long iterations) {
+    for (long long i = 0; i < iterations; ++i) {
+        const char** input = characterInputs[i % COUNT_OF(characterInputs)];
+        sink += PinyinUtility::isCharactersPinyinsMatch(input[0], input[1]);
+    }
+}
+
+static void benchCharactersToPinyins(long long iterations) {
+    vector<string> inputs;
+    for (size_t i = 0; i < COUNT_OF(characterInputs); ++i) {
+        // one character per item
+        vector<string> characters = PinyinUtility::splitCharacters(characterInputs[i][0]);
+        string input;
+        for (size_t j = 0; j < characters.size(); ++j) input += (j ? " " : "") + characters[j];
+        inputs.push_back(input);
+    }
+
+    startBenchmarkTimer();
+    for (long long i = 0; i < iterations; ++i)
+        sink += PinyinUtility::charactersToPinyins(inputs[i % inputs.size()], 0).length();
+}
+
+static void benchPinyinSequenceFromString(long long iterations) {
+    PinyinSequence ps;
+    for (long long i = 0; i < iterations; ++i) {
+        ps.fromString(separatedPinyinInputs[i % COUNT_OF(separatedPinyinInputs)]);
+        sink += ps.size();
+    }
+}
+
+static void benchPinyinSequenceToString(long long iterations) {
+    vector<PinyinSequence> inputs;
+    for (size_t i = 0; i < COUNT_OF(separatedPinyinInputs); ++i) inputs.push_back(separatedPinyinInputs[i]);
+
+    startBenchmarkTimer();
+    for (long long i = 0; i < iterations; ++i)
+        sink += inputs[i % inputs.size()].toString().length();
+}
+
+static void benchDoublePinyinQuery(long long iterations) {
+    for (long long i = 0; i < iterations; ++i)
+        sink += DoublePinyinScheme::getDefaultDoublePinyinScheme().query(doublePinyinInputs[i % COUNT_OF(doublePinyinInputs)]).length();
+}
+
+static void benchIsValidDoublePinyin(long long iterations) {
+    for (long long i = 0; i < iterations; ++i)
+        sink += DoublePinyinScheme::getDefaultDoublePinyinScheme().isValidDoublePinyin(doublePinyinInputs[i % COUNT_OF(doublePinyinInputs)]);
+}
+
+static void benchGetPinyinIDs(long long iterations) {
+    static const char* pinyins[] = {"zhuang", "wo", "men", "xian", "ng", "l", "sh", "zh", "a", "er"};
+    int consonantId, vowelId;
+    for (long long i = 0; i < iterations; ++i) {
+        PinyinDatabase::getPinyinIDs(pinyins[i % COUNT_OF(pinyins)], consonantId, vowelId);
+        sink += consonantId + vowelId;
+    }
+}
+
+static void benchDatabaseQuery(long long iterations) {
+    for (long long i = 0; i < iterations; ++i) {
+        CandidateList candidates;
+        database->query(string(separatedPinyinInputs[i % COUNT_OF(separatedPinyinInputs)]), candidates, 16);
+        sink += candidates.size();
+    }
+}
+
+static void benchGreedyConvert(long long iterations) {
+    for (long long i = 0; i < iterations; ++i)
+        sink += database->greedyConvert(string(separatedPinyinInputs[i % COUNT_OF(separatedPinyinInputs)])).length();
+}
+
+struct Benchmark {
+    const char* name;
+    void (*run)(long long iterations);
+    bool needDatabase;
+};
+
+static const Benchmark benchmarks[] = {
+    {"PinyinUtility::separatePinyins", benchSeparatePinyins, false},
+    {"PinyinUtility::isCharactersPinyinsMatch", benchIsCharactersPinyinsMatch, false},
+    {"PinyinUtility::charactersToPinyins", benchCharactersToPinyins, false},
+    {"PinyinSequence::fromString", benchPinyinSequenceFromString, false},
+    {"PinyinSequence::toString", benchPinyinSequenceToString, false},
+    {"DoublePinyinScheme::query", benchDoublePinyinQuery, false},
+    {"DoublePinyinScheme::isValidDoublePinyin", benchIsValidDoublePinyin, false},
+    {"PinyinDatabase::getPinyinIDs", benchGetPinyinIDs, false},
+    {"PinyinDatabase::query", benchDatabaseQuery, true},
+    {"PinyinDatabase::greedyConvert", benchGreedyConvert, true},
+};
+
+/**
+ * grow iterations until a run takes minimumTime (usec)
+ */
+static void runBenchmark(const Benchmark& benchmark, const long long minimumTime) {
+    long long iterations = 1, elapsed = 0, allocations = 0;
+    for (;;) {
+        startBenchmarkTimer();
+        benchmark.run(iterations);
+        elapsed = XUtility::getMonotonicTime() - benchmarkStartTime;
+        allocations = allocationCount;
+        if (elapsed >= minimumTime || iterations >= 1000000000LL) break;
+
+        // aim 20% over, grow at most 100x per round
+        long long next = elapsed > 0 ? (long long) (iterations * 1.2 * minimumTime / elapsed) : iterations * 100;
+        if (next > iterations * 100) next = iterations * 100;
+        if (next <= iterations) next = iterations + 1;
+        iterations = next;
+    }
+    printf("%-42s %12lld %12.1lf ns/op %10.2lf allocs/op\n", benchmark.name, iterations,
+            elapsed * 1000.0 / iterations, (double) allocations / iterations);
+}
+
+static void printUsage() {
+    printf("sgpycc-bench [-c config.lua] [-d pinyin.db] [-t seconds] [filter ...]\n"
+            "  runs benchmarks whose names contain any filter, all if none\n"
+            "  database benchmarks need -d\n");
+}
+
+int main(int argc, char *argv[]) {
+    string configPath = PKGDATADIR "/config.lua", databasePath;
+    double minimumTime = 0.5;
+    vector<string> filters;
+
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) configPath = argv[++i];
+        else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc) databasePath = argv[++i];
+        else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) minimumTime = atof(argv[++i]);
+        else if (strcmp(argv[i], "-h") == 0) {
+            printUsage();
+            return EXIT_SUCCESS;
+        } else filters.push_back(argv[i]);
+    }
+
+    // settings only (double pinyin scheme, adjustments), databases are opened below
+    if (Session::staticInit(Session::getToolConfigScript(configPath))) {
+        fprintf(stderr, "can not load %s\n", configPath.c_str());
+        Session::staticDestruct();
+        return EXIT_FAILURE;
+    }
+
+    if (!databasePath.empty()) {
+        database = new PinyinDatabase(databasePath);
+        if (!database->isDatabaseOpened()) {
+            fprintf(stderr, "can not open %s\n", databasePath.c_str());
+            delete database;
+            database = NULL;
+        }
+    }
+
+    for (size_t i = 0; i < COUNT_OF(benchmarks); ++i) {
+        const Benchmark& benchmark = benchmarks[i];
+        bool selected = filters.empty();
+        for (size_t j = 0; j < filters.size(); ++j) {
+            if (strstr(benchmark.name, filters[j].c_str())) selected = true;
+        }
+        if (!selected) continue;
+        if (benchmark.needDatabase && !database) {
+            printf("%-42s skipped, no database\n", benchmark.name);
+            continue;
+        }
+        runBenchmark(benchmark, (long long) (minimumTime * XUtility::MICROSECOND_PER_SECOND));
+    }
+
+    if (database) delete database;
+    Session::staticDestruct();
+    return EXIT_SUCCESS;
+}
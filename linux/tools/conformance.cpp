@@ -0,0 +1,407 @@
+/*
+ * File:   conformance.cpp
+ * Author: WU Jun <quark@lihdd.net>
+ *
+ * drive request, pre-request, cache writing, timeout and fallback paths
+ * of engine against a MockFetcher, in process and (with -x) through the
+ * real fetcher script talking to a MockServer. prints what each scenario
+ * expects, whether engine behaves so, and how long the user waits.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdarg>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <glib.h>
+#include <ibus.h>
+
+#include "defines.h"
+#include "Session.h"
+#include "LuaBinding.h"
+#include "Configuration.h"
+#include "PinyinCloudClient.h"
+#include "Metrics.h"
+#include "XUtility.h"
+#include "MockFetcher.h"
+#include "MockServer.h"
+
+using std::string;
+using std::vector;
+
+// settings all scenarios start with, features not under test are off
+#define BASE_SETTINGS "ime.use_double_pinyin = false ime.adaptive_timeout = false ime.hedge_requests = false " \
+    "ime.batch_requests = false ime.delta_request = false ime.split_request_length = 0 " \
+    "ime.idle_prefetch = false ime.local_preview = false ime.fallback_use_db = false " \
+    "ime.fallback_pre_request = false ime.cache_segments = false ime.pre_request = false " \
+    "ime.cache_requests = true ime.strict_timeout = true ime.request_timeout = 2 ime.pre_request_timeout = 1 "
+
+static const char* defaultWords[][2] = {
+    {"ni hao", "你好"},
+    {"wo men", "我们"},
+    {"zhong guo", "中国"},
+    {"ren min", "人民"},
+    {"da jia", "大家"},
+    {"dian nao", "电脑"},
+    {"shi jie", "世界"},
+    {"ni", "你"},
+    {"hao", "好"},
+};
+
+struct Context {
+    Session* session;
+    MockFetcher* fetcher;
+    // through fetcher script and MockServer
+    bool external;
+    const char* mode;
+    int failedCount;
+};
+
+static bool checkAndReport(Context& context, const char* scenario, const bool ok, const string& detail) {
+    printf("%s %-14s %-11s %s\n", ok ? "PASS" : "FAIL", scenario, context.mode, detail.c_str());
+    if (!ok) context.failedCount++;
+    return ok;
+}
+
+static void applySettings(const string& settings) {
+    string script = string(BASE_SETTINGS) + settings + " ime.apply_settings()";
+    LuaBinding::getStaticBinding().doString(script.c_str());
+}
+
+static void clearRequestCache() {
+    LuaBinding::getStaticBinding().doString("request_cache = {}");
+}
+
+/**
+ * dispatch until no request or pre-request is running
+ */
+static void waitIdle(Session& session) {
+    long long deadline = XUtility::getMonotonicTime() + 10 * XUtility::MICROSECOND_PER_SECOND;
+    do {
+        session.waitForRequests(deadline - XUtility::getMonotonicTime());
+        usleep(1000);
+    } while ((PinyinCloudClient::preRequestBusy || PinyinCloudClient::isFetchRunning(PRIORITY_PREFETCH))
+            && XUtility::getMonotonicTime() < deadline);
+    session.dispatchPendingUpdates();
+}
+
+/**
+ * type pinyins key by key, without pause
+ */
+static void typePinyins(Session& session, const string& pinyins) {
+    for (size_t i = 0; i < pinyins.length(); ++i) {
+        if (pinyins[i] != ' ') session.typeKey((unsigned char) pinyins[i]);
+    }
+}
+
+/**
+ * press space and wait for commit
+ * @param waitTime out, usec between space and commit
+ */
+static const string commitWithSpace(Session& session, long long& waitTime) {
+    long long startTime = XUtility::getMonotonicTime();
+    session.typeKey(IBUS_space);
+    session.waitForRequests(10 * XUtility::MICROSECOND_PER_SECOND);
+    waitTime = XUtility::getMonotonicTime() - startTime;
+
+    vector<string> commits = session.takeCommits();
+    string text;
+    for (size_t i = 0; i < commits.size(); ++i) text += commits[i];
+    return text;
+}
+
+static const string formatString(const char* format, ...) {
+    char buffer[1024];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(buffer, sizeof (buffer), format, args);
+    va_end(args);
+    return buffer;
+}
+
+static const string getFirstLine(const string& s) {
+    return s.substr(0, s.find('\n'));
+}
+
+// scenarios
+
+/**
+ * cache miss goes to fetcher, result is committed and cached strong
+ */
+static void runRequest(Context& context) {
+    applySettings("");
+    clearRequestCache();
+    context.fetcher->setLatency(MockFetcher::LATENCY_FIXED, 0.05);
+    context.fetcher->setFailureRate(0);
+
+    string expected = getFirstLine(context.fetcher->convert("ni hao"));
+    long long fetches = context.fetcher->getFetchCount(), waitTime;
+    typePinyins(*context.session, "ni hao");
+    string committed = commitWithSpace(*context.session, waitTime);
+    fetches = context.fetcher->getFetchCount() - fetches;
+
+    bool ok = committed == expected && Configuration::getGlobalCache("ni hao") == expected
+            && (context.external ? fetches >= 1 : fetches == 1);
+    checkAndReport(context, "request", ok, formatString("commit '%s' (want '%s') in %.1lf ms, %lld fetches",
+            committed.c_str(), expected.c_str(), waitTime / 1000.0, fetches));
+}
+
+/**
+ * same request again is answered by cache, fetcher is not called
+ */
+static void runCacheHit(Context& context) {
+    string expected = getFirstLine(context.fetcher->convert("ni hao"));
+    long long fetches = context.fetcher->getFetchCount(), waitTime;
+    long long hits = Metrics::getCounter("cache.request.hit").get();
+    typePinyins(*context.session, "ni hao");
+    string committed = commitWithSpace(*context.session, waitTime);
+    fetches = context.fetcher->getFetchCount() - fetches;
+    hits = Metrics::getCounter("cache.request.hit").get() - hits;
+
+    bool ok = committed == expected && fetches == 0 && hits > 0;
+    checkAndReport(context, "cache-hit", ok, formatString("commit '%s' in %.1lf ms, %lld fetches, %lld cache hits",
+            committed.c_str(), waitTime / 1000.0, fetches, hits));
+}
+
+/**
+ * pre-request while typing fills cache, commit needs no fetch
+ */
+static void runPreRequest(Context& context) {
+    applySettings("ime.pre_request = true");
+    clearRequestCache();
+    context.fetcher->setLatency(MockFetcher::LATENCY_FIXED, 0.05);
+    context.fetcher->setFailureRate(0);
+
+    string expected = getFirstLine(context.fetcher->convert("wo men"));
+    long long fetches = context.fetcher->getFetchCount(), waitTime;
+    typePinyins(*context.session, "wo men");
+    waitIdle(*context.session);
+    long long preFetches = context.fetcher->getFetchCount() - fetches;
+    string cached = Configuration::getGlobalCache("wo men");
+
+    fetches = context.fetcher->getFetchCount();
+    string committed = commitWithSpace(*context.session, waitTime);
+    fetches = context.fetcher->getFetchCount() - fetches;
+
+    bool ok = cached == expected && preFetches >= 1 && committed == expected && fetches == 0;
+    checkAndReport(context, "pre-request", ok, formatString("cached '%s' by %lld fetches, commit '%s' in %.1lf ms, %lld more fetches",
+            cached.c_str(), preFetches, committed.c_str(), waitTime / 1000.0, fetches));
+}
+
+/**
+ * aligned prefix and suffix of response are cached, words go to cloud
+ * memory database
+ */
+static void runSegments(Context& context) {
+    applySettings("ime.cache_segments = true ime.cache_segment_min_length = 2");
+    clearRequestCache();
+    context.fetcher->setLatency(MockFetcher::LATENCY_FIXED, 0.05);
+    context.fetcher->setFailureRate(0);
+
+    string expected = getFirstLine(context.fetcher->convert("zhong guo ren min"));
+    long long waitTime;
+    typePinyins(*context.session, "zhong guo ren min");
+    string committed = commitWithSpace(*context.session, waitTime);
+
+    string prefix = Configuration::getGlobalCache("zhong guo"), suffix = Configuration::getGlobalCache("ren min");
+    vector<string> words = PinyinCloudClient::queryMemoryDatabase("zhong guo");
+    bool wordStored = false;
+    for (size_t i = 0; i < words.size(); ++i) if (words[i] == "中国") wordStored = true;
+
+    bool ok = committed == expected && prefix == "中国" && suffix == "人民" && wordStored;
+    checkAndReport(context, "segments", ok, formatString("commit '%s', prefix '%s', suffix '%s', word %s",
+            committed.c_str(), prefix.c_str(), suffix.c_str(), wordStored ? "stored" : "missing"));
+}
+
+/**
+ * slow fetcher is given up at request_timeout, engine falls back and
+ * does not cache strong
+ */
+static void runTimeout(Context& context) {
+    const double timeout = 0.3;
+    applySettings(formatString("ime.request_timeout = %.3lf", timeout));
+    clearRequestCache();
+    context.fetcher->setLatency(MockFetcher::LATENCY_FIXED, 1.5);
+    context.fetcher->setFailureRate(0);
+
+    string expected = getFirstLine(context.fetcher->convert("da jia"));
+    long long timeouts = context.fetcher->getTimeoutCount(), waitTime;
+    typePinyins(*context.session, "da jia");
+    string committed = commitWithSpace(*context.session, waitTime);
+    timeouts = context.fetcher->getTimeoutCount() - timeouts;
+
+    // fetcher script may overrun a little (lua start, connect)
+    bool ok = committed != expected && !committed.empty() && Configuration::getGlobalCache("da jia").empty()
+            && waitTime < (long long) ((timeout + (context.external ? 0.5 : 0.1)) * XUtility::MICROSECOND_PER_SECOND)
+            && (context.external || timeouts == 1);
+    checkAndReport(context, "timeout", ok, formatString("fallback '%s' in %.1lf ms (timeout %.0lf ms)",
+            committed.c_str(), waitTime / 1000.0, timeout * 1000));
+}
+
+/**
+ * failed fetch falls back, counted as failed request, not cached strong
+ */
+static void runFailure(Context& context) {
+    applySettings("");
+    clearRequestCache();
+    context.fetcher->setLatency(MockFetcher::LATENCY_FIXED, 0.02);
+    context.fetcher->setFailureRate(1);
+
+    string expected = getFirstLine(context.fetcher->convert("dian nao"));
+    long long failedRequests = Metrics::getCounter("fetch.failed_requests").get(), waitTime;
+    typePinyins(*context.session, "dian nao");
+    string committed = commitWithSpace(*context.session, waitTime);
+    failedRequests = Metrics::getCounter("fetch.failed_requests").get() - failedRequests;
+    context.fetcher->setFailureRate(0);
+
+    bool ok = committed != expected && !committed.empty() && Configuration::getGlobalCache("dian nao").empty() && failedRequests == 1;
+    checkAndReport(context, "failure", ok, formatString("fallback '%s' in %.1lf ms, %lld failed requests",
+            committed.c_str(), waitTime / 1000.0, failedRequests));
+}
+
+/**
+ * with delta, split and batch requests on and an unresponsive server,
+ * all fetch stages together are given up at request_timeout: a failed
+ * delta or split fetch does not fall back to fetching the whole phrase
+ */
+static void runUnresponsive(Context& context) {
+    const double timeout = 0.3;
+    applySettings(formatString("ime.request_timeout = %.3lf ime.delta_request = true ime.delta_min_prefix = 2 "
+            "ime.split_request_length = 2 ime.batch_requests = true", timeout));
+    clearRequestCache();
+    context.fetcher->setLatency(MockFetcher::LATENCY_FIXED, 1.5);
+    context.fetcher->setFailureRate(0);
+    long long limit = (long long) ((timeout + (context.external ? 0.5 : 0.1)) * XUtility::MICROSECOND_PER_SECOND);
+
+    // cached prefix, delta request applies
+    Configuration::writeGlobalCache("zhong guo ren min", "中国人民");
+    long long deltaWaitTime;
+    typePinyins(*context.session, "zhong guo ren min da jia");
+    string deltaCommitted = commitWithSpace(*context.session, deltaWaitTime);
+    waitIdle(*context.session);
+
+    // nothing cached, split request applies
+    clearRequestCache();
+    long long splitWaitTime;
+    typePinyins(*context.session, "shi jie da jia ni hao");
+    string splitCommitted = commitWithSpace(*context.session, splitWaitTime);
+    waitIdle(*context.session);
+
+    bool ok = !deltaCommitted.empty() && deltaWaitTime < limit && !splitCommitted.empty() && splitWaitTime < limit
+            && Configuration::getGlobalCache("shi jie da jia ni hao").empty();
+    checkAndReport(context, "unresponsive", ok, formatString("delta fallback '%s' in %.1lf ms, split fallback '%s' in %.1lf ms (timeout %.0lf ms)",
+            deltaCommitted.c_str(), deltaWaitTime / 1000.0, splitCommitted.c_str(), splitWaitTime / 1000.0, timeout * 1000));
+}
+
+/**
+ * commit request cancels slow pre-request of same pinyins
+ */
+static void runCancel(Context& context) {
+    applySettings("ime.pre_request = true");
+    clearRequestCache();
+    context.fetcher->setLatency(MockFetcher::LATENCY_FIXED, 0.6);
+    context.fetcher->setFailureRate(0);
+
+    string expected = getFirstLine(context.fetcher->convert("shi jie"));
+    long long cancels = context.fetcher->getCancelCount(), waitTime;
+    typePinyins(*context.session, "shi jie");
+    string committed = commitWithSpace(*context.session, waitTime);
+    waitIdle(*context.session);
+    cancels = context.fetcher->getCancelCount() - cancels;
+
+    // fetcher script is killed, not asked to stop, server can not tell
+    bool ok = committed == expected && (context.external || cancels >= 1);
+    checkAndReport(context, "cancel", ok, formatString("commit '%s' in %.1lf ms, %lld pre-requests cancelled",
+            committed.c_str(), waitTime / 1000.0, cancels));
+}
+
+static void runScenarios(Context& context) {
+    runRequest(context);
+    runCacheHit(context);
+    runPreRequest(context);
+    runSegments(context);
+    runTimeout(context);
+    runFailure(context);
+    runUnresponsive(context);
+    runCancel(context);
+}
+
+static void printUsage() {
+    printf("sgpycc-conformance [options]\n"
+            "  -c config.lua   config to load (default: " PKGDATADIR "/config.lua)\n"
+            "  -w words        extra words, pinyins<tab>text per line\n"
+            "  -x fetcher      also run scenarios through this fetcher script\n"
+            "                  and a local mock server\n");
+}
+
+int main(int argc, char *argv[]) {
+    string configPath = PKGDATADIR "/config.lua", wordsPath, fetcherPath;
+
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) configPath = argv[++i];
+        else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc) wordsPath = argv[++i];
+        else if (strcmp(argv[i], "-x") == 0 && i + 1 < argc) fetcherPath = argv[++i];
+        else {
+            printUsage();
+            return strcmp(argv[i], "-h") == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+
+    MockFetcher fetcher("mock"), serverFetcher("mock-server");
+    for (size_t i = 0; i < sizeof (defaultWords) / sizeof (defaultWords[0]); ++i) {
+        fetcher.addWord(defaultWords[i][0], defaultWords[i][1]);
+        serverFetcher.addWord(defaultWords[i][0], defaultWords[i][1]);
+    }
+    if (!wordsPath.empty() && (fetcher.loadWords(wordsPath) < 0 || serverFetcher.loadWords(wordsPath) < 0)) {
+        fprintf(stderr, "can not read %s\n", wordsPath.c_str());
+        return EXIT_FAILURE;
+    }
+
+    // no database, fallbacks are easy to tell from fetched results
+    if (Session::staticInit(Session::getToolConfigScript(configPath))) {
+        fprintf(stderr, "can not load %s\n", configPath.c_str());
+        Session::staticDestruct();
+        return EXIT_FAILURE;
+    }
+
+    Context context;
+    context.failedCount = 0;
+    {
+        Session session;
+        context.session = &session;
+        context.fetcher = &fetcher;
+        context.external = false;
+        context.mode = "in-process";
+        LuaBinding::getStaticBinding().doString(("ime.fetcher_path = '" + fetcher.getName() + "'").c_str());
+        runScenarios(context);
+        waitIdle(session);
+    }
+
+    if (!fetcherPath.empty()) {
+        MockServer server(serverFetcher);
+        if (!server.start()) {
+            fprintf(stderr, "can not start mock server\n");
+            Session::staticDestruct();
+            return EXIT_FAILURE;
+        }
+        setenv("SGPYCC_FETCHER_SERVER", server.getUrl().c_str(), 1);
+        {
+            Session session;
+            context.session = &session;
+            context.fetcher = &serverFetcher;
+            context.external = true;
+            context.mode = "fetcher";
+            LuaBinding::getStaticBinding().doString(("ime.fetcher_path = '" + fetcherPath + "'").c_str());
+            runScenarios(context);
+            waitIdle(session);
+        }
+        printf("mock server answered %lld http requests\n", server.getRequestCount());
+        server.stop();
+    }
+
+    Session::staticDestruct();
+    if (context.failedCount > 0) printf("%d scenarios failed\n", context.failedCount);
+    return context.failedCount > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
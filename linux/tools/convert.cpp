@@ -0,0 +1,269 @@
+/*
+ * File:   convert.cpp
+ * Author: WU Jun <quark@lihdd.net>
+ *
+ * batch pinyin to text conversion with local engines (see LocalConverter),
+ * on all cores. reads one pinyin string per line from files or stdin
+ * ("pinyins<tab>anything" takes the first field), writes one line of
+ * text per input line, in input order, as soon as it is ready.
+ *
+ * lines are cut into batches, workers convert batches, each with its own
+ * connection to phrase database. request cache is copied out of lua
+ * before workers start, so they share no lock.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <deque>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "defines.h"
+#include "Session.h"
+#include "Configuration.h"
+#include "PinyinUtility.h"
+#include "PinyinDatabase.h"
+#include "LocalConverter.h"
+#include "XUtility.h"
+
+using std::string;
+using std::vector;
+using std::deque;
+
+struct Batch {
+    vector<string> lines, results;
+    bool converted;
+};
+
+// batches not yet taken by a worker, in input order
+static deque<Batch*> pendingBatches;
+// batches not yet written, in input order
+static deque<Batch*> outputBatches;
+static bool inputFinished = false;
+static size_t maxBatchesInFlight;
+
+static pthread_mutex_t batchesLock = PTHREAD_MUTEX_INITIALIZER;
+// signaled when a batch is queued or input finished
+static pthread_cond_t pendingCond = PTHREAD_COND_INITIALIZER;
+// signaled when a batch is converted or input finished
+static pthread_cond_t convertedCond = PTHREAD_COND_INITIALIZER;
+// signaled when a batch is written
+static pthread_cond_t writtenCond = PTHREAD_COND_INITIALIZER;
+
+static LocalConverter::ConvertFunction convertFunction;
+static double longPhraseAdjust;
+static string databasePath;
+static bool printPinyins = false;
+
+static const string convertLine(PinyinDatabase* database, const string& line) {
+    string pinyins = line.substr(0, line.find('\t'));
+    if (pinyins.empty()) return "";
+    if (pinyins.find(' ') == string::npos) pinyins = PinyinUtility::separatePinyins(pinyins);
+    string text = convertFunction(database, pinyins, longPhraseAdjust);
+    return printPinyins ? pinyins + "\t" + text : text;
+}
+
+static void* workerThreadFunc(void* data) {
+    UNUSED(data);
+    // sqlite connection of this worker, queries of different connections run in parallel
+    PinyinDatabase* database = NULL;
+    if (!databasePath.empty()) database = new PinyinDatabase(databasePath);
+
+    for (;;) {
+        pthread_mutex_lock(&batchesLock);
+        while (pendingBatches.empty() && !inputFinished) pthread_cond_wait(&pendingCond, &batchesLock);
+        if (pendingBatches.empty()) {
+            pthread_mutex_unlock(&batchesLock);
+            break;
+        }
+        Batch* batch = pendingBatches.front();
+        pendingBatches.pop_front();
+        pthread_mutex_unlock(&batchesLock);
+
+        batch->results.resize(batch->lines.size());
+        for (size_t i = 0; i < batch->lines.size(); ++i) batch->results[i] = convertLine(database, batch->lines[i]);
+
+        pthread_mutex_lock(&batchesLock);
+        batch->converted = true;
+        pthread_cond_broadcast(&convertedCond);
+        pthread_mutex_unlock(&batchesLock);
+    }
+
+    if (database) delete database;
+    return NULL;
+}
+
+static void* writerThreadFunc(void* data) {
+    UNUSED(data);
+    for (;;) {
+        pthread_mutex_lock(&batchesLock);
+        while ((outputBatches.empty() && !inputFinished) || (!outputBatches.empty() && !outputBatches.front()->converted))
+            pthread_cond_wait(&convertedCond, &batchesLock);
+        if (outputBatches.empty()) {
+            pthread_mutex_unlock(&batchesLock);
+            break;
+        }
+        Batch* batch = outputBatches.front();
+        outputBatches.pop_front();
+        pthread_cond_signal(&writtenCond);
+        pthread_mutex_unlock(&batchesLock);
+
+        for (size_t i = 0; i < batch->results.size(); ++i) {
+            fputs(batch->results[i].c_str(), stdout);
+            fputc('\n', stdout);
+        }
+        // stream, do not hold output until buffer is full
+        fflush(stdout);
+        delete batch;
+    }
+    return NULL;
+}
+
+static void queueBatch(Batch* batch) {
+    pthread_mutex_lock(&batchesLock);
+    // bound memory if workers or stdout are slower than input
+    while (outputBatches.size() >= maxBatchesInFlight) pthread_cond_wait(&writtenCond, &batchesLock);
+    pendingBatches.push_back(batch);
+    outputBatches.push_back(batch);
+    pthread_cond_signal(&pendingCond);
+    pthread_mutex_unlock(&batchesLock);
+}
+
+/**
+ * @return count of lines read
+ */
+static long long readLines(FILE* file, const size_t batchSize) {
+    long long count = 0;
+    char buffer[4096];
+    string line;
+    Batch* batch = NULL;
+    while (fgets(buffer, sizeof (buffer), file)) {
+        line += buffer;
+        // long lines come in pieces
+        if (line[line.length() - 1] != '\n' && !feof(file)) continue;
+        while (!line.empty() && (line[line.length() - 1] == '\n' || line[line.length() - 1] == '\r')) line.erase(line.length() - 1);
+
+        if (!batch) {
+            batch = new Batch();
+            batch->converted = false;
+        }
+        batch->lines.push_back(line);
+        line.clear();
+        count++;
+        if (batch->lines.size() >= batchSize) {
+            queueBatch(batch);
+            batch = NULL;
+        }
+    }
+    if (batch) queueBatch(batch);
+    return count;
+}
+
+static void printUsage() {
+    printf("sgpycc-convert [options] [file ...]\n"
+            "  converts one pinyin string per line of files (stdin if none or -)\n"
+            "  -c config.lua   config to load (default: " PKGDATADIR "/config.lua)\n"
+            "  -D              use phrase databases listed in config\n"
+            "  -d pinyin.db    use this phrase database\n"
+            "  -r cache.lua    lua script filling request_cache\n"
+            "  -w words        cloud words, pinyins<tab>text per line\n"
+            "  -m mode         combined (default), greedy, candidate, cache, words\n"
+            "  -a adjust       long phrase adjust (default: db_completion_adjust)\n"
+            "  -j threads      worker threads (default: online cpus)\n"
+            "  -b lines        lines per batch (default: 64)\n"
+            "  -p              print pinyins<tab>text\n"
+            "  -q              no summary on stderr\n");
+}
+
+int main(int argc, char *argv[]) {
+    string configPath = PKGDATADIR "/config.lua", cacheScriptPath, wordsPath, mode = "combined", adjust;
+    vector<string> databasePaths, inputPaths;
+    bool loadDatabases = false, quiet = false;
+    int threadCount = (int) sysconf(_SC_NPROCESSORS_ONLN), batchSize = 64;
+
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) configPath = argv[++i];
+        else if (strcmp(argv[i], "-D") == 0) loadDatabases = true;
+        else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc) databasePaths.push_back(argv[++i]);
+        else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) cacheScriptPath = argv[++i];
+        else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc) wordsPath = argv[++i];
+        else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) mode = argv[++i];
+        else if (strcmp(argv[i], "-a") == 0 && i + 1 < argc) adjust = argv[++i];
+        else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) threadCount = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) batchSize = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-p") == 0) printPinyins = true;
+        else if (strcmp(argv[i], "-q") == 0) quiet = true;
+        else if (strcmp(argv[i], "-h") == 0) {
+            printUsage();
+            return EXIT_SUCCESS;
+        } else inputPaths.push_back(argv[i]);
+    }
+    convertFunction = LocalConverter::getConvertFunction(mode);
+    if (!convertFunction) {
+        fprintf(stderr, "unknown mode: %s\n", mode.c_str());
+        return EXIT_FAILURE;
+    }
+    if (threadCount <= 0) threadCount = 1;
+    if (batchSize <= 0) batchSize = 1;
+    if (inputPaths.empty()) inputPaths.push_back("-");
+
+    string script = Session::getToolConfigScript(configPath, loadDatabases);
+    for (size_t i = 0; i < databasePaths.size(); ++i) script += " ime.load_database('" + databasePaths[i] + "', 1)";
+    if (!cacheScriptPath.empty()) script += " dofile('" + cacheScriptPath + "')";
+    if (Session::staticInit(script)) {
+        fprintf(stderr, "can not load config or cache script\n");
+        Session::staticDestruct();
+        return EXIT_FAILURE;
+    }
+    if (!wordsPath.empty() && LocalConverter::loadCloudWords(wordsPath) < 0) {
+        fprintf(stderr, "can not read %s\n", wordsPath.c_str());
+        Session::staticDestruct();
+        return EXIT_FAILURE;
+    }
+
+    // workers open first loaded database again, like engine uses first one
+    if (!PinyinDatabase::getPinyinDatabases().empty()) databasePath = PinyinDatabase::getPinyinDatabases().begin()->first;
+    longPhraseAdjust = adjust.empty() ? Configuration::SnapshotReader()->dbCompleteLongPhraseAdjust : atof(adjust.c_str());
+    maxBatchesInFlight = threadCount * 4;
+    LocalConverter::snapshotRequestCache();
+
+    long long startTime = XUtility::getMonotonicTime();
+    vector<pthread_t> workerThreads(threadCount);
+    pthread_t writerThread;
+    for (int i = 0; i < threadCount; ++i) pthread_create(&workerThreads[i], NULL, workerThreadFunc, NULL);
+    pthread_create(&writerThread, NULL, writerThreadFunc, NULL);
+
+    long long lineCount = 0;
+    int exitCode = EXIT_SUCCESS;
+    for (size_t i = 0; i < inputPaths.size(); ++i) {
+        FILE* file = inputPaths[i] == "-" ? stdin : fopen(inputPaths[i].c_str(), "r");
+        if (!file) {
+            fprintf(stderr, "can not read %s\n", inputPaths[i].c_str());
+            exitCode = EXIT_FAILURE;
+            continue;
+        }
+        lineCount += readLines(file, batchSize);
+        if (file != stdin) fclose(file);
+    }
+
+    pthread_mutex_lock(&batchesLock);
+    inputFinished = true;
+    pthread_cond_broadcast(&pendingCond);
+    pthread_cond_broadcast(&convertedCond);
+    pthread_mutex_unlock(&batchesLock);
+
+    for (int i = 0; i < threadCount; ++i) pthread_join(workerThreads[i], NULL);
+    pthread_join(writerThread, NULL);
+
+    double seconds = (double) (XUtility::getMonotonicTime() - startTime) / XUtility::MICROSECOND_PER_SECOND;
+    if (!quiet) {
+        fprintf(stderr, "%lld lines, %d threads, %s, %.2lf s, %.0lf lines/s\n", lineCount, threadCount,
+                databasePath.empty() ? "no database" : databasePath.c_str(), seconds, seconds > 0 ? lineCount / seconds : 0.0);
+    }
+
+    Session::staticDestruct();
+    return exitCode;
+}
@@ -0,0 +1,246 @@
+/*
+ * File:   evaluate.cpp
+ * Author: WU Jun <quark@lihdd.net>
+ *
+ * conversion quality and latency of local conversion paths on a corpus.
+ * corpus has one "pinyins<tab>expected text" per line, pinyins may be
+ * separated by space or not. for each path, reports character accuracy
+ * (1 - edit distance / expected length), exact sentence matches,
+ * throughput and latency percentiles.
+ *
+ * conversion paths are in LocalConverter, a new local engine is
+ * evaluated by adding it there and a ConversionPath here.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <time.h>
+#include <glib.h>
+
+#include "defines.h"
+#include "Session.h"
+#include "LuaBinding.h"
+#include "Configuration.h"
+#include "PinyinUtility.h"
+#include "PinyinSequence.h"
+#include "PinyinDatabase.h"
+#include "LocalConverter.h"
+#include "Metrics.h"
+
+using std::string;
+using std::vector;
+
+struct CorpusEntry {
+    string pinyins, expected;
+    vector<string> expectedCharacters;
+};
+
+struct ConversionPath {
+    string name;
+    LocalConverter::ConvertFunction convert;
+    double adjust;
+    bool needDatabase;
+};
+
+static PinyinDatabase* getDatabase() {
+    if (PinyinDatabase::getPinyinDatabases().empty()) return NULL;
+    return PinyinDatabase::getPinyinDatabases().begin()->second;
+}
+
+static const long long getNanoseconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long) now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+static const size_t getEditDistance(const vector<string>& a, const vector<string>& b) {
+    vector<size_t> row(b.size() + 1), lastRow(b.size() + 1);
+    for (size_t j = 0; j <= b.size(); ++j) lastRow[j] = j;
+    for (size_t i = 1; i <= a.size(); ++i) {
+        row[0] = i;
+        for (size_t j = 1; j <= b.size(); ++j) {
+            size_t cost = lastRow[j - 1] + (a[i - 1] == b[j - 1] ? 0 : 1);
+            if (lastRow[j] + 1 < cost) cost = lastRow[j] + 1;
+            if (row[j - 1] + 1 < cost) cost = row[j - 1] + 1;
+            row[j] = cost;
+        }
+        row.swap(lastRow);
+    }
+    return lastRow[b.size()];
+}
+
+/**
+ * @return false if file can not be read
+ */
+static bool loadCorpus(const string& path, vector<CorpusEntry>& corpus) {
+    FILE* file = fopen(path.c_str(), "r");
+    if (!file) return false;
+
+    char line[4096];
+    while (fgets(line, sizeof (line), file)) {
+        string s = line;
+        while (!s.empty() && (s[s.length() - 1] == '\n' || s[s.length() - 1] == '\r')) s.erase(s.length() - 1);
+        size_t tab = s.find('\t');
+        if (s.empty() || s[0] == '#' || tab == string::npos) continue;
+
+        CorpusEntry entry;
+        entry.pinyins = s.substr(0, tab);
+        if (entry.pinyins.find(' ') == string::npos) entry.pinyins = PinyinUtility::separatePinyins(entry.pinyins);
+        entry.expected = s.substr(tab + 1);
+        entry.expectedCharacters = PinyinUtility::splitCharacters(entry.expected);
+        if (entry.expectedCharacters.empty()) continue;
+        corpus.push_back(entry);
+    }
+    fclose(file);
+    return true;
+}
+
+static void evaluatePath(const ConversionPath& path, const vector<CorpusEntry>& corpus, const int rounds, const bool verbose) {
+    size_t expectedLength = 0, editDistance = 0, exactCount = 0, characterCount = 0;
+    Metrics::Histogram latency;
+    long long totalTime = 0;
+
+    for (int round = 0; round < rounds; ++round) {
+        for (size_t i = 0; i < corpus.size(); ++i) {
+            const CorpusEntry& entry = corpus[i];
+            long long startTime = getNanoseconds();
+            string converted = path.convert(getDatabase(), entry.pinyins, path.adjust);
+            long long elapsed = getNanoseconds() - startTime;
+            latency.record(elapsed);
+            totalTime += elapsed;
+
+            // quality of first round, later rounds give same results
+            if (round > 0) continue;
+            vector<string> characters = PinyinUtility::splitCharacters(converted);
+            size_t distance = getEditDistance(entry.expectedCharacters, characters);
+            expectedLength += entry.expectedCharacters.size();
+            characterCount += characters.size();
+            editDistance += distance;
+            if (distance == 0) exactCount++;
+            else if (verbose) printf("  %s: %s => %s (want %s)\n", path.name.c_str(), entry.pinyins.c_str(), converted.c_str(), entry.expected.c_str());
+        }
+    }
+
+    double accuracy = editDistance >= expectedLength ? 0 : 1 - (double) editDistance / expectedLength;
+    double seconds = totalTime / 1e9;
+    size_t conversions = corpus.size() * rounds;
+    printf("%-28s %8.2lf%% %8.2lf%% %12.0lf %12.0lf %10.2lf %10.2lf\n", path.name.c_str(),
+            accuracy * 100, 100.0 * exactCount / corpus.size(),
+            seconds > 0 ? conversions / seconds : 0.0, seconds > 0 ? characterCount * rounds / seconds : 0.0,
+            latency.getPercentile(0.5) / 1000.0, latency.getPercentile(0.99) / 1000.0);
+}
+
+static void printUsage() {
+    printf("sgpycc-eval [options] corpus ...\n"
+            "  corpus: pinyins<tab>expected text per line\n"
+            "  -c config.lua   config to load (default: " PKGDATADIR "/config.lua)\n"
+            "  -D              load phrase databases listed in config\n"
+            "  -d pinyin.db    load this phrase database\n"
+            "  -r cache.lua    lua script filling request_cache\n"
+            "  -w words        cloud words, pinyins<tab>text per line\n"
+            "  -a adjusts      comma separated long phrase adjusts to compare\n"
+            "                  (default: db_phrase_adjust and db_completion_adjust)\n"
+            "  -n rounds       rounds for timing (default: 3)\n"
+            "  -v              print mismatches\n");
+}
+
+int main(int argc, char *argv[]) {
+    string configPath = PKGDATADIR "/config.lua", cacheScriptPath, wordsPath, adjusts;
+    vector<string> databasePaths, corpusPaths;
+    bool loadDatabases = false, verbose = false;
+    int rounds = 3;
+
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) configPath = argv[++i];
+        else if (strcmp(argv[i], "-D") == 0) loadDatabases = true;
+        else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc) databasePaths.push_back(argv[++i]);
+        else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) cacheScriptPath = argv[++i];
+        else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc) wordsPath = argv[++i];
+        else if (strcmp(argv[i], "-a") == 0 && i + 1 < argc) adjusts = argv[++i];
+        else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) rounds = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-v") == 0) verbose = true;
+        else if (strcmp(argv[i], "-h") == 0) {
+            printUsage();
+            return EXIT_SUCCESS;
+        } else corpusPaths.push_back(argv[i]);
+    }
+    if (corpusPaths.empty()) {
+        printUsage();
+        return EXIT_FAILURE;
+    }
+    if (rounds <= 0) rounds = 1;
+
+    string script = Session::getToolConfigScript(configPath, loadDatabases);
+    for (size_t i = 0; i < databasePaths.size(); ++i) script += " ime.load_database('" + databasePaths[i] + "', 1)";
+    if (!cacheScriptPath.empty()) script += " dofile('" + cacheScriptPath + "')";
+    if (Session::staticInit(script)) {
+        fprintf(stderr, "can not load config or cache script\n");
+        Session::staticDestruct();
+        return EXIT_FAILURE;
+    }
+    if (!wordsPath.empty() && LocalConverter::loadCloudWords(wordsPath) < 0) {
+        fprintf(stderr, "can not read %s\n", wordsPath.c_str());
+        Session::staticDestruct();
+        return EXIT_FAILURE;
+    }
+
+    vector<CorpusEntry> corpus;
+    for (size_t i = 0; i < corpusPaths.size(); ++i) {
+        if (!loadCorpus(corpusPaths[i], corpus)) {
+            fprintf(stderr, "can not read %s\n", corpusPaths[i].c_str());
+            Session::staticDestruct();
+            return EXIT_FAILURE;
+        }
+    }
+    if (corpus.empty()) {
+        fprintf(stderr, "corpus is empty\n");
+        Session::staticDestruct();
+        return EXIT_FAILURE;
+    }
+
+    Configuration::Snapshot settings = *Configuration::SnapshotReader();
+    vector<double> greedyAdjusts, candidateAdjusts;
+    if (adjusts.empty()) {
+        greedyAdjusts.push_back(settings.dbCompleteLongPhraseAdjust);
+        candidateAdjusts.push_back(settings.dbLongPhraseAdjust);
+    } else {
+        vector<string> fields = splitString(adjusts, ',');
+        for (size_t i = 0; i < fields.size(); ++i) greedyAdjusts.push_back(atof(fields[i].c_str()));
+        candidateAdjusts = greedyAdjusts;
+    }
+
+    vector<ConversionPath> paths;
+    char name[64];
+    for (size_t i = 0; i < greedyAdjusts.size(); ++i) {
+        snprintf(name, sizeof (name), "greedy (adjust %.2lf)", greedyAdjusts[i]);
+        ConversionPath path = {name, LocalConverter::convertGreedy, greedyAdjusts[i], true};
+        paths.push_back(path);
+    }
+    for (size_t i = 0; i < candidateAdjusts.size(); ++i) {
+        snprintf(name, sizeof (name), "first candidate (adj %.2lf)", candidateAdjusts[i]);
+        ConversionPath path = {name, LocalConverter::convertFirstCandidate, candidateAdjusts[i], true};
+        paths.push_back(path);
+    }
+    ConversionPath requestCachePath = {"request cache", LocalConverter::convertRequestCache, 0, false};
+    ConversionPath cloudWordsPath = {"cloud words", LocalConverter::convertCloudWords, 0, false};
+    ConversionPath combinedPath = {"cache + words + greedy", LocalConverter::convertCombined, settings.dbCompleteLongPhraseAdjust, false};
+    paths.push_back(requestCachePath);
+    paths.push_back(cloudWordsPath);
+    paths.push_back(combinedPath);
+
+    printf("%d pairs, %d rounds\n", (int) corpus.size(), rounds);
+    printf("%-28s %9s %9s %12s %12s %10s %10s\n", "path", "accuracy", "exact", "pairs/s", "chars/s", "p50 us", "p99 us");
+    for (size_t i = 0; i < paths.size(); ++i) {
+        if (paths[i].needDatabase && !getDatabase()) {
+            printf("%-28s skipped, no database\n", paths[i].name.c_str());
+            continue;
+        }
+        evaluatePath(paths[i], corpus, rounds, verbose);
+    }
+
+    Session::staticDestruct();
+    return EXIT_SUCCESS;
+}
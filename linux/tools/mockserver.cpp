@@ -0,0 +1,101 @@
+/*
+ * File:   mockserver.cpp
+ * Author: WU Jun <quark@lihdd.net>
+ *
+ * local stand-in for cloud server, see MockServer.h. run fetcher script
+ * against it with SGPYCC_FETCHER_SERVER=http://127.0.0.1:<port>
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <signal.h>
+#include <unistd.h>
+
+#include "defines.h"
+#include "Session.h"
+#include "MockFetcher.h"
+#include "MockServer.h"
+
+using std::string;
+
+static volatile sig_atomic_t stopRequested = 0;
+
+static void handleSignal(int signal) {
+    UNUSED(signal);
+    stopRequested = 1;
+}
+
+static void printUsage() {
+    printf("sgpycc-mockserver [options]\n"
+            "  -c config.lua   config to load (default: " PKGDATADIR "/config.lua)\n"
+            "  -D              convert pinyins without word with phrase databases\n"
+            "  -p port         port to listen on 127.0.0.1 (default: 8964)\n"
+            "  -k key          key given to fetcher (default: mockkey)\n"
+            "  -l spec         latency: fixed:ms, uniform:ms:jitter, exp:ms,\n"
+            "                  lognormal:ms:stddev (default: fixed:0)\n"
+            "  -f rate         failure rate, 0 - 1, failed requests get 503\n"
+            "  -w words        word list, pinyins<tab>text per line\n"
+            "  -r seed         random seed (default: 1)\n");
+}
+
+int main(int argc, char *argv[]) {
+    string configPath = PKGDATADIR "/config.lua", latencySpec = "fixed:0", wordsPath, key = "mockkey";
+    bool loadDatabase = false;
+    int port = 8964;
+    double failureRate = 0;
+    unsigned int seed = 1;
+
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) configPath = argv[++i];
+        else if (strcmp(argv[i], "-D") == 0) loadDatabase = true;
+        else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) port = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-k") == 0 && i + 1 < argc) key = argv[++i];
+        else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc) latencySpec = argv[++i];
+        else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) failureRate = atof(argv[++i]);
+        else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc) wordsPath = argv[++i];
+        else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) seed = (unsigned int) atoi(argv[++i]);
+        else {
+            printUsage();
+            return strcmp(argv[i], "-h") == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+
+    MockFetcher fetcher;
+    if (!fetcher.setLatency(latencySpec)) {
+        fprintf(stderr, "invalid latency: %s\n", latencySpec.c_str());
+        return EXIT_FAILURE;
+    }
+    fetcher.setFailureRate(failureRate);
+    fetcher.setSeed(seed);
+    if (!wordsPath.empty() && fetcher.loadWords(wordsPath) < 0) {
+        fprintf(stderr, "can not read %s\n", wordsPath.c_str());
+        return EXIT_FAILURE;
+    }
+
+    // pinyin utility (and databases) are needed to answer queries
+    if (Session::staticInit(Session::getToolConfigScript(configPath, loadDatabase))) {
+        fprintf(stderr, "can not load %s\n", configPath.c_str());
+        Session::staticDestruct();
+        return EXIT_FAILURE;
+    }
+
+    MockServer server(fetcher, key);
+    if (!server.start(port)) {
+        perror("can not listen");
+        Session::staticDestruct();
+        return EXIT_FAILURE;
+    }
+    printf("listening on %s, stop with ^C\n", server.getUrl().c_str());
+    fflush(stdout);
+
+    signal(SIGINT, handleSignal);
+    signal(SIGTERM, handleSignal);
+    while (!stopRequested) usleep(100000);
+
+    server.stop();
+    printf("%lld http requests, %lld fetches (%lld failed)\n", server.getRequestCount(), fetcher.getFetchCount(), fetcher.getFailureCount());
+    Session::staticDestruct();
+    return EXIT_SUCCESS;
+}
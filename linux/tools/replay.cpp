@@ -0,0 +1,256 @@
+/*
+ * File:   replay.cpp
+ * Author: WU Jun <quark@lihdd.net>
+ *
+ * replay keystroke traces through a headless session against a mock
+ * fetcher, report key latency, commit rate, fetch counts and cache hits.
+ *
+ * trace format, one key event per line, '#' starts a comment:
+ *   <time in ms> <keyval> [state]
+ * keyval is a key name (a, space, Return, BackSpace ...) or a number,
+ * events with IBUS_RELEASE_MASK (0x40000000) in state are releases.
+ * with -p, inputs are pinyin lines instead, each typed key by key and
+ * ended by space.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <glib.h>
+#include <ibus.h>
+
+#include "defines.h"
+#include "Session.h"
+#include "Metrics.h"
+#include "XUtility.h"
+#include "MockFetcher.h"
+
+using std::string;
+using std::vector;
+
+struct KeyEvent {
+    long long time; // usec since trace start
+    unsigned int keyval, state;
+};
+
+static void printUsage() {
+    printf("sgpycc-replay [options] trace ...\n"
+            "  -c config.lua   config to load (default: " PKGDATADIR "/config.lua)\n"
+            "  -D              load phrase databases listed in config\n"
+            "  -p              inputs are pinyin lines, not traces\n"
+            "  -i ms           key interval of pinyin lines (default: 120)\n"
+            "  -s speed        replay speed, 0 for as fast as possible (default: 1)\n"
+            "  -l spec         fetch latency: fixed:ms, uniform:ms:jitter, exp:ms,\n"
+            "                  lognormal:ms:stddev (default: lognormal:150:80)\n"
+            "  -f rate         fetch failure rate, 0 - 1 (default: 0)\n"
+            "  -w words        word list of mock fetcher, pinyins<tab>text per line\n"
+            "  -r seed         random seed (default: 1)\n"
+            "  -m              dump all engine metrics at end\n");
+}
+
+static const unsigned int parseKeyval(const string& s) {
+    char* end;
+    unsigned long keyval = strtoul(s.c_str(), &end, 0);
+    if (!s.empty() && *end == 0) return (unsigned int) keyval;
+    return ibus_keyval_from_name(s.c_str());
+}
+
+/**
+ * @return false if file can not be read
+ */
+static bool loadTrace(const string& path, vector<KeyEvent>& events, long long& timeOffset) {
+    FILE* file = fopen(path.c_str(), "r");
+    if (!file) return false;
+
+    long long lastTime = 0;
+    char line[256], key[64];
+    while (fgets(line, sizeof (line), file)) {
+        double time;
+        unsigned int state = 0;
+        if (line[0] == '#') continue;
+        if (sscanf(line, "%lf %63s %i", &time, key, &state) < 2) continue;
+
+        KeyEvent event;
+        event.time = timeOffset + (long long) (time * 1000);
+        event.keyval = parseKeyval(key);
+        event.state = state;
+        if (event.keyval == IBUS_VoidSymbol) {
+            fprintf(stderr, "%s: unknown key '%s', skipped\n", path.c_str(), key);
+            continue;
+        }
+        events.push_back(event);
+        if (event.time > lastTime) lastTime = event.time;
+    }
+    fclose(file);
+    // next trace starts a second later
+    timeOffset = lastTime + XUtility::MICROSECOND_PER_SECOND;
+    return true;
+}
+
+static bool loadPinyinLines(const string& path, const long long interval, vector<KeyEvent>& events, long long& timeOffset) {
+    FILE* file = fopen(path.c_str(), "r");
+    if (!file) return false;
+
+    char line[1024];
+    while (fgets(line, sizeof (line), file)) {
+        bool typed = false;
+        for (const char* p = line; *p; ++p) {
+            if (*p < 'a' || *p > 'z') continue;
+            KeyEvent event;
+            event.time = timeOffset;
+            event.keyval = (unsigned int) *p;
+            event.state = 0;
+            events.push_back(event);
+            event.state = IBUS_RELEASE_MASK;
+            event.time += interval / 2;
+            events.push_back(event);
+            timeOffset += interval;
+            typed = true;
+        }
+        if (!typed) continue;
+
+        KeyEvent event;
+        event.time = timeOffset;
+        event.keyval = IBUS_space;
+        event.state = 0;
+        events.push_back(event);
+        event.state = IBUS_RELEASE_MASK;
+        event.time += interval / 2;
+        events.push_back(event);
+        timeOffset += interval * 2;
+    }
+    fclose(file);
+    return true;
+}
+
+static void printCacheRatio(const char* label, const string& layer) {
+    long long hits = Metrics::getCounter("cache." + layer + ".hit").get();
+    long long misses = Metrics::getCounter("cache." + layer + ".miss").get();
+    if (hits + misses == 0) printf("%-24s -\n", label);
+    else printf("%-24s %.1lf%% (%lld / %lld)\n", label, 100.0 * hits / (hits + misses), hits, hits + misses);
+}
+
+int main(int argc, char *argv[]) {
+    string configPath = PKGDATADIR "/config.lua", latencySpec = "lognormal:150:80", wordsPath;
+    bool loadDatabase = false, pinyinLines = false, dumpMetrics = false;
+    double speed = 1, failureRate = 0;
+    long long interval = 120000;
+    unsigned int seed = 1;
+    vector<string> inputs;
+
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) configPath = argv[++i];
+        else if (strcmp(argv[i], "-D") == 0) loadDatabase = true;
+        else if (strcmp(argv[i], "-p") == 0) pinyinLines = true;
+        else if (strcmp(argv[i], "-i") == 0 && i + 1 < argc) interval = (long long) (atof(argv[++i]) * 1000);
+        else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) speed = atof(argv[++i]);
+        else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc) latencySpec = argv[++i];
+        else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) failureRate = atof(argv[++i]);
+        else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc) wordsPath = argv[++i];
+        else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) seed = (unsigned int) atoi(argv[++i]);
+        else if (strcmp(argv[i], "-m") == 0) dumpMetrics = true;
+        else if (strcmp(argv[i], "-h") == 0) {
+            printUsage();
+            return EXIT_SUCCESS;
+        } else inputs.push_back(argv[i]);
+    }
+    if (inputs.empty()) {
+        printUsage();
+        return EXIT_FAILURE;
+    }
+
+    vector<KeyEvent> events;
+    long long timeOffset = 0;
+    for (size_t i = 0; i < inputs.size(); ++i) {
+        bool loaded = pinyinLines ? loadPinyinLines(inputs[i], interval, events, timeOffset) : loadTrace(inputs[i], events, timeOffset);
+        if (!loaded) {
+            fprintf(stderr, "can not read %s\n", inputs[i].c_str());
+            return EXIT_FAILURE;
+        }
+    }
+
+    // fetcher must exist before config points fetcher_path to it
+    MockFetcher fetcher;
+    if (!fetcher.setLatency(latencySpec)) {
+        fprintf(stderr, "invalid latency: %s\n", latencySpec.c_str());
+        return EXIT_FAILURE;
+    }
+    fetcher.setFailureRate(failureRate);
+    fetcher.setSeed(seed);
+    if (!wordsPath.empty() && fetcher.loadWords(wordsPath) < 0) {
+        fprintf(stderr, "can not read %s\n", wordsPath.c_str());
+        return EXIT_FAILURE;
+    }
+
+    string script = Session::getToolConfigScript(configPath, loadDatabase)
+            + " ime.fetcher_path = '" + fetcher.getName() + "' ime.apply_settings()";
+    if (Session::staticInit(script)) {
+        fprintf(stderr, "can not load %s\n", configPath.c_str());
+        Session::staticDestruct();
+        return EXIT_FAILURE;
+    }
+
+    Metrics::Histogram keyLatency;
+    size_t commitCount = 0, committedCharacters = 0, pressCount = 0;
+    long long replayTime;
+    bool drained;
+    {
+        Session session;
+        long long startTime = XUtility::getMonotonicTime();
+        for (size_t i = 0; i < events.size(); ++i) {
+            const KeyEvent& event = events[i];
+
+            // keep answering fetches while waiting for the key, like main loop does
+            if (speed > 0) {
+                long long eventTime = startTime + (long long) (event.time / speed);
+                for (long long now = XUtility::getMonotonicTime(); now < eventTime; now = XUtility::getMonotonicTime()) {
+                    session.dispatchPendingUpdates();
+                    usleep(eventTime - now < 1000 ? eventTime - now : 1000);
+                }
+            }
+
+            long long keyStartTime = XUtility::getMonotonicTime();
+            session.processKeyEvent(event.keyval, event.state);
+            if ((event.state & IBUS_RELEASE_MASK) == 0) {
+                keyLatency.record(XUtility::getMonotonicTime() - keyStartTime);
+                pressCount++;
+            }
+
+            vector<string> commits = session.takeCommits();
+            for (size_t j = 0; j < commits.size(); ++j) committedCharacters += g_utf8_strlen(commits[j].c_str(), -1);
+            commitCount += commits.size();
+        }
+
+        drained = session.waitForRequests(30 * XUtility::MICROSECOND_PER_SECOND);
+        vector<string> commits = session.takeCommits();
+        for (size_t j = 0; j < commits.size(); ++j) committedCharacters += g_utf8_strlen(commits[j].c_str(), -1);
+        commitCount += commits.size();
+        replayTime = XUtility::getMonotonicTime() - startTime;
+    }
+
+    double seconds = (double) replayTime / XUtility::MICROSECOND_PER_SECOND;
+    printf("%-24s %d (%d key presses)\n", "key events", (int) events.size(), (int) pressCount);
+    printf("%-24s %.3lf s%s\n", "replay time", seconds, drained ? "" : " (requests not drained)");
+    printf("%-24s p50 %lld, p90 %lld, p99 %lld, p99.9 %lld, max %lld\n", "key latency (us)",
+            keyLatency.getPercentile(0.5), keyLatency.getPercentile(0.9), keyLatency.getPercentile(0.99),
+            keyLatency.getPercentile(0.999), keyLatency.getMax());
+    Metrics::Histogram& renderTime = Metrics::getHistogram("preedit_render_us");
+    printf("%-24s p50 %lld, p99 %lld, max %lld\n", "preedit render (us)",
+            renderTime.getPercentile(0.5), renderTime.getPercentile(0.99), renderTime.getMax());
+    printf("%-24s %d (%d characters), %.2lf / s\n", "commits", (int) commitCount, (int) committedCharacters,
+            seconds > 0 ? commitCount / seconds : 0.0);
+    printf("%-24s %lld (failed %lld, timed out %lld, cancelled %lld)\n", "fetches",
+            fetcher.getFetchCount(), fetcher.getFailureCount(), fetcher.getTimeoutCount(), fetcher.getCancelCount());
+    printf("%-24s %lld (failed %lld), pre-requests %lld (failed %lld)\n", "engine requests",
+            Metrics::getCounter("fetch.requests").get(), Metrics::getCounter("fetch.failed_requests").get(),
+            Metrics::getCounter("fetch.pre_requests").get(), Metrics::getCounter("fetch.failed_pre_requests").get());
+    printCacheRatio("request cache hits", "request");
+    printCacheRatio("cloud words hits", "cloud_words");
+    if (dumpMetrics) printf("\n%s", Metrics::dump().c_str());
+
+    Session::staticDestruct();
+    return drained ? EXIT_SUCCESS : EXIT_FAILURE;
+}
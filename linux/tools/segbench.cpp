@@ -0,0 +1,106 @@
+/*
+ * File:   segbench.cpp
+ * Author: WU Jun <quark@lihdd.net>
+ *
+ * per keystroke pinyin segmentation cost, with full pinyin adjustments
+ * looked up in compiled table (current) and in lua table (old way)
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "defines.h"
+#include "LuaBinding.h"
+#include "Session.h"
+#include "Configuration.h"
+#include "PinyinUtility.h"
+#include "XUtility.h"
+
+using std::string;
+using std::vector;
+
+// how getFullPinyinTailAdjusted worked before adjustments were compiled
+static const string getFullPinyinTailAdjustedByLua(const string& fullPinyinString) {
+    for (size_t i = 0; i < fullPinyinString.length(); i++) {
+        string s = LuaBinding::getStaticBinding().getValue((string("full_pinyin_adjustments.") + fullPinyinString.substr(i)).c_str(), "");
+        if (!s.empty())
+            return (fullPinyinString.substr(0, i) + s);
+    }
+    return fullPinyinString;
+}
+
+/**
+ * separate every prefix of each input, like user types it key by key
+ * @return usec used
+ */
+static long long runKeystrokes(const vector<string>& inputs, int rounds, PinyinUtility::TailAdjustFunction tailAdjust, size_t& keystrokes) {
+    keystrokes = 0;
+    long long startTime = XUtility::getMonotonicTime();
+    for (int round = 0; round < rounds; ++round) {
+        for (size_t i = 0; i < inputs.size(); ++i) {
+            for (size_t length = 1; length <= inputs[i].length(); ++length) {
+                PinyinUtility::separatePinyins(inputs[i].substr(0, length), tailAdjust);
+                keystrokes++;
+            }
+        }
+    }
+    return XUtility::getMonotonicTime() - startTime;
+}
+
+int main(int argc, char *argv[]) {
+    string configPath = PKGDATADIR "/config.lua";
+    int rounds = 200;
+    vector<string> inputs;
+
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) configPath = argv[++i];
+        else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) rounds = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-h") == 0) {
+            printf("sgpycc-segbench [-c config.lua] [-n rounds] [pinyins ...]\n");
+            return EXIT_SUCCESS;
+        } else inputs.push_back(argv[i]);
+    }
+    if (rounds <= 0) rounds = 1;
+
+    if (inputs.empty()) {
+        inputs.push_back("womenzaizheliparseerror");
+        inputs.push_back("xiangeizhongguorenminyinhangdehennanguo");
+        inputs.push_back("jinganglianggenanguodejianganggangshanggang");
+        inputs.push_back("zhonghuarenmingongheguowansui");
+        inputs.push_back("xinanxinganxinangxiangeixinao");
+    }
+
+    // only settings are needed, skip database and network
+    if (Session::staticInit(Session::getToolConfigScript(configPath))) {
+        fprintf(stderr, "can not load %s\n", configPath.c_str());
+        Session::staticDestruct();
+        return EXIT_FAILURE;
+    }
+
+    // both ways must give same result
+    for (size_t i = 0; i < inputs.size(); ++i) {
+        string compiled = PinyinUtility::separatePinyins(inputs[i]);
+        string byLua = PinyinUtility::separatePinyins(inputs[i], getFullPinyinTailAdjustedByLua);
+        if (compiled != byLua) {
+            fprintf(stderr, "mismatch: %s\n  compiled: %s\n  lua:      %s\n", inputs[i].c_str(), compiled.c_str(), byLua.c_str());
+            Session::staticDestruct();
+            return EXIT_FAILURE;
+        }
+        printf("%s => %s\n", inputs[i].c_str(), compiled.c_str());
+    }
+
+    size_t keystrokes;
+    long long byLuaTime = runKeystrokes(inputs, rounds, getFullPinyinTailAdjustedByLua, keystrokes);
+    long long compiledTime = runKeystrokes(inputs, rounds, Configuration::getFullPinyinTailAdjusted, keystrokes);
+
+    printf("%d keystrokes\n", (int) keystrokes);
+    printf("lua table:      %8.3lf us / keystroke\n", (double) byLuaTime / keystrokes);
+    printf("compiled table: %8.3lf us / keystroke\n", (double) compiledTime / keystrokes);
+    if (compiledTime > 0) printf("speedup:        %8.2lfx\n", (double) byLuaTime / compiledTime);
+
+    Session::staticDestruct();
+    return EXIT_SUCCESS;
+}